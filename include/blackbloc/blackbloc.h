@@ -40,6 +40,7 @@
 #include <blackbloc/list.h>
 #include <blackbloc/vector.h>
 #include <blackbloc/gfile.h>
+#include <blackbloc/mem.h>
 
 /* Animation frame */
 typedef uint16_t aframe_t;
@@ -80,5 +81,8 @@ int easy_explode(char *str, char split,
 /* Filesystem I/O API */
 int game_open(struct gfile *f, const char *name);
 void game_close(struct gfile *f);
+void game_prefetch(const char * const *names, unsigned int num);
+unsigned int game_readdir(const char *prefix,
+			int (*cb)(void *priv, const char *name), void *priv);
 
 #endif /* __BLACKBLOC_HEADER_INCLUDED__ */
@@ -31,6 +31,15 @@ extern int cl_alive;
 extern float fps;
 extern double lerp;
 
+/* Per-frame scratch memory from main.c, good until the end of the next
+ * frame and never freed. Allocations are 16 byte aligned. Use
+ * gang_mark() and gang_rewind() on frame_arena() for scratch which
+ * doesn't need to outlive the caller.
+ */
+struct gang *frame_arena(void);
+_malloc void *frame_alloc(size_t sz);
+_malloc char *frame_strdup(const char *str);
+
 /* Main API entry points */
 int cl_init(void);
 void cl_frame(void);
@@ -55,6 +64,10 @@ void clcmd_crouch(int, char *);
 void clcmd_jump(int, char *);
 void clcmd_map(int, char *);
 void clcmd_textures(int, char *);
+void clcmd_trace(int, char *);
+void clcmd_verify(int, char *);
+void clcmd_faults(int, char *);
+void clcmd_mem(int, char *);
 
 void cl_move(void);
 void cl_viewangles(vector_t angles);
@@ -0,0 +1,106 @@
+/*
+ * This file is part of blackbloc
+ * Copyright (c) 2008 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+#ifndef _CPOOL_HEADER_INCLUDED_
+#define _CPOOL_HEADER_INCLUDED_
+
+#include <pthread.h>
+#include <blackbloc/list.h>
+#include <blackbloc/mpool.h>
+
+/** Objects per magazine.
+ * \ingroup g_cpool
+*/
+#define CPOOL_MAG_SIZE		64
+
+/** Magazines per chunk and max chunks, magazines are never freed
+ * until cpool_fini() so a 32 bit index is enough to name one.
+ * \ingroup g_cpool
+*/
+#define CPOOL_MAG_CHUNK		256
+#define CPOOL_MAX_CHUNKS	1024
+
+/** A stack of free objects.
+ * \ingroup g_cpool
+*/
+struct cpool_mag {
+	/** Index of next magazine in the depot, zero for none. */
+	uint32_t next;
+	/** Our own index, one based. */
+	uint32_t idx;
+	/** Number of objects in obj[]. */
+	unsigned int rounds;
+	/** The objects. */
+	void *obj[CPOOL_MAG_SIZE];
+};
+
+/** Per-thread magazines.
+ * \ingroup g_cpool
+*/
+struct cpool_cache {
+	/** The pool, for the thread exit destructor. */
+	struct cpool *pool;
+	/** Entry in the pool's list of caches. */
+	struct list_head list;
+	/** Magazine we allocate from and free to. */
+	struct cpool_mag *loaded;
+	/** Previous magazine, swapped with loaded rather than going to
+	 * the depot when an alloc/free pattern straddles a boundary. */
+	struct cpool_mag *prev;
+};
+
+/** Thread-safe mpool descriptor.
+ * \ingroup g_cpool
+*/
+struct cpool {
+	/** Object size. */
+	size_t obj_size;
+	/** Depot stack of full magazines, generation:index. */
+	uint64_t full;
+	/** Depot stack of empty magazines, generation:index. */
+	uint64_t empty;
+	/** Chunks of magazines, indexed by (idx - 1) / CPOOL_MAG_CHUNK. */
+	struct cpool_mag **chunk;
+	/** Per-thread cache. */
+	pthread_key_t key;
+	/** Protects everything below. */
+	pthread_mutex_t lock;
+	/** Magazines allocated so far. */
+	uint32_t num_mags;
+	/** Where objects come from when magazines run dry. */
+	struct mpool slab;
+	/** Every thread's cache. */
+	struct list_head caches;
+};
+
+_public int cpool_init(struct cpool *p, size_t obj_size, unsigned slab_size);
+_public void cpool_fini(struct cpool *p);
+_public void cpool_flush(struct cpool *p);
+_public _malloc void *cpool_alloc(struct cpool *p);
+_public void cpool_free(struct cpool *p, void *obj);
+_malloc static inline void *cpool_alloc0(struct cpool *p);
+
+/** Allocate an object initialized to zero.
+ * \ingroup g_cpool
+ *
+ * @param p cpool object to allocate from.
+ *
+ * This is the same as cpool_alloc() but initializes the returned
+ * memory to all zeros.
+ *
+ * @return pointer to new object or NULL for error
+*/
+static inline void *cpool_alloc0(struct cpool *p)
+{
+	void *ret;
+
+	ret = cpool_alloc(p);
+	if ( ret )
+		memset(ret, 0, p->obj_size);
+
+	return ret;
+}
+
+#endif /* _CPOOL_HEADER_INCLUDED_ */
@@ -0,0 +1,16 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*/
+#ifndef _CRC32C_HEADER_INCLUDED_
+#define _CRC32C_HEADER_INCLUDED_
+
+/* CRC32C (Castagnoli), pass zero as crc to start a new checksum or the
+ * previous result to continue one.
+ */
+_check_result uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+_check_result uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl(void);
+
+#endif /* _CRC32C_HEADER_INCLUDED_ */
@@ -20,9 +20,9 @@ typedef uint32_t fnv_hash_t;
 /* Generic record structure */
 /* Fowler/Noll/Vo hash 
  * Its fast to compute, its obvious code, it performs well... */
-static inline fnv_hash_t fnv_hash(const char *str)
+static inline fnv_hash_t fnv_hash_seed(const char *str, fnv_hash_t seed)
 {
-	fnv_hash_t h=FNV_OFFSET;
+	fnv_hash_t h=seed;
 	uint8_t *data=(uint8_t *)str;
 
 	while(*data)
@@ -31,4 +31,26 @@ static inline fnv_hash_t fnv_hash(const char *str)
 	return h;
 }
 
+static inline fnv_hash_t fnv_hash(const char *str)
+{
+	return fnv_hash_seed(str, FNV_OFFSET);
+}
+
+/* The low bits of FNV are weak, eg. for short strings the bottom bit is
+ * just the parity of the input. Fold the high bits down before reducing
+ * the hash modulo a table size.
+ *
+ * This is on disk in GFILE_NIDX_PHASH2 blocks, changing it needs a new
+ * block id the same way PHASH2 came about.
+ */
+static inline fnv_hash_t fnv_mix(fnv_hash_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bUL;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35UL;
+	h ^= h >> 16;
+	return h;
+}
+
 #endif /* __FNV_HASH_HEADER_INCLUDED__ */
@@ -9,6 +9,11 @@
 /* for memset */
 #include <string.h>
 
+/** Back slabs with transparent huge pages, see gang_init_aligned().
+ * \ingroup g_gang
+*/
+#define GANG_HUGEPAGE	(1 << 0)
+
 /** Gang memory area descriptor.
  * \ingroup g_gang
 */
@@ -19,6 +24,8 @@ struct gang_slab {
 	void *ptr;
 	/** Mext memory area in the list. */
 	struct gang_slab *next;
+	/** Size of the whole area including this header. */
+	size_t size;
 };
 
 /** Gang memory allocator.
@@ -27,14 +34,35 @@ struct gang_slab {
 struct gang {
 	/** Size to make system memory requests. */
 	size_t slab_size;
+	/** Allocation alignment, a power of two. */
+	size_t align;
+	/** GANG_* flags. */
+	unsigned int flags;
 	/** Head of memory area list. */
 	struct gang_slab *head;
-	/** Tail of memory area list. */
+	/** Area we're allocating from, those after it are spare. */
 	struct gang_slab *tail;
 };
 
+/** Saved allocation point, see gang_mark().
+ * \ingroup g_gang
+*/
+struct gang_mark {
+	/** Area that was being allocated from. */
+	struct gang_slab *slab;
+	/** Its free pointer at the time. */
+	void *ptr;
+	/** Its remaining length at the time. */
+	size_t len;
+};
+
 _public int gang_init(struct gang *m, size_t slab_size);
+_public int gang_init_aligned(struct gang *m, size_t slab_size,
+				size_t align, unsigned int flags);
 _public void gang_fini(struct gang *m);
+_public void gang_mark(struct gang *m, struct gang_mark *mark);
+_public void gang_rewind(struct gang *m, const struct gang_mark *mark);
+_public void gang_reset(struct gang *m);
 _malloc _public void * gang_alloc(struct gang *m, size_t sz);
 _malloc static inline void *gang_alloc0(struct gang *m, size_t sz);
 
@@ -6,7 +6,13 @@
 #ifndef _GFILE_INTERNAL_HEADER_INCLUDED_
 #define _GFILE_INTERNAL_HEADER_INCLUDED_
 
-#define GFILE_MAGIC 0xdead1337
+/* Version 1 archives have 32 bit offsets and an unsorted directory, they
+ * start with GFILE_MAGIC. Everything else starts with GFILE_MAGIC64 and
+ * a version number, readers refuse versions they don't know about.
+ */
+#define GFILE_MAGIC	0xdead1337
+#define GFILE_MAGIC64	0xdead6464
+#define GFILE_VERSION	2
 
 struct gfile_blk {
 	uint16_t b_type;
@@ -22,6 +28,26 @@ struct gfile_hdr {
 	struct gfile_blk h_blk[0];
 }_packed;
 
+/* Version 2 block directory entry, sorted by type and then id so a
+ * block is found with a binary search. Type/id pairs are unique.
+ */
+struct gfile_blk64 {
+	uint16_t b_type;
+	uint16_t b_id;
+	uint32_t b_flags;
+	uint64_t b_ofs;
+	uint64_t b_len;
+}_packed;
+
+struct gfile_hdr64 {
+	uint32_t h_magic;
+	uint16_t h_version;
+	uint16_t h_flags;
+	uint32_t h_num_blk;
+	uint32_t h_reserved;
+	struct gfile_blk64 h_blk[0];
+}_packed;
+
 /* Align all records to 8 bytes */
 #define GFILE_ALIGN_BITS 3UL
 #define GFILE_ALIGN (1UL << GFILE_ALIGN_BITS)
@@ -35,6 +61,10 @@ struct gfile_hdr {
 #define  GFILE_BLOB_FILES	0
 #define GFILE_TYPE_NIDX		1 /* name index */
 #define  GFILE_NIDX_FILENAMES	0
+#define  GFILE_NIDX_PHASH	1 /* minimal perfect hash of the filenames */
+#define  GFILE_NIDX_PHASH2	2 /* same, over fnv_mix()'d hashes */
+#define GFILE_TYPE_CSUM		2 /* checksums */
+#define  GFILE_CSUM_CRC32C	0
 
 struct gfile_name {
 	/** Offset of file in to record block. */
@@ -45,8 +75,34 @@ struct gfile_name {
 	uint32_t n_name;
 	/** Length of the file-name. */
 	uint16_t n_nlen;
-	/** Reserved for mode flags. */
+	/** Mode flags. */
+	uint16_t n_mode;
+}_packed;
+
+/* Version 2 name index entry, the 64 bit record offset comes first so
+ * that it's naturally aligned.
+ */
+struct gfile_name64 {
+	/** Offset of file in to the archive. */
+	uint64_t n_ofs;
+	/** Length of this file. */
+	uint32_t n_len;
+	/** Offset of filename from the start of the name index block. */
+	uint32_t n_name;
+	/** Length of the file-name. */
+	uint16_t n_nlen;
+	/** Mode flags. */
 	uint16_t n_mode;
+	uint32_t n_reserved;
+}_packed;
+
+/* n_mode flags */
+#define GFILE_MODE_LZ		(1 << 0) /* record is gfile_lz + lz stream */
+
+/* Prefix of compressed records, n_len covers this and the lz stream */
+struct gfile_lz {
+	/** Decompressed length */
+	uint32_t z_len;
 }_packed;
 
 struct gfile_nidx {
@@ -54,8 +110,39 @@ struct gfile_nidx {
 	uint32_t i_num_names;
 	/** Size of string table for names. */
 	uint32_t i_strtab_sz;
-	/** name array follows idx header */
+	/** name array follows idx header, gfile_name64 after version 1 */
 	struct gfile_name i_name[0];
 }_packed;
 
+/* Minimal perfect hash over the name index, hash and displace style.
+ * Bucket is H(fnv_hash(name)) % p_num_buckets. A zero displacement means
+ * the bucket is empty, a negative one is (-slot - 1) for a single entry
+ * bucket, otherwise slot is H(fnv_hash_seed(name, disp)) % p_num_slots.
+ * The slot table maps back in to i_name[] so the sorted index is
+ * untouched.
+ *
+ * H() is fnv_mix() for GFILE_NIDX_PHASH2, which is what mkgfile writes.
+ * GFILE_NIDX_PHASH blocks use the raw FNV hash, whose low bits can't
+ * separate some short names, they're still read for older archives.
+ */
+struct gfile_phash {
+	/** Number of displacement buckets. */
+	uint32_t p_num_buckets;
+	/** Number of slots, always equal to i_num_names. */
+	uint32_t p_num_slots;
+	/** int32_t displacements follow, then uint32_t slot table */
+	uint32_t p_data[0];
+}_packed;
+
+/* One CRC32C per name index entry, in the same order. It covers the
+ * n_len bytes of the record as stored, so compressed records are
+ * checked before they're decompressed.
+ */
+struct gfile_csum {
+	/** Number of checksums, always equal to i_num_names. */
+	uint32_t c_num;
+	/** Checksums follow */
+	uint32_t c_crc[0];
+}_packed;
+
 #endif /* _GFILE_INTERNAL_HEADER_INCLUDED_ */
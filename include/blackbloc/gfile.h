@@ -8,6 +8,7 @@
 
 typedef struct _gnode *gnode_t;
 typedef struct _gfs *gfs_t;
+typedef struct _gvfs *gvfs_t;
 
 struct gfile {
 	const void *f_ptr;
@@ -15,10 +16,74 @@ struct gfile {
 	const char *f_name;
 };
 
-_check_result gfs_t gfs_open(const char *filename);
+/* Range of an archive's name index, see gfs_dir_open() */
+struct gfs_dir {
+	gfs_t d_fs;
+	uint32_t d_idx;
+	uint32_t d_end;
+};
+
+/* gfs_open() flags */
+#define GFS_NO_PHASH	(1 << 0) /* ignore perfect hash, bsearch names */
+#define GFS_VERIFY_OPEN	(1 << 1) /* check each file's CRC on first open */
+#define GFS_VERIFY_BG	(1 << 2) /* check every file on a thread */
+#define GFS_POPULATE	(1 << 3) /* fault the whole archive in at open */
+#define GFS_LOCK_INDEX	(1 << 4) /* mlock the directory, index and hashes */
+#define GFS_HUGEPAGE	(1 << 5) /* transparent huge page advice */
+#define GFS_PREAD	(1 << 6) /* read files in to buffers, don't map them */
+#define GFS_PREAD_THREADS (1 << 7) /* GFS_PREAD with threads, not io_uring */
+
+/* Archive mapping footprint, see gfs_mem_stat() */
+struct gfs_mem {
+	uint64_t m_mapped;
+	uint64_t m_resident;
+	uint64_t m_locked;
+};
+
+/* Checksum verification counters, see gfs_verify_stat() */
+struct gfs_verify {
+	unsigned int v_num_files;
+	unsigned int v_checked;
+	unsigned int v_bad;
+	uint64_t v_bytes;
+	/** Time spent checking in gfile_open() */
+	uint64_t v_open_ns;
+	/** Time spent checking on the background thread */
+	uint64_t v_bg_ns;
+};
+
+_check_result gfs_t gfs_open(const char *filename, unsigned int flags);
 void gfs_close(gfs_t fs);
+void gfs_cache_size(gfs_t fs, size_t max);
+void gfs_verify_stat(gfs_t fs, struct gfs_verify *v);
+void gfs_mem_stat(gfs_t fs, struct gfs_mem *m);
+_check_result int gfs_lock(gfs_t fs, const char * const *names,
+				unsigned int num);
 
 _check_result int gfile_open(gfs_t fs, struct gfile *f, const char *name);
 void gfile_close(gfs_t fs, struct gfile *f);
 
+/* Listing by name prefix, eg. every anim for a model */
+unsigned int gfs_dir_open(gfs_t fs, struct gfs_dir *d, const char *prefix);
+const char *gfs_dir_next(struct gfs_dir *d);
+unsigned int gfs_readdir(gfs_t fs, const char *prefix,
+			int (*cb)(void *priv, const char *name), void *priv);
+
+/* Mount stack, lookups go through one merged index */
+_check_result gvfs_t gvfs_new(void);
+void gvfs_free(gvfs_t vfs);
+_check_result gfs_t gfs_mount(gvfs_t vfs, const char *filename,
+				unsigned int flags, int prio);
+_check_result int gfs_unmount(gvfs_t vfs, gfs_t fs);
+
+_check_result int gvfs_open(gvfs_t vfs, struct gfile *f, const char *name);
+void gvfs_close(gvfs_t vfs, struct gfile *f);
+unsigned int gvfs_readdir(gvfs_t vfs, const char *prefix,
+			int (*cb)(void *priv, const char *name), void *priv);
+
+/* Readahead hints for files which are about to be opened */
+void gfs_prefetch(gfs_t fs, const char * const *names, unsigned int num);
+void gvfs_prefetch(gvfs_t vfs, const char * const *names, unsigned int num);
+_check_result int gvfs_prefetch_thread(gvfs_t vfs);
+
 #endif /* _GFILE_HEADER_INCLUDED_ */
@@ -0,0 +1,24 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*/
+#ifndef _LZ_HEADER_INCLUDED_
+#define _LZ_HEADER_INCLUDED_
+
+/* Simple byte oriented LZ77 codec, a sequence is:
+ *  token: high nibble literal count, low nibble match length - 4
+ *  literal count extension bytes if the nibble was 15 (255 means more)
+ *  literals
+ *  16 bit little endian match offset (absent on the final sequence)
+ *  match length extension bytes if the nibble was 15
+ */
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	0xffff
+
+_check_result size_t lz_compress(const void *src, size_t len,
+					void *dst, size_t max);
+_check_result int lz_decompress(const void *src, size_t len,
+					void *dst, size_t out_len);
+
+#endif /* _LZ_HEADER_INCLUDED_ */
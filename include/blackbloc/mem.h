@@ -0,0 +1,61 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Allocation accounting. Loaders allocate through these with a tag for
+* the subsystem the memory belongs to and mpool/gang slabs are counted
+* under their own tags. Without --enable-memstats it all compiles down
+* to plain libc calls.
+*/
+#ifndef _MEM_HEADER_INCLUDED_
+#define _MEM_HEADER_INCLUDED_
+
+#include <stdio.h>
+
+#define MEM_MISC	0
+#define MEM_BSP		1
+#define MEM_MD5MESH	2
+#define MEM_MD5ANIM	3
+#define MEM_MD2		4
+#define MEM_IMG		5
+#define MEM_MPOOL	6
+#define MEM_GANG	7
+#define MEM_NR_TAGS	8
+
+struct mem_stat {
+	/** Bytes allocated and not yet freed. */
+	size_t s_live;
+	/** Highest s_live has been. */
+	size_t s_peak;
+	/** Allocations ever made. */
+	unsigned long s_allocs;
+	/** Allocations during the last complete frame. */
+	unsigned long s_frame;
+};
+
+#if MEM_STATS
+_malloc void *mem_alloc(unsigned int tag, size_t sz);
+_malloc void *mem_calloc(unsigned int tag, size_t num, size_t sz);
+_malloc char *mem_strdup(unsigned int tag, const char *str);
+void mem_free(unsigned int tag, void *ptr);
+void mem_add(unsigned int tag, size_t sz);
+void mem_sub(unsigned int tag, size_t sz);
+#else
+#define mem_alloc(tag, sz) malloc(sz)
+#define mem_calloc(tag, num, sz) calloc(num, sz)
+#define mem_strdup(tag, str) strdup(str)
+#define mem_free(tag, ptr) free(ptr)
+#define mem_add(tag, sz) do { } while(0)
+#define mem_sub(tag, sz) do { } while(0)
+#endif
+
+int mem_enabled(void);
+const char *mem_tag_name(unsigned int tag);
+void mem_get(unsigned int tag, struct mem_stat *st);
+void mem_total(struct mem_stat *st);
+void mem_frame(void);
+void mem_nomalloc(int on);
+void mem_dump(FILE *f);
+
+#endif /* _MEM_HEADER_INCLUDED_ */
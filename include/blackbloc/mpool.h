@@ -9,6 +9,11 @@
 /* for memset */
 #include <string.h>
 
+/** Back slabs with transparent huge pages, see mpool_init_aligned().
+ * \ingroup g_mpool
+*/
+#define MPOOL_HUGEPAGE	(1 << 0)
+
 /** mpool descriptor.
  * \ingroup g_mpool
 */
@@ -17,6 +22,12 @@ struct mpool {
 	size_t obj_size;
 	/** Size of each block including mpool_hdr overhead. */
 	size_t slab_size;
+	/** Object alignment, a power of two. */
+	size_t align;
+	/** Offset of the first object in a block. */
+	size_t hdr_size;
+	/** MPOOL_* flags. */
+	unsigned int flags;
 	/** List of blocks. */
 	struct mpool_hdr *slabs;
 	/** List of free'd objects. */
@@ -36,7 +47,11 @@ struct mpool_hdr {
 };
 
 _public int mpool_init(struct mpool *m, size_t obj_size, unsigned slab_size);
+_public int mpool_init_aligned(struct mpool *m, size_t obj_size,
+				unsigned slab_size, size_t align,
+				unsigned int flags);
 _public void mpool_fini(struct mpool *m);
+_public size_t mpool_trim(struct mpool *m);
 _public void mpool_destroy(struct mpool *m, void(*dtor)(void *));
 _public _malloc void *mpool_alloc(struct mpool *m);
 _malloc static inline void *mpool_alloc0(struct mpool *m);
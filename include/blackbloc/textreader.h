@@ -8,8 +8,30 @@
 
 typedef struct _textreader *textreader_t;
 
+/* A piece of the text being read, not NUL terminated */
+struct txt_slice {
+	const char *ptr;
+	size_t len;
+};
+
+#define TXT_TOK_NONE	0
+#define TXT_TOK_WORD	1
+#define TXT_TOK_STRING	2
+
 textreader_t textreader_new(const char *ptr, size_t len);
 char *textreader_gets(textreader_t txt);
+int textreader_line(textreader_t txt, struct txt_slice *line);
 void textreader_free(textreader_t txt);
 
+int txt_token(struct txt_slice *line, struct txt_slice *tok);
+int txt_slice_eq(const struct txt_slice *s, const char *str);
+int txt_slice_int(const struct txt_slice *s, int *val);
+int txt_slice_float(const struct txt_slice *s, float *val);
+
+int txt_word(struct txt_slice *line, struct txt_slice *tok);
+int txt_next_int(struct txt_slice *line, int *val);
+int txt_next_float(struct txt_slice *line, float *val);
+unsigned int txt_next_floats(struct txt_slice *line, float *v, unsigned int n);
+int txt_next_tuple(struct txt_slice *line, float *v, unsigned int n);
+
 #endif /* _TEXTREADER_HEADER_INCLUDED_ */
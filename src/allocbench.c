@@ -0,0 +1,662 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Allocator benchmarks, eg:
+*
+*   allocbench [-t max_threads] [-n rounds] [-p]
+*
+* First single threaded patterns: mpool and gang against malloc for a
+* range of object sizes, allocating a working set and then freeing it
+* LIFO, FIFO, in random order or in bursts where half of each burst is
+* freed before the next. Gang can't free, it's reset after each round.
+* The rounds are compiled separately for each allocator so the inline
+* fast paths get measured as the rest of the tree uses them. After
+* timing, one more round stops short leaving the last 1/16th of the
+* objects it would free, fragmentation is then the proportion of what
+* the allocator holds after trimming which isn't live objects. RSS is
+* the growth over the whole run.
+*
+* Then contention, unless -p is given: malloc, an mpool behind a mutex
+* (which is what sharing one takes) and a cpool are each run with 1, 2,
+* 4 and so on up to 32 threads. In the local test every thread frees
+* what it allocated, in the remote test each thread frees what its
+* neighbour allocated in the previous round.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/mpool.h>
+#include <blackbloc/cpool.h>
+#include <blackbloc/gang.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define OBJ_SIZE	64
+#define BATCH		1024
+#define MAX_THREADS	32
+
+struct allocator {
+	const char *name;
+	int (*init)(void);
+	void (*fini)(void);
+	void *(*alloc)(void);
+	void (*free)(void *obj);
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	void *obj[BATCH];
+	double ns;
+};
+
+static const struct allocator *cur;
+static struct worker workers[MAX_THREADS];
+static unsigned int num_threads;
+static unsigned int num_rounds = 1000;
+static int remote;
+static pthread_barrier_t barrier;
+
+static struct mpool mp;
+static pthread_mutex_t mp_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cpool cp;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int malloc_init(void)
+{
+	return 1;
+}
+
+static void malloc_fini(void)
+{
+}
+
+static void *malloc_alloc(void)
+{
+	return malloc(OBJ_SIZE);
+}
+
+static void malloc_free(void *obj)
+{
+	free(obj);
+}
+
+static int mpool_init_locked(void)
+{
+	return mpool_init(&mp, OBJ_SIZE, 0);
+}
+
+static void mpool_fini_locked(void)
+{
+	mpool_fini(&mp);
+}
+
+static void *mpool_alloc_locked(void)
+{
+	void *ret;
+
+	pthread_mutex_lock(&mp_lock);
+	ret = mpool_alloc(&mp);
+	pthread_mutex_unlock(&mp_lock);
+	return ret;
+}
+
+static void mpool_free_locked(void *obj)
+{
+	pthread_mutex_lock(&mp_lock);
+	mpool_free(&mp, obj);
+	pthread_mutex_unlock(&mp_lock);
+}
+
+static int cpool_init_bench(void)
+{
+	return cpool_init(&cp, OBJ_SIZE, 0);
+}
+
+static void cpool_fini_bench(void)
+{
+	cpool_fini(&cp);
+}
+
+static void *cpool_alloc_bench(void)
+{
+	return cpool_alloc(&cp);
+}
+
+static void cpool_free_bench(void *obj)
+{
+	cpool_free(&cp, obj);
+}
+
+static const struct allocator allocators[] = {
+	{"malloc", malloc_init, malloc_fini, malloc_alloc, malloc_free},
+	{"mpool+mutex", mpool_init_locked, mpool_fini_locked,
+		mpool_alloc_locked, mpool_free_locked},
+	{"cpool", cpool_init_bench, cpool_fini_bench,
+		cpool_alloc_bench, cpool_free_bench},
+};
+
+static void fill(struct worker *w)
+{
+	unsigned int i;
+
+	for(i = 0; i < BATCH; i++) {
+		w->obj[i] = (*cur->alloc)();
+		if ( NULL == w->obj[i] )
+			abort();
+		memset(w->obj[i], w->id, OBJ_SIZE);
+	}
+}
+
+static void drain(struct worker *w)
+{
+	unsigned int i;
+
+	for(i = 0; i < BATCH; i++)
+		(*cur->free)(w->obj[i]);
+}
+
+static void *worker(void *priv)
+{
+	struct worker *w = priv;
+	unsigned int r;
+	double start;
+
+	pthread_barrier_wait(&barrier);
+	start = now();
+
+	for(r = 0; r < num_rounds; r++) {
+		fill(w);
+		if ( remote ) {
+			/* swap batches with our neighbour */
+			pthread_barrier_wait(&barrier);
+			drain(&workers[(w->id + 1) % num_threads]);
+			pthread_barrier_wait(&barrier);
+		}else{
+			drain(w);
+		}
+	}
+
+	w->ns = now() - start;
+	return NULL;
+}
+
+static int run(const struct allocator *a, unsigned int threads)
+{
+	unsigned int i;
+	double ns = 0, wall = 0;
+
+	if ( !(*a->init)() )
+		return 0;
+
+	cur = a;
+	num_threads = threads;
+	pthread_barrier_init(&barrier, NULL, threads);
+
+	for(i = 0; i < threads; i++) {
+		workers[i].id = i;
+		if ( pthread_create(&workers[i].thread, NULL,
+					worker, &workers[i]) ) {
+			fprintf(stderr, "%s: pthread_create failed\n", _func);
+			abort();
+		}
+	}
+
+	for(i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ns += workers[i].ns;
+		if ( workers[i].ns > wall )
+			wall = workers[i].ns;
+	}
+
+	pthread_barrier_destroy(&barrier);
+	(*a->fini)();
+
+	/* an op is an alloc and a free, throughput is over the slowest */
+	printf("%-12s %2u threads: %7.1f ns/op %8.2f Mops/s\n",
+		a->name, threads,
+		ns / ((double)threads * num_rounds * BATCH),
+		(threads * (double)num_rounds * BATCH) / (wall / 1e3));
+	return 1;
+}
+
+#define PAT_OBJS	4096
+#define PAT_BURST	64
+#define PAT_KEEP	16
+
+enum {
+	PAT_LIFO,
+	PAT_FIFO,
+	PAT_RANDOM,
+	PAT_BURSTS,
+	PAT_NR
+};
+
+static const char * const pat_names[PAT_NR] = {
+	[PAT_LIFO] = "lifo",
+	[PAT_FIFO] = "fifo",
+	[PAT_RANDOM] = "random",
+	[PAT_BURSTS] = "burst",
+};
+
+static const size_t pat_sizes[] = {16, 64, 256, 1024};
+
+struct pattern_bench {
+	const char *name;
+	int (*init)(void);
+	void (*fini)(void);
+	void (*round)(unsigned int pat);
+	void *(*alloc)(void);
+	void (*free)(void *obj);
+	size_t (*footprint)(void);
+};
+
+static void *slot[PAT_OBJS];
+static unsigned int perm[PAT_OBJS];
+static size_t pat_size;
+
+static struct gang gm;
+static size_t malloc_base;
+
+/* Resident set from /proc, getrusage() only knows the peak */
+static unsigned long rss_kb(void)
+{
+	unsigned long sz, res = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if ( NULL == f )
+		return 0;
+	if ( fscanf(f, "%lu %lu", &sz, &res) != 2 )
+		res = 0;
+	fclose(f);
+	return res * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+/* One round of a pattern, PAT_OBJS allocations and as many frees. Made
+ * for each allocator so that ALLOC and FREE are inlined.
+ */
+#define PATTERN_ROUND(fn, ALLOC, FREE)					\
+static void fn(unsigned int pat)					\
+{									\
+	unsigned int i, j;						\
+									\
+	if ( pat == PAT_BURSTS ) {					\
+		for(i = 0; i < PAT_OBJS; i += PAT_BURST) {		\
+			for(j = i; j < i + PAT_BURST; j++) {		\
+				slot[j] = ALLOC;			\
+				if ( unlikely(NULL == slot[j]) )	\
+					abort();			\
+			}						\
+			if ( 0 == i )					\
+				continue;				\
+			for(j = i - PAT_BURST; j < i; j++) {		\
+				if ( perm[j] & 1 ) {			\
+					FREE(slot[j]);			\
+					slot[j] = NULL;			\
+				}					\
+			}						\
+		}							\
+		for(i = 0; i < PAT_OBJS; i++)				\
+			FREE(slot[perm[i]]);				\
+		return;							\
+	}								\
+									\
+	for(i = 0; i < PAT_OBJS; i++) {					\
+		slot[i] = ALLOC;					\
+		if ( unlikely(NULL == slot[i]) )			\
+			abort();					\
+	}								\
+									\
+	switch ( pat ) {						\
+	case PAT_LIFO:							\
+		for(i = PAT_OBJS; i--; )				\
+			FREE(slot[i]);					\
+		break;							\
+	case PAT_FIFO:							\
+		for(i = 0; i < PAT_OBJS; i++)				\
+			FREE(slot[i]);					\
+		break;							\
+	case PAT_RANDOM:						\
+		for(i = 0; i < PAT_OBJS; i++)				\
+			FREE(slot[perm[i]]);				\
+		break;							\
+	}								\
+}
+
+#define MALLOC_ALLOC	malloc(pat_size)
+#define MALLOC_FREE(x)	free(x)
+#define MPOOL_ALLOC	mpool_alloc(&mp)
+#define MPOOL_FREE(x)	mpool_free(&mp, x)
+#define GANG_ALLOC	gang_alloc(&gm, pat_size)
+#define GANG_FREE(x)	do { } while(0)
+
+PATTERN_ROUND(pat_malloc_round, MALLOC_ALLOC, MALLOC_FREE)
+PATTERN_ROUND(pat_mpool_round, MPOOL_ALLOC, MPOOL_FREE)
+PATTERN_ROUND(gang_pattern, GANG_ALLOC, GANG_FREE)
+
+/* What malloc has from the system, zero if we can't tell. mallinfo2()
+ * returns a struct by value and that's glibc's API, not something we
+ * can change, so let it off -Waggregate-return.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+static size_t malloc_held(void)
+{
+#if HAVE_MALLINFO2
+	struct mallinfo2 mi;
+
+	mi = mallinfo2();
+	return mi.arena + mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+#pragma GCC diagnostic pop
+
+static int pat_malloc_init(void)
+{
+	malloc_trim(0);
+	malloc_base = malloc_held();
+	return 1;
+}
+
+static void pat_malloc_fini(void)
+{
+}
+
+static void *pat_malloc_alloc(void)
+{
+	return malloc(pat_size);
+}
+
+static void pat_malloc_free(void *obj)
+{
+	free(obj);
+}
+
+static size_t pat_malloc_footprint(void)
+{
+	size_t held;
+
+	malloc_trim(0);
+	held = malloc_held();
+
+	return (held > malloc_base) ? held - malloc_base : 0;
+}
+
+static int pat_mpool_init(void)
+{
+	return mpool_init(&mp, pat_size, 0);
+}
+
+static void pat_mpool_fini(void)
+{
+	mpool_fini(&mp);
+}
+
+static void *pat_mpool_alloc(void)
+{
+	return mpool_alloc(&mp);
+}
+
+static void pat_mpool_free(void *obj)
+{
+	mpool_free(&mp, obj);
+}
+
+static size_t pat_mpool_footprint(void)
+{
+	struct mpool_hdr *h;
+	size_t ret = 0;
+
+	mpool_trim(&mp);
+	for(h = mp.slabs; h; h = h->next)
+		ret += mp.slab_size;
+	return ret;
+}
+
+static int pat_gang_init(void)
+{
+	return gang_init(&gm, 0);
+}
+
+static void pat_gang_fini(void)
+{
+	gang_fini(&gm);
+}
+
+static void pat_gang_round(unsigned int pat)
+{
+	gang_pattern(pat);
+	gang_reset(&gm);
+}
+
+static void *pat_gang_alloc(void)
+{
+	return gang_alloc(&gm, pat_size);
+}
+
+static void pat_gang_free(void *obj)
+{
+}
+
+static size_t pat_gang_footprint(void)
+{
+	struct gang_slab *s;
+	size_t ret = 0;
+
+	for(s = gm.head; s; s = s->next)
+		ret += s->size;
+	return ret;
+}
+
+static const struct pattern_bench pattern_benches[] = {
+	{"malloc", pat_malloc_init, pat_malloc_fini, pat_malloc_round,
+		pat_malloc_alloc, pat_malloc_free, pat_malloc_footprint},
+	{"mpool", pat_mpool_init, pat_mpool_fini, pat_mpool_round,
+		pat_mpool_alloc, pat_mpool_free, pat_mpool_footprint},
+	{"gang", pat_gang_init, pat_gang_fini, pat_gang_round,
+		pat_gang_alloc, pat_gang_free, pat_gang_footprint},
+};
+
+static unsigned int pat_order(unsigned int pat, unsigned int i)
+{
+	switch ( pat ) {
+	case PAT_LIFO:
+		return PAT_OBJS - 1 - i;
+	case PAT_FIFO:
+		return i;
+	default:
+		return perm[i];
+	}
+}
+
+/* Free in the pattern's order until only the last 1/PAT_KEEP are left,
+ * have the allocator give back what it can and see how much of what it
+ * still holds is in use.
+ */
+static double pat_frag(const struct pattern_bench *b, unsigned int pat)
+{
+	unsigned int i, keep = PAT_OBJS / PAT_KEEP;
+	size_t live, held;
+
+	for(i = 0; i < PAT_OBJS; i++) {
+		slot[i] = (*b->alloc)();
+		if ( NULL == slot[i] )
+			abort();
+	}
+
+	for(i = 0; i < PAT_OBJS - keep; i++)
+		(*b->free)(slot[pat_order(pat, i)]);
+
+	live = keep * pat_size;
+	held = (*b->footprint)();
+
+	for(; i < PAT_OBJS; i++)
+		(*b->free)(slot[pat_order(pat, i)]);
+
+	if ( 0 == held )
+		return -1.0;
+	if ( held < live )
+		return 0.0;
+	return 100.0 * (held - live) / held;
+}
+
+/* Each in its own process so that one can't leave the heap or RSS in
+ * a state which skews the next.
+ */
+static int pat_run(const struct pattern_bench *b, unsigned int pat,
+			unsigned int rounds)
+{
+	double start, ns, frag;
+	unsigned int r;
+	long rss;
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if ( pid < 0 ) {
+		fprintf(stderr, "%s: fork: %s\n", _func, get_err());
+		return 0;
+	}
+	if ( pid ) {
+		if ( waitpid(pid, &status, 0) < 0 )
+			return 0;
+		return WIFEXITED(status) && !WEXITSTATUS(status);
+	}
+
+	rss = rss_kb();
+	if ( !(*b->init)() )
+		_exit(EXIT_FAILURE);
+
+	/* warm up so we aren't timing the first slabs being faulted in */
+	(*b->round)(pat);
+
+	start = now();
+	for(r = 0; r < rounds; r++)
+		(*b->round)(pat);
+	ns = now() - start;
+
+	frag = pat_frag(b, pat);
+	rss = rss_kb() - rss;
+	(*b->fini)();
+
+	/* an op is an alloc or a free, gang's frees cost nothing */
+	printf("%-7s %5lu %-6s %7.1f ns/op %7ld KB rss",
+		b->name, (unsigned long)pat_size, pat_names[pat],
+		ns / (2.0 * rounds * PAT_OBJS), rss);
+	if ( frag < 0 )
+		printf("      - frag\n");
+	else
+		printf(" %5.1f%% frag\n", frag);
+	fflush(stdout);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Same order every run so that runs can be compared */
+static void pat_shuffle(void)
+{
+	uint32_t x = 2463534242U;
+	unsigned int i, j, tmp;
+
+	for(i = 0; i < PAT_OBJS; i++)
+		perm[i] = i;
+
+	for(i = PAT_OBJS - 1; i > 0; i--) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		j = x % (i + 1);
+		tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+}
+
+static int patterns(unsigned int rounds)
+{
+	unsigned int s, pat, i;
+
+	pat_shuffle();
+
+	printf("patterns:\n");
+	for(s = 0; s < sizeof(pat_sizes) / sizeof(*pat_sizes); s++) {
+		pat_size = pat_sizes[s];
+		for(pat = 0; pat < PAT_NR; pat++) {
+			for(i = 0; i < sizeof(pattern_benches) /
+					sizeof(*pattern_benches); i++) {
+				if ( !pat_run(&pattern_benches[i], pat,
+						rounds) )
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-t max_threads] [-n rounds] [-p]\n",
+		cmd);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max = MAX_THREADS, t, i;
+	int c, only_patterns = 0;
+
+	while ( (c = getopt(argc, argv, "t:n:p")) != -1 ) {
+		switch ( c ) {
+		case 't':
+			max = atoi(optarg);
+			break;
+		case 'n':
+			num_rounds = atoi(optarg);
+			break;
+		case 'p':
+			only_patterns = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( max < 1 || max > MAX_THREADS || num_rounds < 1 ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* a pattern round is four contention rounds worth of allocations */
+	if ( !patterns((num_rounds + 3) / 4) )
+		return EXIT_FAILURE;
+	if ( only_patterns )
+		return EXIT_SUCCESS;
+
+	for(remote = 0; remote < 2; remote++) {
+		printf("%s frees:\n", (remote) ? "remote" : "local");
+		for(t = 1; t <= max; t *= 2) {
+			for(i = 0; i < sizeof(allocators) /
+					sizeof(*allocators); i++) {
+				if ( !run(&allocators[i], t) )
+					return EXIT_FAILURE;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -48,27 +48,23 @@ void cl_cmd_run(const char *cmd)
 	struct cl_cmd *c;
 	int ret;
 
-	buf = strdup(cmd);
+	buf = frame_strdup(cmd);
 	if ( NULL == buf )
 		return;
 	
 	ret = easy_explode(buf, 0, tok, sizeof(tok)/sizeof(*tok));
-	if ( ret <= 0 ) {
-		free(buf);
+	if ( ret <= 0 )
 		return;
-	}
 	if ( ret == 1 )
 		tok[1] = NULL;
 
 	c = cl_cmd_by_name(tok[0]);
 	if ( NULL == c ) {
 		con_printf("%s: Unknown command\n", tok[0]);
-		free(buf);
 		return;
 	}
 
 	c->fn(1, tok[1]);
-	free(buf);
 }
 
 int cl_cmd_bind(const char *k, const char *c)
@@ -129,6 +125,10 @@ static struct cl_cmd command[]={
 	{clcmd_quit, "quit", "Exit the game"},
 	{clcmd_help, "help", "Print a list of commands"},
 	{clcmd_console, "console", "Toggle the console"},
+	{clcmd_trace, "trace", "Record file accesses to a file"},
+	{clcmd_verify, "verify", "Show archive checksum verification stats"},
+	{clcmd_faults, "faults", "Show resident set and page fault counts"},
+	{clcmd_mem, "mem", "Show heap usage by subsystem, or dump it to a file"},
 };
 
 static void clcmd_help(int s, char *arg)
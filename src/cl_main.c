@@ -3,7 +3,10 @@
 * Copyright (c) 2003 Gianni Tedesco
 * Released under the terms of the GNU GPL version 2
 */
+#include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <SDL.h>
 
 #include <blackbloc/blackbloc.h>
@@ -26,47 +29,332 @@ static q2bsp_t map;
 
 static md2_model_t soldier[6];
 static md5_model_t marine[20];
-static gfs_t gfs;
-
-static const char * const anims[] = {
-	"models/md5/chars/marscity/marscity_marine1_convo2.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_talk2.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_idle2.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_idle1.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_idle1.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_convo1.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_idle3.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_stand.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_talk3.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_talk2.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_convo3.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_talk1.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_convo1.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_talk1.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_stand.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_convo3.md5anim",
-	"models/md5/chars/marscity/marscity_marine2_convo2.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_talk3.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_idle3.md5anim",
-	"models/md5/chars/marscity/marscity_marine1_idle2.md5anim",
+static gvfs_t vfs;
+static gfs_t game_fs;
+static FILE *trace;
+
+static const char * const marine_mesh =
+	"models/md5/chars/marine.md5mesh";
+static const char * const anim_prefix =
+	"models/md5/chars/marscity/marscity_marine";
+static const char *anims[sizeof(marine)/sizeof(*marine)];
+static unsigned int num_anims;
+
+/* Which anim each marine plays, as it was before they were listed */
+static const char * const marine_anim[] = {
+	"1_convo2", "1_talk2", "2_idle2", "1_idle1", "2_idle1",
+	"2_convo1", "2_idle3", "1_stand", "2_talk3", "2_talk2",
+	"2_convo3", "2_talk1", "1_convo1", "1_talk1", "2_stand",
+	"1_convo3", "2_convo2", "1_talk3", "1_idle3", "1_idle2",
 };
 
 int game_open(struct gfile *f, const char *name)
 {
-	return gfile_open(gfs, f, name);
+	if ( !gvfs_open(vfs, f, name) )
+		return 0;
+
+	/* Record access order, mkgfile -t lays files out this way */
+	if ( trace )
+		fprintf(trace, "%s\n", name);
+	return 1;
 }
 
 void game_close(struct gfile *f)
 {
-	gfile_close(gfs, f);
+	gvfs_close(vfs, f);
 }
 
-int cl_init(void)
+/* Loaders declare what they're about to open so the I/O overlaps */
+void game_prefetch(const char * const *names, unsigned int num)
+{
+	gvfs_prefetch(vfs, names, num);
+}
+
+unsigned int game_readdir(const char *prefix,
+			int (*cb)(void *priv, const char *name), void *priv)
+{
+	return gvfs_readdir(vfs, prefix, cb, priv);
+}
+
+/* Names point in to the archive so they live as long as the mount */
+static int add_anim(void *priv, const char *name)
+{
+	size_t len = strlen(name);
+
+	if ( len < 8 || strcmp(name + len - 8, ".md5anim") )
+		return 1;
+
+	anims[num_anims++] = name;
+	return num_anims < sizeof(anims)/sizeof(*anims);
+}
+
+/* Helper for qsort/bsearch */
+static int anim_compar(const void *aa, const void *bb)
+{
+	const char * const *a = aa;
+	const char * const *b = bb;
+
+	return strcmp(*a, *b);
+}
+
+/* Listing order depends on the mounts, so go by name. A marine whose
+ * anim isn't there gets one of the others, in sorted order.
+ */
+static const char *pick_anim(unsigned int i)
+{
+	char buf[128];
+	const char *key = buf;
+	const char **ret;
+
+	snprintf(buf, sizeof(buf), "%s%s.md5anim", anim_prefix,
+		marine_anim[i % (sizeof(marine_anim)/sizeof(*marine_anim))]);
+	ret = bsearch(&key, anims, num_anims, sizeof(*anims), anim_compar);
+	if ( ret )
+		return *ret;
+	return anims[i % num_anims];
+}
+
+static int trace_start(const char *fn)
+{
+	FILE *f;
+
+	f = fopen(fn, "w");
+	if ( NULL == f ) {
+		con_printf("trace: %s: %s\n", fn, get_err());
+		return 0;
+	}
+
+	if ( trace )
+		fclose(trace);
+	trace = f;
+	con_printf("trace: recording file accesses to %s\n", fn);
+	return 1;
+}
+
+void clcmd_trace(int s, char *arg)
+{
+	if ( arg ) {
+		trace_start(arg);
+		return;
+	}
+
+	if ( trace ) {
+		fclose(trace);
+		trace = NULL;
+		con_printf("trace: stopped\n");
+	}
+}
+
+void clcmd_verify(int s, char *arg)
+{
+	struct gfs_verify v;
+
+	gfs_verify_stat(game_fs, &v);
+	if ( v.v_num_files == 0 ) {
+		con_printf("verify: off, set BLACKBLOC_VERIFY=open|bg\n");
+		return;
+	}
+
+	con_printf("verify: %u/%u files, %u bad, %lu KB\n",
+		v.v_checked, v.v_num_files, v.v_bad,
+		(unsigned long)(v.v_bytes >> 10));
+	con_printf("verify: %lu ms in open, %lu ms in background\n",
+		(unsigned long)(v.v_open_ns / 1000000),
+		(unsigned long)(v.v_bg_ns / 1000000));
+}
+
+/* Resident set from /proc, getrusage() only knows the peak */
+static unsigned long rss_kb(void)
+{
+	unsigned long sz, res = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if ( NULL == f )
+		return 0;
+	if ( fscanf(f, "%lu %lu", &sz, &res) != 2 )
+		res = 0;
+	fclose(f);
+	return res * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+/* Faults since the last call too, so a run of frames can be checked */
+void clcmd_faults(int s, char *arg)
 {
+	static long last_min, last_maj;
+	struct gfs_mem m;
+	struct rusage r;
+
+	getrusage(RUSAGE_SELF, &r);
+	gfs_mem_stat(game_fs, &m);
+
+	con_printf("faults: rss %lu KB, peak %lu KB\n",
+		rss_kb(), (unsigned long)r.ru_maxrss);
+	con_printf("faults: %ld minor (+%ld), %ld major (+%ld)\n",
+		r.ru_minflt, r.ru_minflt - last_min,
+		r.ru_majflt, r.ru_majflt - last_maj);
+	con_printf("faults: game.gfs %lu KB mapped, %lu KB resident, "
+			"%lu KB locked\n",
+		(unsigned long)(m.m_mapped >> 10),
+		(unsigned long)(m.m_resident >> 10),
+		(unsigned long)(m.m_locked >> 10));
+
+	last_min = r.ru_minflt;
+	last_maj = r.ru_majflt;
+}
+
+/* Heap by subsystem, or with a filename dump it there for scripts */
+void clcmd_mem(int s, char *arg)
+{
+	struct mem_stat st;
 	unsigned int i;
-	gfs = gfs_open("data/game.gfs");
-	if ( gfs == NULL )
+	FILE *f;
+
+	if ( !mem_enabled() ) {
+		con_printf("mem: off, configure with --enable-memstats\n");
+		return;
+	}
+
+	if ( arg ) {
+		f = fopen(arg, "w");
+		if ( NULL == f ) {
+			con_printf("mem: %s: %s\n", arg, get_err());
+			return;
+		}
+		mem_dump(f);
+		fclose(f);
+		return;
+	}
+
+	for(i = 0; i < MEM_NR_TAGS; i++) {
+		mem_get(i, &st);
+		con_printf("mem: %-8s %8lu KB live, %8lu KB peak, "
+				"%lu allocs, %lu/frame\n",
+			mem_tag_name(i),
+			(unsigned long)(st.s_live >> 10),
+			(unsigned long)(st.s_peak >> 10),
+			st.s_allocs, st.s_frame);
+	}
+
+	mem_total(&st);
+	con_printf("mem: %-8s %8lu KB live, %8lu KB peak, "
+			"%lu allocs, %lu/frame\n", "heap",
+		(unsigned long)(st.s_live >> 10),
+		(unsigned long)(st.s_peak >> 10),
+		st.s_allocs, st.s_frame);
+}
+
+/* Mapping options from the environment, a comma separated list of
+ * populate, lock and hugepage. Nothing by default.
+ */
+static unsigned int map_flags(void)
+{
+	const char *mode, *end;
+	unsigned int flags = 0;
+	size_t len;
+
+	mode = getenv("BLACKBLOC_MAP");
+	for(; mode && *mode; mode = (*end) ? end + 1 : end) {
+		end = strchr(mode, ',');
+		if ( NULL == end )
+			end = mode + strlen(mode);
+		len = end - mode;
+
+		if ( len == 8 && !strncmp(mode, "populate", len) )
+			flags |= GFS_POPULATE;
+		else if ( len == 4 && !strncmp(mode, "lock", len) )
+			flags |= GFS_LOCK_INDEX;
+		else if ( len == 8 && !strncmp(mode, "hugepage", len) )
+			flags |= GFS_HUGEPAGE;
+		else if ( len )
+			con_printf("client: unknown BLACKBLOC_MAP option: "
+					"%.*s\n", (int)len, mode);
+	}
+
+	return flags;
+}
+
+/* Read backend from the environment, mmap, pread or threads. The latter
+ * two read files in to buffers, via io_uring if we can. Default is mmap.
+ */
+static unsigned int io_flags(void)
+{
+	const char *mode;
+
+	mode = getenv("BLACKBLOC_IO");
+	if ( NULL == mode || !strcmp(mode, "mmap") )
 		return 0;
+	if ( !strcmp(mode, "pread") )
+		return GFS_PREAD;
+	if ( !strcmp(mode, "threads") )
+		return GFS_PREAD | GFS_PREAD_THREADS;
+	con_printf("client: unknown BLACKBLOC_IO mode: %s\n", mode);
+	return 0;
+}
+
+/* Checksum verification mode from the environment, default is not to
+ * check, checking every file at open is a CRC pass over all of startup.
+ */
+static unsigned int verify_flags(void)
+{
+	const char *mode;
+
+	mode = getenv("BLACKBLOC_VERIFY");
+	if ( NULL == mode )
+		return 0;
+	if ( !strcmp(mode, "open") )
+		return GFS_VERIFY_OPEN;
+	if ( !strcmp(mode, "bg") )
+		return GFS_VERIFY_BG;
+	if ( strcmp(mode, "never") )
+		con_printf("client: unknown BLACKBLOC_VERIFY mode: %s\n", mode);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int cl_init(void)
+{
+	const char *trace_fn;
+	unsigned int i, mflags;
+	struct rusage r0, r1;
+	double start;
+
+	/* Catch the startup loads too, not just what's run from console */
+	trace_fn = getenv("BLACKBLOC_TRACE");
+	if ( trace_fn )
+		trace_start(trace_fn);
+
+	vfs = gvfs_new();
+	if ( vfs == NULL )
+		return 0;
+
+	mflags = map_flags();
+	game_fs = gfs_mount(vfs, "data/game.gfs",
+				verify_flags() | io_flags() | mflags, 0);
+	if ( game_fs == NULL )
+		return 0;
+
+	/* Not fatal, prefetches just turn in to madvise() */
+	if ( !gvfs_prefetch_thread(vfs) )
+		con_printf("client: no prefetch thread\n");
+
+	game_readdir(anim_prefix, add_anim, NULL);
+	qsort(anims, num_anims, sizeof(*anims), anim_compar);
+	game_prefetch(&marine_mesh, 1);
+	game_prefetch(anims, num_anims);
+
+	/* The models are always on screen, keep them out of the frame */
+	if ( mflags & GFS_LOCK_INDEX ) {
+		if ( !gfs_lock(game_fs, &marine_mesh, 1) ||
+				!gfs_lock(game_fs, anims, num_anims) )
+			con_printf("client: mlock: %s\n", get_err());
+	}
 
 	client_frame = 0;
 
@@ -100,34 +388,50 @@ int cl_init(void)
 		}
 	}
 #endif
+	getrusage(RUSAGE_SELF, &r0);
+	start = now();
+
 	for(i = 0; i < sizeof(marine)/sizeof(*marine); i++) {
-		marine[i] = md5_new("models/md5/chars/marine.md5mesh");
+		marine[i] = md5_new(marine_mesh);
 		if ( marine[i] ) {
 			vector_t v;
 			v[Z] = 0;
 			v[Y] = 0;
 			v[Z] = 50 + 50 * i;
-			md5_animate(marine[i], anims[i]);
+			if ( num_anims )
+				md5_animate(marine[i], pick_anim(i));
 			md5_spawn(marine[i], v);
 		}
 	}
 
+	getrusage(RUSAGE_SELF, &r1);
+	con_printf("client: marines loaded in %.1f ms, %ld major faults\n",
+			now() - start, r1.ru_majflt - r0.ru_majflt);
 	return 1;
 }
 
 static int load_map(const char *arg)
 {
 	q2bsp_t tmp_map;
+	struct rusage r0, r1;
+	double start;
 	char buf[strlen(arg) + strlen("maps/.bsp") + 1];
 
 	snprintf(buf, sizeof(buf), "maps/%s.bsp", arg);
 
+	getrusage(RUSAGE_SELF, &r0);
+	start = now();
+
 	tmp_map = q2bsp_load(buf);
 	if ( NULL == tmp_map ) {
 		con_printf("%s: map not found\n", buf);
 		return 0;
 	}
 
+	getrusage(RUSAGE_SELF, &r1);
+	con_printf("%s: loaded in %.1f ms, %ld major faults\n", buf,
+			now() - start, r1.ru_majflt - r0.ru_majflt);
+
 	q2bsp_free(map);
 	map = tmp_map;
 	return 1;
@@ -0,0 +1,376 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Thread-safe mpool. Each thread allocates from and frees to its own
+* pair of magazines, small stacks of free objects, so the common case
+* touches no shared state at all. When both are empty or both are full
+* a thread swaps one with the depot, a pair of lock-free stacks of full
+* and empty magazines. Frees on a thread other than the one which did
+* the allocation just go in to that thread's magazines and get back to
+* everyone else via the depot.
+*
+* Only when the depot has nothing to give is the lock taken, to carve a
+* magazine's worth of objects out of an ordinary mpool.
+*/
+
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/cpool.h>
+
+#include <pthread.h>
+
+static struct cpool_mag *mag_ptr(struct cpool *p, uint32_t idx)
+{
+	struct cpool_mag *chunk;
+
+	idx--;
+	chunk = __atomic_load_n(&p->chunk[idx / CPOOL_MAG_CHUNK],
+				__ATOMIC_ACQUIRE);
+	return &chunk[idx % CPOOL_MAG_CHUNK];
+}
+
+/* Depot stacks are a generation count in the top half and a magazine
+ * index in the bottom half, the generation changes on every push and
+ * pop so a pop which races with a pop and re-push of the same magazine
+ * will fail its compare and swap. Magazines aren't freed until the pool
+ * is, so a stale one is always safe to look at.
+ */
+static void depot_push(uint64_t *top, struct cpool_mag *m)
+{
+	uint64_t old, new;
+
+	old = __atomic_load_n(top, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&m->next, (uint32_t)old, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | m->idx;
+	}while ( !__atomic_compare_exchange_n(top, &old, new, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+}
+
+static struct cpool_mag *depot_pop(struct cpool *p, uint64_t *top)
+{
+	struct cpool_mag *m;
+	uint64_t old, new;
+	uint32_t next;
+
+	old = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+	do {
+		if ( 0 == (uint32_t)old )
+			return NULL;
+		m = mag_ptr(p, (uint32_t)old);
+		next = __atomic_load_n(&m->next, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | next;
+	}while ( !__atomic_compare_exchange_n(top, &old, new, 1,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) );
+
+	return m;
+}
+
+/* An empty magazine, from the depot if there's one there */
+static struct cpool_mag *mag_alloc(struct cpool *p)
+{
+	struct cpool_mag *m, *chunk;
+	uint32_t i;
+
+	m = depot_pop(p, &p->empty);
+	if ( m )
+		return m;
+
+	pthread_mutex_lock(&p->lock);
+
+	i = p->num_mags / CPOOL_MAG_CHUNK;
+	if ( i >= CPOOL_MAX_CHUNKS ) {
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+
+	if ( 0 == p->num_mags % CPOOL_MAG_CHUNK ) {
+		chunk = malloc(CPOOL_MAG_CHUNK * sizeof(*chunk));
+		if ( NULL == chunk ) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		__atomic_store_n(&p->chunk[i], chunk, __ATOMIC_RELEASE);
+	}
+
+	m = &p->chunk[i][p->num_mags % CPOOL_MAG_CHUNK];
+	m->idx = ++p->num_mags;
+	m->next = 0;
+	m->rounds = 0;
+
+	pthread_mutex_unlock(&p->lock);
+	return m;
+}
+
+static void mag_put(struct cpool *p, struct cpool_mag *m)
+{
+	depot_push((m->rounds) ? &p->full : &p->empty, m);
+}
+
+/* Give a thread's magazines back to the depot and forget about it */
+static void cache_free(void *priv)
+{
+	struct cpool_cache *c = priv;
+	struct cpool *p = c->pool;
+
+	mag_put(p, c->loaded);
+	mag_put(p, c->prev);
+
+	pthread_mutex_lock(&p->lock);
+	list_del(&c->list);
+	pthread_mutex_unlock(&p->lock);
+
+	free(c);
+}
+
+static struct cpool_cache *cache_new(struct cpool *p)
+{
+	struct cpool_cache *c;
+
+	c = malloc(sizeof(*c));
+	if ( NULL == c )
+		return NULL;
+
+	c->pool = p;
+	c->loaded = mag_alloc(p);
+	if ( NULL == c->loaded )
+		goto err_free;
+	c->prev = mag_alloc(p);
+	if ( NULL == c->prev )
+		goto err_loaded;
+
+	if ( pthread_setspecific(p->key, c) )
+		goto err_prev;
+
+	pthread_mutex_lock(&p->lock);
+	list_add_tail(&c->list, &p->caches);
+	pthread_mutex_unlock(&p->lock);
+	return c;
+
+err_prev:
+	mag_put(p, c->prev);
+err_loaded:
+	mag_put(p, c->loaded);
+err_free:
+	free(c);
+	return NULL;
+}
+
+static inline struct cpool_cache *cache_get(struct cpool *p)
+{
+	struct cpool_cache *c;
+
+	c = pthread_getspecific(p->key);
+	if ( likely(c != NULL) )
+		return c;
+
+	return cache_new(p);
+}
+
+/* No cache for this thread, we're out of memory so go slow */
+static void *locked_alloc(struct cpool *p)
+{
+	void *ret;
+
+	pthread_mutex_lock(&p->lock);
+	ret = mpool_alloc(&p->slab);
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+static void locked_free(struct cpool *p, void *obj)
+{
+	pthread_mutex_lock(&p->lock);
+	mpool_free(&p->slab, obj);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Depot's dry, fill the loaded magazine from the slabs */
+static void *cache_fill(struct cpool *p, struct cpool_cache *c)
+{
+	struct cpool_mag *m = c->loaded;
+	void *obj;
+
+	pthread_mutex_lock(&p->lock);
+	while ( m->rounds < CPOOL_MAG_SIZE ) {
+		obj = mpool_alloc(&p->slab);
+		if ( NULL == obj )
+			break;
+		m->obj[m->rounds++] = obj;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if ( 0 == m->rounds )
+		return NULL;
+
+	return m->obj[--m->rounds];
+}
+
+/** Initialise a cpool.
+ * \ingroup g_cpool
+ *
+ * @param p a cpool structure to use
+ * @param obj_size size of objects to allocate
+ * @param slab_size size of slabs in number of objects (set to zero for auto)
+ *
+ * As mpool_init() but the resulting pool may be used from any number of
+ * threads at once.
+ *
+ * @return zero on error, non-zero for success
+ */
+int _public cpool_init(struct cpool *p, size_t obj_size, unsigned slab_size)
+{
+	memset(p, 0, sizeof(*p));
+
+	if ( !mpool_init(&p->slab, obj_size, slab_size) )
+		return 0;
+
+	p->chunk = calloc(CPOOL_MAX_CHUNKS, sizeof(*p->chunk));
+	if ( NULL == p->chunk )
+		goto err;
+
+	if ( pthread_key_create(&p->key, cache_free) )
+		goto err_chunk;
+
+	pthread_mutex_init(&p->lock, NULL);
+	INIT_LIST_HEAD(&p->caches);
+	p->obj_size = p->slab.obj_size;
+	return 1;
+
+err_chunk:
+	free(p->chunk);
+err:
+	mpool_fini(&p->slab);
+	return 0;
+}
+
+/** Destroy a cpool.
+ * \ingroup g_cpool
+ * @param p a valid cpool structure returned from cpool_init()
+ *
+ * Frees all memory including that of every thread's cache. No other
+ * thread may be using the pool.
+ */
+void _public cpool_fini(struct cpool *p)
+{
+	struct cpool_cache *c, *tmp;
+	unsigned int i;
+
+	pthread_key_delete(p->key);
+
+	list_for_each_entry_safe(c, tmp, &p->caches, list)
+		free(c);
+
+	for(i = 0; i < CPOOL_MAX_CHUNKS; i++)
+		free(p->chunk[i]);
+	free(p->chunk);
+
+	mpool_fini(&p->slab);
+	pthread_mutex_destroy(&p->lock);
+	memset(p, 0, sizeof(*p));
+}
+
+/** Return the calling thread's cached objects to the pool.
+ * \ingroup g_cpool
+ * @param p a valid cpool structure returned from cpool_init()
+ *
+ * This happens anyway when a thread exits, call this to let other
+ * threads have the objects when a thread is going to be idle a while.
+ */
+void _public cpool_flush(struct cpool *p)
+{
+	struct cpool_cache *c;
+
+	c = pthread_getspecific(p->key);
+	if ( NULL == c )
+		return;
+
+	pthread_setspecific(p->key, NULL);
+	cache_free(c);
+}
+
+/** Allocate an object from a cpool.
+ * \ingroup g_cpool
+ * @param p a valid cpool structure returned from cpool_init()
+ *
+ * Allocate a new object, returns NULL if out of memory. Safe to call
+ * from any thread.
+ *
+ * @return a new object
+ */
+void *cpool_alloc(struct cpool *p)
+{
+	struct cpool_cache *c;
+	struct cpool_mag *m;
+
+	c = cache_get(p);
+	if ( unlikely(NULL == c) )
+		return locked_alloc(p);
+
+	if ( likely(c->loaded->rounds) )
+		return c->loaded->obj[--c->loaded->rounds];
+
+	if ( c->prev->rounds ) {
+		m = c->prev;
+		c->prev = c->loaded;
+		c->loaded = m;
+		return m->obj[--m->rounds];
+	}
+
+	m = depot_pop(p, &p->full);
+	if ( m ) {
+		depot_push(&p->empty, c->prev);
+		c->prev = c->loaded;
+		c->loaded = m;
+		return m->obj[--m->rounds];
+	}
+
+	return cache_fill(p, c);
+}
+
+/** Free an object.
+ * \ingroup g_cpool
+ * @param p cpool object that obj was allocated from.
+ * @param obj pointer to object to free.
+ *
+ * Safe to call from any thread, not just the one which allocated obj.
+ */
+void cpool_free(struct cpool *p, void *obj)
+{
+	struct cpool_cache *c;
+	struct cpool_mag *m;
+
+	if ( unlikely(obj == NULL) )
+		return;
+
+	c = cache_get(p);
+	if ( unlikely(NULL == c) ) {
+		locked_free(p, obj);
+		return;
+	}
+
+	if ( likely(c->loaded->rounds < CPOOL_MAG_SIZE) ) {
+		c->loaded->obj[c->loaded->rounds++] = obj;
+		return;
+	}
+
+	if ( c->prev->rounds < CPOOL_MAG_SIZE ) {
+		m = c->prev;
+		c->prev = c->loaded;
+		c->loaded = m;
+		m->obj[m->rounds++] = obj;
+		return;
+	}
+
+	m = mag_alloc(p);
+	if ( unlikely(NULL == m) ) {
+		locked_free(p, obj);
+		return;
+	}
+
+	depot_push(&p->full, c->prev);
+	c->prev = c->loaded;
+	c->loaded = m;
+	m->obj[m->rounds++] = obj;
+}
@@ -0,0 +1,139 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* CRC32C for gfile checksums. Uses the SSE4.2 crc32 instruction where the
+* CPU has it, otherwise slice-by-8 which does a word per iteration with
+* eight table lookups. The tables and the choice of implementation are
+* set up on first use.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/crc32c.h>
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+#define CRC32C_POLY	0x82f63b78U /* reversed */
+
+static uint32_t tab[8][256];
+static uint32_t (*crc_fn)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	/* byte at a time until we're aligned */
+	for(; len && ((uintptr_t)p & 7); len--)
+		crc = tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for(; len >= 8; len -= 8, p += 8) {
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo = le32toh(lo) ^ crc;
+		hi = le32toh(hi);
+		crc = tab[7][lo & 0xff] ^
+			tab[6][(lo >> 8) & 0xff] ^
+			tab[5][(lo >> 16) & 0xff] ^
+			tab[4][lo >> 24] ^
+			tab[3][hi & 0xff] ^
+			tab[2][(hi >> 8) & 0xff] ^
+			tab[1][(hi >> 16) & 0xff] ^
+			tab[0][hi >> 24];
+	}
+
+	for(; len; len--)
+		crc = tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	for(; len && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+#if defined(__x86_64__)
+	{
+		uint64_t c = crc, w;
+
+		for(; len >= 8; len -= 8, p += 8) {
+			memcpy(&w, p, sizeof(w));
+			c = _mm_crc32_u64(c, w);
+		}
+		crc = c;
+	}
+#endif
+	for(; len >= 4; len -= 4, p += 4) {
+		uint32_t w;
+		memcpy(&w, p, sizeof(w));
+		crc = _mm_crc32_u32(crc, w);
+	}
+
+	for(; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static void crc_init(void)
+{
+	unsigned int i, j;
+	uint32_t crc;
+
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		tab[0][i] = crc;
+	}
+
+	for(i = 0; i < 256; i++) {
+		crc = tab[0][i];
+		for(j = 1; j < 8; j++) {
+			crc = tab[0][crc & 0xff] ^ (crc >> 8);
+			tab[j][i] = crc;
+		}
+	}
+
+	crc_fn = crc_sw;
+#if CRC32C_HW
+	if ( __builtin_cpu_supports("sse4.2") )
+		crc_fn = crc_hw;
+#endif
+}
+
+/** Checksum a buffer.
+ * @param crc zero, or the result of a previous call to continue from
+ * @param buf data to checksum
+ * @param len length of buf
+ *
+ * @return the CRC32C of everything so far
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+	return ~(*crc_fn)(~crc, buf, len);
+}
+
+/** Same as crc32c() but never uses the CRC instruction, for testing. */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+	return ~crc_sw(~crc, buf, len);
+}
+
+/** Name of the implementation crc32c() picked. */
+const char *crc32c_impl(void)
+{
+	pthread_once(&crc_once, crc_init);
+	return (crc_fn == crc_sw) ? "slice-by-8" : "sse4.2";
+}
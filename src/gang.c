@@ -7,6 +7,8 @@
 #include <blackbloc/blackbloc.h>
 #include <blackbloc/gang.h>
 
+#include "slab.h"
+
 /** Initialize a gang allocator.
  * \ingroup g_gang
  * @param m An gang structure to use
@@ -19,12 +21,40 @@
  */
 int _public gang_init(struct gang *m, size_t slab_size)
 {
+	return gang_init_aligned(m, slab_size, 1, 0);
+}
+
+/** Initialize a gang allocator with aligned allocations.
+ * \ingroup g_gang
+ * @param m An gang structure to use
+ * @param slab_size default size of system allocation units
+ * @param align alignment of every allocation, a power of two
+ * @param flags GANG_HUGEPAGE to back slabs with transparent huge pages
+ *
+ * As gang_init() but every allocation is aligned to align bytes, sizes
+ * are rounded up to match. With GANG_HUGEPAGE slabs are mmap'd in huge
+ * page multiples.
+ *
+ * @return zero on error, non-zero for success.
+ */
+int _public gang_init_aligned(struct gang *m, size_t slab_size,
+				size_t align, unsigned int flags)
+{
+	if ( align == 0 )
+		align = 1;
+	if ( align & (align - 1) )
+		return 0;
+
 	if ( slab_size == 0 )
 		slab_size = 8192;
 	if ( slab_size < sizeof(struct gang_slab) )
 		slab_size = sizeof(struct gang_slab);
+	if ( flags & GANG_HUGEPAGE )
+		slab_size = SLAB_ALIGN(slab_size, SLAB_HUGE_SIZE);
 
 	m->slab_size = slab_size;
+	m->align = align;
+	m->flags = flags;
 	m->head = NULL;
 	m->tail = NULL;
 
@@ -45,48 +75,108 @@ void _public gang_fini(struct gang *m)
 	for(s=m->head; s;) {
 		struct gang_slab *t = s;
 		s = s->next;
-		free(t);
+		slab_free(MEM_GANG, t, t->size,
+				m->flags & GANG_HUGEPAGE);
 	}
 
 	memset(m, 0, sizeof(*m));
 }
 
+/** Remember the current allocation point.
+ * \ingroup g_gang
+ * @param m The gang structure.
+ * @param mark Filled in with where the next allocation will come from.
+ *
+ * Pass the mark to gang_rewind() to free everything allocated since in
+ * one go. Marks nest, a rewind to an earlier mark invalidates any later
+ * ones.
+ */
+void _public gang_mark(struct gang *m, struct gang_mark *mark)
+{
+	mark->slab = m->tail;
+	if ( m->tail ) {
+		mark->ptr = m->tail->ptr;
+		mark->len = m->tail->len;
+	}else{
+		mark->ptr = NULL;
+		mark->len = 0;
+	}
+}
+
+/** Free everything allocated since a mark.
+ * \ingroup g_gang
+ * @param m The gang structure.
+ * @param mark A mark from gang_mark() on the same allocator.
+ *
+ * Slabs which were filled since the mark are kept for reuse, nothing is
+ * returned to the system until gang_fini().
+ */
+void _public gang_rewind(struct gang *m, const struct gang_mark *mark)
+{
+	m->tail = mark->slab;
+	if ( m->tail ) {
+		m->tail->ptr = mark->ptr;
+		m->tail->len = mark->len;
+	}
+}
+
+/** Free everything allocated from a gang but keep the slabs.
+ * \ingroup g_gang
+ * @param m The gang structure.
+ *
+ * After this the allocator is empty but allocations are served from the
+ * slabs it already has until they run out.
+ */
+void _public gang_reset(struct gang *m)
+{
+	m->tail = NULL;
+}
+
 /** Allocator slow path.
  * \ingroup g_gang
  * @param m The gang structure to allocate from.
  * @param sz Object size.
  *
- * Slow path for allocations which may request additional memory
- * from the system.
+ * Slow path for allocations which moves on to the next spare slab or
+ * requests additional memory from the system.
 */
 static void *gang_alloc_slow(struct gang *m, size_t sz)
 {
 	size_t alloc;
 	size_t overhead;
-	struct gang_slab *s;
+	struct gang_slab *s, *spare;
 	void *ret;
 
-	overhead = sizeof(struct gang_slab);
-
-	alloc = overhead + sz;
-	if ( alloc < m->slab_size )
-		alloc = m->slab_size;
+	overhead = SLAB_ALIGN(sizeof(struct gang_slab), m->align);
 
-	s = malloc(alloc);
-	if ( s == NULL )
-		return NULL;
-
-	ret = (void *)s + overhead;
-	s->ptr = (void *)s + overhead + sz;
-	s->len = alloc - (overhead + sz);
-	s->next = NULL;
-
-	if ( m->tail == NULL ) {
-		m->head = s;
+	spare = (m->tail) ? m->tail->next : m->head;
+	if ( spare && spare->size - overhead >= sz ) {
+		s = spare;
 	}else{
-		m->tail->next = s;
+		alloc = overhead + sz;
+		if ( alloc < m->slab_size )
+			alloc = m->slab_size;
+		if ( m->flags & GANG_HUGEPAGE )
+			alloc = SLAB_ALIGN(alloc, SLAB_HUGE_SIZE);
+
+		s = slab_alloc(MEM_GANG, alloc, m->align,
+				m->flags & GANG_HUGEPAGE);
+		if ( s == NULL )
+			return NULL;
+
+		/* goes in before any spares, which may still be useful */
+		s->size = alloc;
+		s->next = spare;
+		if ( m->tail == NULL ) {
+			m->head = s;
+		}else{
+			m->tail->next = s;
+		}
 	}
 
+	ret = (void *)s + overhead;
+	s->ptr = ret + sz;
+	s->len = s->size - (overhead + sz);
 	m->tail = s;
 
 	return ret;
@@ -101,13 +191,16 @@ static void *gang_alloc_slow(struct gang *m, size_t sz)
  * available in slabs then no call will be made to the system
  * allocator malloc/brk/mmap/HeapAlloc or whatever.
  *
- * \bug There's no way to specify any alignment requierments.
+ * Allocations are aligned as given to gang_init_aligned(), they're
+ * unaligned after plain gang_init().
 */
 void *gang_alloc(struct gang *m, size_t sz)
 {
 	void *ret;
 	void *end;
 
+	sz = SLAB_ALIGN(sz, m->align);
+
 	if ( unlikely(m->tail == NULL || m->tail->len < sz) ) {
 		return gang_alloc_slow(m, sz);
 	}
@@ -6,94 +6,484 @@
 #include <blackbloc/blackbloc.h>
 #include <blackbloc/gfile.h>
 #include <blackbloc/gfile-internal.h>
+#include <blackbloc/fnv_hash.h>
+#include <blackbloc/lz.h>
+#include <blackbloc/crc32c.h>
+
+#include "gfs.h"
 
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
 
-#define GFS_MAX_LEN (0xffffffff)
 #define GFS_MIN_LEN (sizeof(struct gfile_hdr) + \
 			2 * sizeof(struct gfile_blk) + \
 			sizeof(struct gfile_nidx))
 
-/* Note that the file layout is such that we only need
- * these 4 fields to do correct + optimnal file lookup
- */
-struct _gfs {
-	const uint8_t *fs_map;
-	const uint8_t *fs_end;
-	uint32_t fs_num_names;
-	const struct gfile_name *fs_name;
+/* Bounds of a block, the directory was checked by gfile_dir() */
+struct blk {
+	const uint8_t *b_ptr;
+	uint64_t b_len;
 };
 
 static const struct gfile_nidx *gfile_nidx(struct _gfs *fs,
-					const struct gfile_blk *b)
+					const struct blk *b)
 {
 	const struct gfile_nidx *n;
-	const uint8_t *ptr;
-	size_t ofs;
-
-	ofs = be32toh(b->b_ofs);
+	uint64_t sz;
 
-	if ( fs->fs_map + ofs + sizeof(*n) > fs->fs_end )
+	if ( b->b_len < sizeof(*n) )
 		return NULL;
 
-	ptr = (fs->fs_map + ofs);
-	n = (struct gfile_nidx *)ptr;
+	n = (const struct gfile_nidx *)b->b_ptr;
 
-	ptr += sizeof(struct gfile_name) * be32toh(n->i_num_names);
-	ptr += be32toh(n->i_strtab_sz);
-
-	if ( (uint8_t *)ptr > fs->fs_end )
+	sz = (fs->fs_version == 1) ? sizeof(struct gfile_name) :
+					sizeof(struct gfile_name64);
+	sz = sizeof(*n) + sz * be32toh(n->i_num_names) +
+		be32toh(n->i_strtab_sz);
+	if ( sz > b->b_len )
 		return NULL;
 
 	return n;
 }
 
-static struct gfile_blk *gfile_blk(struct _gfs *fs,
-					unsigned int type,
-					unsigned int id)
+static int gfile_phash(struct _gfs *fs, const struct blk *b, int mix)
 {
-	unsigned int i;
-	struct gfile_hdr *h;
-	struct gfile_blk *b;
-	unsigned int num_blk;
+	const struct gfile_phash *p;
+	const uint8_t *ptr;
 
-	h = (struct gfile_hdr *)fs->fs_map;
-	num_blk = be32toh(h->h_num_blk);
+	if ( b->b_len < sizeof(*p) )
+		return 0;
 
-	b = h->h_blk + num_blk;
-	if ( (uint8_t *)b > fs->fs_end )
-		return NULL;
+	ptr = b->b_ptr;
+	p = (struct gfile_phash *)ptr;
+
+	if ( be32toh(p->p_num_slots) != fs->fs_num_names ||
+			be32toh(p->p_num_buckets) == 0 )
+		return 0;
+
+	if ( (b->b_len - sizeof(*p)) / sizeof(uint32_t) <
+			(uint64_t)be32toh(p->p_num_buckets) +
+			fs->fs_num_names )
+		return 0;
+
+	ptr += sizeof(*p);
+	fs->fs_num_buckets = be32toh(p->p_num_buckets);
+	fs->fs_disp = (const uint32_t *)ptr;
+	fs->fs_slot = fs->fs_disp + fs->fs_num_buckets;
+	fs->fs_phash_mix = mix;
+	return 1;
+}
+
+static int gfile_csum(struct _gfs *fs, const struct blk *b)
+{
+	const struct gfile_csum *c;
+
+	if ( b->b_len < sizeof(*c) )
+		return 0;
+
+	c = (const struct gfile_csum *)b->b_ptr;
+	if ( be32toh(c->c_num) != fs->fs_num_names ||
+			(b->b_len - sizeof(*c)) / sizeof(uint32_t) <
+				fs->fs_num_names )
+		return 0;
+
+	fs->fs_crc = (const uint32_t *)(b->b_ptr + sizeof(*c));
+	return 1;
+}
+
+/* Sanity check the block directory, every block must be inside the
+ * file and version 2 directories must be sorted with no duplicates.
+ */
+static int gfile_dir(struct _gfs *fs)
+{
+	const struct gfile_hdr *h = (const struct gfile_hdr *)fs->fs_map;
+	const struct gfile_hdr64 *h64 = (const struct gfile_hdr64 *)fs->fs_map;
+	uint64_t len = fs->fs_end - fs->fs_map, ofs, blen;
+	uint32_t i, key, prev = 0;
+
+	if ( be32toh(h->h_magic) == GFILE_MAGIC ) {
+		fs->fs_version = 1;
+		fs->fs_num_blk = be32toh(h->h_num_blk);
+		if ( fs->fs_num_blk > (len - sizeof(*h)) / sizeof(*h->h_blk) )
+			return 0;
+		for(i = 0; i < fs->fs_num_blk; i++) {
+			ofs = be32toh(h->h_blk[i].b_ofs);
+			blen = be32toh(h->h_blk[i].b_len);
+			if ( ofs > len || blen > len - ofs )
+				return 0;
+		}
+		return 1;
+	}
+
+	if ( be32toh(h64->h_magic) != GFILE_MAGIC64 ||
+			len < sizeof(*h64) )
+		return 0;
+
+	fs->fs_version = be16toh(h64->h_version);
+	if ( fs->fs_version != GFILE_VERSION ) {
+		con_printf("%s: unsupported gfile version %u\n",
+				_func, fs->fs_version);
+		return 0;
+	}
+
+	fs->fs_num_blk = be32toh(h64->h_num_blk);
+	if ( fs->fs_num_blk > (len - sizeof(*h64)) / sizeof(*h64->h_blk) )
+		return 0;
+
+	for(i = 0; i < fs->fs_num_blk; i++) {
+		ofs = be64toh(h64->h_blk[i].b_ofs);
+		blen = be64toh(h64->h_blk[i].b_len);
+		if ( ofs > len || blen > len - ofs )
+			return 0;
+		key = (be16toh(h64->h_blk[i].b_type) << 16) |
+			be16toh(h64->h_blk[i].b_id);
+		if ( i && key <= prev )
+			return 0;
+		prev = key;
+	}
 
-	/* linear scan for now */
-	for(b = h->h_blk, i = 0; i < num_blk; i++,b++) {
+	return 1;
+}
+
+/* Version 1 directories are in no particular order */
+static int blk_v1(struct _gfs *fs, unsigned int type, unsigned int id,
+			struct blk *ret)
+{
+	const struct gfile_hdr *h = (const struct gfile_hdr *)fs->fs_map;
+	const struct gfile_blk *b;
+	uint32_t i;
+
+	for(b = h->h_blk, i = 0; i < fs->fs_num_blk; i++, b++) {
 		if ( be16toh(b->b_type) != type )
 			continue;
 		if ( be16toh(b->b_id) != id )
 			continue;
-		return b;
+		ret->b_ptr = fs->fs_map + be32toh(b->b_ofs);
+		ret->b_len = be32toh(b->b_len);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int blk_v2(struct _gfs *fs, unsigned int type, unsigned int id,
+			struct blk *ret)
+{
+	const struct gfile_hdr64 *h = (const struct gfile_hdr64 *)fs->fs_map;
+	const struct gfile_blk64 *b;
+	uint32_t key = (type << 16) | id, k;
+	unsigned int n, i;
+
+	for(b = h->h_blk, n = fs->fs_num_blk; n; ) {
+		i = n / 2;
+		k = (be16toh(b[i].b_type) << 16) | be16toh(b[i].b_id);
+		if ( key < k ) {
+			n = i;
+		}else if ( key > k ) {
+			b += i + 1;
+			n -= i + 1;
+		}else{
+			ret->b_ptr = fs->fs_map + be64toh(b[i].b_ofs);
+			ret->b_len = be64toh(b[i].b_len);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int gfile_blk(struct _gfs *fs, unsigned int type, unsigned int id,
+			struct blk *ret)
+{
+	if ( fs->fs_version == 1 )
+		return blk_v1(fs, type, id, ret);
+	return blk_v2(fs, type, id, ret);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CRC of a record as stored, from ptr if the caller already has it. If
+ * not it's straight out of the map or with GFS_PREAD, read in chunks.
+ */
+static int rec_crc(struct _gfs *fs, uint32_t idx, const uint8_t *ptr,
+			uint32_t *crc)
+{
+	uint64_t ofs;
+	uint32_t len, n;
+	uint8_t *buf;
+
+	ofs = gfs_rec_ofs(fs, idx);
+	len = gfs_rec_len(fs, idx);
+	if ( ofs + len > (uint64_t)(fs->fs_end - fs->fs_map) )
+		return 0;
+
+	if ( NULL == ptr && NULL == fs->fs_io )
+		ptr = fs->fs_map + ofs;
+	if ( ptr ) {
+		*crc = crc32c(0, ptr, len);
+		return 1;
+	}
+
+	buf = malloc(GFS_CRC_CHUNK);
+	if ( NULL == buf )
+		return 0;
+
+	for(*crc = 0; len; len -= n, ofs += n) {
+		n = (len < GFS_CRC_CHUNK) ? len : GFS_CRC_CHUNK;
+		if ( !gfs_pread(fs->fs_fd, buf, n, ofs) ) {
+			free(buf);
+			return 0;
+		}
+		*crc = crc32c(*crc, buf, n);
+	}
+
+	free(buf);
+	return 1;
+}
+
+/* Check one file and record the result, returns a GFS_VSTATE. The verify
+ * thread and gfile_open() can race on the same file in which case only
+ * the first result counts, they're going to agree anyway.
+ */
+static int verify_one(struct _gfs *fs, uint32_t idx, const uint8_t *ptr,
+			uint64_t *ns)
+{
+	uint8_t state, old = GFS_VSTATE_UNKNOWN;
+	uint64_t start;
+	uint32_t len, crc;
+
+	len = gfs_rec_len(fs, idx);
+
+	start = now_ns();
+	if ( !rec_crc(fs, idx, ptr, &crc) || crc != be32toh(fs->fs_crc[idx]) )
+		state = GFS_VSTATE_BAD;
+	else
+		state = GFS_VSTATE_GOOD;
+	__atomic_fetch_add(ns, now_ns() - start, __ATOMIC_RELAXED);
+
+	if ( !__atomic_compare_exchange_n(&fs->fs_vstate[idx], &old, state, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE) )
+		return old;
+
+	__atomic_fetch_add(&fs->fs_vchecked, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&fs->fs_vbytes, len, __ATOMIC_RELAXED);
+	if ( state == GFS_VSTATE_BAD )
+		__atomic_fetch_add(&fs->fs_vbad, 1, __ATOMIC_RELAXED);
+	return state;
+}
+
+struct vent {
+	uint64_t v_ofs;
+	uint32_t v_idx;
+};
+
+static int vent_cmp(const void *_A, const void *_B)
+{
+	const struct vent *a = _A, *b = _B;
+	if ( a->v_ofs != b->v_ofs )
+		return (a->v_ofs < b->v_ofs) ? -1 : 1;
+	return (a->v_idx < b->v_idx) ? -1 : (a->v_idx > b->v_idx);
+}
+
+/* Check every file in record order so the reads are sequential */
+static void *verify_thread(void *priv)
+{
+	struct _gfs *fs = priv;
+	struct vent *v;
+	uint32_t i;
+
+	v = malloc((fs->fs_num_names + 1) * sizeof(*v));
+	if ( NULL == v ) {
+		fprintf(stderr, "gfs: verify: %s\n", get_err());
+		return NULL;
+	}
+
+	for(i = 0; i < fs->fs_num_names; i++) {
+		v[i].v_ofs = gfs_rec_ofs(fs, i);
+		v[i].v_idx = i;
+	}
+	qsort(v, fs->fs_num_names, sizeof(*v), vent_cmp);
+
+	for(i = 0; i < fs->fs_num_names; i++) {
+		if ( __atomic_load_n(&fs->fs_vquit, __ATOMIC_RELAXED) )
+			break;
+		if ( verify_one(fs, v[i].v_idx, NULL, &fs->fs_vbg_ns) ==
+				GFS_VSTATE_BAD )
+			fprintf(stderr, "gfile: %s: checksum mismatch\n",
+				gfs_name(fs, v[i].v_idx));
 	}
 
+	free(v);
 	return NULL;
 }
 
-gfs_t gfs_open(const char *fn)
+/* Set up checksum verification as asked for in the gfs_open() flags */
+static int verify_init(struct _gfs *fs, const char *fn)
+{
+	int ret;
+
+	if ( !(fs->fs_flags & (GFS_VERIFY_OPEN | GFS_VERIFY_BG)) )
+		return 1;
+
+	if ( NULL == fs->fs_crc ) {
+		con_printf("%s: %s: no checksums to verify\n", _func, fn);
+		return 1;
+	}
+
+	fs->fs_vstate = calloc(fs->fs_num_names + 1, 1);
+	if ( NULL == fs->fs_vstate )
+		return 0;
+
+	if ( !(fs->fs_flags & GFS_VERIFY_BG) )
+		return 1;
+
+	ret = pthread_create(&fs->fs_vthread, NULL, verify_thread, fs);
+	if ( ret ) {
+		/* better late than never */
+		con_printf("%s: pthread_create: %s\n", _func, strerror(ret));
+		fs->fs_flags |= GFS_VERIFY_OPEN;
+		return 1;
+	}
+
+	fs->fs_vrunning = 1;
+	return 1;
+}
+
+static void verify_stop(struct _gfs *fs)
+{
+	if ( fs->fs_vrunning ) {
+		__atomic_store_n(&fs->fs_vquit, 1, __ATOMIC_RELAXED);
+		pthread_join(fs->fs_vthread, NULL);
+		fs->fs_vrunning = 0;
+	}
+	free(fs->fs_vstate);
+}
+
+/* Is a file fit to open? Ones nobody has checked yet are unless we're
+ * verifying on open. ptr is the record as stored, if we have it.
+ */
+static int verify_name(struct _gfs *fs, uint32_t idx, const uint8_t *ptr)
+{
+	uint8_t state;
+
+	state = __atomic_load_n(&fs->fs_vstate[idx], __ATOMIC_ACQUIRE);
+	if ( state == GFS_VSTATE_UNKNOWN && (fs->fs_flags & GFS_VERIFY_OPEN) )
+		state = verify_one(fs, idx, ptr, &fs->fs_vopen_ns);
+
+	return state != GFS_VSTATE_BAD;
+}
+
+/** Get checksum verification counters.
+ * @param fs the archive
+ * @param v filled in with the counts so far
+ *
+ * All zeroes if the archive wasn't opened with GFS_VERIFY_OPEN or
+ * GFS_VERIFY_BG, or has no checksums. In GFS_VERIFY_BG mode this can
+ * be polled while the thread is still running.
+ */
+void gfs_verify_stat(gfs_t fs, struct gfs_verify *v)
+{
+	memset(v, 0, sizeof(*v));
+	if ( NULL == fs->fs_vstate )
+		return;
+
+	v->v_num_files = fs->fs_num_names;
+	v->v_checked = __atomic_load_n(&fs->fs_vchecked, __ATOMIC_RELAXED);
+	v->v_bad = __atomic_load_n(&fs->fs_vbad, __ATOMIC_RELAXED);
+	v->v_bytes = __atomic_load_n(&fs->fs_vbytes, __ATOMIC_RELAXED);
+	v->v_open_ns = __atomic_load_n(&fs->fs_vopen_ns, __ATOMIC_RELAXED);
+	v->v_bg_ns = __atomic_load_n(&fs->fs_vbg_ns, __ATOMIC_RELAXED);
+}
+
+/* Everything but the records, merged. r must have room for five. */
+static unsigned int index_ranges(struct _gfs *fs, struct gfs_range *r)
+{
+	static const uint16_t blk[][2] = {
+		{GFILE_TYPE_NIDX, GFILE_NIDX_FILENAMES},
+		{GFILE_TYPE_NIDX, GFILE_NIDX_PHASH},
+		{GFILE_TYPE_NIDX, GFILE_NIDX_PHASH2},
+		{GFILE_TYPE_CSUM, GFILE_CSUM_CRC32C},
+	};
+	unsigned int i, n = 0;
+	struct blk b;
+
+	r[n].r_fs = fs;
+	r[n].r_ofs = 0;
+	r[n].r_len = (fs->fs_version == 1) ?
+			sizeof(struct gfile_hdr) +
+			fs->fs_num_blk * sizeof(struct gfile_blk) :
+			sizeof(struct gfile_hdr64) +
+			fs->fs_num_blk * sizeof(struct gfile_blk64);
+	n++;
+
+	for(i = 0; i < sizeof(blk)/sizeof(*blk); i++) {
+		if ( !gfile_blk(fs, blk[i][0], blk[i][1], &b) )
+			continue;
+		r[n].r_fs = fs;
+		r[n].r_ofs = b.b_ptr - fs->fs_map;
+		r[n].r_len = b.b_len;
+		n++;
+	}
+
+	return gfs_range_merge(r, n);
+}
+
+/* So lookups never fault */
+static void lock_index(struct _gfs *fs)
+{
+	struct gfs_range r[5];
+	unsigned int i, n;
+
+	n = index_ranges(fs, r);
+	for(i = 0; i < n; i++) {
+		if ( !gfs_range_lock(&r[i]) ) {
+			con_printf("%s: mlock: %s\n", _func, get_err());
+			break;
+		}
+	}
+}
+
+/* Fault in the whole mapping, for when MAP_POPULATE can't be used */
+static void populate(struct _gfs *fs)
+{
+	const volatile uint8_t *ptr;
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+
+	for(ptr = fs->fs_map; ptr < fs->fs_end; ptr += pgsz)
+		(void)*ptr;
+}
+
+gfs_t gfs_open(const char *fn, unsigned int flags)
 {
-	const struct gfile_hdr *h;
-	const struct gfile_blk *b;
 	const struct gfile_nidx *n;
+	struct blk b;
 	struct _gfs *fs;
 	struct stat st;
 	size_t fs_len;
-	int fd;
+	int fd, mflags = MAP_SHARED;
 
 	fs = calloc(1, sizeof(*fs));
 	if (fs == NULL)
 		goto out;
 
+	INIT_LIST_HEAD(&fs->fs_lru);
+	INIT_LIST_HEAD(&fs->fs_list);
+	INIT_LIST_HEAD(&fs->fs_pending);
+
+	/* records won't be touched through the map */
+	if ( flags & GFS_PREAD )
+		flags &= ~(GFS_POPULATE | GFS_HUGEPAGE);
+	fs->fs_zcache_max = GFS_ZCACHE_MAX;
+
 	fd = open(fn, O_RDONLY);
 	if ( fd < 0 )
 		goto err_free;
@@ -101,43 +491,110 @@ gfs_t gfs_open(const char *fn)
 	if ( fstat(fd, &st) )
 		goto err_close;
 
-#if _FILE_OFFSET_BITS > 32
-	if ( st.st_size > GFS_MAX_LEN )
+	/* only a problem on 32 bit machines */
+	if ( (uint64_t)st.st_size > SIZE_MAX )
 		goto err_close;
-#endif
 	if ( (size_t)st.st_size < GFS_MIN_LEN )
 		goto err_close;
 
+	/* Huge page advice has to come before the pages are faulted in */
+	if ( (flags & GFS_POPULATE) && !(flags & GFS_HUGEPAGE) )
+		mflags |= MAP_POPULATE;
+
 	fs_len = st.st_size;
-	fs->fs_map = mmap(NULL, fs_len, PROT_READ, MAP_SHARED, fd, 0);
+	fs->fs_map = mmap(NULL, fs_len, PROT_READ, mflags, fd, 0);
 	if ( fs->fs_map == MAP_FAILED )
 		goto err_close;
 
 	fs->fs_end  = fs->fs_map + fs_len;
-	h = (const struct gfile_hdr *)fs->fs_map;
-	if ( be32toh(h->h_magic) != GFILE_MAGIC )
+
+	/* Only a hint, file backed THP depends on the kernel and fs */
+	if ( flags & GFS_HUGEPAGE ) {
+		madvise((void *)fs->fs_map, fs_len, MADV_HUGEPAGE);
+		if ( flags & GFS_POPULATE )
+			populate(fs);
+	}
+	if ( !gfile_dir(fs) )
 		goto err_unmap;
 	
 	/* The DB is basically "live" now as far as accessor methods
 	 * are concerned...
 	 */
 
-	b = gfile_blk(fs, GFILE_TYPE_NIDX, GFILE_NIDX_FILENAMES);
-	if ( b == NULL )
+	if ( !gfile_blk(fs, GFILE_TYPE_NIDX, GFILE_NIDX_FILENAMES, &b) )
 		goto err_unmap;
 
-	n = gfile_nidx(fs, b);
+	n = gfile_nidx(fs, &b);
 	if ( n == NULL )
 		goto err_unmap;
 	
 	fs->fs_num_names = be32toh(n->i_num_names);
-	fs->fs_name = n->i_name;
+	if ( fs->fs_version == 1 ) {
+		/* name offsets are from the start of the file */
+		fs->fs_name = n->i_name;
+		fs->fs_nbase = fs->fs_map;
+	}else{
+		fs->fs_name64 = (const struct gfile_name64 *)
+				((const uint8_t *)n + sizeof(*n));
+		fs->fs_nbase = (const uint8_t *)n;
+	}
 
-	con_printf("%s: %s: %u files\n",
-			_func, fn, fs->fs_num_names);
+	/* Perfect hash is optional, older archives lack it or have the
+	 * one over raw FNV hashes. A bad one just means lookups fall back
+	 * to the binary search.
+	 */
+	if ( !(flags & GFS_NO_PHASH) ) {
+		if ( gfile_blk(fs, GFILE_TYPE_NIDX, GFILE_NIDX_PHASH2, &b) ) {
+			if ( !gfile_phash(fs, &b, 1) )
+				con_printf("%s: %s: bad perfect hash, ignored\n",
+						_func, fn);
+		}else if ( gfile_blk(fs, GFILE_TYPE_NIDX,
+					GFILE_NIDX_PHASH, &b) ) {
+			if ( !gfile_phash(fs, &b, 0) )
+				con_printf("%s: %s: bad perfect hash, ignored\n",
+						_func, fn);
+		}
+	}
 
-	close(fd);
+	/* So are checksums, but a bad checksum block means corruption */
+	if ( gfile_blk(fs, GFILE_TYPE_CSUM, GFILE_CSUM_CRC32C, &b) &&
+			!gfile_csum(fs, &b) )
+		goto err_unmap;
+
+	fs->fs_fd = fd;
+	fs->fs_flags = flags;
+
+	if ( flags & GFS_PREAD ) {
+		struct gfs_range r[5];
+		unsigned int i, num;
+
+		fs->fs_io = gfs_io_new(fd, flags & GFS_PREAD_THREADS);
+		if ( NULL == fs->fs_io )
+			goto err_unmap;
+
+		/* Only the index is used through the map, get it over
+		 * with now rather than on the first few lookups
+		 */
+		num = index_ranges(fs, r);
+		for(i = 0; i < num; i++)
+			gfs_range_fetch(&r[i]);
+	}
+
+	if ( !verify_init(fs, fn) )
+		goto err_io;
+
+	if ( flags & GFS_LOCK_INDEX )
+		lock_index(fs);
+
+	con_printf("%s: %s: v%u, %u files%s%s, %s\n",
+			_func, fn, fs->fs_version, fs->fs_num_names,
+			(fs->fs_disp) ? " (hashed)" : "",
+			(fs->fs_vstate) ? " (verified)" : "",
+			(fs->fs_io) ? gfs_io_name(fs->fs_io) : "mmap");
 	return fs;
+err_io:
+	if ( fs->fs_io )
+		gfs_io_free(fs->fs_io);
 err_unmap:
 	munmap((void *)fs->fs_map, fs_len);
 err_close:
@@ -149,53 +606,753 @@ out:
 	return NULL;
 }
 
+static void zcache_free(struct _gfs *fs, struct zcache_ent *e)
+{
+	hlist_del(&e->z_hash);
+	fs->fs_zcache_sz -= e->z_len;
+	free(e);
+}
+
+/* Evict least recently used idle entries until we're in budget */
+static void zcache_trim(struct _gfs *fs)
+{
+	struct zcache_ent *e;
+
+	while ( fs->fs_zcache_sz > fs->fs_zcache_max &&
+			!list_empty(&fs->fs_lru) ) {
+		e = list_entry(fs->fs_lru.next, struct zcache_ent, z_lru);
+		list_del(&e->z_lru);
+		zcache_free(fs, e);
+	}
+}
+
 void gfs_close(gfs_t fs)
 {
+	struct zcache_ent *z;
+	unsigned int i;
+
+	verify_stop(fs);
+
+	/* reads in flight have to land before their buffers go */
+	list_for_each_entry(z, &fs->fs_pending, z_lru)
+		gfs_io_wait(fs->fs_io, &z->z_io);
+
+	for(i = 0; i < GFS_ZCACHE_HASH; i++) {
+		struct hlist_node *n, *tmp;
+		hlist_for_each_safe(n, tmp, &fs->fs_zhash[i]) {
+			struct zcache_ent *e;
+			e = hlist_entry(n, struct zcache_ent, z_hash);
+			assert(e->z_ref == 0);
+			zcache_free(fs, e);
+		}
+	}
+
+	if ( fs->fs_io )
+		gfs_io_free(fs->fs_io);
 	munmap((void *)fs->fs_map, fs->fs_end - fs->fs_map);
+	close(fs->fs_fd);
 	free(fs);
 }
 
-int gfile_open(gfs_t fs, struct gfile *f, const char *name)
+static struct zcache_ent *zcache_find(struct _gfs *fs, uint64_t ofs)
 {
-	const struct gfile_name *ptr;
-	unsigned int n;
+	struct hlist_head *h;
+	struct hlist_node *n;
+	struct zcache_ent *e;
 
-	assert(fs != NULL);
-	assert(f != NULL);
+	h = &fs->fs_zhash[(ofs >> GFILE_ALIGN_BITS) % GFS_ZCACHE_HASH];
+	hlist_for_each(n, h) {
+		e = hlist_entry(n, struct zcache_ent, z_hash);
+		if ( e->z_ofs == ofs )
+			return e;
+	}
+
+	return NULL;
+}
+
+static void zcache_add(struct _gfs *fs, struct zcache_ent *e)
+{
+	struct hlist_head *h;
+
+	h = &fs->fs_zhash[(e->z_ofs >> GFILE_ALIGN_BITS) % GFS_ZCACHE_HASH];
+	hlist_add_head(&e->z_hash, h);
+	fs->fs_zcache_sz += e->z_len;
+}
+
+/* Decompress a record in to a new, referenced, cache entry */
+static struct zcache_ent *zcache_lz(struct _gfs *fs, uint64_t ofs,
+					const uint8_t *ptr, size_t len)
+{
+	const struct gfile_lz *z;
+	struct zcache_ent *e;
+	size_t z_len;
+
+	if ( len < sizeof(*z) )
+		return NULL;
+
+	z = (const struct gfile_lz *)ptr;
+	z_len = be32toh(z->z_len);
+
+	e = malloc(sizeof(*e) + z_len);
+	if ( NULL == e )
+		return NULL;
+
+	if ( !lz_decompress(ptr + sizeof(*z), len - sizeof(*z),
+				e->z_data, z_len) ) {
+		free(e);
+		return NULL;
+	}
+
+	e->z_fs = fs;
+	e->z_ofs = ofs;
+	e->z_ref = 1;
+	e->z_raw = 0;
+	e->z_io.q_state = GFS_IO_DONE;
+	e->z_len = z_len;
+	return e;
+}
+
+/* Find or decompress a compressed record and take a reference */
+static struct zcache_ent *zcache_get(struct _gfs *fs, uint32_t idx)
+{
+	struct zcache_ent *e;
+	uint64_t ofs;
+	size_t len;
+
+	ofs = gfs_rec_ofs(fs, idx);
+	e = zcache_find(fs, ofs);
+	if ( e ) {
+		if ( e->z_ref++ == 0 )
+			list_del(&e->z_lru);
+		return e;
+	}
+
+	len = gfs_rec_len(fs, idx);
+	if ( ofs + len > (uint64_t)(fs->fs_end - fs->fs_map) )
+		return NULL;
+
+	e = zcache_lz(fs, ofs, fs->fs_map + ofs, len);
+	if ( NULL == e )
+		return NULL;
+
+	zcache_add(fs, e);
+	zcache_trim(fs);
+	return e;
+}
+
+static void zcache_put(struct _gfs *fs, struct zcache_ent *e)
+{
+	assert(e->z_ref);
+	if ( --e->z_ref )
+		return;
+	list_add_tail(&e->z_lru, &fs->fs_lru);
+	zcache_trim(fs);
+}
+
+/* Cache entry for a record as stored, nothing's read in to it yet */
+static struct zcache_ent *pread_new(struct _gfs *fs, uint32_t idx)
+{
+	struct zcache_ent *e;
+	uint64_t ofs;
+	uint32_t len;
+
+	ofs = gfs_rec_ofs(fs, idx);
+	len = gfs_rec_len(fs, idx);
+	if ( ofs + len > (uint64_t)(fs->fs_end - fs->fs_map) )
+		return NULL;
+
+	e = malloc(sizeof(*e) + len);
+	if ( NULL == e )
+		return NULL;
+
+	e->z_fs = fs;
+	e->z_ofs = ofs;
+	e->z_ref = 0;
+	e->z_raw = 1;
+	e->z_len = len;
+	e->z_io.q_buf = e->z_data;
+	e->z_io.q_len = len;
+	e->z_io.q_ofs = ofs;
+	e->z_io.q_state = GFS_IO_PENDING;
+	zcache_add(fs, e);
+	return e;
+}
+
+/* Finished reads go on the LRU where they can be evicted */
+static void pread_collect(struct _gfs *fs)
+{
+	struct zcache_ent *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &fs->fs_pending, z_lru) {
+		switch ( gfs_io_poll(fs->fs_io, &e->z_io) ) {
+		case GFS_IO_PENDING:
+			continue;
+		case GFS_IO_DONE:
+			list_move_tail(&e->z_lru, &fs->fs_lru);
+			break;
+		default:
+			list_del(&e->z_lru);
+			zcache_free(fs, e);
+			break;
+		}
+	}
+
+	zcache_trim(fs);
+}
+
+/* Queue a read for a GFS_PREAD archive unless it's already cached */
+void gfs_pread_queue(struct _gfs *fs, uint32_t idx)
+{
+	struct zcache_ent *e;
+
+	if ( zcache_find(fs, gfs_rec_ofs(fs, idx)) )
+		return;
+
+	e = pread_new(fs, idx);
+	if ( NULL == e )
+		return;
+
+	list_add_tail(&e->z_lru, &fs->fs_pending);
+	gfs_io_queue(fs->fs_io, &e->z_io);
+}
+
+void gfs_pread_submit(struct _gfs *fs)
+{
+	pread_collect(fs);
+	gfs_io_submit(fs->fs_io);
+}
+
+/** Set the decompressed file cache budget.
+ * @param fs the archive
+ * @param max bytes of idle decompressed files to keep around
+ *
+ * Files which are still open are never evicted so this is a bound on
+ * what we keep after gfile_close(), not on peak usage.
+ */
+void gfs_cache_size(gfs_t fs, size_t max)
+{
+	fs->fs_zcache_max = max;
+	if ( fs->fs_io )
+		pread_collect(fs);
+	zcache_trim(fs);
+}
+
+/* Open a file from a GFS_PREAD archive. It's waited for if it was queued
+ * and read right now if not, then checked and decompressed the first
+ * time it's opened.
+ */
+static int pread_open(struct _gfs *fs, struct gfile *f, uint32_t idx)
+{
+	struct zcache_ent *e, *z;
+	uint64_t ofs;
+
+	ofs = gfs_rec_ofs(fs, idx);
+	e = zcache_find(fs, ofs);
+	if ( e && e->z_ref == 0 ) {
+		list_del(&e->z_lru);
+		if ( !gfs_io_wait(fs->fs_io, &e->z_io) ) {
+			zcache_free(fs, e);
+			e = NULL;
+		}
+	}
+
+	if ( NULL == e ) {
+		e = pread_new(fs, idx);
+		if ( NULL == e )
+			goto err;
+		if ( !gfs_pread(fs->fs_fd, e->z_data, e->z_len, ofs) ) {
+			zcache_free(fs, e);
+			goto err;
+		}
+		e->z_io.q_state = GFS_IO_DONE;
+	}
+
+	e->z_ref++;
+
+	if ( fs->fs_vstate &&
+			!verify_name(fs, idx, (e->z_raw) ? e->z_data : NULL) ) {
+		fprintf(stderr, "gfile: %s: checksum mismatch\n", f->f_name);
+		zcache_put(fs, e);
+		return 0;
+	}
+
+	if ( e->z_raw && (gfs_rec_mode(fs, idx) & GFILE_MODE_LZ) ) {
+		z = zcache_lz(fs, ofs, e->z_data, e->z_len);
+		if ( NULL == z ) {
+			fprintf(stderr, "gfile: %s: %s\n", f->f_name,
+				load_err("corrupt compressed file"));
+			zcache_put(fs, e);
+			return 0;
+		}
+
+		/* nobody else can have the stored copy yet */
+		assert(e->z_ref == 1);
+		zcache_free(fs, e);
+		zcache_add(fs, z);
+		e = z;
+	}
+
+	e->z_raw = 0;
+	f->f_ptr = e->z_data;
+	f->f_len = e->z_len;
+	fs->fs_nopen++;
+	zcache_trim(fs);
+	return 1;
+
+err:
+	fprintf(stderr, "gfile: %s: %s\n", f->f_name, load_err("read error"));
+	return 0;
+}
+
+/* Binary search the sorted name index */
+static uint32_t lookup_sorted(struct _gfs *fs, const char *name)
+{
+	uint32_t base = 0, n;
 
 	n = fs->fs_num_names;
-	ptr = fs->fs_name;
 
-	for(;;) {
-		unsigned int i;
+	while ( n ) {
+		uint32_t i;
 		int ret;
 
 		i = n / 2;
-		ret = strcmp(name,
-				(char *)fs->fs_map + be32toh(ptr[i].n_name));
+		ret = strcmp(name, gfs_name(fs, base + i));
 		if ( ret < 0 ) {
 			n = i;
 		}else if ( ret > 0 ) {
-			ptr = ptr + (i + 1);
+			base = base + (i + 1);
 			n = n - (i + 1);
 		}else{
-			f->f_ptr = fs->fs_map + be32toh(ptr[i].n_ofs);
-			f->f_len = be32toh(ptr[i].n_len);
-			f->f_name = (char *)fs->fs_map + be32toh(ptr[i].n_name);
-			assert((uint8_t *)f->f_ptr + f->f_len < fs->fs_end);
-			return 1;
+			return base + i;
 		}
-		if ( n == 0 )
-			break;
 	}
 
-	fprintf(stderr, "gfile: %s: name not found\n", name);
-	return 0;
+	return GFS_NOT_FOUND;
+}
+
+static fnv_hash_t phash_hash(const struct _gfs *fs, fnv_hash_t h)
+{
+	return (fs->fs_phash_mix) ? fnv_mix(h) : h;
+}
+
+/* Perfect hash gives us exactly one candidate to confirm */
+static uint32_t lookup_phash(struct _gfs *fs, const char *name)
+{
+	int32_t disp;
+	uint32_t slot, idx;
+
+	disp = (int32_t)be32toh(fs->fs_disp[phash_hash(fs, fnv_hash(name)) %
+						fs->fs_num_buckets]);
+	if ( disp == 0 )
+		return GFS_NOT_FOUND;
+	else if ( disp < 0 )
+		slot = -disp - 1;
+	else
+		slot = phash_hash(fs, fnv_hash_seed(name, disp)) %
+			fs->fs_num_names;
+
+	if ( slot >= fs->fs_num_names )
+		return GFS_NOT_FOUND;
+
+	idx = be32toh(fs->fs_slot[slot]);
+	if ( idx >= fs->fs_num_names )
+		return GFS_NOT_FOUND;
+
+	if ( strcmp(name, gfs_name(fs, idx)) )
+		return GFS_NOT_FOUND;
+
+	return idx;
+}
+
+/* Open a file given its name index entry */
+int gfs_open_name(struct _gfs *fs, struct gfile *f, uint32_t idx)
+{
+	uint64_t ofs;
+
+	f->f_name = gfs_name(fs, idx);
+
+	if ( fs->fs_io )
+		return pread_open(fs, f, idx);
+
+	if ( fs->fs_vstate && !verify_name(fs, idx, NULL) ) {
+		fprintf(stderr, "gfile: %s: checksum mismatch\n", f->f_name);
+		return 0;
+	}
+
+	if ( gfs_rec_mode(fs, idx) & GFILE_MODE_LZ ) {
+		struct zcache_ent *e;
+
+		e = zcache_get(fs, idx);
+		if ( NULL == e ) {
+			fprintf(stderr, "gfile: %s: %s\n",
+				f->f_name,
+				load_err("corrupt compressed file"));
+			return 0;
+		}
+
+		f->f_ptr = e->z_data;
+		f->f_len = e->z_len;
+		fs->fs_nopen++;
+		return 1;
+	}
+
+	ofs = gfs_rec_ofs(fs, idx);
+	f->f_ptr = fs->fs_map + ofs;
+	f->f_len = gfs_rec_len(fs, idx);
+	assert(ofs + f->f_len <= (uint64_t)(fs->fs_end - fs->fs_map));
+	fs->fs_nopen++;
+	return 1;
+}
+
+uint32_t gfs_lookup(struct _gfs *fs, const char *name)
+{
+	if ( fs->fs_disp )
+		return lookup_phash(fs, name);
+	else
+		return lookup_sorted(fs, name);
+}
+
+int gfile_open(gfs_t fs, struct gfile *f, const char *name)
+{
+	uint32_t idx;
+
+	assert(fs != NULL);
+	assert(f != NULL);
+
+	idx = gfs_lookup(fs, name);
+	if ( GFS_NOT_FOUND == idx ) {
+		fprintf(stderr, "gfile: %s: name not found\n", name);
+		return 0;
+	}
+
+	return gfs_open_name(fs, f, idx);
 }
 
 void gfile_close(gfs_t fs, struct gfile *f)
 {
 	assert(fs != NULL);
 	assert(f != NULL);
-	/* HEH, that was easy */
+	assert(fs->fs_nopen);
+
+	fs->fs_nopen--;
+
+	/* Uncompressed files are straight out of the map */
+	if ( gfs_mapped(fs, f->f_ptr) )
+		return;
+
+	zcache_put(fs, zcache_entry(f->f_ptr));
+}
+
+/* First index for which the first len bytes of the name compare greater
+ * than key, or greater or equal if !upper. The index is sorted by strcmp
+ * so names sharing a prefix are contiguous.
+ */
+static uint32_t lower_bound(struct _gfs *fs, const char *key, size_t len,
+				int upper)
+{
+	uint32_t base = 0, n, i;
+	int ret;
+
+	for(n = fs->fs_num_names; n; ) {
+		i = n / 2;
+		ret = strncmp(gfs_name(fs, base + i), key, len);
+		if ( ret < 0 || (upper && ret == 0) ) {
+			base = base + (i + 1);
+			n = n - (i + 1);
+		}else{
+			n = i;
+		}
+	}
+
+	return base;
+}
+
+/** Start listing files under a prefix.
+ * @param fs the archive
+ * @param d iterator to initialise
+ * @param prefix name prefix, eg. "models/md5/", or "" for everything
+ *
+ * Two binary searches find the range of matching names, so listing k
+ * files costs O(log N + k). Names are in sorted order and stay valid
+ * until the archive is closed.
+ *
+ * @return number of matching files
+ */
+unsigned int gfs_dir_open(gfs_t fs, struct gfs_dir *d, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	assert(fs != NULL);
+	assert(d != NULL);
+
+	d->d_fs = fs;
+	d->d_idx = lower_bound(fs, prefix, len, 0);
+	d->d_end = lower_bound(fs, prefix, len, 1);
+	return d->d_end - d->d_idx;
+}
+
+/** Next name from a gfs_dir_open() iterator, or NULL at the end. */
+const char *gfs_dir_next(struct gfs_dir *d)
+{
+	if ( d->d_idx >= d->d_end )
+		return NULL;
+	return gfs_name(d->d_fs, d->d_idx++);
+}
+
+/** Call a function for each file under a prefix.
+ * @param fs the archive
+ * @param prefix name prefix, "" for everything
+ * @param cb called with each name in sorted order, return zero to stop
+ * @param priv passed to cb
+ *
+ * @return number of names passed to cb
+ */
+unsigned int gfs_readdir(gfs_t fs, const char *prefix,
+			int (*cb)(void *priv, const char *name), void *priv)
+{
+	struct gfs_dir d;
+	const char *name;
+	unsigned int num = 0;
+
+	gfs_dir_open(fs, &d, prefix);
+	while ( (name = gfs_dir_next(&d)) ) {
+		num++;
+		if ( !(*cb)(priv, name) )
+			break;
+	}
+
+	return num;
+}
+
+static int range_cmp(const void *_A, const void *_B)
+{
+	const struct gfs_range *a = _A, *b = _B;
+
+	if ( a->r_fs != b->r_fs )
+		return ((uintptr_t)a->r_fs < (uintptr_t)b->r_fs) ? -1 : 1;
+	if ( a->r_ofs != b->r_ofs )
+		return (a->r_ofs < b->r_ofs) ? -1 : 1;
+	return 0;
+}
+
+/* Sort ranges by archive and offset and coalesce any which overlap or
+ * are within GFS_PREFETCH_GAP of each other. Returns the new count.
+ */
+unsigned int gfs_range_merge(struct gfs_range *r, unsigned int num)
+{
+	unsigned int i, j;
+
+	if ( num == 0 )
+		return 0;
+
+	qsort(r, num, sizeof(*r), range_cmp);
+
+	for(i = 0, j = 1; j < num; j++) {
+		uint64_t end = r[i].r_ofs + r[i].r_len;
+		uint64_t j_end = r[j].r_ofs + r[j].r_len;
+
+		if ( r[j].r_fs != r[i].r_fs ||
+				r[j].r_ofs > end + GFS_PREFETCH_GAP ) {
+			r[++i] = r[j];
+			continue;
+		}
+
+		if ( j_end > end )
+			r[i].r_len = j_end - r[i].r_ofs;
+	}
+
+	return i + 1;
+}
+
+/* Page aligned bounds of a range within the mapping */
+static void range_pages(const struct gfs_range *r,
+			const uint8_t **begin, const uint8_t **end,
+			size_t *pgsz)
+{
+	const uint8_t *ptr = r->r_fs->fs_map + r->r_ofs;
+
+	*pgsz = sysconf(_SC_PAGESIZE);
+	*begin = (const uint8_t *)((uintptr_t)ptr & ~(uintptr_t)(*pgsz - 1));
+	*end = r->r_fs->fs_end;
+	if ( r->r_len < (uint64_t)(*end - ptr) )
+		*end = ptr + r->r_len;
+}
+
+/* Ask the kernel to start reading a range in, doesn't wait for it */
+void gfs_range_advise(const struct gfs_range *r)
+{
+	const uint8_t *begin, *end;
+	size_t pgsz;
+
+	range_pages(r, &begin, &end, &pgsz);
+	if ( end > begin )
+		madvise((void *)begin, end - begin, MADV_WILLNEED);
+}
+
+/* Read a range in and fault it in to our page tables, this blocks so
+ * it's for the prefetch thread only.
+ */
+void gfs_range_fetch(const struct gfs_range *r)
+{
+	const volatile uint8_t *ptr;
+	const uint8_t *begin, *end;
+	size_t pgsz;
+
+	range_pages(r, &begin, &end, &pgsz);
+	if ( end <= begin )
+		return;
+
+	posix_fadvise(r->r_fs->fs_fd, begin - r->r_fs->fs_map,
+			end - begin, POSIX_FADV_WILLNEED);
+	for(ptr = begin; ptr < end; ptr += pgsz)
+		(void)*ptr;
+}
+
+/* Pin a range in memory, this faults it in first so it blocks */
+int gfs_range_lock(const struct gfs_range *r)
+{
+	const uint8_t *begin, *end;
+	size_t pgsz;
+
+	range_pages(r, &begin, &end, &pgsz);
+	if ( end <= begin )
+		return 1;
+
+	if ( mlock(begin, end - begin) )
+		return 0;
+
+	r->r_fs->fs_locked += end - begin;
+	return 1;
+}
+
+/* Collect the byte ranges of the named files, unknown names are skipped
+ * since prefetch is only ever a hint.
+ */
+static unsigned int gfs_ranges(struct _gfs *fs, struct gfs_range *r,
+				const char * const *names, unsigned int num)
+{
+	unsigned int i, n;
+	uint32_t idx;
+
+	for(i = n = 0; i < num; i++) {
+		idx = gfs_lookup(fs, names[i]);
+		if ( GFS_NOT_FOUND == idx )
+			continue;
+		r[n].r_fs = fs;
+		r[n].r_ofs = gfs_rec_ofs(fs, idx);
+		r[n].r_len = gfs_rec_len(fs, idx);
+		n++;
+	}
+
+	return n;
+}
+
+/** Start reading files in before they're opened.
+ * @param fs the archive
+ * @param names files which are about to be loaded
+ * @param num number of names
+ *
+ * Issues MADV_WILLNEED on the coalesced byte ranges of the files and
+ * returns straight away, the I/O happens in the background. With
+ * GFS_PREAD the reads are queued on the backend instead.
+ */
+void gfs_prefetch(gfs_t fs, const char * const *names, unsigned int num)
+{
+	struct gfs_range *r;
+	unsigned int i, n;
+
+	if ( fs->fs_io ) {
+		uint32_t idx;
+
+		for(i = 0; i < num; i++) {
+			idx = gfs_lookup(fs, names[i]);
+			if ( idx != GFS_NOT_FOUND )
+				gfs_pread_queue(fs, idx);
+		}
+		gfs_pread_submit(fs);
+		return;
+	}
+
+	r = malloc(num * sizeof(*r));
+	if ( NULL == r )
+		return;
+
+	n = gfs_range_merge(r, gfs_ranges(fs, r, names, num));
+	for(i = 0; i < n; i++)
+		gfs_range_advise(&r[i]);
+
+	free(r);
+}
+
+/** Pin files in memory so opening them never faults.
+ * @param fs the archive
+ * @param names hot files, eg. everything a level needs
+ * @param num number of names
+ *
+ * Unknown names are skipped. This reads the files in and blocks, and it
+ * fails if RLIMIT_MEMLOCK is too low. Pages stay locked until the
+ * archive is closed. With GFS_PREAD records never fault anyway so this
+ * is just a prefetch.
+ *
+ * @return zero if the files couldn't be locked
+ */
+int gfs_lock(gfs_t fs, const char * const *names, unsigned int num)
+{
+	struct gfs_range *r;
+	unsigned int i, n;
+	int ret = 1;
+
+	if ( fs->fs_io ) {
+		gfs_prefetch(fs, names, num);
+		return 1;
+	}
+
+	r = malloc((num ? num : 1) * sizeof(*r));
+	if ( NULL == r )
+		return 0;
+
+	n = gfs_range_merge(r, gfs_ranges(fs, r, names, num));
+	for(i = 0; i < n; i++) {
+		if ( !gfs_range_lock(&r[i]) ) {
+			ret = 0;
+			break;
+		}
+	}
+
+	free(r);
+	return ret;
+}
+
+/** Memory footprint of an archive mapping.
+ * @param fs the archive
+ * @param m filled in with mapped, resident and locked byte counts
+ *
+ * Residency comes from mincore() so it costs a syscall and a byte per
+ * page of archive, it's for stats and not for calling every frame.
+ */
+void gfs_mem_stat(gfs_t fs, struct gfs_mem *m)
+{
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	size_t len = fs->fs_end - fs->fs_map;
+	size_t i, num_pg = (len + pgsz - 1) / pgsz;
+	unsigned char *vec;
+
+	m->m_mapped = len;
+	m->m_resident = 0;
+	m->m_locked = fs->fs_locked;
+
+	vec = malloc(num_pg ? num_pg : 1);
+	if ( NULL == vec )
+		return;
+
+	if ( !mincore((void *)fs->fs_map, len, vec) ) {
+		for(i = 0; i < num_pg; i++)
+			if ( vec[i] & 1 )
+				m->m_resident += pgsz;
+		/* the last page is partial */
+		if ( m->m_resident > len )
+			m->m_resident = len;
+	}
+
+	free(vec);
 }
@@ -0,0 +1,195 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*/
+#ifndef __GFS_INTERNAL_HEADER_INCLUDED__
+#define __GFS_INTERNAL_HEADER_INCLUDED__
+
+#include <pthread.h>
+
+/* Decompressed file cache, unreferenced entries are kept around on an
+ * LRU until the cache goes over budget. Entries are keyed by record
+ * offset since deduplicated names share a record.
+ */
+#define GFS_ZCACHE_HASH	256
+#define GFS_ZCACHE_MAX	(32U << 20)
+
+/* Read size when checksumming a GFS_PREAD record nobody's loaded */
+#define GFS_CRC_CHUNK	(256U << 10)
+
+/* Prefetch ranges closer than this are read as one, a small gap costs
+ * less than an extra seek.
+ */
+#define GFS_PREFETCH_GAP	(16U << 10)
+
+/* Per file verification state */
+#define GFS_VSTATE_UNKNOWN	0
+#define GFS_VSTATE_GOOD		1
+#define GFS_VSTATE_BAD		2
+
+/* Read states, see gfsio.c */
+#define GFS_IO_DONE	0
+#define GFS_IO_PENDING	1
+#define GFS_IO_ERROR	2
+
+struct gfs_ioreq {
+	struct list_head q_list;
+	uint8_t *q_buf;
+	size_t q_len;
+	uint64_t q_ofs;
+	int q_state;
+};
+
+/* With GFS_PREAD every record goes through the cache, not just the
+ * compressed ones. Entries start out holding the record as stored and
+ * are checked and decompressed on first open. Reads in flight are on
+ * fs_pending instead of the LRU so they can't be evicted.
+ */
+struct zcache_ent {
+	struct hlist_node z_hash;
+	struct list_head z_lru;
+	struct _gfs *z_fs;
+	uint64_t z_ofs;
+	unsigned int z_ref;
+	int z_raw;
+	struct gfs_ioreq z_io;
+	size_t z_len;
+	uint8_t z_data[0];
+};
+
+/* Note that the file layout is such that we only need
+ * these few fields to do correct + optimnal file lookup, the
+ * perfect hash is optional and just makes it faster
+ */
+struct _gfs {
+	const uint8_t *fs_map;
+	const uint8_t *fs_end;
+	uint32_t fs_num_names;
+	/* fs_name for version 1 archives, fs_name64 otherwise */
+	const struct gfile_name *fs_name;
+	const struct gfile_name64 *fs_name64;
+	/* what n_name is relative to */
+	const uint8_t *fs_nbase;
+
+	unsigned int fs_version;
+	uint32_t fs_num_blk;
+
+	/* kept open for readahead */
+	int fs_fd;
+	unsigned int fs_flags;
+
+	/* GFS_PREAD backend and reads which haven't been opened yet */
+	struct gfs_io *fs_io;
+	struct list_head fs_pending;
+
+	uint32_t fs_num_buckets;
+	const uint32_t *fs_disp;
+	const uint32_t *fs_slot;
+	int fs_phash_mix;
+
+	struct hlist_head fs_zhash[GFS_ZCACHE_HASH];
+	struct list_head fs_lru;
+	size_t fs_zcache_sz;
+	size_t fs_zcache_max;
+
+	/* checksums, fs_vstate is one VSTATE_* per name */
+	const uint32_t *fs_crc;
+	uint8_t *fs_vstate;
+	pthread_t fs_vthread;
+	int fs_vrunning;
+	int fs_vquit;
+	unsigned int fs_vchecked;
+	unsigned int fs_vbad;
+	uint64_t fs_vbytes;
+	uint64_t fs_vopen_ns;
+	uint64_t fs_vbg_ns;
+
+	/* bytes pinned by GFS_LOCK_INDEX and gfs_lock() */
+	uint64_t fs_locked;
+
+	/* mount stack, see gvfs.c */
+	struct list_head fs_list;
+	int fs_prio;
+	unsigned int fs_nopen;
+};
+
+/* A byte range of an archive to read ahead of time. Merged ranges of a
+ * 64 bit archive can be over 4GB.
+ */
+struct gfs_range {
+	struct _gfs *r_fs;
+	uint64_t r_ofs;
+	uint64_t r_len;
+};
+
+/* Is this pointer straight out of the archive mapping? */
+static inline int gfs_mapped(const struct _gfs *fs, const void *ptr)
+{
+	return (const uint8_t *)ptr >= fs->fs_map &&
+		(const uint8_t *)ptr <= fs->fs_end;
+}
+
+/* Recover the cache entry from a decompressed file pointer */
+static inline struct zcache_ent *zcache_entry(const void *ptr)
+{
+	return (struct zcache_ent *)((uint8_t *)ptr -
+			offsetof(struct zcache_ent, z_data));
+}
+
+/* Name index accessors, these hide the index entry format */
+static inline const char *gfs_name(const struct _gfs *fs, uint32_t idx)
+{
+	if ( fs->fs_name )
+		return (const char *)fs->fs_nbase +
+			be32toh(fs->fs_name[idx].n_name);
+	return (const char *)fs->fs_nbase +
+		be32toh(fs->fs_name64[idx].n_name);
+}
+
+static inline uint64_t gfs_rec_ofs(const struct _gfs *fs, uint32_t idx)
+{
+	if ( fs->fs_name )
+		return be32toh(fs->fs_name[idx].n_ofs);
+	return be64toh(fs->fs_name64[idx].n_ofs);
+}
+
+static inline uint32_t gfs_rec_len(const struct _gfs *fs, uint32_t idx)
+{
+	if ( fs->fs_name )
+		return be32toh(fs->fs_name[idx].n_len);
+	return be32toh(fs->fs_name64[idx].n_len);
+}
+
+static inline uint16_t gfs_rec_mode(const struct _gfs *fs, uint32_t idx)
+{
+	if ( fs->fs_name )
+		return be16toh(fs->fs_name[idx].n_mode);
+	return be16toh(fs->fs_name64[idx].n_mode);
+}
+
+/* gfs_lookup() return for a name which isn't there */
+#define GFS_NOT_FOUND	0xffffffffU
+
+uint32_t gfs_lookup(struct _gfs *fs, const char *name);
+int gfs_open_name(struct _gfs *fs, struct gfile *f, uint32_t idx);
+
+void gfs_pread_queue(struct _gfs *fs, uint32_t idx);
+void gfs_pread_submit(struct _gfs *fs);
+
+unsigned int gfs_range_merge(struct gfs_range *r, unsigned int num);
+void gfs_range_advise(const struct gfs_range *r);
+void gfs_range_fetch(const struct gfs_range *r);
+int gfs_range_lock(const struct gfs_range *r);
+
+/* gfsio.c */
+_check_result int gfs_pread(int fd, void *buf, size_t len, uint64_t ofs);
+_check_result struct gfs_io *gfs_io_new(int fd, int threads);
+void gfs_io_free(struct gfs_io *io);
+const char *gfs_io_name(const struct gfs_io *io);
+void gfs_io_queue(struct gfs_io *io, struct gfs_ioreq *q);
+void gfs_io_submit(struct gfs_io *io);
+int gfs_io_poll(struct gfs_io *io, struct gfs_ioreq *q);
+int gfs_io_wait(struct gfs_io *io, struct gfs_ioreq *q);
+
+#endif /* __GFS_INTERNAL_HEADER_INCLUDED__ */
@@ -0,0 +1,593 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Name lookup microbenchmark for gfs archives. Feed it the same manifest
+* that was fed to mkgfile, eg:
+*
+*   mkgfile < manifest > test.gfs && gfsbench test.gfs < manifest
+*
+* Every name is looked up via the perfect hash and again via the sorted
+* index, in a shuffled order so we measure cache misses and not the
+* hardware prefetcher. If more archives are given then lookups through
+* the mount stack are timed with just the first archive mounted and then
+* with all of them mounted.
+*
+* With -r a client access trace is replayed against a cold page cache
+* instead, reporting wall time and major faults, eg. to compare the
+* default layout against one made with mkgfile -t.
+*
+* With -v the checksum code is timed, first raw CRC32C throughput and
+* then opening every file with each of the gfs verification modes.
+*
+* With -m every file is opened and read with each of the mapping options
+* and the page faults taken after gfs_open() returns are counted.
+*
+* With -l every file under a prefix is listed, eg. -l models/md5/ and
+* the time for the listing is compared against a linear scan.
+*
+* With -i the mmap backend is compared against GFS_PREAD with io_uring
+* and with the thread pool. Files are prefetched a batch at a time and
+* then opened and read, from a cold page cache and again warm.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/gfile.h>
+#include <blackbloc/crc32c.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#define BENCH_ROUNDS 10
+#define CRC_BENCH_SZ (64U << 20)
+#define IO_BATCH 256
+
+static char **names;
+static unsigned int num_names;
+
+void con_printf(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int read_names(FILE *f)
+{
+	char buf[8192];
+	unsigned int max = 0;
+
+	while ( fgets(buf, sizeof(buf), f) ) {
+		char *lf;
+
+		lf = strchr(buf, '\n');
+		if ( lf )
+			*lf = '\0';
+		lf = strchr(buf, '\r');
+		if ( lf )
+			*lf = '\0';
+
+		if ( buf[0] == '\0' || buf[0] == '#' )
+			continue;
+
+		lf = buf;
+		if ( strlen(buf) > 1 && buf[0] == '.' && buf[1] == '/' )
+			lf += 2;
+
+		if ( num_names >= max ) {
+			char **new;
+			max = (max) ? max * 2 : 1024;
+			new = realloc(names, max * sizeof(*names));
+			if ( NULL == new )
+				return 0;
+			names = new;
+		}
+
+		names[num_names] = strdup(lf);
+		if ( NULL == names[num_names] )
+			return 0;
+		num_names++;
+	}
+
+	return num_names != 0;
+}
+
+static void shuffle(void)
+{
+	unsigned int i;
+
+	srand(0x1337);
+	for(i = num_names - 1; i > 0; i--) {
+		unsigned int j = rand() % (i + 1);
+		char *tmp = names[i];
+		names[i] = names[j];
+		names[j] = tmp;
+	}
+}
+
+static double lookup_loop(int (*op)(void *, struct gfile *, const char *),
+				void (*cl)(void *, struct gfile *),
+				void *fs)
+{
+	struct gfile f;
+	unsigned int i, r;
+	double start;
+
+	/* one warm pass so we measure lookups and not page faults */
+	for(i = 0; i < num_names; i++) {
+		if ( !(*op)(fs, &f, names[i]) )
+			return -1.0;
+		(*cl)(fs, &f);
+	}
+
+	start = now();
+	for(r = 0; r < BENCH_ROUNDS; r++) {
+		for(i = 0; i < num_names; i++) {
+			if ( !(*op)(fs, &f, names[i]) )
+				abort();
+			(*cl)(fs, &f);
+		}
+	}
+
+	return (now() - start) / ((double)num_names * BENCH_ROUNDS);
+}
+
+static int gfs_op(void *fs, struct gfile *f, const char *name)
+{
+	return gfile_open(fs, f, name);
+}
+
+static void gfs_cl(void *fs, struct gfile *f)
+{
+	gfile_close(fs, f);
+}
+
+static int vfs_op(void *vfs, struct gfile *f, const char *name)
+{
+	return gvfs_open(vfs, f, name);
+}
+
+static void vfs_cl(void *vfs, struct gfile *f)
+{
+	gvfs_close(vfs, f);
+}
+
+/* Drop the archive from the page cache so the replay hits the disk */
+static int evict(const char *fn)
+{
+	int fd, ret;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: %s: %s\n", _func, fn, get_err());
+		return 0;
+	}
+
+	fdatasync(fd);
+	ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	if ( ret ) {
+		fprintf(stderr, "%s: %s: %s\n", _func, fn, strerror(ret));
+		return 0;
+	}
+	return 1;
+}
+
+/* Open every file in trace order and touch each page, like a loader */
+static int replay(const char *fn)
+{
+	struct rusage r0, r1;
+	struct gfile f;
+	unsigned int i;
+	size_t j;
+	volatile uint8_t sum = 0;
+	double start;
+	gfs_t fs;
+
+	if ( !evict(fn) )
+		return 0;
+
+	getrusage(RUSAGE_SELF, &r0);
+	start = now();
+
+	fs = gfs_open(fn, 0);
+	if ( NULL == fs )
+		return 0;
+
+	for(i = 0; i < num_names; i++) {
+		const uint8_t *ptr;
+
+		if ( !gfile_open(fs, &f, names[i]) )
+			continue;
+		for(ptr = f.f_ptr, j = 0; j < f.f_len; j += 4096)
+			sum += ptr[j];
+		gfile_close(fs, &f);
+	}
+
+	gfs_close(fs);
+
+	getrusage(RUSAGE_SELF, &r1);
+	printf("replay: %u files: %.1f ms, %ld major faults\n",
+		num_names, (now() - start) / 1e6,
+		r1.ru_majflt - r0.ru_majflt);
+	return 1;
+}
+
+static void crc_bench(void)
+{
+	uint8_t *buf;
+	uint32_t crc;
+	double start;
+	size_t i;
+
+	buf = malloc(CRC_BENCH_SZ);
+	if ( NULL == buf )
+		return;
+	for(i = 0; i < CRC_BENCH_SZ; i++)
+		buf[i] = i * 2654435761U >> 13;
+
+	start = now();
+	crc = crc32c(0, buf, CRC_BENCH_SZ);
+	printf("crc32c %s: %.1f MB/s\n", crc32c_impl(),
+		(CRC_BENCH_SZ / ((now() - start) / 1e9)) / (1 << 20));
+
+	start = now();
+	if ( crc32c_sw(0, buf, CRC_BENCH_SZ) != crc )
+		printf("crc32c: implementations disagree!\n");
+	printf("crc32c slice-by-8: %.1f MB/s\n",
+		(CRC_BENCH_SZ / ((now() - start) / 1e9)) / (1 << 20));
+
+	free(buf);
+}
+
+/* Open everything once with a verification mode, then let any verify
+ * thread finish so we see what it cost.
+ */
+static int verify_bench(const char *fn, unsigned int flags,
+			const char *label)
+{
+	struct gfs_verify v;
+	struct gfile f;
+	unsigned int i, num_bad = 0;
+	double start, t_open;
+	gfs_t fs;
+
+	fs = gfs_open(fn, flags);
+	if ( NULL == fs )
+		return 0;
+
+	start = now();
+	for(i = 0; i < num_names; i++) {
+		if ( !gfile_open(fs, &f, names[i]) ) {
+			num_bad++;
+			continue;
+		}
+		gfile_close(fs, &f);
+	}
+	t_open = now() - start;
+
+	/* give up on the thread after ten seconds */
+	for(i = 0; i < 10000; i++) {
+		gfs_verify_stat(fs, &v);
+		if ( !(flags & GFS_VERIFY_BG) ||
+				v.v_checked == v.v_num_files )
+			break;
+		usleep(1000);
+	}
+
+	printf("%s: %u opens (%u failed) in %.1f ms, "
+		"checked %u/%u files (%lu KB), %u bad, "
+		"%.1f ms in open, %.1f ms in background\n",
+		label, num_names, num_bad, t_open / 1e6,
+		v.v_checked, v.v_num_files,
+		(unsigned long)(v.v_bytes >> 10), v.v_bad,
+		v.v_open_ns / 1e6, v.v_bg_ns / 1e6);
+
+	gfs_close(fs);
+	return 1;
+}
+
+/* Faults taken by a load after the archive is opened */
+static int map_bench(const char *fn, unsigned int flags, const char *label)
+{
+	struct rusage r0, r1;
+	struct gfs_mem m;
+	struct gfile f;
+	unsigned int i;
+	size_t j;
+	volatile uint8_t sum = 0;
+	double t_open, start;
+	gfs_t fs;
+
+	t_open = now();
+	fs = gfs_open(fn, flags);
+	if ( NULL == fs )
+		return 0;
+	t_open = now() - t_open;
+
+	getrusage(RUSAGE_SELF, &r0);
+	start = now();
+	for(i = 0; i < num_names; i++) {
+		const uint8_t *ptr;
+
+		if ( !gfile_open(fs, &f, names[i]) )
+			continue;
+		for(ptr = f.f_ptr, j = 0; j < f.f_len; j += 4096)
+			sum += ptr[j];
+		gfile_close(fs, &f);
+	}
+	getrusage(RUSAGE_SELF, &r1);
+
+	gfs_mem_stat(fs, &m);
+	printf("%s: open %.1f ms, load %.1f ms, %ld minor %ld major faults, "
+		"%lu/%lu KB resident, %lu KB locked\n",
+		label, t_open / 1e6, (now() - start) / 1e6,
+		r1.ru_minflt - r0.ru_minflt, r1.ru_majflt - r0.ru_majflt,
+		(unsigned long)(m.m_resident >> 10),
+		(unsigned long)(m.m_mapped >> 10),
+		(unsigned long)(m.m_locked >> 10));
+
+	gfs_close(fs);
+	return 1;
+}
+
+/* Load everything a batch at a time, prefetching each batch first */
+static int io_bench(const char *fn, unsigned int flags, const char *label,
+			int cold)
+{
+	struct rusage r0, r1;
+	struct gfile f;
+	unsigned int i, j, n;
+	volatile uint8_t sum = 0;
+	size_t bytes = 0, k;
+	double start;
+	gfs_t fs;
+
+	if ( cold && !evict(fn) )
+		return 0;
+
+	getrusage(RUSAGE_SELF, &r0);
+	start = now();
+
+	fs = gfs_open(fn, flags);
+	if ( NULL == fs )
+		return 0;
+
+	for(i = 0; i < num_names; i += n) {
+		n = num_names - i;
+		if ( n > IO_BATCH )
+			n = IO_BATCH;
+
+		gfs_prefetch(fs, (const char * const *)names + i, n);
+		for(j = i; j < i + n; j++) {
+			const uint8_t *ptr;
+
+			if ( !gfile_open(fs, &f, names[j]) )
+				continue;
+			for(ptr = f.f_ptr, k = 0; k < f.f_len; k += 4096)
+				sum += ptr[k];
+			bytes += f.f_len;
+			gfile_close(fs, &f);
+		}
+	}
+
+	gfs_close(fs);
+
+	getrusage(RUSAGE_SELF, &r1);
+	start = now() - start;
+	printf("%s %s: %.1f ms, %.1f MB/s, %ld major faults\n",
+		label, (cold) ? "cold" : "warm", start / 1e6,
+		(bytes / (start / 1e9)) / (1 << 20),
+		r1.ru_majflt - r0.ru_majflt);
+	return 1;
+}
+
+static int count_name(void *priv, const char *name)
+{
+	(*(unsigned int *)priv)++;
+	return 1;
+}
+
+static int list_bench(const char *fn, const char *prefix)
+{
+	unsigned int i, r, num = 0, num_scan = 0;
+	size_t len = strlen(prefix);
+	double t_dir, t_scan;
+	gfs_t fs;
+
+	fs = gfs_open(fn, 0);
+	if ( NULL == fs )
+		return 0;
+
+	t_dir = now();
+	for(r = 0; r < BENCH_ROUNDS; r++)
+		gfs_readdir(fs, prefix, count_name, &num);
+	t_dir = (now() - t_dir) / BENCH_ROUNDS;
+	num /= BENCH_ROUNDS;
+
+	/* what you'd do without it, given a manifest */
+	t_scan = now();
+	for(r = 0; r < BENCH_ROUNDS; r++) {
+		for(i = 0; i < num_names; i++)
+			if ( !strncmp(names[i], prefix, len) )
+				num_scan++;
+	}
+	t_scan = (now() - t_scan) / BENCH_ROUNDS;
+	num_scan /= BENCH_ROUNDS;
+
+	printf("readdir %s: %u names in %.1f us, scan found %u in %.1f us\n",
+		prefix, num, t_dir / 1e3, num_scan, t_scan / 1e3);
+	gfs_close(fs);
+	return 1;
+}
+
+static int bench(const char *fn, unsigned int flags, const char *label)
+{
+	double ns;
+	gfs_t fs;
+
+	fs = gfs_open(fn, flags);
+	if ( NULL == fs )
+		return 0;
+
+	ns = lookup_loop(gfs_op, gfs_cl, fs);
+	gfs_close(fs);
+	if ( ns < 0 )
+		return 0;
+
+	printf("%s: %u names: %.1f ns/lookup\n", label, num_names, ns);
+	return 1;
+}
+
+static int bench_mounts(char **fn, int num)
+{
+	double ns;
+	gvfs_t vfs;
+	int i;
+
+	vfs = gvfs_new();
+	if ( NULL == vfs )
+		return 0;
+
+	for(i = 0; i < num; i++) {
+		if ( NULL == gfs_mount(vfs, fn[i], 0, i) ) {
+			gvfs_free(vfs);
+			return 0;
+		}
+	}
+
+	ns = lookup_loop(vfs_op, vfs_cl, vfs);
+	gvfs_free(vfs);
+	if ( ns < 0 )
+		return 0;
+
+	printf("mount x%d: %u names: %.1f ns/lookup\n", num, num_names, ns);
+	return 1;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s <file.gfs> [more.gfs ...] < manifest\n",
+		cmd);
+	fprintf(stderr, "       %s -r <file.gfs> < trace\n", cmd);
+	fprintf(stderr, "       %s -v <file.gfs> < manifest\n", cmd);
+	fprintf(stderr, "       %s -m <file.gfs> < manifest\n", cmd);
+	fprintf(stderr, "       %s -l prefix <file.gfs> < manifest\n", cmd);
+	fprintf(stderr, "       %s -i <file.gfs> < manifest\n", cmd);
+}
+
+int main(int argc, char **argv)
+{
+	int c, rmode = 0, vmode = 0, mmode = 0, imode = 0;
+	const char *prefix = NULL;
+	char **fn;
+	int num;
+
+	while ( (c = getopt(argc, argv, "rvmil:")) != -1 ) {
+		switch ( c ) {
+		case 'r':
+			rmode = 1;
+			break;
+		case 'v':
+			vmode = 1;
+			break;
+		case 'm':
+			mmode = 1;
+			break;
+		case 'i':
+			imode = 1;
+			break;
+		case 'l':
+			prefix = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fn = argv + optind;
+	num = argc - optind;
+	if ( num < 1 ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ( !read_names(stdin) ) {
+		fprintf(stderr, "%s: no names to look up\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ( rmode )
+		return replay(fn[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	if ( prefix )
+		return list_bench(fn[0], prefix) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	if ( mmode ) {
+		if ( !map_bench(fn[0], 0, "default") ||
+				!map_bench(fn[0], GFS_LOCK_INDEX, "lock") ||
+				!map_bench(fn[0], GFS_POPULATE, "populate") ||
+				!map_bench(fn[0], GFS_POPULATE | GFS_HUGEPAGE,
+						"populate+hugepage") )
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	if ( imode ) {
+		static const struct {
+			unsigned int flags;
+			const char *label;
+		} io[] = {
+			{0, "mmap"},
+			{GFS_PREAD, "pread"},
+			{GFS_PREAD | GFS_PREAD_THREADS, "threads"},
+		};
+
+		for(c = 0; c < (int)(sizeof(io) / sizeof(*io)); c++) {
+			if ( !io_bench(fn[0], io[c].flags, io[c].label, 1) ||
+					!io_bench(fn[0], io[c].flags,
+							io[c].label, 0) )
+				return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if ( vmode ) {
+		crc_bench();
+		if ( !verify_bench(fn[0], 0, "never") ||
+				!verify_bench(fn[0], GFS_VERIFY_OPEN, "open") ||
+				!verify_bench(fn[0], GFS_VERIFY_BG, "background") )
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	shuffle();
+
+	if ( !bench(fn[0], 0, "phash") )
+		return EXIT_FAILURE;
+	if ( !bench(fn[0], GFS_NO_PHASH, "bsearch") )
+		return EXIT_FAILURE;
+
+	if ( num > 1 ) {
+		if ( !bench_mounts(fn, 1) )
+			return EXIT_FAILURE;
+		if ( !bench_mounts(fn, num) )
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,491 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Read backend for archives opened with GFS_PREAD. Records are read in to
+* buffers we own instead of being faulted in through the mapping, which
+* on network and FUSE filesystems means a synchronous stall for every
+* page. Reads are queued in batches and completed either by io_uring or,
+* where that's missing or not allowed, by a small pool of pread threads.
+*
+* Only one thread may queue and wait on a gfs_io, completions from the
+* pool are the only cross-thread traffic.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/gfile.h>
+#include <blackbloc/gfile-internal.h>
+
+#include "gfs.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#define GFS_IO_THREADS	4
+#define GFS_IO_DEPTH	64
+
+#if HAVE_LINUX_IO_URING_H
+struct uring {
+	int u_fd;
+	int u_file;
+	unsigned int u_to_submit;
+	unsigned int u_inflight;
+
+	unsigned int *u_sq_head;
+	unsigned int *u_sq_tail;
+	unsigned int *u_sq_mask;
+	unsigned int *u_sq_array;
+	unsigned int u_sq_entries;
+	struct io_uring_sqe *u_sqes;
+
+	unsigned int *u_cq_head;
+	unsigned int *u_cq_tail;
+	unsigned int *u_cq_mask;
+	unsigned int u_cq_entries;
+	struct io_uring_cqe *u_cqes;
+
+	void *u_sq_ptr;
+	size_t u_sq_sz;
+	void *u_cq_ptr;
+	size_t u_cq_sz;
+	size_t u_sqes_sz;
+};
+#endif
+
+struct gfs_io {
+	int io_fd;
+#if HAVE_LINUX_IO_URING_H
+	/** Ring, u_fd is -1 if we're using the thread pool. */
+	struct uring io_ring;
+#endif
+	/** Thread pool, only if there's no ring. */
+	pthread_t io_thread[GFS_IO_THREADS];
+	unsigned int io_num_threads;
+	/** Protects io_queue and io_quit. */
+	pthread_mutex_t io_lock;
+	/** Signalled when reads are queued or on shutdown. */
+	pthread_cond_t io_wake;
+	/** Signalled when a read completes. */
+	pthread_cond_t io_done;
+	struct list_head io_queue;
+	int io_quit;
+};
+
+/** Read all of a range, retrying short reads.
+ * @return zero on error or if the file ends early
+ */
+int gfs_pread(int fd, void *buf, size_t len, uint64_t ofs)
+{
+	uint8_t *ptr = buf;
+	ssize_t ret;
+
+	while ( len ) {
+		ret = pread(fd, ptr, len, ofs);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			if ( ret == 0 )
+				errno = 0;
+			return 0;
+		}
+		ptr += ret;
+		ofs += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+static void req_done(struct gfs_ioreq *q, int ok)
+{
+	__atomic_store_n(&q->q_state, (ok) ? GFS_IO_DONE : GFS_IO_ERROR,
+				__ATOMIC_RELEASE);
+}
+
+#if HAVE_LINUX_IO_URING_H
+static int uring_enter(struct uring *u, unsigned int to_submit,
+			unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, u->u_fd, to_submit,
+				min_complete,
+				(min_complete) ? IORING_ENTER_GETEVENTS : 0,
+				NULL, 0);
+	}while ( ret < 0 && errno == EINTR );
+
+	return ret;
+}
+
+static void uring_free(struct uring *u)
+{
+	if ( u->u_sqes )
+		munmap(u->u_sqes, u->u_sqes_sz);
+	if ( u->u_cq_ptr && u->u_cq_ptr != u->u_sq_ptr )
+		munmap(u->u_cq_ptr, u->u_cq_sz);
+	if ( u->u_sq_ptr )
+		munmap(u->u_sq_ptr, u->u_sq_sz);
+	close(u->u_fd);
+	u->u_fd = -1;
+}
+
+static int uring_init(struct uring *u)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	/* seccomp or io_uring_disabled give us EPERM */
+	u->u_fd = syscall(__NR_io_uring_setup, GFS_IO_DEPTH, &p);
+	if ( u->u_fd < 0 )
+		return 0;
+
+	u->u_sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->u_cq_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( u->u_cq_sz > u->u_sq_sz )
+			u->u_sq_sz = u->u_cq_sz;
+		u->u_cq_sz = u->u_sq_sz;
+	}
+
+	u->u_sq_ptr = mmap(NULL, u->u_sq_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->u_fd,
+				IORING_OFF_SQ_RING);
+	if ( u->u_sq_ptr == MAP_FAILED ) {
+		u->u_sq_ptr = NULL;
+		goto err;
+	}
+
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		u->u_cq_ptr = u->u_sq_ptr;
+	}else{
+		u->u_cq_ptr = mmap(NULL, u->u_cq_sz, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, u->u_fd,
+					IORING_OFF_CQ_RING);
+		if ( u->u_cq_ptr == MAP_FAILED ) {
+			u->u_cq_ptr = NULL;
+			goto err;
+		}
+	}
+
+	u->u_sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->u_sqes = mmap(NULL, u->u_sqes_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->u_fd,
+				IORING_OFF_SQES);
+	if ( u->u_sqes == MAP_FAILED ) {
+		u->u_sqes = NULL;
+		goto err;
+	}
+
+	sq = u->u_sq_ptr;
+	u->u_sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->u_sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->u_sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->u_sq_array = (unsigned int *)(sq + p.sq_off.array);
+	u->u_sq_entries = p.sq_entries;
+
+	cq = u->u_cq_ptr;
+	u->u_cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->u_cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->u_cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->u_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->u_cq_entries = p.cq_entries;
+	return 1;
+
+err:
+	uring_free(u);
+	return 0;
+}
+
+static int uring_submit(struct uring *u)
+{
+	int ret;
+
+	if ( 0 == u->u_to_submit )
+		return 1;
+
+	ret = uring_enter(u, u->u_to_submit, 0);
+	if ( ret < 0 )
+		return 0;
+
+	u->u_to_submit -= ret;
+	return 1;
+}
+
+/* Caller makes sure there's a free sq slot */
+static void uring_push(struct uring *u, struct gfs_ioreq *q)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	tail = *u->u_sq_tail;
+	idx = tail & *u->u_sq_mask;
+	sqe = &u->u_sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = u->u_file;
+	sqe->addr = (uintptr_t)q->q_buf;
+	sqe->len = (q->q_len > 0x7ffff000) ? 0x7ffff000 : q->q_len;
+	sqe->off = q->q_ofs;
+	sqe->user_data = (uintptr_t)q;
+	u->u_sq_array[idx] = idx;
+
+	__atomic_store_n(u->u_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->u_to_submit++;
+	u->u_inflight++;
+}
+
+/* Reap whatever has completed, short reads go back on the ring and
+ * anything the ring can't do is done synchronously.
+ */
+static void uring_reap(struct gfs_io *io, unsigned int wait)
+{
+	struct uring *u = &io->io_ring;
+	struct io_uring_cqe *cqe;
+	struct gfs_ioreq *q;
+	unsigned int head;
+	int res;
+
+	if ( wait ) {
+		res = uring_enter(u, u->u_to_submit, 1);
+		if ( res > 0 )
+			u->u_to_submit -= res;
+	}
+
+	head = *u->u_cq_head;
+	while ( head != __atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE) ) {
+		cqe = &u->u_cqes[head & *u->u_cq_mask];
+		q = (struct gfs_ioreq *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		head++;
+		u->u_inflight--;
+
+		if ( res > 0 && (size_t)res < q->q_len ) {
+			q->q_buf += res;
+			q->q_ofs += res;
+			q->q_len -= res;
+		}else if ( res < 0 && res != -EINTR && res != -EAGAIN ) {
+			/* eg. old kernels without IORING_OP_READ */
+			req_done(q, gfs_pread(io->io_fd, q->q_buf,
+						q->q_len, q->q_ofs));
+			continue;
+		}else if ( res >= 0 ) {
+			req_done(q, (size_t)res == q->q_len);
+			continue;
+		}
+
+		/* short or interrupted, go round again */
+		if ( u->u_to_submit >= u->u_sq_entries )
+			uring_submit(u);
+		if ( u->u_to_submit < u->u_sq_entries ) {
+			uring_push(u, q);
+		}else{
+			req_done(q, gfs_pread(io->io_fd, q->q_buf,
+						q->q_len, q->q_ofs));
+		}
+	}
+
+	__atomic_store_n(u->u_cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+static void *io_thread(void *priv)
+{
+	struct gfs_io *io = priv;
+	struct gfs_ioreq *q;
+	int ok;
+
+	pthread_mutex_lock(&io->io_lock);
+	for(;;) {
+		while ( !io->io_quit && list_empty(&io->io_queue) )
+			pthread_cond_wait(&io->io_wake, &io->io_lock);
+		if ( list_empty(&io->io_queue) )
+			break;
+
+		q = list_entry(io->io_queue.next, struct gfs_ioreq, q_list);
+		list_del(&q->q_list);
+		pthread_mutex_unlock(&io->io_lock);
+
+		ok = gfs_pread(io->io_fd, q->q_buf, q->q_len, q->q_ofs);
+
+		pthread_mutex_lock(&io->io_lock);
+		req_done(q, ok);
+		pthread_cond_broadcast(&io->io_done);
+	}
+	pthread_mutex_unlock(&io->io_lock);
+	return NULL;
+}
+
+/** Create a read backend for an archive.
+ * @param fd the archive, which must stay open
+ * @param threads use the pread thread pool even if io_uring works
+ *
+ * @return the backend or NULL on error
+ */
+struct gfs_io *gfs_io_new(int fd, int threads)
+{
+	struct gfs_io *io;
+	unsigned int i;
+
+	io = calloc(1, sizeof(*io));
+	if ( NULL == io )
+		return NULL;
+
+	io->io_fd = fd;
+	INIT_LIST_HEAD(&io->io_queue);
+	pthread_mutex_init(&io->io_lock, NULL);
+	pthread_cond_init(&io->io_wake, NULL);
+	pthread_cond_init(&io->io_done, NULL);
+
+#if HAVE_LINUX_IO_URING_H
+	io->io_ring.u_fd = -1;
+	if ( !threads && uring_init(&io->io_ring) ) {
+		io->io_ring.u_file = fd;
+		return io;
+	}
+#endif
+
+	for(i = 0; i < GFS_IO_THREADS; i++) {
+		if ( pthread_create(&io->io_thread[i], NULL, io_thread, io) )
+			break;
+	}
+
+	io->io_num_threads = i;
+	if ( 0 == i ) {
+		gfs_io_free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+/** Wait for anything in flight and free a read backend */
+void gfs_io_free(struct gfs_io *io)
+{
+	unsigned int i;
+
+#if HAVE_LINUX_IO_URING_H
+	if ( io->io_ring.u_fd >= 0 ) {
+		while ( io->io_ring.u_inflight )
+			uring_reap(io, 1);
+		uring_free(&io->io_ring);
+	}
+#endif
+
+	pthread_mutex_lock(&io->io_lock);
+	io->io_quit = 1;
+	pthread_cond_broadcast(&io->io_wake);
+	pthread_mutex_unlock(&io->io_lock);
+
+	for(i = 0; i < io->io_num_threads; i++)
+		pthread_join(io->io_thread[i], NULL);
+
+	pthread_cond_destroy(&io->io_done);
+	pthread_cond_destroy(&io->io_wake);
+	pthread_mutex_destroy(&io->io_lock);
+	free(io);
+}
+
+/** Name of the backend, for logs and benchmarks */
+const char *gfs_io_name(const struct gfs_io *io)
+{
+#if HAVE_LINUX_IO_URING_H
+	if ( io->io_ring.u_fd >= 0 )
+		return "io_uring";
+#endif
+	return "pread threads";
+}
+
+/** Queue a read, nothing may be done until gfs_io_submit().
+ * @param io the backend
+ * @param q read to do, q_state must stay valid until it completes
+ */
+void gfs_io_queue(struct gfs_io *io, struct gfs_ioreq *q)
+{
+	q->q_state = GFS_IO_PENDING;
+	if ( 0 == q->q_len ) {
+		q->q_state = GFS_IO_DONE;
+		return;
+	}
+
+#if HAVE_LINUX_IO_URING_H
+	if ( io->io_ring.u_fd >= 0 ) {
+		struct uring *u = &io->io_ring;
+
+		/* keep completions from overflowing the cq ring */
+		if ( u->u_to_submit >= u->u_sq_entries )
+			uring_submit(u);
+		while ( u->u_to_submit >= u->u_sq_entries ||
+				u->u_inflight >= u->u_cq_entries )
+			uring_reap(io, 1);
+		uring_push(u, q);
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&io->io_lock);
+	list_add_tail(&q->q_list, &io->io_queue);
+	pthread_mutex_unlock(&io->io_lock);
+}
+
+/** Start everything that's been queued */
+void gfs_io_submit(struct gfs_io *io)
+{
+#if HAVE_LINUX_IO_URING_H
+	if ( io->io_ring.u_fd >= 0 ) {
+		uring_submit(&io->io_ring);
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&io->io_lock);
+	pthread_cond_broadcast(&io->io_wake);
+	pthread_mutex_unlock(&io->io_lock);
+}
+
+/** Has a queued read finished? Never blocks.
+ * @return the q_state, GFS_IO_PENDING if it's still going
+ */
+int gfs_io_poll(struct gfs_io *io, struct gfs_ioreq *q)
+{
+#if HAVE_LINUX_IO_URING_H
+	if ( io->io_ring.u_fd >= 0 &&
+			__atomic_load_n(&q->q_state, __ATOMIC_ACQUIRE) ==
+				GFS_IO_PENDING )
+		uring_reap(io, 0);
+#endif
+	return __atomic_load_n(&q->q_state, __ATOMIC_ACQUIRE);
+}
+
+/** Block until a queued read finishes.
+ * @return non-zero if the data is there
+ */
+int gfs_io_wait(struct gfs_io *io, struct gfs_ioreq *q)
+{
+#if HAVE_LINUX_IO_URING_H
+	if ( io->io_ring.u_fd >= 0 ) {
+		while ( gfs_io_poll(io, q) == GFS_IO_PENDING )
+			uring_reap(io, 1);
+		return q->q_state == GFS_IO_DONE;
+	}
+#endif
+
+	pthread_mutex_lock(&io->io_lock);
+	pthread_cond_broadcast(&io->io_wake);
+	while ( q->q_state == GFS_IO_PENDING )
+		pthread_cond_wait(&io->io_done, &io->io_lock);
+	pthread_mutex_unlock(&io->io_lock);
+	return q->q_state == GFS_IO_DONE;
+}
@@ -0,0 +1,497 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Mount stack of gfs archives. Higher priority archives shadow files in
+* lower ones. Rather than probing each archive in turn we keep a single
+* merged hash of every visible name which is rebuilt on mount/unmount,
+* so lookups cost the same no matter how many archives are mounted.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/gfile.h>
+#include <blackbloc/gfile-internal.h>
+#include <blackbloc/fnv_hash.h>
+
+#include "gfs.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+/* Merged index entry, e_fs is NULL for empty slots */
+struct gvfs_ent {
+	uint32_t e_hash;
+	uint32_t e_idx;
+	struct _gfs *e_fs;
+};
+
+/* A batch of ranges queued for the prefetch thread */
+struct pf_batch {
+	struct list_head b_list;
+	unsigned int b_num;
+	unsigned int b_cur;
+	struct gfs_range b_r[0];
+};
+
+struct _gvfs {
+	/** Mounted archives, highest priority first. */
+	struct list_head v_mounts;
+	/** Open addressed hash of all visible names. */
+	struct gvfs_ent *v_tab;
+	/** Size of v_tab minus one, it's always a power of two. */
+	uint32_t v_mask;
+	/** Number of visible names. */
+	uint32_t v_num_names;
+
+	/** Prefetch thread, only if gvfs_prefetch_thread() was called. */
+	pthread_t v_thread;
+	/** Protects everything below. */
+	pthread_mutex_t v_lock;
+	/** Signalled when batches are queued or on shutdown. */
+	pthread_cond_t v_wake;
+	/** Signalled when the thread finishes a range. */
+	pthread_cond_t v_idle;
+	/** Queue of pf_batch. */
+	struct list_head v_pf;
+	/** Archive the thread is reading right now, if any. */
+	struct _gfs *v_pf_busy;
+	int v_pf_running;
+	int v_pf_quit;
+};
+
+gvfs_t gvfs_new(void)
+{
+	struct _gvfs *vfs;
+
+	vfs = calloc(1, sizeof(*vfs));
+	if ( NULL == vfs )
+		return NULL;
+
+	INIT_LIST_HEAD(&vfs->v_mounts);
+	INIT_LIST_HEAD(&vfs->v_pf);
+	return vfs;
+}
+
+/* Insert unless a higher priority archive already provided the name */
+static void merge_name(struct _gvfs *vfs, struct gvfs_ent *tab,
+			uint32_t mask, struct _gfs *fs, uint32_t idx)
+{
+	const char *name = gfs_name(fs, idx);
+	uint32_t h = fnv_mix(fnv_hash(name));
+	uint32_t i;
+
+	for(i = h & mask; tab[i].e_fs; i = (i + 1) & mask) {
+		if ( tab[i].e_hash != h )
+			continue;
+		if ( !strcmp(name, gfs_name(tab[i].e_fs, tab[i].e_idx)) )
+			return;
+	}
+
+	tab[i].e_hash = h;
+	tab[i].e_idx = idx;
+	tab[i].e_fs = fs;
+	vfs->v_num_names++;
+}
+
+static int rebuild_index(struct _gvfs *vfs)
+{
+	struct gvfs_ent *tab;
+	struct _gfs *fs;
+	uint64_t total = 0;
+	uint32_t sz, i;
+
+	list_for_each_entry(fs, &vfs->v_mounts, fs_list)
+		total += fs->fs_num_names;
+
+	/* keep load factor under a half */
+	for(sz = 16; sz < total * 2; sz <<= 1)
+		if ( sz >= (1U << 31) )
+			return 0;
+
+	tab = calloc(sz, sizeof(*tab));
+	if ( NULL == tab )
+		return 0;
+
+	vfs->v_num_names = 0;
+	list_for_each_entry(fs, &vfs->v_mounts, fs_list) {
+		for(i = 0; i < fs->fs_num_names; i++)
+			merge_name(vfs, tab, sz - 1, fs, i);
+	}
+
+	free(vfs->v_tab);
+	vfs->v_tab = tab;
+	vfs->v_mask = sz - 1;
+	return 1;
+}
+
+/** Mount an archive.
+ * @param vfs the mount stack
+ * @param fn archive filename
+ * @param flags gfs_open() flags
+ * @param prio priority, higher shadows lower, ties go to the latest mount
+ *
+ * @return the archive, or NULL on error
+ */
+gfs_t gfs_mount(gvfs_t vfs, const char *fn, unsigned int flags, int prio)
+{
+	struct _gfs *fs, *tmp;
+
+	fs = gfs_open(fn, flags);
+	if ( NULL == fs )
+		return NULL;
+
+	fs->fs_prio = prio;
+	list_for_each_entry(tmp, &vfs->v_mounts, fs_list) {
+		if ( tmp->fs_prio <= prio )
+			break;
+	}
+	list_add_tail(&fs->fs_list, &tmp->fs_list);
+
+	if ( !rebuild_index(vfs) ) {
+		con_printf("%s: %s: %s\n", _func, fn,
+			load_err("index too large"));
+		list_del(&fs->fs_list);
+		gfs_close(fs);
+		return NULL;
+	}
+
+	con_printf("%s: %s: %u names visible\n", _func, fn,
+			vfs->v_num_names);
+	return fs;
+}
+
+/* Drop any queued prefetches of an archive and wait for the thread to
+ * let go of it, so that it can be closed.
+ */
+static void prefetch_cancel(struct _gvfs *vfs, struct _gfs *fs)
+{
+	struct pf_batch *b;
+	unsigned int i;
+
+	if ( !vfs->v_pf_running )
+		return;
+
+	pthread_mutex_lock(&vfs->v_lock);
+	list_for_each_entry(b, &vfs->v_pf, b_list) {
+		for(i = b->b_cur; i < b->b_num; i++)
+			if ( b->b_r[i].r_fs == fs )
+				b->b_r[i].r_fs = NULL;
+	}
+	while ( vfs->v_pf_busy == fs )
+		pthread_cond_wait(&vfs->v_idle, &vfs->v_lock);
+	pthread_mutex_unlock(&vfs->v_lock);
+}
+
+/** Unmount an archive.
+ * @param vfs the mount stack
+ * @param fs an archive returned by gfs_mount()
+ *
+ * Fails if any files from the archive are still open.
+ *
+ * @return zero on error, non-zero for success
+ */
+int gfs_unmount(gvfs_t vfs, gfs_t fs)
+{
+	struct list_head *prev;
+
+	if ( fs->fs_nopen ) {
+		con_printf("%s: archive busy: %u files open\n",
+				_func, fs->fs_nopen);
+		return 0;
+	}
+
+	prefetch_cancel(vfs, fs);
+
+	prev = fs->fs_list.prev;
+	list_del(&fs->fs_list);
+	if ( !rebuild_index(vfs) ) {
+		/* put it back where it was, can't leave dangling entries */
+		list_add(&fs->fs_list, prev);
+		rebuild_index(vfs);
+		return 0;
+	}
+
+	gfs_close(fs);
+	return 1;
+}
+
+static void prefetch_stop(struct _gvfs *vfs)
+{
+	struct pf_batch *b, *tmp;
+
+	if ( !vfs->v_pf_running )
+		return;
+
+	pthread_mutex_lock(&vfs->v_lock);
+	vfs->v_pf_quit = 1;
+	pthread_cond_signal(&vfs->v_wake);
+	pthread_mutex_unlock(&vfs->v_lock);
+
+	pthread_join(vfs->v_thread, NULL);
+
+	list_for_each_entry_safe(b, tmp, &vfs->v_pf, b_list) {
+		list_del(&b->b_list);
+		free(b);
+	}
+
+	pthread_cond_destroy(&vfs->v_idle);
+	pthread_cond_destroy(&vfs->v_wake);
+	pthread_mutex_destroy(&vfs->v_lock);
+	vfs->v_pf_running = 0;
+}
+
+void gvfs_free(gvfs_t vfs)
+{
+	struct _gfs *fs, *tmp;
+
+	if ( NULL == vfs )
+		return;
+
+	prefetch_stop(vfs);
+
+	list_for_each_entry_safe(fs, tmp, &vfs->v_mounts, fs_list) {
+		list_del(&fs->fs_list);
+		gfs_close(fs);
+	}
+
+	free(vfs->v_tab);
+	free(vfs);
+}
+
+static const struct gvfs_ent *gvfs_lookup(struct _gvfs *vfs,
+						const char *name)
+{
+	const struct gvfs_ent *e;
+	uint32_t h, i;
+
+	h = fnv_mix(fnv_hash(name));
+	for(i = h & vfs->v_mask; vfs->v_tab; i = (i + 1) & vfs->v_mask) {
+		e = &vfs->v_tab[i];
+		if ( NULL == e->e_fs )
+			break;
+		if ( e->e_hash != h )
+			continue;
+		if ( strcmp(name, gfs_name(e->e_fs, e->e_idx)) )
+			continue;
+		return e;
+	}
+
+	return NULL;
+}
+
+int gvfs_open(gvfs_t vfs, struct gfile *f, const char *name)
+{
+	const struct gvfs_ent *e;
+
+	assert(vfs != NULL);
+	assert(f != NULL);
+
+	e = gvfs_lookup(vfs, name);
+	if ( NULL == e ) {
+		fprintf(stderr, "gfile: %s: name not found\n", name);
+		return 0;
+	}
+
+	return gfs_open_name(e->e_fs, f, e->e_idx);
+}
+
+void gvfs_close(gvfs_t vfs, struct gfile *f)
+{
+	struct _gfs *fs;
+
+	assert(vfs != NULL);
+	assert(f != NULL);
+
+	list_for_each_entry(fs, &vfs->v_mounts, fs_list) {
+		if ( gfs_mapped(fs, f->f_ptr) ) {
+			gfile_close(fs, f);
+			return;
+		}
+	}
+
+	/* Must be decompressed, the cache entry knows who owns it */
+	gfile_close(zcache_entry(f->f_ptr)->z_fs, f);
+}
+
+/** Call a function for each visible file under a prefix.
+ * @param vfs the mount stack
+ * @param prefix name prefix, "" for everything
+ * @param cb called with each name, return zero to stop
+ * @param priv passed to cb
+ *
+ * Each archive's matching range is walked in turn and names which are
+ * shadowed by another mount are skipped, so every visible name comes
+ * out once. Names are sorted within an archive but not across them.
+ *
+ * @return number of names passed to cb
+ */
+unsigned int gvfs_readdir(gvfs_t vfs, const char *prefix,
+			int (*cb)(void *priv, const char *name), void *priv)
+{
+	const struct gvfs_ent *e;
+	struct gfs_dir d;
+	struct _gfs *fs;
+	const char *name;
+	unsigned int num = 0;
+
+	assert(vfs != NULL);
+
+	list_for_each_entry(fs, &vfs->v_mounts, fs_list) {
+		gfs_dir_open(fs, &d, prefix);
+		while ( (name = gfs_dir_next(&d)) ) {
+			e = gvfs_lookup(vfs, name);
+			if ( NULL == e || e->e_fs != fs )
+				continue;
+			num++;
+			if ( !(*cb)(priv, name) )
+				return num;
+		}
+	}
+
+	return num;
+}
+
+static void *prefetch_thread(void *priv)
+{
+	struct _gvfs *vfs = priv;
+	struct pf_batch *b;
+	struct gfs_range r;
+
+	pthread_mutex_lock(&vfs->v_lock);
+	for(;;) {
+		while ( list_empty(&vfs->v_pf) && !vfs->v_pf_quit )
+			pthread_cond_wait(&vfs->v_wake, &vfs->v_lock);
+		if ( vfs->v_pf_quit )
+			break;
+
+		b = list_entry(vfs->v_pf.next, struct pf_batch, b_list);
+		r = b->b_r[b->b_cur++];
+		if ( b->b_cur == b->b_num ) {
+			list_del(&b->b_list);
+			free(b);
+		}
+
+		/* cancelled by an unmount */
+		if ( NULL == r.r_fs )
+			continue;
+
+		vfs->v_pf_busy = r.r_fs;
+		pthread_mutex_unlock(&vfs->v_lock);
+
+		gfs_range_fetch(&r);
+
+		pthread_mutex_lock(&vfs->v_lock);
+		vfs->v_pf_busy = NULL;
+		pthread_cond_broadcast(&vfs->v_idle);
+	}
+	pthread_mutex_unlock(&vfs->v_lock);
+	return NULL;
+}
+
+/** Start a background prefetch thread.
+ * @param vfs the mount stack
+ *
+ * Once running, gvfs_prefetch() also queues the files for the thread
+ * which walks them in the declared order, faulting them in to the
+ * archive mappings ahead of the loader.
+ *
+ * @return zero on error, non-zero for success
+ */
+int gvfs_prefetch_thread(gvfs_t vfs)
+{
+	int ret;
+
+	if ( vfs->v_pf_running )
+		return 1;
+
+	pthread_mutex_init(&vfs->v_lock, NULL);
+	pthread_cond_init(&vfs->v_wake, NULL);
+	pthread_cond_init(&vfs->v_idle, NULL);
+	vfs->v_pf_quit = 0;
+
+	ret = pthread_create(&vfs->v_thread, NULL, prefetch_thread, vfs);
+	if ( ret ) {
+		con_printf("%s: pthread_create: %s\n", _func, strerror(ret));
+		pthread_cond_destroy(&vfs->v_idle);
+		pthread_cond_destroy(&vfs->v_wake);
+		pthread_mutex_destroy(&vfs->v_lock);
+		return 0;
+	}
+
+	vfs->v_pf_running = 1;
+	return 1;
+}
+
+/* Coalesce ranges and start the I/O, clobbers the array */
+static void advise_ranges(struct gfs_range *r, unsigned int num)
+{
+	unsigned int i;
+
+	num = gfs_range_merge(r, num);
+	for(i = 0; i < num; i++)
+		gfs_range_advise(&r[i]);
+}
+
+/** Declare files which are about to be loaded.
+ * @param vfs the mount stack
+ * @param names files in the order they'll be opened
+ * @param num number of names
+ *
+ * Names which aren't found are ignored. The kernel is advised straight
+ * away as in gfs_prefetch() and if there's a prefetch thread then the
+ * files are queued for it too. Files on GFS_PREAD archives are queued on
+ * the archive's own backend and skip the thread.
+ */
+void gvfs_prefetch(gvfs_t vfs, const char * const *names, unsigned int num)
+{
+	const struct gvfs_ent *e;
+	struct gfs_range *tmp;
+	struct pf_batch *b;
+	struct _gfs *fs;
+	unsigned int i, n;
+
+	b = malloc(sizeof(*b) + num * sizeof(*b->b_r));
+	if ( NULL == b )
+		return;
+
+	for(i = n = 0; i < num; i++) {
+		e = gvfs_lookup(vfs, names[i]);
+		if ( NULL == e )
+			continue;
+		if ( e->e_fs->fs_io ) {
+			gfs_pread_queue(e->e_fs, e->e_idx);
+			continue;
+		}
+		b->b_r[n].r_fs = e->e_fs;
+		b->b_r[n].r_ofs = gfs_rec_ofs(e->e_fs, e->e_idx);
+		b->b_r[n].r_len = gfs_rec_len(e->e_fs, e->e_idx);
+		n++;
+	}
+
+	list_for_each_entry(fs, &vfs->v_mounts, fs_list) {
+		if ( fs->fs_io )
+			gfs_pread_submit(fs);
+	}
+
+	if ( !vfs->v_pf_running || n == 0 ) {
+		advise_ranges(b->b_r, n);
+		free(b);
+		return;
+	}
+
+	/* thread wants them in load order, the advice wants them sorted */
+	tmp = malloc(n * sizeof(*tmp));
+	if ( tmp ) {
+		memcpy(tmp, b->b_r, n * sizeof(*tmp));
+		advise_ranges(tmp, n);
+		free(tmp);
+	}
+
+	b->b_num = n;
+	b->b_cur = 0;
+
+	pthread_mutex_lock(&vfs->v_lock);
+	list_add_tail(&b->b_list, &vfs->v_pf);
+	pthread_cond_signal(&vfs->v_wake);
+	pthread_mutex_unlock(&vfs->v_lock);
+}
@@ -53,7 +53,7 @@ static int prep_resample(struct _texture *tex, unsigned int mip, GLint format)
 	for(h = 1; h < tex->t_mipmap[mip].m_height; h <<= 1);
 
 	if ( w != tex->t_mipmap[mip].m_width || h != tex->t_mipmap[mip].m_height ) {
-		buf = malloc(w * h * 4);
+		buf = mem_alloc(MEM_IMG, w * h * 4);
 		if ( buf == NULL ) {
 			con_printf("teximg_upload_resample: %s: malloc(): %s\n",
 				tex->t_name, get_err());
@@ -67,7 +67,7 @@ static int prep_resample(struct _texture *tex, unsigned int mip, GLint format)
 				buf, w, h, format);
 
 		/* Free old image */
-		free(tex->t_mipmap[mip].m_pixels);
+		mem_free(MEM_IMG, tex->t_mipmap[mip].m_pixels);
 
 		/* Overwrite with scaled image */
 		tex->t_mipmap[mip].m_width = w;
@@ -94,7 +94,8 @@ static int pcx_prep(struct _texture *tex, unsigned int mip)
 	/* The size is checked in pcx_load */
 	pal = pcx->f.f_ptr + pcx->f.f_len - PCX_PAL;
 
-	tex->t_mipmap[mip].m_pixels = malloc(pcx->width * pcx->height * 4);
+	tex->t_mipmap[mip].m_pixels = mem_alloc(MEM_IMG,
+					pcx->width * pcx->height * 4);
 	if ( tex->t_mipmap[mip].m_pixels == NULL )
 		return 0;
 
@@ -149,7 +150,8 @@ static void pcx_dtor(struct _texture *tex)
 {
 	struct _pcx_img *pcx = (struct _pcx_img *)tex;
 	list_del(&pcx->list);
-	free(pcx);
+	game_close(&pcx->f);
+	mem_free(MEM_IMG, pcx);
 }
 
 static const struct _texops pcx_ops = {
@@ -166,7 +168,7 @@ static struct _texture *do_pcx_load(const char *name)
 	struct _pcx_img *pcx;
 	struct pcx hdr;
 
-	pcx = calloc(1, sizeof(*pcx));
+	pcx = mem_calloc(MEM_IMG, 1, sizeof(*pcx));
 	if ( pcx == NULL )
 		return 0;
 
@@ -214,7 +216,7 @@ static struct _texture *do_pcx_load(const char *name)
 err:
 	game_close(&pcx->f);
 err_free:
-	free(pcx);
+	mem_free(MEM_IMG, pcx);
 	return NULL;
 }
 
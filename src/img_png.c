@@ -62,7 +62,7 @@ static void png_dtor(struct _texture *tex)
 {
 	struct _png_img *png = (struct _png_img *)tex;
 	list_del(&png->list);
-	free(png);
+	mem_free(MEM_IMG, png);
 }
 
 static const struct _texops ops_rgb = {
@@ -113,7 +113,7 @@ static struct _texture *do_png_load(const char *name)
 	if ( !(info=png_create_info_struct(pngstruct)) )
 		goto err_png;
 
-	if ( !(png=calloc(1, sizeof(*png))) )
+	if ( !(png=mem_calloc(MEM_IMG, 1, sizeof(*png))) )
 		goto err_png;
 
 	if ( !game_open(&png->f, name) )
@@ -149,7 +149,7 @@ static struct _texture *do_png_load(const char *name)
 
 	/* Allocate buffer and read image */
 	rb = png_get_rowbytes(pngstruct, info);
-	buf = malloc(h * rb);
+	buf = mem_alloc(MEM_IMG, h * rb);
 	if ( NULL == buf )
 		goto err_close;
 
@@ -177,7 +177,7 @@ static struct _texture *do_png_load(const char *name)
 err_close:
 	game_close(&png->f);
 err_img:
-	free(png);
+	mem_free(MEM_IMG, png);
 err_png:
 	png_destroy_read_struct(&pngstruct, &info, NULL);
 err:
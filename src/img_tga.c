@@ -62,7 +62,8 @@ static void tga_dtor(struct _texture *tex)
 {
 	struct _tga_img *tga = (struct _tga_img *)tex;
 	list_del(&tga->list);
-	free(tga);
+	game_close(&tga->f);
+	mem_free(MEM_IMG, tga);
 }
 
 static const struct _texops ops_24 = {
@@ -126,7 +127,7 @@ static int prep_rle(struct _texture *tex, unsigned int mip)
 	stride = (tex->t_ops == &ops_rle24) ? 3 : 4;
 	s_ptr = tga->pixels;
 
-	ptr = buf = malloc(tga->height * tga->width * stride);
+	ptr = buf = mem_alloc(MEM_IMG, tga->height * tga->width * stride);
 	if ( NULL == buf )
 		return 0;
 
@@ -175,7 +176,7 @@ static struct _texture *do_tga_load(const char *name)
 	struct _tga_img *tga;
 	struct tga hdr;
 
-	tga = calloc(1, sizeof(*tga));
+	tga = mem_calloc(MEM_IMG, 1, sizeof(*tga));
 	if ( tga == NULL )
 		return NULL;
 
@@ -244,7 +245,7 @@ static struct _texture *do_tga_load(const char *name)
 err:
 	game_close(&tga->f);
 err_free:
-	free(tga);
+	mem_free(MEM_IMG, tga);
 	return NULL;
 }
 
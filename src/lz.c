@@ -0,0 +1,224 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* In-tree LZ77 codec for gfile archives. Compression is greedy with a
+* single entry hash table, it's only run by mkgfile. Decompression is
+* the bit that matters and it's just a couple of memcpy's per sequence.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/lz.h>
+
+#define LZ_HASH_BITS	14
+#define LZ_HASH_SIZE	(1U << LZ_HASH_BITS)
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t ret;
+	memcpy(&ret, p, sizeof(ret));
+	return ret;
+}
+
+static inline unsigned int lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a nibble overflow as a run of 255's */
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	for(; len >= 255; len -= 255) {
+		if ( op >= oend )
+			return NULL;
+		*op++ = 255;
+	}
+	if ( op >= oend )
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend,
+			const uint8_t *lit, size_t num_lit,
+			size_t ofs, size_t mlen)
+{
+	uint8_t *token;
+
+	if ( op >= oend )
+		return NULL;
+
+	token = op++;
+	*token = 0;
+
+	if ( num_lit >= 15 ) {
+		*token = 15 << 4;
+		op = put_len(op, oend, num_lit - 15);
+		if ( NULL == op )
+			return NULL;
+	}else{
+		*token = num_lit << 4;
+	}
+
+	if ( (size_t)(oend - op) < num_lit )
+		return NULL;
+	memcpy(op, lit, num_lit);
+	op += num_lit;
+
+	/* final sequence has literals only */
+	if ( mlen == 0 )
+		return op;
+
+	if ( oend - op < 2 )
+		return NULL;
+	*op++ = ofs & 0xff;
+	*op++ = ofs >> 8;
+
+	mlen -= LZ_MIN_MATCH;
+	if ( mlen >= 15 ) {
+		*token |= 15;
+		op = put_len(op, oend, mlen - 15);
+	}else{
+		*token |= mlen;
+	}
+
+	return op;
+}
+
+/** Compress a buffer.
+ * @param src data to compress
+ * @param len length of src
+ * @param dst output buffer
+ * @param max size of output buffer
+ *
+ * @return compressed length, or zero if it doesn't fit in max bytes
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t max)
+{
+	uint32_t tab[LZ_HASH_SIZE];
+	const uint8_t *in = src;
+	const uint8_t *ip, *anchor, *iend;
+	uint8_t *op = dst, *oend = op + max;
+
+	memset(tab, 0, sizeof(tab));
+
+	ip = anchor = in;
+	iend = in + len;
+
+	while ( len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH ) {
+		uint32_t seq = read32(ip);
+		unsigned int h = lz_hash(seq);
+		const uint8_t *ref;
+		uint32_t pos;
+		size_t mlen;
+
+		/* table holds position + 1 so that zero is empty */
+		pos = tab[h];
+		tab[h] = (ip - in) + 1;
+
+		if ( pos == 0 ) {
+			ip++;
+			continue;
+		}
+
+		ref = in + pos - 1;
+		if ( ip - ref > LZ_MAX_OFFSET || read32(ref) != seq ) {
+			ip++;
+			continue;
+		}
+
+		for(mlen = LZ_MIN_MATCH; ip + mlen < iend; mlen++)
+			if ( ref[mlen] != ip[mlen] )
+				break;
+
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+		if ( NULL == op )
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	if ( NULL == op )
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t c;
+
+	do {
+		if ( *ip >= iend )
+			return 0;
+		c = *(*ip)++;
+		*len += c;
+	}while ( c == 255 );
+
+	return 1;
+}
+
+/** Decompress a buffer.
+ * @param src compressed data
+ * @param len length of src
+ * @param dst output buffer
+ * @param out_len exact decompressed length
+ *
+ * @return zero on corrupt input, non-zero on success
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t out_len)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + out_len;
+
+	while ( ip < iend ) {
+		const uint8_t *ref;
+		size_t num_lit, mlen, ofs;
+		uint8_t token;
+
+		token = *ip++;
+
+		num_lit = token >> 4;
+		if ( num_lit == 15 && !get_len(&ip, iend, &num_lit) )
+			return 0;
+
+		if ( (size_t)(iend - ip) < num_lit ||
+				(size_t)(oend - op) < num_lit )
+			return 0;
+		memcpy(op, ip, num_lit);
+		ip += num_lit;
+		op += num_lit;
+
+		/* end of final sequence */
+		if ( ip == iend )
+			break;
+
+		if ( iend - ip < 2 )
+			return 0;
+		ofs = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		mlen = token & 0xf;
+		if ( mlen == 15 && !get_len(&ip, iend, &mlen) )
+			return 0;
+		mlen += LZ_MIN_MATCH;
+
+		if ( ofs == 0 || ofs > (size_t)(op - (uint8_t *)dst) ||
+				(size_t)(oend - op) < mlen )
+			return 0;
+		ref = op - ofs;
+
+		if ( ofs >= mlen ) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		}else{
+			/* overlapping copy, eg. runs */
+			while ( mlen-- )
+				*op++ = *ref++;
+		}
+	}
+
+	return op == oend;
+}
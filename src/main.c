@@ -11,15 +11,74 @@
 #include <blackbloc/sdl_mouse.h>
 #include <blackbloc/gl_render.h>
 #include <blackbloc/client.h>
+#include <blackbloc/gang.h>
+
+#define FRAME_SLAB	(1U << 20)
+#define MEM_WARMUP	100
 
 float fps = 30;
 double lerp = 0;
 
+/* Scratch memory, there's two so that what was allocated last frame is
+ * still good for this one. Each is reset when it comes round again.
+ */
+static struct gang frame_mem[2];
+static unsigned int frame_cur;
+
+struct gang *frame_arena(void)
+{
+	return &frame_mem[frame_cur];
+}
+
+void *frame_alloc(size_t sz)
+{
+	return gang_alloc(&frame_mem[frame_cur], sz);
+}
+
+char *frame_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ret;
+
+	ret = frame_alloc(len);
+	if ( ret )
+		memcpy(ret, str, len);
+	return ret;
+}
+
+static void frame_flip(void)
+{
+	frame_cur ^= 1;
+	gang_reset(&frame_mem[frame_cur]);
+}
+
+/* With BLACKBLOC_MEM=assert any malloc from inside gl_render() aborts,
+ * once MEM_WARMUP frames have had the chance to load everything.
+ */
+static int mem_assert(void)
+{
+	const char *mode;
+
+	mode = getenv("BLACKBLOC_MEM");
+	if ( NULL == mode )
+		return 0;
+	if ( strcmp(mode, "assert") ) {
+		con_printf("main: unknown BLACKBLOC_MEM mode: %s\n", mode);
+		return 0;
+	}
+	if ( !mem_enabled() ) {
+		con_printf("main: BLACKBLOC_MEM needs --enable-memstats\n");
+		return 0;
+	}
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
 	SDL_Event e;
 	uint32_t now, nextframe = 0, gl_frames = 0;
 	uint32_t ctr;
+	int nomalloc;
 
 	/* Initialise SDL */
 	if ( SDL_Init(SDL_INIT_VIDEO) < 0 ) {
@@ -30,14 +89,24 @@ int main(int argc, char **argv)
 	/* Cleanup SDL on exit */
 	atexit(SDL_Quit);
 
+	if ( !gang_init_aligned(&frame_mem[0], FRAME_SLAB, 16, 0) ||
+			!gang_init_aligned(&frame_mem[1], FRAME_SLAB, 16, 0) ) {
+		con_printf("main: frame arena init failed\n");
+		exit(1);
+	}
+
 	if ( !cl_init() ) {
 		con_printf("client: cl_init failed\n");
 		exit(1);
 	}
 
+	nomalloc = mem_assert();
 	now = ctr = SDL_GetTicks();
 
 	while( cl_alive ) {
+		frame_flip();
+		mem_frame();
+
 		/* poll for client input events */
 		while( SDL_PollEvent(&e) ) {
 			switch ( e.type ) {
@@ -74,7 +143,10 @@ int main(int argc, char **argv)
 		}
 
 		/* Render a scene */
+		if ( nomalloc && gl_frames >= MEM_WARMUP )
+			mem_nomalloc(1);
 		gl_render();
+		mem_nomalloc(0);
 		gl_frames++;
 
 		/* Calculate FPS */
@@ -25,7 +25,7 @@ static struct md2_mesh *md2_mesh_load(const char *name)
 	const struct md2_aliasframe *f;
 	struct md2_mesh *mesh;
 
-	mesh = calloc(1, sizeof(*mesh));
+	mesh = mem_calloc(MEM_MD2, 1, sizeof(*mesh));
 	if ( mesh == NULL ) {
 		con_printf("md2: %s: malloc(): %s\n", name, get_err());
 		return NULL;
@@ -98,7 +98,7 @@ static struct md2_mesh *md2_mesh_load(const char *name)
 	}
 
 	/* Load the frames */
-	mesh->frame = malloc(hdr.num_frames * sizeof(*mesh->frame));
+	mesh->frame = mem_alloc(MEM_MD2, hdr.num_frames * sizeof(*mesh->frame));
 	if ( mesh->frame == NULL ) {
 		con_printf("md2: %s: out of memory for frames\n", name);
 		goto err_close;
@@ -125,7 +125,8 @@ static struct md2_mesh *md2_mesh_load(const char *name)
 		goto err_free_frames;
 	}
 
-	mesh->glcmds = malloc(mesh->num_glcmds * sizeof(*mesh->glcmds));
+	mesh->glcmds = mem_alloc(MEM_MD2,
+			mesh->num_glcmds * sizeof(*mesh->glcmds));
 	if ( mesh->glcmds == NULL ) {
 		con_printf("md2: %s: out of memory for GL commands\n", name);
 		goto err_free_frames;
@@ -150,13 +151,13 @@ static struct md2_mesh *md2_mesh_load(const char *name)
 	return mesh;
 
 err_free_glcmds:
-	free(mesh->glcmds);
+	mem_free(MEM_MD2, mesh->glcmds);
 err_free_frames:
-	free(mesh->frame);
+	mem_free(MEM_MD2, mesh->frame);
 err_close:
 	game_close(&mesh->f);
 err:
-	free(mesh);
+	mem_free(MEM_MD2, mesh);
 	return NULL;
 }
 
@@ -179,9 +180,9 @@ void md2_mesh_put(struct md2_mesh *mesh)
 {
 	assert(mesh->ref);
 	if ( --mesh->ref == 0 ) {
-		free(mesh->glcmds);
-		free(mesh->frame);
+		mem_free(MEM_MD2, mesh->glcmds);
+		mem_free(MEM_MD2, mesh->frame);
 		game_close(&mesh->f);
-		free(mesh);
+		mem_free(MEM_MD2, mesh);
 	}
 }
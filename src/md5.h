@@ -15,6 +15,12 @@ struct md5_joint_t {
 	quat4_t orient;
 };
 
+/* Animation joint, the same in every frame so it's kept just once */
+struct md5_hier_t {
+	char name[64];
+	int parent;
+};
+
 /* Vertex */
 struct md5_vertex_t {
 	vec2_t st;
@@ -38,6 +44,27 @@ struct md5_weight_t {
 	vec3_t pos;
 };
 
+/* One weight of each of MD5_SKIN_LANES vertices, as they're skinned,
+ * see md5skin.c
+ */
+#define MD5_SKIN_LANES	16
+struct md5_skin_block_t {
+	int32_t joint[MD5_SKIN_LANES];
+	float pos[4][MD5_SKIN_LANES]; /* position times bias, then the bias */
+	float normal[3][MD5_SKIN_LANES]; /* normal times bias */
+};
+
+/* Vertices with the same number of weights, one after the other */
+struct md5_skin_run_t {
+	unsigned int num_verts;
+	unsigned int num_weights;
+};
+
+/* Joint as a matrix, rotation with the translation in the last column */
+struct md5_mat34_t {
+	vector_t row[3];
+};
+
 /* Bounding box */
 struct md5_bbox_t {
 	vec3_t min;
@@ -54,6 +81,13 @@ struct md5_mesh_part {
 	unsigned int num_tris;
 	unsigned int num_weights;
 
+	/* Built at load for md5_skin(), vertices sorted by weight count */
+	struct md5_skin_block_t *skin_blocks;
+	struct md5_skin_run_t *skin_runs;
+	unsigned int num_skin_runs;
+	vec2_t *skin_st;
+	unsigned int *skin_indices;
+
 	char shader[256];
 	texture_t skin;
 	texture_t normalmap;
@@ -72,25 +106,221 @@ struct md5_mesh {
 	unsigned int max_verts;
 	unsigned int max_tris;
 
+	/* Cooked models are used in place, kept open while loaded */
+	struct gfile cooked;
+
 	char *name;
 	unsigned int ref;
 	struct list_head list;
 };
 
+/* Quantised animation key, a position as steps across the joint's
+ * range or an orientation as the three smallest components of the
+ * quaternion. The top bits of v[0] and v[1] say which one was dropped.
+ */
+struct md5_qkey_t {
+	uint16_t frame;
+	uint16_t v[3];
+};
+
+/* Quantised animation joint, keys are indexes in to md5_anim qkeys */
+struct md5_qjoint_t {
+	vec3_t min;
+	vec3_t scale;
+	uint32_t pos;
+	uint32_t rot;
+	uint16_t num_pos;
+	uint16_t num_rot;
+};
+
+/* How far keyframe reduction may stray, in model units and radians */
+#define MD5Q_POS_TOL	0.01f
+#define MD5Q_ROT_TOL	0.001f
+
 /* Animation data */
 struct md5_anim {
 	unsigned int num_frames;
 	unsigned int num_joints;
 	unsigned int frameRate;
 
-	struct md5_joint_t **skelFrames;
+	struct md5_hier_t *hier;
+	/* num_joints for each frame, one frame after another */
+	vec3_t *pos;
+	quat4_t *orient;
 	struct md5_bbox_t *bboxes;
 
+	/* Quantised animations have these instead of pos and orient */
+	struct md5_qjoint_t *qjoints;
+	struct md5_qkey_t *qkeys;
+	unsigned int num_qkeys;
+
+	struct gfile cooked;
+
 	char *name;
 	unsigned int ref;
 	struct list_head list;
 };
 
+/* Cooked models and animations, as written by md5cook. The arrays are
+ * the in-memory structures above, so the loaders can use them in place
+ * in the game file. Little endian, and the header records the structure
+ * sizes so a file cooked by a different build gets refused rather than
+ * misread. Cooked files keep the .md5mesh/.md5anim names and are told
+ * apart from text by the magic.
+ */
+#define MD5C_MAGIC	0x6335646dU /* "md5c" */
+#define MD5C_VERSION	3
+#define MD5C_MESH	0
+#define MD5C_ANIM	1
+#define MD5C_QANIM	2
+#define MD5C_ALIGN	16 /* every array starts on a vector_t boundary */
+
+struct md5c_hdr {
+	uint32_t h_magic;
+	uint16_t h_version;
+	uint16_t h_type;
+	uint16_t h_joint_sz;
+	uint16_t h_vert_sz;
+	uint16_t h_tri_sz;
+	uint16_t h_weight_sz;
+	uint16_t h_bbox_sz;
+	uint16_t h_hier_sz;
+	uint16_t h_qjoint_sz;
+	uint16_t h_qkey_sz;
+};
+
+/* Offsets are from the start of the file */
+struct md5c_part {
+	char p_shader[256];
+	uint32_t p_num_verts;
+	uint32_t p_num_tris;
+	uint32_t p_num_weights;
+	uint32_t p_verts;
+	uint32_t p_tris;
+	uint32_t p_weights;
+};
+
+struct md5c_mesh {
+	struct md5c_hdr m_hdr;
+	uint32_t m_num_joints;
+	uint32_t m_num_meshes;
+	uint32_t m_joints;
+	uint32_t m_parts;
+};
+
+/* Positions and orientations are laid out as in struct md5_anim */
+struct md5c_anim {
+	struct md5c_hdr a_hdr;
+	uint32_t a_num_frames;
+	uint32_t a_num_joints;
+	uint32_t a_frame_rate;
+	uint32_t a_hier;
+	uint32_t a_pos;
+	uint32_t a_orient;
+	uint32_t a_bboxes;
+};
+
+/* Quantised animation, from md5cook -q */
+struct md5c_qanim {
+	struct md5c_hdr q_hdr;
+	uint32_t q_num_frames;
+	uint32_t q_num_joints;
+	uint32_t q_frame_rate;
+	uint32_t q_num_keys;
+	uint32_t q_hier;
+	uint32_t q_joints;
+	uint32_t q_keys;
+	uint32_t q_bboxes;
+};
+
+static inline void md5c_hdr_init(struct md5c_hdr *h, unsigned int type)
+{
+	memset(h, 0, sizeof(*h));
+	h->h_magic = MD5C_MAGIC;
+	h->h_version = MD5C_VERSION;
+	h->h_type = type;
+	h->h_joint_sz = sizeof(struct md5_joint_t);
+	h->h_vert_sz = sizeof(struct md5_vertex_t);
+	h->h_tri_sz = sizeof(struct md5_triangle_t);
+	h->h_weight_sz = sizeof(struct md5_weight_t);
+	h->h_bbox_sz = sizeof(struct md5_bbox_t);
+	h->h_hier_sz = sizeof(struct md5_hier_t);
+	h->h_qjoint_sz = sizeof(struct md5_qjoint_t);
+	h->h_qkey_sz = sizeof(struct md5_qkey_t);
+}
+
+/* Whether a file is cooked at all, so the text parser can be skipped */
+static inline int md5c_cooked(const struct gfile *f)
+{
+	return f->f_len >= sizeof(struct md5c_hdr) &&
+		!memcmp(f->f_ptr, "md5c", 4);
+}
+
+/* Whether this build can use a cooked file of the given type */
+static inline int md5c_hdr_ok(const struct gfile *f, unsigned int type)
+{
+	const struct md5c_hdr *h = f->f_ptr;
+	struct md5c_hdr ours;
+
+	md5c_hdr_init(&ours, type);
+	return (BYTE_ORDER == LITTLE_ENDIAN) &&
+		!memcmp(h, &ours, sizeof(ours));
+}
+
+/* An array of num * sz bytes at ofs, inside the file and aligned. Empty
+ * arrays come back as NULL, like they would from the text loaders.
+ */
+static inline int md5c_array(const struct gfile *f, uint32_t ofs,
+				uint32_t num, size_t sz, const void **ptr)
+{
+	*ptr = NULL;
+	if ( 0 == num || 0 == sz )
+		return 1;
+	if ( ofs & (MD5C_ALIGN - 1) || ofs > f->f_len ||
+			(f->f_len - ofs) / num < sz )
+		return 0;
+	*ptr = (const uint8_t *)f->f_ptr + ofs;
+	return 1;
+}
+
+/* Whether memory is part of a cooked file rather than allocated */
+static inline int md5c_owns(const struct gfile *f, const void *ptr)
+{
+	const uint8_t *p = ptr, *base = f->f_ptr;
+	return p >= base && p < base + f->f_len;
+}
+
+/* Joints straight out of a file still need checking like parsed ones */
+static inline int md5c_joints_ok(const struct md5_joint_t *joints,
+					unsigned int num)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		if ( joints[i].name[sizeof(joints[i].name) - 1] != '\0' ||
+				joints[i].parent < -1 ||
+				joints[i].parent >= (int)num )
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline int md5c_hier_ok(const struct md5_hier_t *hier,
+				unsigned int num)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		if ( hier[i].name[sizeof(hier[i].name) - 1] != '\0' ||
+				hier[i].parent < -1 ||
+				hier[i].parent >= (int)num )
+			return 0;
+	}
+
+	return 1;
+}
+
 struct _md5_model {
 	struct entity ent;
 	struct md5_mesh *mesh;
@@ -106,11 +336,40 @@ void md5_anim_put(struct md5_anim *anim);
 
 int CheckAnimValidity (const struct md5_mesh *mdl,
 					 const struct md5_anim *anim);
+int md5_mesh_read(const char *filename, struct md5_mesh *mdl);
 int ReadMD5Anim (const char *filename, struct md5_anim *anim);
 void FreeAnim (struct md5_anim *anim);
-void InterpolateSkeletons (const struct md5_joint_t *skelA,
-				 const struct md5_joint_t *skelB,
-				 int num_joints, float interp,
-				 struct md5_joint_t *out);
+void InterpolateSkeletons (const struct md5_anim *anim,
+				 unsigned int frameA, unsigned int frameB,
+				 float interp, struct md5_joint_t *out);
+
+int md5_skin_init(struct md5_mesh_part *mesh);
+void md5_skin_free(struct md5_mesh_part *mesh);
+void md5_palette(const struct md5_joint_t *skel, unsigned int num_joints,
+			struct md5_mat34_t *pal);
+void md5_skin(const struct md5_mesh_part *mesh,
+		const struct md5_mat34_t *pal,
+		vec3_t *verts, vec3_t *norms);
+const char *md5_skin_impl(void);
+
+/* Skinning kernels, for testing */
+#define MD5_SKIN_SCALAR	0
+#define MD5_SKIN_SSE2	1
+#define MD5_SKIN_AVX2	2
+#define MD5_SKIN_AVX512	3
+#define MD5_SKIN_NR_ISA	4
+const char *md5_skin_isa_name(unsigned int isa);
+int md5_skin_isa(unsigned int isa, const struct md5_mesh_part *mesh,
+			const struct md5_mat34_t *pal,
+			vec3_t *verts, vec3_t *norms);
+
+int md5_anim_quantise(struct md5_anim *anim, float pos_tol, float rot_tol,
+			float *pos_err, float *rot_err);
+int md5_anim_qvalid(const struct md5_anim *anim);
+void md5_anim_qjoint(const struct md5_anim *anim, unsigned int frame,
+			unsigned int joint, vec3_t pos, quat4_t orient);
+void md5_anim_qinterp(const struct md5_anim *anim, unsigned int frameA,
+			unsigned int frameB, float interp,
+			struct md5_joint_t *out);
 
 #endif /* __MD5_INTERNAL_HEADER_INCLUDED__ */
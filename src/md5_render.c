@@ -8,135 +8,39 @@
 #include <blackbloc/blackbloc.h>
 #include <blackbloc/client.h>
 #include <blackbloc/gfile.h>
+#include <blackbloc/gang.h>
 #include <blackbloc/tex.h>
 #include <blackbloc/img/tga.h>
 #include <blackbloc/model/md5.h>
 
 #include "md5.h"
 
-/* OpenGL vertex array related stuff */
-static unsigned int max_verts;
-static unsigned int max_tris;
+/* OpenGL vertex array related stuff, these come from the frame arena
+ * and are only good for the md5_render() call which set them up.
+ */
 static vec3_t *vertexArray;
-//static vec3_t *tangentArray;
 static vec3_t *normalArray;
-static vec2_t *texArray;
-static GLuint *vertexIndices;
+static struct md5_mat34_t *palette;
 
 static int AllocVertexArrays(const struct md5_mesh *mesh)
 {
-	if ( mesh->max_verts > max_verts ) {
-		free(vertexArray);
-		vertexArray = malloc(sizeof(vec3_t) * mesh->max_verts);
-		if ( NULL == vertexArray )
-			goto err;
-
-		free(normalArray);
-		normalArray = malloc(sizeof(vec3_t) * mesh->max_verts);
-		if ( NULL == normalArray )
-			goto err;
+	struct gang *mem = frame_arena();
 
-#if 0
-		free(tangentArray);
-		tangentArray = malloc(sizeof(vec3_t) * mesh->max_verts);
-		if ( NULL == tangentArray )
-			goto err;
-#endif
-
-		free(texArray);
-		texArray = malloc(sizeof(vec2_t) * mesh->max_verts);
-		if ( NULL == texArray )
-			goto err;
-	}
-	if ( mesh->max_tris > max_tris ) {
-		free(vertexIndices);
-		vertexIndices = malloc(sizeof(GLuint) * mesh->max_tris * 3);
-		if ( NULL == vertexIndices )
-			goto err;
-	}
-
-	max_verts = mesh->max_verts;
-	max_tris = mesh->max_tris;
-	return 1;
-err:
-	free(vertexArray);
-//	free(tangentArray);
-	free(normalArray);
-	free(texArray);
-	free(vertexIndices);
-	max_verts = max_tris = 0;
-	return 0;
+	vertexArray = gang_alloc(mem, sizeof(vec3_t) * mesh->max_verts);
+	normalArray = gang_alloc(mem, sizeof(vec3_t) * mesh->max_verts);
+	palette = gang_alloc(mem, sizeof(*palette) * mesh->num_joints);
 
+	return vertexArray && normalArray && palette;
 }
 
 /**
  * Prepare a mesh for drawing.  Compute mesh's final vertex positions
- * given a skeleton.  Put the vertices in vertex arrays.
+ * given the skeleton's palette.  Put the vertices in vertex arrays,
+ * texture coordinates and indices were set up at load.
  */
-static void
-PrepareMesh(const struct md5_mesh_part *mesh, const struct md5_joint_t *skeleton)
+static void PrepareMesh(const struct md5_mesh_part *mesh)
 {
-	unsigned int i, j, k;
-
-	/* Setup vertex indices */
-	for (k = 0, i = 0; i < mesh->num_tris; ++i) {
-		for (j = 0; j < 3; ++j, ++k)
-			vertexIndices[k] = mesh->triangles[i].index[j];
-	}
-
-	/* Setup vertices */
-	for (i = 0; i < mesh->num_verts; ++i) {
-		vec3_t vert = { 0.0f, 0.0f, 0.0f };
-		vec3_t norm = { 0.0f, 0.0f, 0.0f };
-//		vec3_t tan = { 0.0f, 0.0f, 0.0f };
-
-		/* Calculate final vertex to draw with weights */
-		for (j = 0; j < mesh->vertices[i].count; ++j) {
-			const struct md5_weight_t *weight
-			    = &mesh->weights[mesh->vertices[i].start + j];
-			const struct md5_joint_t *joint
-			    = &skeleton[weight->joint];
-			vec3_t wv;
-
-			/* Calculate transformed vertex for this weight */
-			Quat_rotatePoint(joint->orient, weight->pos, wv);
-
-			/* The sum of all weight->bias should be 1.0 */
-			vert[0] +=
-			    (joint->pos[0] + wv[0]) * weight->bias;
-			vert[1] +=
-			    (joint->pos[1] + wv[1]) * weight->bias;
-			vert[2] +=
-			    (joint->pos[2] + wv[2]) * weight->bias;
-
-			Quat_rotatePoint(joint->orient, weight->normal, wv);
-			v_scale(wv, weight->bias);
-			v_add(norm, norm, wv);
-
-//			Quat_rotatePoint(joint->orient, weight->tangent, wv);
-//			v_scale(wv, weight->bias);
-//			v_add(tan, tan, wv);
-		}
-
-		v_normalize(norm);
-//		v_normalize(tan);
-
-		vertexArray[i][0] = vert[0];
-		vertexArray[i][1] = vert[1];
-		vertexArray[i][2] = vert[2];
-
-		normalArray[i][0] = norm[0];
-		normalArray[i][1] = norm[1];
-		normalArray[i][2] = norm[2];
-
-#if 0
-		tangentArray[i][0] = tan[0];
-		tangentArray[i][1] = tan[1];
-		tangentArray[i][2] = tan[2];
-#endif
-		texArray[i][0] = mesh->vertices[i].st[0];
-		texArray[i][1] = 1.0f - mesh->vertices[i].st[1];
-	}
+	md5_skin(mesh, palette, vertexArray, normalArray);
 }
 
 /**
@@ -184,11 +88,7 @@ static void Animate(const struct _md5_model *model)
 	cur = frame % anim->num_frames;
 	next = (frame + 1) % anim->num_frames;
 
-	InterpolateSkeletons(anim->skelFrames[cur],
-				anim->skelFrames[next],
-				anim->num_joints,
-				the_lerp,
-				model->skeleton);
+	InterpolateSkeletons(anim, cur, next, the_lerp, model->skeleton);
 }
 
 static int compile_shader(const char *fn, GLint type, GLuint *id)
@@ -207,6 +107,7 @@ static int compile_shader(const char *fn, GLint type, GLuint *id)
 	str[0] = (GLchar *)file.f_ptr;
 	sz[0] = file.f_len;
 	glShaderSource(s, 1, str, sz);
+	game_close(&file);
 
 	glCompileShader(s);
 
@@ -262,11 +163,16 @@ static void load_shaders(void)
 void md5_render(md5_model_t md5)
 {
 	const struct md5_mesh *mesh = md5->mesh;
+	struct gang_mark mark;
 	vector_t org, rot;
 	unsigned int i;
 
+	/* GL has copied the arrays by the time we're done, next model
+	 * can have the same memory
+	 */
+	gang_mark(frame_arena(), &mark);
 	if ( !AllocVertexArrays(mesh) )
-		return;
+		goto out;
 
 	v_copy(org, md5->ent.origin);
 	v_copy(rot, md5->ent.angles);
@@ -276,6 +182,9 @@ void md5_render(md5_model_t md5)
 		Animate(md5);
 	}
 
+	/* Once for all the meshes */
+	md5_palette(md5->skeleton, mesh->num_joints, palette);
+
 	glTranslatef(org[X], org[Y], org[Z]);
 	glRotatef(rot[X] - 90, 1, 0, 0);
 	glRotatef(rot[Y], 0, 1, 0);
@@ -299,7 +208,7 @@ void md5_render(md5_model_t md5)
 
 	/* Draw each mesh of the model */
 	for (i = 0; i < mesh->num_meshes; ++i) {
-		PrepareMesh(&mesh->meshes[i], md5->skeleton);
+		PrepareMesh(&mesh->meshes[i]);
 		glActiveTextureARB(GL_TEXTURE0);
 		tex_bind(mesh->meshes[i].skin);
 		glActiveTextureARB(GL_TEXTURE1);
@@ -308,11 +217,11 @@ void md5_render(md5_model_t md5)
 
 		glVertexPointer(3, GL_FLOAT, 0, vertexArray);
 		glNormalPointer(GL_FLOAT, 0, normalArray);
-		glTexCoordPointer(2, GL_FLOAT, 0, texArray);
+		glTexCoordPointer(2, GL_FLOAT, 0, mesh->meshes[i].skin_st);
 //		glVertexAttribPointerARB(tangent_attrib, 3, GL_FLOAT, GL_FALSE, 0, tangentArray);
 
 		glDrawElements(GL_TRIANGLES, mesh->meshes[i].num_tris * 3,
-				GL_UNSIGNED_INT, vertexIndices);
+				GL_UNSIGNED_INT, mesh->meshes[i].skin_indices);
 	}
 
 	glUseProgram(0);
@@ -329,6 +238,8 @@ void md5_render(md5_model_t md5)
 	glEnable(GL_TEXTURE_2D);
 #endif
 	glCullFace(GL_BACK);
+out:
+	gang_rewind(frame_arena(), &mark);
 }
 
 md5_model_t md5_new(const char *name)
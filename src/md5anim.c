@@ -39,12 +39,21 @@
 #include <stdio.h>
 #include "md5.h"
 
-/* Joint info */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define MD5_ANIM_LANES	4
+#else
+#define MD5_ANIM_LANES	1
+#endif
+
+/* Joint info, names and parents go straight in to the hierarchy. The
+ * inverse is only worked out for joints which are somebody's parent.
+ */
 struct joint_info_t {
-	char name[64];
-	int parent;
 	int flags;
 	int startIndex;
+	int children;
+	quat4_t inv;
 };
 
 /* Base frame joint */
@@ -53,6 +62,25 @@ struct baseframe_joint_t {
 	quat4_t orient;
 };
 
+/* A joint in each of MD5_ANIM_LANES frames, a field at a time */
+struct joint_lanes {
+	float pos[3][MD5_ANIM_LANES];
+	float orient[4][MD5_ANIM_LANES];
+	float inv[4][MD5_ANIM_LANES];
+};
+
+/* Frames are read in to a batch and built MD5_ANIM_LANES at a time, a
+ * frame per SIMD lane. That only works if parents come before their
+ * children, otherwise they're built one by one.
+ */
+struct frame_batch {
+	float *data;
+	struct joint_lanes *lanes;
+	unsigned int frame[MD5_ANIM_LANES];
+	unsigned int num;
+	int ordered;
+};
+
 /**
  * Check if an animation can be used for a given model.  Model's
  * skeleton and animation's skeleton must match.
@@ -66,15 +94,13 @@ CheckAnimValidity(const struct md5_mesh *mdl, const struct md5_anim *anim)
 	if (mdl->num_joints != anim->num_joints)
 		return 0;
 
-	/* We just check with frame[0] */
 	for (i = 0; i < mdl->num_joints; ++i) {
 		/* Joints must have the same parent index */
-		if (mdl->baseSkel[i].parent != anim->skelFrames[0][i].parent)
+		if (mdl->baseSkel[i].parent != anim->hier[i].parent)
 			return 0;
 
 		/* Joints must have the same name */
-		if (strcmp(mdl->baseSkel[i].name, anim->skelFrames[0][i].name)
-		    != 0)
+		if (strcmp(mdl->baseSkel[i].name, anim->hier[i].name) != 0)
 			return 0;
 	}
 
@@ -85,10 +111,11 @@ CheckAnimValidity(const struct md5_mesh *mdl, const struct md5_anim *anim)
  * Build skeleton for a given frame data.
  */
 static void
-BuildFrameSkeleton(const struct joint_info_t *jointInfos,
+BuildFrameSkeleton(const struct md5_hier_t *hier,
+		   struct joint_info_t *jointInfos,
 		   const struct baseframe_joint_t *baseFrame,
 		   const float *animFrameData,
-		   struct md5_joint_t *skelFrame, int num_joints)
+		   vec3_t *pos, quat4_t *orient, int num_joints)
 {
 	int i;
 
@@ -143,190 +170,712 @@ BuildFrameSkeleton(const struct joint_info_t *jointInfos,
 		/* NOTE: we assume that this joint's parent has
 		   already been calculated, i.e. joint's ID should
 		   never be smaller than its parent ID. */
-		struct md5_joint_t *thisJoint = &skelFrame[i];
-
-		int parent = jointInfos[i].parent;
-		thisJoint->parent = parent;
-		strcpy(thisJoint->name, jointInfos[i].name);
+		int parent = hier[i].parent;
 
 		/* Has parent? */
-		if (thisJoint->parent < 0) {
-			memcpy(thisJoint->pos, animatedPos, sizeof(vec3_t));
-			memcpy(thisJoint->orient, animatedOrient,
-			       sizeof(quat4_t));
+		if (parent < 0) {
+			memcpy(pos[i], animatedPos, sizeof(vec3_t));
+			memcpy(orient[i], animatedOrient, sizeof(quat4_t));
 		} else {
-			struct md5_joint_t *parentJoint = &skelFrame[parent];
-			vec3_t rpos;	/* Rotated position */
+			quat4_t tmp, rpos;	/* Rotated position */
 
-			/* Add positions */
-			Quat_rotatePoint(parentJoint->orient, animatedPos,
-					 rpos);
-			thisJoint->pos[0] = rpos[0] + parentJoint->pos[0];
-			thisJoint->pos[1] = rpos[1] + parentJoint->pos[1];
-			thisJoint->pos[2] = rpos[2] + parentJoint->pos[2];
+			/* Add positions. This is Quat_rotatePoint() using
+			 * the parent's inverse from when it was built.
+			 */
+			if (parent < i) {
+				Quat_multVec(orient[parent], animatedPos, tmp);
+				Quat_multQuat(tmp, jointInfos[parent].inv,
+					      rpos);
+			} else {
+				Quat_rotatePoint(orient[parent], animatedPos,
+						 rpos);
+			}
+			pos[i][0] = rpos[0] + pos[parent][0];
+			pos[i][1] = rpos[1] + pos[parent][1];
+			pos[i][2] = rpos[2] + pos[parent][2];
 
 			/* Concatenate rotations */
-			Quat_multQuat(parentJoint->orient, animatedOrient,
-				      thisJoint->orient);
-			Quat_normalize(thisJoint->orient);
+			Quat_multQuat(orient[parent], animatedOrient,
+				      orient[i]);
+			Quat_normalize(orient[i]);
+		}
+
+		if (jointInfos[i].children) {
+			float *inv = jointInfos[i].inv;
+
+			inv[X] = -orient[i][X];
+			inv[Y] = -orient[i][Y];
+			inv[Z] = -orient[i][Z];
+			inv[W] = orient[i][W];
+			Quat_normalize(inv);
 		}
 	}
 }
 
+#if MD5_ANIM_LANES > 1
+/* Quaternion operations as in quat.c, a frame per lane. The arithmetic
+ * is the same and in the same order, so each lane comes out just as
+ * BuildFrameSkeleton() would have it. The helpers have to be inlined,
+ * -Os doesn't bother and then the vectors all go through the stack.
+ */
+__attribute__((always_inline))
+static inline __m128 lanes_neg(__m128 a)
+{
+	return _mm_xor_ps(a, _mm_set1_ps(-0.0f));
+}
+
+__attribute__((always_inline))
+static inline void lanes_computeW(__m128 q[4])
+{
+	__m128 t;
+
+	t = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f),
+			_mm_mul_ps(q[X], q[X])), _mm_mul_ps(q[Y], q[Y])),
+			_mm_mul_ps(q[Z], q[Z]));
+	q[W] = _mm_andnot_ps(_mm_cmplt_ps(t, _mm_setzero_ps()),
+			lanes_neg(_mm_sqrt_ps(t)));
+}
+
+__attribute__((always_inline))
+static inline void lanes_normalize(__m128 q[4])
+{
+	__m128 mag, ok, s;
+
+	mag = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(q[X], q[X]), _mm_mul_ps(q[Y], q[Y])),
+			_mm_mul_ps(q[Z], q[Z])), _mm_mul_ps(q[W], q[W])));
+
+	/* Lanes with a bogus length are multiplied by one instead */
+	ok = _mm_cmpgt_ps(mag, _mm_setzero_ps());
+	s = _mm_or_ps(_mm_and_ps(ok, _mm_div_ps(_mm_set1_ps(1.0f), mag)),
+			_mm_andnot_ps(ok, _mm_set1_ps(1.0f)));
+
+	q[X] = _mm_mul_ps(q[X], s);
+	q[Y] = _mm_mul_ps(q[Y], s);
+	q[Z] = _mm_mul_ps(q[Z], s);
+	q[W] = _mm_mul_ps(q[W], s);
+}
+
+/* The W of the product isn't wanted when rotating a point */
+__attribute__((always_inline))
+static inline void lanes_multQuat(const __m128 qa[4], const __m128 qb[4],
+				  __m128 out[4], int want_w)
+{
+	if ( want_w ) {
+		out[W] = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(
+				_mm_mul_ps(qa[W], qb[W]),
+				_mm_mul_ps(qa[X], qb[X])),
+				_mm_mul_ps(qa[Y], qb[Y])),
+				_mm_mul_ps(qa[Z], qb[Z]));
+	}
+	out[X] = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(qa[X], qb[W]), _mm_mul_ps(qa[W], qb[X])),
+			_mm_mul_ps(qa[Y], qb[Z])), _mm_mul_ps(qa[Z], qb[Y]));
+	out[Y] = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(qa[Y], qb[W]), _mm_mul_ps(qa[W], qb[Y])),
+			_mm_mul_ps(qa[Z], qb[X])), _mm_mul_ps(qa[X], qb[Z]));
+	out[Z] = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(qa[Z], qb[W]), _mm_mul_ps(qa[W], qb[Z])),
+			_mm_mul_ps(qa[X], qb[Y])), _mm_mul_ps(qa[Y], qb[X]));
+}
+
+__attribute__((always_inline))
+static inline void lanes_multVec(const __m128 q[4], const __m128 v[3],
+				 __m128 out[4])
+{
+	out[W] = _mm_sub_ps(_mm_sub_ps(lanes_neg(_mm_mul_ps(q[X], v[X])),
+			_mm_mul_ps(q[Y], v[Y])), _mm_mul_ps(q[Z], v[Z]));
+	out[X] = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(q[W], v[X]),
+			_mm_mul_ps(q[Y], v[Z])), _mm_mul_ps(q[Z], v[Y]));
+	out[Y] = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(q[W], v[Y]),
+			_mm_mul_ps(q[Z], v[X])), _mm_mul_ps(q[X], v[Z]));
+	out[Z] = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(q[W], v[Z]),
+			_mm_mul_ps(q[X], v[Y])), _mm_mul_ps(q[Y], v[X]));
+}
+
+/* One component from each frame */
+__attribute__((always_inline))
+static inline __m128 lanes_component(const float * const data[4],
+				     int idx)
+{
+	return _mm_setr_ps(data[0][idx], data[1][idx],
+			   data[2][idx], data[3][idx]);
+}
+
 /**
- * Load an MD5 animation from file.
+ * Build skeletons for MD5_ANIM_LANES frames at once. Parents have to come
+ * before their children. Lanes from num on are built but not stored.
  */
-int ReadMD5Anim(const char *filename, struct md5_anim *anim)
+static void
+BuildFrameLanes(const struct md5_hier_t *hier,
+		const struct joint_info_t *jointInfos,
+		const struct baseframe_joint_t *baseFrame,
+		const float * const animFrameData[MD5_ANIM_LANES],
+		struct joint_lanes *lanes,
+		vec3_t * const pos[MD5_ANIM_LANES],
+		quat4_t * const orient[MD5_ANIM_LANES],
+		int num_joints, unsigned int num)
+{
+	unsigned int l;
+	int i;
+
+	for (i = 0; i < num_joints; ++i) {
+		const struct baseframe_joint_t *baseJoint = &baseFrame[i];
+		const struct joint_info_t *ji = &jointInfos[i];
+		struct joint_lanes *jl = &lanes[i];
+		int parent = hier[i].parent;
+		int j = ji->startIndex;
+		__m128 p[3], q[4], o[4], c0, c1, c2, c3;
+		float out[MD5_ANIM_LANES][8];
+
+		p[0] = (ji->flags & 1) ? lanes_component(animFrameData, j++)
+				: _mm_set1_ps(baseJoint->pos[0]);
+		p[1] = (ji->flags & 2) ? lanes_component(animFrameData, j++)
+				: _mm_set1_ps(baseJoint->pos[1]);
+		p[2] = (ji->flags & 4) ? lanes_component(animFrameData, j++)
+				: _mm_set1_ps(baseJoint->pos[2]);
+		q[X] = (ji->flags & 8) ? lanes_component(animFrameData, j++)
+				: _mm_set1_ps(baseJoint->orient[X]);
+		q[Y] = (ji->flags & 16) ? lanes_component(animFrameData, j++)
+				: _mm_set1_ps(baseJoint->orient[Y]);
+		q[Z] = (ji->flags & 32) ? lanes_component(animFrameData, j++)
+				: _mm_set1_ps(baseJoint->orient[Z]);
+		lanes_computeW(q);
+
+		if (parent < 0) {
+			o[X] = q[X];
+			o[Y] = q[Y];
+			o[Z] = q[Z];
+			o[W] = q[W];
+		} else {
+			const struct joint_lanes *pl = &lanes[parent];
+			__m128 po[4], inv[4], tmp[4], rpos[4];
+
+			po[X] = _mm_loadu_ps(pl->orient[X]);
+			po[Y] = _mm_loadu_ps(pl->orient[Y]);
+			po[Z] = _mm_loadu_ps(pl->orient[Z]);
+			po[W] = _mm_loadu_ps(pl->orient[W]);
+			inv[X] = _mm_loadu_ps(pl->inv[X]);
+			inv[Y] = _mm_loadu_ps(pl->inv[Y]);
+			inv[Z] = _mm_loadu_ps(pl->inv[Z]);
+			inv[W] = _mm_loadu_ps(pl->inv[W]);
+
+			lanes_multVec(po, p, tmp);
+			lanes_multQuat(tmp, inv, rpos, 0);
+			p[0] = _mm_add_ps(rpos[X], _mm_loadu_ps(pl->pos[0]));
+			p[1] = _mm_add_ps(rpos[Y], _mm_loadu_ps(pl->pos[1]));
+			p[2] = _mm_add_ps(rpos[Z], _mm_loadu_ps(pl->pos[2]));
+
+			lanes_multQuat(po, q, o, 1);
+			lanes_normalize(o);
+		}
+
+		_mm_storeu_ps(jl->pos[0], p[0]);
+		_mm_storeu_ps(jl->pos[1], p[1]);
+		_mm_storeu_ps(jl->pos[2], p[2]);
+		_mm_storeu_ps(jl->orient[X], o[X]);
+		_mm_storeu_ps(jl->orient[Y], o[Y]);
+		_mm_storeu_ps(jl->orient[Z], o[Z]);
+		_mm_storeu_ps(jl->orient[W], o[W]);
+
+		if (ji->children) {
+			__m128 inv[4];
+
+			inv[X] = lanes_neg(o[X]);
+			inv[Y] = lanes_neg(o[Y]);
+			inv[Z] = lanes_neg(o[Z]);
+			inv[W] = o[W];
+			lanes_normalize(inv);
+			_mm_storeu_ps(jl->inv[X], inv[X]);
+			_mm_storeu_ps(jl->inv[Y], inv[Y]);
+			_mm_storeu_ps(jl->inv[Z], inv[Z]);
+			_mm_storeu_ps(jl->inv[W], inv[W]);
+		}
+
+		/* Lanes back out to their frames, in order in case a frame
+		 * was given twice
+		 */
+		c0 = p[0];
+		c1 = p[1];
+		c2 = p[2];
+		c3 = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		_mm_storeu_ps(out[0], c0);
+		_mm_storeu_ps(out[1], c1);
+		_mm_storeu_ps(out[2], c2);
+		_mm_storeu_ps(out[3], c3);
+
+		c0 = o[X];
+		c1 = o[Y];
+		c2 = o[Z];
+		c3 = o[W];
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		_mm_storeu_ps(out[0] + 4, c0);
+		_mm_storeu_ps(out[1] + 4, c1);
+		_mm_storeu_ps(out[2] + 4, c2);
+		_mm_storeu_ps(out[3] + 4, c3);
+
+		for (l = 0; l < num; l++) {
+			memcpy(pos[l][i], out[l], sizeof(vec3_t));
+			memcpy(orient[l][i], out[l] + 4, sizeof(quat4_t));
+		}
+	}
+}
+#endif
+
+/* Build the frames in the batch, then keep the last one's data in the
+ * first slot for any junk in the next.
+ */
+static void build_frames(struct md5_anim *anim,
+			 struct joint_info_t *jointInfos,
+			 const struct baseframe_joint_t *baseFrame,
+			 struct frame_batch *b,
+			 unsigned int numAnimatedComponents)
+{
+	unsigned int i;
+
+	if ( 0 == b->num )
+		return;
+
+#if MD5_ANIM_LANES > 1
+	if ( b->ordered ) {
+		const float *data[MD5_ANIM_LANES];
+		vec3_t *pos[MD5_ANIM_LANES];
+		quat4_t *orient[MD5_ANIM_LANES];
+
+		/* Spare lanes just do the first frame again */
+		for(i = 0; i < MD5_ANIM_LANES; i++) {
+			unsigned int l = (i < b->num) ? i : 0;
+
+			data[i] = b->data + l * numAnimatedComponents;
+			pos[i] = anim->pos + b->frame[l] * anim->num_joints;
+			orient[i] = anim->orient +
+					b->frame[l] * anim->num_joints;
+		}
+
+		BuildFrameLanes(anim->hier, jointInfos, baseFrame, data,
+				b->lanes, pos, orient, anim->num_joints,
+				b->num);
+	}else
+#endif
+	{
+		for(i = 0; i < b->num; i++) {
+			BuildFrameSkeleton(anim->hier, jointInfos, baseFrame,
+				b->data + i * numAnimatedComponents,
+				anim->pos + b->frame[i] * anim->num_joints,
+				anim->orient + b->frame[i] * anim->num_joints,
+				anim->num_joints);
+		}
+	}
+
+	if ( b->num > 1 && numAnimatedComponents ) {
+		memcpy(b->data, b->data +
+			(b->num - 1) * numAnimatedComponents,
+			sizeof(*b->data) * numAnimatedComponents);
+	}
+	b->num = 0;
+}
+
+/* Hierarchy lines are: name parent flags startIndex */
+static int read_hierarchy(textreader_t txt, struct md5_hier_t *hier,
+			  struct joint_info_t *jointInfos,
+			  unsigned int num_joints,
+			  unsigned int numAnimatedComponents)
+{
+	struct md5_hier_t *h;
+	struct joint_info_t *ji;
+	struct txt_slice line, tok;
+	unsigned int i, n, bit;
+	size_t len;
+
+	for (i = 0; i < num_joints; ++i) {
+		h = &hier[i];
+		ji = &jointInfos[i];
+		if ( !textreader_line(txt, &line) )
+			return 0;
+
+		/* Names keep their quotes, as they always have */
+		txt_word(&line, &tok);
+		len = tok.len;
+		if ( len >= sizeof(h->name) )
+			len = sizeof(h->name) - 1;
+		memcpy(h->name, tok.ptr, len);
+		h->name[len] = '\0';
+
+		if ( !txt_next_int(&line, &h->parent) ||
+				!txt_next_int(&line, &ji->flags) ||
+				!txt_next_int(&line, &ji->startIndex) )
+			return 0;
+
+		/* Don't let a joint index outside of the skeleton or
+		 * the frame data
+		 */
+		for(n = bit = 0; bit < 6; bit++)
+			n += !!(ji->flags & (1 << bit));
+		if ( h->parent < -1 || h->parent >= (int)num_joints ||
+				ji->startIndex < 0 ||
+				ji->startIndex + n > numAnimatedComponents )
+			return 0;
+		if ( h->parent >= 0 )
+			jointInfos[h->parent].children++;
+	}
+
+	return 1;
+}
+
+/* Whether every joint comes after its parent */
+static int parents_first(const struct md5_hier_t *hier,
+			 unsigned int num_joints)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_joints; ++i) {
+		if ( hier[i].parent >= (int)i )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Bounds lines are: ( min ) ( max ) */
+static int read_bounds(textreader_t txt, struct md5_bbox_t *bboxes,
+		       unsigned int num_frames)
+{
+	struct txt_slice line;
+	unsigned int i;
+
+	for (i = 0; i < num_frames; ++i) {
+		if ( !textreader_line(txt, &line) )
+			return 0;
+		if ( txt_next_tuple(&line, bboxes[i].min, 3) )
+			txt_next_tuple(&line, bboxes[i].max, 3);
+	}
+
+	return 1;
+}
+
+/* Base frame lines are: ( pos ) ( orient ) */
+static int read_baseframe(textreader_t txt,
+			  struct baseframe_joint_t *baseFrame,
+			  unsigned int num_joints)
+{
+	struct txt_slice line;
+	unsigned int i;
+
+	for (i = 0; i < num_joints; ++i) {
+		if ( !textreader_line(txt, &line) )
+			return 0;
+		if ( txt_next_tuple(&line, baseFrame[i].pos, 3) &&
+				txt_next_tuple(&line, baseFrame[i].orient, 3) )
+			Quat_computeW(baseFrame[i].orient);
+	}
+
+	return 1;
+}
+
+/* Frame data is just numbers, up to a } at the start of a line. Junk
+ * still uses up a component, leaving it as it was.
+ */
+static void read_frame(textreader_t txt, float *animFrameData,
+		       unsigned int numAnimatedComponents)
+{
+	struct txt_slice line, tok;
+	unsigned int i;
+
+	for(i = 0; textreader_line(txt, &line); ) {
+		if ( line.len && line.ptr[0] == '}' )
+			break;
+		while ( i < numAnimatedComponents ) {
+			i += txt_next_floats(&line, &animFrameData[i],
+					     numAnimatedComponents - i);
+			if ( i >= numAnimatedComponents ||
+					!txt_token(&line, &tok) )
+				break;
+			i++;
+		}
+	}
+}
+
+/**
+ * Parse an MD5 animation from text.
+ *
+ * Every line starts with a keyword, dispatch on that and parse the
+ * rest of it in place.
+ */
+static int anim_parse(const struct gfile *f, const char *filename,
+		      struct md5_anim *anim)
 {
-	struct gfile f;
 	textreader_t txt;
-	char *line;
+	struct txt_slice line, kw;
 	struct joint_info_t *jointInfos = NULL;
 	struct baseframe_joint_t *baseFrame = NULL;
-	float *animFrameData = NULL;
-	unsigned int version, numAnimatedComponents;
-	unsigned int i, frame_index;
-	int ret = 0;
+	struct frame_batch batch;
+	unsigned int numAnimatedComponents = 0;
+	float *frameData;
+	int val, ret = 0;
 
-	if ( !game_open(&f, filename) ) {
-		con_printf("md5: error: couldn't open \"%s\"!\n", filename);
+	txt = textreader_new(f->f_ptr, f->f_len);
+	if ( NULL == txt )
 		return 0;
-	}
 
-	txt = textreader_new(f.f_ptr, f.f_len);
-	if ( NULL == txt )
-		goto out_close;
+	memset(&batch, 0, sizeof(batch));
+	while ( textreader_line(txt, &line) ) {
+		if ( txt_token(&line, &kw) != TXT_TOK_WORD )
+			continue;
 
-	while( (line = textreader_gets(txt)) ) {
-		if (sscanf(line, " MD5Version %d", &version) == 1) {
-			if (version != 10) {
+		if ( txt_slice_eq(&kw, "MD5Version") ) {
+			if ( !txt_next_int(&line, &val) )
+				continue;
+			if (val != 10) {
 				/* Bad version */
 				con_printf("Error: bad animation version\n");
 				goto out;
 			}
-		} else if (sscanf(line, " numFrames %d", &anim->num_frames) ==
-			   1) {
-			/* Allocate memory for skeleton frames and bounding boxes */
+		} else if ( txt_slice_eq(&kw, "numFrames") ) {
+			/* Frames are sized when numJoints comes along */
+			if ( !txt_next_int(&line, &val) || val < 0 ||
+					anim->bboxes || anim->hier )
+				goto bad;
+			anim->num_frames = val;
+
+			/* Allocate memory for bounding boxes */
 			if (anim->num_frames > 0) {
-				anim->skelFrames = (struct md5_joint_t **)
-				    malloc(sizeof(struct md5_joint_t *) *
-					   anim->num_frames);
-				anim->bboxes = (struct md5_bbox_t *)
-				    malloc(sizeof(struct md5_bbox_t) *
-					   anim->num_frames);
+				anim->bboxes = mem_alloc(MEM_MD5ANIM,
+					anim->num_frames *
+					sizeof(*anim->bboxes));
+				if ( NULL == anim->bboxes )
+					goto bad;
 			}
-		} else if (sscanf(line, " numJoints %d", &anim->num_joints) ==
-			   1) {
+		} else if ( txt_slice_eq(&kw, "numJoints") ) {
+			if ( !txt_next_int(&line, &val) || val < 0 ||
+					jointInfos )
+				goto bad;
+			anim->num_joints = val;
+
 			if (anim->num_joints > 0) {
-				for (i = 0; i < anim->num_frames; ++i) {
-					/* Allocate memory for joints of each frame */
-					anim->skelFrames[i] =
-					    (struct md5_joint_t *)
-					    malloc(sizeof(struct md5_joint_t) *
-						   anim->num_joints);
+				/* Allocate memory for the joints, and for
+				 * their positions and orientations in each
+				 * frame
+				 */
+				anim->hier = mem_calloc(MEM_MD5ANIM,
+					anim->num_joints, sizeof(*anim->hier));
+				if ( NULL == anim->hier )
+					goto bad;
+				if ( anim->num_frames > 0 ) {
+					anim->pos = mem_calloc(MEM_MD5ANIM,
+						anim->num_frames,
+						anim->num_joints *
+						sizeof(*anim->pos));
+					anim->orient = mem_calloc(MEM_MD5ANIM,
+						anim->num_frames,
+						anim->num_joints *
+						sizeof(*anim->orient));
+					if ( NULL == anim->pos ||
+							NULL == anim->orient )
+						goto bad;
 				}
 
 				/* Allocate temporary memory for building skeleton frames */
-				jointInfos = (struct joint_info_t *)
-				    malloc(sizeof(struct joint_info_t) *
-					   anim->num_joints);
-
-				baseFrame = (struct baseframe_joint_t *)
-				    malloc(sizeof(struct baseframe_joint_t) *
-					   anim->num_joints);
+				jointInfos = mem_calloc(MEM_MD5ANIM,
+					anim->num_joints, sizeof(*jointInfos));
+				baseFrame = mem_calloc(MEM_MD5ANIM,
+					anim->num_joints, sizeof(*baseFrame));
+				if ( NULL == jointInfos || NULL == baseFrame )
+					goto bad;
+#if MD5_ANIM_LANES > 1
+				batch.lanes = mem_alloc(MEM_MD5ANIM,
+					anim->num_joints *
+					sizeof(*batch.lanes));
+				if ( NULL == batch.lanes )
+					goto bad;
+#endif
 			}
-		} else if (sscanf(line, " frameRate %d", &anim->frameRate) == 1) {
-			/*
-			   printf ("md5anim: animation's frame rate is %d\n", anim->frameRate);
-			 */
-		} else
-		    if (sscanf
-			(line, " numAnimatedComponents %d",
-			 &numAnimatedComponents) == 1) {
+		} else if ( txt_slice_eq(&kw, "frameRate") ) {
+			if ( txt_next_int(&line, &val) )
+				anim->frameRate = val;
+		} else if ( txt_slice_eq(&kw, "numAnimatedComponents") ) {
+			if ( !txt_next_int(&line, &val) || val < 0 ||
+					batch.data )
+				goto bad;
+			numAnimatedComponents = val;
+
 			if (numAnimatedComponents > 0) {
-				/* Allocate memory for animation frame data */
-				animFrameData =
-				    (float *)malloc(sizeof(float) *
-						    numAnimatedComponents);
+				/* Allocate memory for a batch of frame data */
+				batch.data = mem_alloc(MEM_MD5ANIM,
+					sizeof(*batch.data) * MD5_ANIM_LANES *
+					numAnimatedComponents);
+				if ( NULL == batch.data )
+					goto bad;
 			}
-		} else if (strncmp(line, "hierarchy {", 11) == 0) {
-			for (i = 0; i < anim->num_joints; ++i) {
-				/* Read whole line */
-				line = textreader_gets(txt);
-
-				/* Read joint info */
-				sscanf(line, " %s %d %d %d", jointInfos[i].name,
-				       &jointInfos[i].parent,
-				       &jointInfos[i].flags,
-				       &jointInfos[i].startIndex);
-			}
-		} else if (strncmp(line, "bounds {", 8) == 0) {
-			for (i = 0; i < anim->num_frames; ++i) {
-				/* Read whole line */
-				line = textreader_gets(txt);
-
-				/* Read bounding box */
-				sscanf(line, " ( %f %f %f ) ( %f %f %f )",
-				       &anim->bboxes[i].min[0],
-				       &anim->bboxes[i].min[1],
-				       &anim->bboxes[i].min[2],
-				       &anim->bboxes[i].max[0],
-				       &anim->bboxes[i].max[1],
-				       &anim->bboxes[i].max[2]);
-			}
-		} else if (strncmp(line, "baseframe {", 10) == 0) {
-			for (i = 0; i < anim->num_joints; ++i) {
-				/* Read whole line */
-				line = textreader_gets(txt);
-
-				/* Read base frame joint */
-				if (sscanf(line, " ( %f %f %f ) ( %f %f %f )",
-					   &baseFrame[i].pos[0],
-					   &baseFrame[i].pos[1],
-					   &baseFrame[i].pos[2],
-					   &baseFrame[i].orient[0],
-					   &baseFrame[i].orient[1],
-					   &baseFrame[i].orient[2]) == 6) {
-					/* Compute the w component */
-					Quat_computeW(baseFrame[i].orient);
-				}
-			}
-		} else if (sscanf(line, "frame %d {", &frame_index) == 1) {
-			int x, y;
-			for(i = 0;;) {
-				char *tok[numAnimatedComponents - i];
-				line = textreader_gets(txt);
-				if ( NULL == line || line[0] == '}' )
-					break;
-				x = easy_explode(line, 0, tok,
-						sizeof(tok)/sizeof(*tok));
-				for(y = 0; y < x; y++, i++) {
-					sscanf(tok[y], "%f", &animFrameData[i]);
-				}
+		} else if ( txt_slice_eq(&kw, "hierarchy") ) {
+			build_frames(anim, jointInfos, baseFrame, &batch,
+				     numAnimatedComponents);
+			if ( !read_hierarchy(txt, anim->hier, jointInfos,
+						anim->num_joints,
+						numAnimatedComponents) )
+				goto bad;
+			batch.ordered = parents_first(anim->hier,
+						      anim->num_joints);
+		} else if ( txt_slice_eq(&kw, "bounds") ) {
+			if ( !read_bounds(txt, anim->bboxes, anim->num_frames) )
+				goto bad;
+		} else if ( txt_slice_eq(&kw, "baseframe") ) {
+			build_frames(anim, jointInfos, baseFrame, &batch,
+				     numAnimatedComponents);
+			if ( !read_baseframe(txt, baseFrame, anim->num_joints) )
+				goto bad;
+		} else if ( txt_slice_eq(&kw, "frame") ) {
+			if ( !txt_next_int(&line, &val) || val < 0 ||
+					(unsigned int)val >= anim->num_frames ||
+					NULL == anim->pos )
+				goto bad;
+
+			/* Start from the frame before, as junk leaves it */
+			frameData = batch.data +
+					batch.num * numAnimatedComponents;
+			if ( batch.num && numAnimatedComponents ) {
+				memcpy(frameData,
+					frameData - numAnimatedComponents,
+					sizeof(*frameData) *
+					numAnimatedComponents);
 			}
+			read_frame(txt, frameData, numAnimatedComponents);
 
-			/* Build frame skeleton from the collected data */
-			BuildFrameSkeleton(jointInfos, baseFrame, animFrameData,
-					   anim->skelFrames[frame_index],
-					   anim->num_joints);
+			/* Build frame skeletons once there's a batch */
+			batch.frame[batch.num++] = val;
+			if ( batch.num == MD5_ANIM_LANES ) {
+				build_frames(anim, jointInfos, baseFrame,
+					     &batch, numAnimatedComponents);
+			}
 		}
 	}
 
+	build_frames(anim, jointInfos, baseFrame, &batch,
+		     numAnimatedComponents);
+	ret = 1;
+	goto out;
+
+bad:
+	con_printf("md5: %s: bad or truncated animation\n", filename);
+out:
 	/* Free temporary data allocated */
-	if (animFrameData)
-		free(animFrameData);
+	mem_free(MEM_MD5ANIM, batch.lanes);
+	mem_free(MEM_MD5ANIM, batch.data);
+	mem_free(MEM_MD5ANIM, baseFrame);
+	mem_free(MEM_MD5ANIM, jointInfos);
+	textreader_free(txt);
+	return ret;
+}
+
+/**
+ * Use a cooked MD5 animation in place.
+ *
+ * The frames were built by md5cook, so once the file has been checked
+ * there's nothing to do.
+ */
+static int qanim_cooked(const char *filename, struct md5_anim *anim)
+{
+	const struct gfile *f = &anim->cooked;
+	const struct md5c_qanim *q = f->f_ptr;
+	const void *hier, *qjoints, *qkeys, *bboxes;
+
+	if ( q->q_num_joints > f->f_len / sizeof(*anim->hier) ||
+			!md5c_array(f, q->q_hier, q->q_num_joints,
+				sizeof(*anim->hier), &hier) ||
+			!md5c_array(f, q->q_joints, q->q_num_joints,
+				sizeof(*anim->qjoints), &qjoints) ||
+			!md5c_array(f, q->q_keys, q->q_num_keys,
+				sizeof(*anim->qkeys), &qkeys) ||
+			!md5c_array(f, q->q_bboxes, q->q_num_frames,
+				sizeof(*anim->bboxes), &bboxes) )
+		goto bad;
+
+	anim->hier = (struct md5_hier_t *)hier;
+	anim->qjoints = (struct md5_qjoint_t *)qjoints;
+	anim->qkeys = (struct md5_qkey_t *)qkeys;
+	anim->bboxes = (struct md5_bbox_t *)bboxes;
+	anim->num_qkeys = q->q_num_keys;
+	anim->num_frames = q->q_num_frames;
+	anim->num_joints = q->q_num_joints;
+	anim->frameRate = q->q_frame_rate;
+
+	if ( !md5c_hier_ok(anim->hier, anim->num_joints) ||
+			!md5_anim_qvalid(anim) )
+		goto bad;
 
-	if (baseFrame)
-		free(baseFrame);
+	return 1;
+bad:
+	con_printf("md5: %s: bad or truncated cooked animation\n",
+			filename);
+	return 0;
+}
 
-	if (jointInfos)
-		free(jointInfos);
+static int anim_cooked(const char *filename, struct md5_anim *anim)
+{
+	const struct gfile *f = &anim->cooked;
+	const struct md5c_anim *a = f->f_ptr;
+	const void *hier, *pos, *orient, *bboxes;
 
-	ret = 1;
+	if ( f->f_len >= sizeof(struct md5c_qanim) &&
+			md5c_hdr_ok(f, MD5C_QANIM) )
+		return qanim_cooked(filename, anim);
 
-out:
-	textreader_free(txt);
-out_close:
+	if ( f->f_len < sizeof(*a) || !md5c_hdr_ok(f, MD5C_ANIM) ) {
+		con_printf("md5: %s: cooked by an incompatible md5cook\n",
+				filename);
+		return 0;
+	}
+
+	if ( a->a_num_joints > f->f_len / sizeof(*anim->hier) ||
+			!md5c_array(f, a->a_hier, a->a_num_joints,
+				sizeof(*anim->hier), &hier) ||
+			!md5c_array(f, a->a_pos, a->a_num_frames,
+				sizeof(*anim->pos) * a->a_num_joints, &pos) ||
+			!md5c_array(f, a->a_orient, a->a_num_frames,
+				sizeof(*anim->orient) * a->a_num_joints,
+				&orient) ||
+			!md5c_array(f, a->a_bboxes, a->a_num_frames,
+				sizeof(*anim->bboxes), &bboxes) )
+		goto bad;
+
+	anim->hier = (struct md5_hier_t *)hier;
+	anim->pos = (vec3_t *)pos;
+	anim->orient = (quat4_t *)orient;
+	anim->bboxes = (struct md5_bbox_t *)bboxes;
+	anim->num_frames = a->a_num_frames;
+	anim->num_joints = a->a_num_joints;
+	anim->frameRate = a->a_frame_rate;
+
+	if ( !md5c_hier_ok(anim->hier, anim->num_joints) )
+		goto bad;
+
+	return 1;
+bad:
+	con_printf("md5: %s: bad or truncated cooked animation\n",
+			filename);
+	return 0;
+}
+
+/**
+ * Load an MD5 animation, cooked or text.
+ */
+int ReadMD5Anim(const char *filename, struct md5_anim *anim)
+{
+	struct gfile f;
+	int ret;
+
+	if ( !game_open(&f, filename) ) {
+		con_printf("md5: error: couldn't open \"%s\"!\n", filename);
+		return 0;
+	}
+
+	/* Freeing the animation closes it */
+	if ( md5c_cooked(&f) ) {
+		anim->cooked = f;
+		return anim_cooked(filename, anim);
+	}
+
+	ret = anim_parse(&f, filename, anim);
 	game_close(&f);
 	return ret;
 }
@@ -334,21 +883,25 @@ out_close:
 /**
  * Free resources allocated for the animation.
  */
-void FreeAnim(struct md5_anim *anim)
+static void anim_array_free(struct md5_anim *anim, void *ptr)
 {
-	unsigned int i;
-
-	if (anim->skelFrames) {
-		for (i = 0; i < anim->num_frames; ++i) {
-			free(anim->skelFrames[i]);
-		}
-		free(anim->skelFrames);
-	}
+	if ( !md5c_owns(&anim->cooked, ptr) )
+		mem_free(MEM_MD5ANIM, ptr);
+}
 
-	free(anim->bboxes);
-	free(anim->name);
+void FreeAnim(struct md5_anim *anim)
+{
+	anim_array_free(anim, anim->hier);
+	anim_array_free(anim, anim->pos);
+	anim_array_free(anim, anim->orient);
+	anim_array_free(anim, anim->bboxes);
+	anim_array_free(anim, anim->qjoints);
+	anim_array_free(anim, anim->qkeys);
+	if ( anim->cooked.f_ptr )
+		game_close(&anim->cooked);
+	mem_free(MEM_MD5ANIM, anim->name);
 	list_del(&anim->list);
-	free(anim);
+	mem_free(MEM_MD5ANIM, anim);
 }
 
 static LIST_HEAD(md5_anims);
@@ -357,15 +910,16 @@ static struct md5_anim *do_mesh_load(const char *filename)
 {
 	struct md5_anim *anim;
 
-	anim = calloc(1, sizeof(*anim));
+	anim = mem_calloc(MEM_MD5ANIM, 1, sizeof(*anim));
 	if ( NULL == anim )
 		return NULL;
+	INIT_LIST_HEAD(&anim->list);
 
 	/* Load MD5 model file */
 	if (!ReadMD5Anim(filename, anim))
 		goto err;
 
-	anim->name = strdup(filename);
+	anim->name = mem_strdup(MEM_MD5ANIM, filename);
 	if ( NULL == anim->name )
 		goto err;
 
@@ -376,8 +930,6 @@ static struct md5_anim *do_mesh_load(const char *filename)
 	return anim;
 err:
 	FreeAnim(anim);
-	free(anim->name);
-	free(anim);
 	return NULL;
 }
 
@@ -396,33 +948,41 @@ struct md5_anim *md5_anim_get_by_name(const char *filename)
 }
 
 /**
- * Smoothly interpolate two skeletons
+ * Smoothly interpolate the skeletons of two frames of an animation
  */
 void
-InterpolateSkeletons(const struct md5_joint_t *skelA,
-		     const struct md5_joint_t *skelB,
-		     int num_joints, float interp, struct md5_joint_t *out)
+InterpolateSkeletons(const struct md5_anim *anim,
+		     unsigned int frameA, unsigned int frameB,
+		     float interp, struct md5_joint_t *out)
 {
-	int i;
+	const vec3_t *posA, *posB;
+	const quat4_t *orientA, *orientB;
+	unsigned int i;
 
-	for (i = 0; i < num_joints; ++i) {
+	if ( anim->qjoints ) {
+		md5_anim_qinterp(anim, frameA, frameB, interp, out);
+		return;
+	}
+
+	posA = anim->pos + frameA * anim->num_joints;
+	posB = anim->pos + frameB * anim->num_joints;
+	orientA = anim->orient + frameA * anim->num_joints;
+	orientB = anim->orient + frameB * anim->num_joints;
+
+	for (i = 0; i < anim->num_joints; ++i) {
 		/* Copy parent index */
-		out[i].parent = skelA[i].parent;
+		out[i].parent = anim->hier[i].parent;
 
 		/* Linear interpolation for position */
 		out[i].pos[0] =
-		    skelA[i].pos[0] + interp * (skelB[i].pos[0] -
-						skelA[i].pos[0]);
+		    posA[i][0] + interp * (posB[i][0] - posA[i][0]);
 		out[i].pos[1] =
-		    skelA[i].pos[1] + interp * (skelB[i].pos[1] -
-						skelA[i].pos[1]);
+		    posA[i][1] + interp * (posB[i][1] - posA[i][1]);
 		out[i].pos[2] =
-		    skelA[i].pos[2] + interp * (skelB[i].pos[2] -
-						skelA[i].pos[2]);
+		    posA[i][2] + interp * (posB[i][2] - posA[i][2]);
 
 		/* Spherical linear interpolation for orientation */
-		Quat_slerp(skelA[i].orient, skelB[i].orient, interp,
-			   out[i].orient);
+		Quat_slerp(orientA[i], orientB[i], interp, out[i].orient);
 	}
 }
 
@@ -0,0 +1,1084 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* md5 loading speed, eg:
+*
+*   md5bench [-n rounds] [-c cooked_dir] [-q] file.md5anim file.md5mesh ...
+*
+* Each animation is loaded with ReadMD5Anim() and with a reference
+* loader, which is the sscanf() one that md5anim.c used to have, and
+* every skeleton frame and bounding box they come up with is compared
+* bit for bit before either is timed. Models are timed through
+* md5_mesh_read(), and then skinned in their base pose by the matrix
+* palette and, for reference, with quaternions the way md5_render.c
+* used to. The scalar skinning kernel is checked against the
+* quaternions, and each SIMD kernel the CPU can run against the scalar
+* one, then they're all timed in vertices a second. With -c, the md5cook'd
+* version of each file, under the same name in cooked_dir, is checked
+* against the text one and timed as well. With -q each animation is
+* also quantised, with the default tolerances, and
+* InterpolateSkeletons() is timed on it next to the floats. Files are
+* mapped once, up front, like a gfile out of an archive so that we're
+* timing parsing and not I/O, and the best of the rounds is what's
+* reported.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/textreader.h>
+#include <blackbloc/vector.h>
+#include <blackbloc/tex.h>
+#include <blackbloc/img/tga.h>
+#include <blackbloc/model/md5.h>
+
+#include <stdio.h>
+#include <math.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "md5.h"
+
+struct ref_joint_info {
+	char name[64];
+	int parent;
+	int flags;
+	int startIndex;
+};
+
+struct ref_baseframe_joint {
+	vec3_t pos;
+	quat4_t orient;
+};
+
+/* How animations used to be kept, a whole skeleton for every frame */
+struct ref_anim {
+	unsigned int num_frames;
+	unsigned int num_joints;
+	unsigned int frameRate;
+
+	struct md5_joint_t **skelFrames;
+	struct md5_bbox_t *bboxes;
+};
+
+static struct gfile mapped[2];
+static unsigned int num_mapped;
+static unsigned int num_rounds = 20;
+static const char *cooked_dir;
+static int quantise;
+
+void con_printf(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+}
+
+/* Everything is loaded from the files we mapped */
+int game_open(struct gfile *f, const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_mapped; i++) {
+		if ( !strcmp(name, mapped[i].f_name) ) {
+			*f = mapped[i];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void game_close(struct gfile *f)
+{
+}
+
+/* Only do_mesh_load() calls these, which we never do */
+void game_prefetch(const char * const *names, unsigned int num)
+{
+}
+
+texture_t tga_get_by_name(const char *name)
+{
+	return NULL;
+}
+
+void tex_put(texture_t tex)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void ref_build(const struct ref_joint_info *jointInfos,
+			const struct ref_baseframe_joint *baseFrame,
+			const float *animFrameData,
+			struct md5_joint_t *skelFrame, int num_joints)
+{
+	int i;
+
+	for (i = 0; i < num_joints; ++i) {
+		const struct ref_baseframe_joint *baseJoint = &baseFrame[i];
+		struct md5_joint_t *thisJoint = &skelFrame[i];
+		vec3_t animatedPos;
+		quat4_t animatedOrient;
+		int j = 0, k;
+
+		memcpy(animatedPos, baseJoint->pos, sizeof(vec3_t));
+		memcpy(animatedOrient, baseJoint->orient, sizeof(quat4_t));
+
+		for(k = 0; k < 6; k++) {
+			if ( !(jointInfos[i].flags & (1 << k)) )
+				continue;
+			if ( k < 3 )
+				animatedPos[k] =
+					animFrameData[jointInfos[i].startIndex + j];
+			else
+				animatedOrient[k - 3] =
+					animFrameData[jointInfos[i].startIndex + j];
+			++j;
+		}
+
+		Quat_computeW(animatedOrient);
+
+		thisJoint->parent = jointInfos[i].parent;
+		strcpy(thisJoint->name, jointInfos[i].name);
+
+		if (thisJoint->parent < 0) {
+			memcpy(thisJoint->pos, animatedPos, sizeof(vec3_t));
+			memcpy(thisJoint->orient, animatedOrient,
+			       sizeof(quat4_t));
+		} else {
+			struct md5_joint_t *parentJoint =
+				&skelFrame[thisJoint->parent];
+			vec3_t rpos;
+
+			Quat_rotatePoint(parentJoint->orient, animatedPos,
+					 rpos);
+			thisJoint->pos[0] = rpos[0] + parentJoint->pos[0];
+			thisJoint->pos[1] = rpos[1] + parentJoint->pos[1];
+			thisJoint->pos[2] = rpos[2] + parentJoint->pos[2];
+
+			Quat_multQuat(parentJoint->orient, animatedOrient,
+				      thisJoint->orient);
+			Quat_normalize(thisJoint->orient);
+		}
+	}
+}
+
+/* The old loader, a line at a time through sscanf() */
+static int ref_read(const char *filename, struct ref_anim *anim)
+{
+	struct gfile f;
+	textreader_t txt;
+	char *line, *tok, *sv;
+	struct ref_joint_info *jointInfos = NULL;
+	struct ref_baseframe_joint *baseFrame = NULL;
+	float *animFrameData = NULL;
+	unsigned int version, numAnimatedComponents = 0;
+	unsigned int i, frame_index;
+	int ret = 0;
+
+	if ( !game_open(&f, filename) )
+		return 0;
+
+	txt = textreader_new(f.f_ptr, f.f_len);
+	if ( NULL == txt )
+		goto out_close;
+
+	while( (line = textreader_gets(txt)) ) {
+		if (sscanf(line, " MD5Version %d", &version) == 1) {
+			if (version != 10)
+				goto out;
+		} else if (sscanf(line, " numFrames %d",
+				  &anim->num_frames) == 1) {
+			anim->skelFrames = calloc(anim->num_frames,
+						  sizeof(*anim->skelFrames));
+			anim->bboxes = calloc(anim->num_frames,
+					      sizeof(*anim->bboxes));
+			if ( NULL == anim->skelFrames || NULL == anim->bboxes )
+				goto out;
+		} else if (sscanf(line, " numJoints %d",
+				  &anim->num_joints) == 1) {
+			for (i = 0; i < anim->num_frames; ++i) {
+				anim->skelFrames[i] = calloc(anim->num_joints,
+						sizeof(struct md5_joint_t));
+				if ( NULL == anim->skelFrames[i] )
+					goto out;
+			}
+			jointInfos = calloc(anim->num_joints,
+					    sizeof(*jointInfos));
+			baseFrame = calloc(anim->num_joints,
+					   sizeof(*baseFrame));
+			if ( NULL == jointInfos || NULL == baseFrame )
+				goto out;
+		} else if (sscanf(line, " frameRate %d",
+				  &anim->frameRate) == 1) {
+		} else if (sscanf(line, " numAnimatedComponents %d",
+				  &numAnimatedComponents) == 1) {
+			animFrameData = calloc(numAnimatedComponents,
+					       sizeof(float));
+			if ( NULL == animFrameData )
+				goto out;
+		} else if (strncmp(line, "hierarchy {", 11) == 0) {
+			for (i = 0; i < anim->num_joints; ++i) {
+				line = textreader_gets(txt);
+				if ( NULL == line )
+					goto out;
+				sscanf(line, " %63s %d %d %d",
+				       jointInfos[i].name,
+				       &jointInfos[i].parent,
+				       &jointInfos[i].flags,
+				       &jointInfos[i].startIndex);
+			}
+		} else if (strncmp(line, "bounds {", 8) == 0) {
+			for (i = 0; i < anim->num_frames; ++i) {
+				line = textreader_gets(txt);
+				if ( NULL == line )
+					goto out;
+				sscanf(line, " ( %f %f %f ) ( %f %f %f )",
+				       &anim->bboxes[i].min[0],
+				       &anim->bboxes[i].min[1],
+				       &anim->bboxes[i].min[2],
+				       &anim->bboxes[i].max[0],
+				       &anim->bboxes[i].max[1],
+				       &anim->bboxes[i].max[2]);
+			}
+		} else if (strncmp(line, "baseframe {", 10) == 0) {
+			for (i = 0; i < anim->num_joints; ++i) {
+				line = textreader_gets(txt);
+				if ( NULL == line )
+					goto out;
+				if (sscanf(line, " ( %f %f %f ) ( %f %f %f )",
+					   &baseFrame[i].pos[0],
+					   &baseFrame[i].pos[1],
+					   &baseFrame[i].pos[2],
+					   &baseFrame[i].orient[0],
+					   &baseFrame[i].orient[1],
+					   &baseFrame[i].orient[2]) == 6)
+					Quat_computeW(baseFrame[i].orient);
+			}
+		} else if (sscanf(line, "frame %u {", &frame_index) == 1) {
+			if ( frame_index >= anim->num_frames )
+				goto out;
+			for(i = 0;;) {
+				line = textreader_gets(txt);
+				if ( NULL == line || line[0] == '}' )
+					break;
+				/* split up like easy_explode() did */
+				for(tok = strtok_r(line, " \t\r\n", &sv);
+						tok && i < numAnimatedComponents;
+						tok = strtok_r(NULL, " \t\r\n", &sv))
+					sscanf(tok, "%f", &animFrameData[i++]);
+			}
+
+			ref_build(jointInfos, baseFrame, animFrameData,
+				  anim->skelFrames[frame_index],
+				  anim->num_joints);
+		}
+	}
+
+	ret = 1;
+out:
+	free(animFrameData);
+	free(baseFrame);
+	free(jointInfos);
+	textreader_free(txt);
+out_close:
+	game_close(&f);
+	return ret;
+}
+
+static void ref_free(struct ref_anim *anim)
+{
+	unsigned int i;
+
+	if ( anim->skelFrames ) {
+		for(i = 0; i < anim->num_frames; i++)
+			free(anim->skelFrames[i]);
+	}
+	free(anim->skelFrames);
+	free(anim->bboxes);
+	free(anim);
+}
+
+static struct md5_anim *new_load(const char *fn)
+{
+	struct md5_anim *anim;
+
+	anim = mem_calloc(MEM_MD5ANIM, 1, sizeof(*anim));
+	if ( NULL == anim )
+		return NULL;
+	INIT_LIST_HEAD(&anim->list);
+
+	if ( !ReadMD5Anim(fn, anim) ) {
+		FreeAnim(anim);
+		return NULL;
+	}
+
+	return anim;
+}
+
+static struct ref_anim *ref_load(const char *fn)
+{
+	struct ref_anim *anim;
+
+	anim = calloc(1, sizeof(*anim));
+	if ( NULL == anim )
+		return NULL;
+
+	if ( !ref_read(fn, anim) ) {
+		ref_free(anim);
+		return NULL;
+	}
+
+	return anim;
+}
+
+/* Bit for bit, so -0 vs. 0 and differently rounded floats all count */
+static int same(const struct ref_anim *a, const struct md5_anim *b)
+{
+	const struct md5_joint_t *ja;
+	unsigned int i, j, k;
+
+	if ( a->num_frames != b->num_frames ||
+			a->num_joints != b->num_joints ||
+			a->frameRate != b->frameRate ) {
+		printf("  header differs\n");
+		return 0;
+	}
+
+	for(i = 0; i < a->num_frames; i++) {
+		for(j = 0; j < a->num_joints; j++) {
+			ja = &a->skelFrames[i][j];
+			k = i * b->num_joints + j;
+			if ( strcmp(ja->name, b->hier[j].name) ||
+					ja->parent != b->hier[j].parent ||
+					memcmp(ja->pos, b->pos[k],
+						sizeof(ja->pos)) ||
+					memcmp(ja->orient, b->orient[k],
+						sizeof(ja->orient)) ) {
+				printf("  frame %u joint %u differs\n", i, j);
+				return 0;
+			}
+		}
+		if ( memcmp(&a->bboxes[i], &b->bboxes[i],
+				sizeof(a->bboxes[i])) ) {
+			printf("  frame %u bounds differ\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static double time_ref(const char *fn)
+{
+	struct ref_anim *anim;
+	double start, ns;
+
+	start = now();
+	anim = ref_load(fn);
+	ns = now() - start;
+	if ( NULL == anim )
+		return -1.0;
+	ref_free(anim);
+	return ns;
+}
+
+static double time_load(const char *fn)
+{
+	struct md5_anim *anim;
+	double start, ns;
+
+	start = now();
+	anim = new_load(fn);
+	ns = now() - start;
+	if ( NULL == anim )
+		return -1.0;
+	FreeAnim(anim);
+	return ns;
+}
+
+/* Skeleton memory, which for the reference is also what it used to be */
+static size_t ref_skel_size(const struct ref_anim *anim)
+{
+	return anim->num_frames * (sizeof(*anim->skelFrames) +
+			anim->num_joints * sizeof(**anim->skelFrames));
+}
+
+static size_t skel_size(const struct md5_anim *anim)
+{
+	return anim->num_joints * sizeof(*anim->hier) +
+		(size_t)anim->num_frames * anim->num_joints *
+			(sizeof(*anim->pos) + sizeof(*anim->orient));
+}
+
+static size_t qskel_size(const struct md5_anim *anim)
+{
+	return anim->num_joints * (sizeof(*anim->hier) +
+			sizeof(*anim->qjoints)) +
+		anim->num_qkeys * sizeof(*anim->qkeys);
+}
+
+/* Every frame blended with the next, per joint */
+static double time_interp(const struct md5_anim *anim,
+				struct md5_joint_t *skel)
+{
+	unsigned int i;
+	double start;
+
+	start = now();
+	for(i = 0; i < anim->num_frames; i++) {
+		InterpolateSkeletons(anim, i, (i + 1) % anim->num_frames,
+					0.5f, skel);
+	}
+	return (now() - start) / ((double)anim->num_frames *
+					anim->num_joints);
+}
+
+static struct md5_mesh *mesh_load(const char *fn)
+{
+	struct md5_mesh *mesh;
+
+	mesh = mem_calloc(MEM_MD5MESH, 1, sizeof(*mesh));
+	if ( NULL == mesh )
+		return NULL;
+	INIT_LIST_HEAD(&mesh->list);
+	mesh->ref = 1;
+
+	if ( !md5_mesh_read(fn, mesh) ) {
+		md5_mesh_put(mesh);
+		return NULL;
+	}
+
+	return mesh;
+}
+
+static double time_mesh(const char *fn)
+{
+	struct md5_mesh *mesh;
+	double start, ns;
+
+	start = now();
+	mesh = mesh_load(fn);
+	ns = now() - start;
+	if ( NULL == mesh )
+		return -1.0;
+	md5_mesh_put(mesh);
+	return ns;
+}
+
+/* How md5_render.c used to skin, two quaternion rotations per weight */
+static void ref_skin(const struct md5_mesh_part *mesh,
+			const struct md5_joint_t *skel,
+			vec3_t *verts, vec3_t *norms)
+{
+	unsigned int i, j;
+
+	for(i = 0; i < mesh->num_verts; i++) {
+		vec3_t vert = {0.0f, 0.0f, 0.0f};
+		vec3_t norm = {0.0f, 0.0f, 0.0f};
+		float len;
+
+		for(j = 0; j < mesh->vertices[i].count; j++) {
+			const struct md5_weight_t *weight
+				= &mesh->weights[mesh->vertices[i].start + j];
+			const struct md5_joint_t *joint
+				= &skel[weight->joint];
+			vec3_t wv;
+
+			Quat_rotatePoint(joint->orient, weight->pos, wv);
+			vert[0] += (joint->pos[0] + wv[0]) * weight->bias;
+			vert[1] += (joint->pos[1] + wv[1]) * weight->bias;
+			vert[2] += (joint->pos[2] + wv[2]) * weight->bias;
+
+			Quat_rotatePoint(joint->orient, weight->normal, wv);
+			norm[0] += wv[0] * weight->bias;
+			norm[1] += wv[1] * weight->bias;
+			norm[2] += wv[2] * weight->bias;
+		}
+
+		len = sqrt(norm[0] * norm[0] + norm[1] * norm[1] +
+				norm[2] * norm[2]);
+		if ( len != 0.0f ) {
+			norm[0] /= len;
+			norm[1] /= len;
+			norm[2] /= len;
+		}
+
+		memcpy(verts[i], vert, sizeof(vert));
+		memcpy(norms[i], norm, sizeof(norm));
+	}
+}
+
+/* Relative to the size of the model, NaNs from degenerate triangles
+ * have to be NaN in both
+ */
+static float skin_diff(const float *a, const float *b, float scale)
+{
+	float d = 0.0f, e;
+	unsigned int i;
+
+	for(i = 0; i < 3; i++) {
+		if ( isnan(a[i]) || isnan(b[i]) ) {
+			if ( !isnan(a[i]) || !isnan(b[i]) )
+				return INFINITY;
+			continue;
+		}
+		e = fabsf(a[i] - b[i]) / scale;
+		if ( e > d )
+			d = e;
+	}
+
+	return d;
+}
+
+/* Each kernel against the scalar one, over every vertex */
+static int isa_diff(struct md5_mesh *mdl, unsigned int isa,
+			const struct md5_mat34_t *pal, float scale,
+			vec3_t *rv, vec3_t *rn, vec3_t *v, vec3_t *n,
+			float *vd, float *nd)
+{
+	unsigned int i, j;
+	float d;
+
+	*vd = *nd = 0.0f;
+	for(i = 0; i < mdl->num_meshes; i++) {
+		const struct md5_mesh_part *mesh = &mdl->meshes[i];
+
+		md5_skin_isa(MD5_SKIN_SCALAR, mesh, pal, rv, rn);
+		if ( !md5_skin_isa(isa, mesh, pal, v, n) )
+			return 0;
+		for(j = 0; j < mesh->num_verts; j++) {
+			d = skin_diff(rv[j], v[j], scale);
+			if ( d > *vd )
+				*vd = d;
+			d = skin_diff(rn[j], n[j], 1.0f);
+			if ( d > *nd )
+				*nd = d;
+		}
+	}
+
+	return 1;
+}
+
+static double time_isa(struct md5_mesh *mdl, unsigned int isa,
+			struct md5_mat34_t *pal, vec3_t *v, vec3_t *n)
+{
+	double best = 0, start, ns;
+	unsigned int i, j;
+
+	for(i = 0; i < num_rounds; i++) {
+		start = now();
+		md5_palette(mdl->baseSkel, mdl->num_joints, pal);
+		for(j = 0; j < mdl->num_meshes; j++)
+			md5_skin_isa(isa, &mdl->meshes[j], pal, v, n);
+		ns = now() - start;
+		if ( 0 == i || ns < best )
+			best = ns;
+	}
+
+	return best;
+}
+
+static int bench_skin(struct md5_mesh *mdl)
+{
+	struct md5_mat34_t *pal = NULL;
+	vec3_t *rv = NULL, *rn = NULL, *v = NULL, *n = NULL;
+	double ref_ns = 0, scalar_ns = 0, start, ns;
+	float scale = 1.0f, vd = 0.0f, nd = 0.0f, d;
+	unsigned int i, j, k, num_weights = 0, num_verts = 0;
+	unsigned int have = 1U << MD5_SKIN_SCALAR;
+	const char *name;
+	int ret = 0;
+
+	start = now();
+	for(i = 0; i < mdl->num_meshes; i++) {
+		if ( !md5_skin_init(&mdl->meshes[i]) ) {
+			fprintf(stderr, "%s: md5_skin_init failed\n", _func);
+			return 0;
+		}
+	}
+	ns = now() - start;
+
+	pal = malloc(mdl->num_joints * sizeof(*pal));
+	rv = malloc(mdl->max_verts * sizeof(*rv));
+	rn = malloc(mdl->max_verts * sizeof(*rn));
+	v = malloc(mdl->max_verts * sizeof(*v));
+	n = malloc(mdl->max_verts * sizeof(*n));
+	if ( mdl->max_verts && (NULL == rv || NULL == rn || NULL == v ||
+			NULL == n || NULL == pal) ) {
+		fprintf(stderr, "%s: malloc: %s\n", _func, get_err());
+		goto out;
+	}
+
+	/* Every vertex a triangle uses, through the sorted indices */
+	md5_palette(mdl->baseSkel, mdl->num_joints, pal);
+	for(i = 0; i < mdl->num_meshes; i++) {
+		const struct md5_mesh_part *mesh = &mdl->meshes[i];
+
+		ref_skin(mesh, mdl->baseSkel, rv, rn);
+		md5_skin_isa(MD5_SKIN_SCALAR, mesh, pal, v, n);
+		for(j = 0; j < mesh->num_verts; j++) {
+			for(k = 0; k < 3; k++) {
+				if ( fabsf(rv[j][k]) > scale )
+					scale = fabsf(rv[j][k]);
+			}
+		}
+		for(j = 0; j < mesh->num_tris * 3; j++) {
+			const float *a, *b;
+
+			a = rv[mesh->triangles[j / 3].index[j % 3]];
+			b = v[mesh->skin_indices[j]];
+			d = skin_diff(a, b, scale);
+			if ( d > vd )
+				vd = d;
+
+			a = rn[mesh->triangles[j / 3].index[j % 3]];
+			b = n[mesh->skin_indices[j]];
+			d = skin_diff(a, b, 1.0f);
+			if ( d > nd )
+				nd = d;
+		}
+		num_verts += mesh->num_verts;
+		num_weights += mesh->num_weights;
+	}
+
+	printf("  skinning %u verts %u weights, layout built in %.2f ms\n",
+		num_verts, num_weights, ns / 1e6);
+	printf("  max difference %g of model size, %g in normals\n", vd, nd);
+	if ( !(vd < 1e-5f && nd < 1e-4f) ) {
+		printf("  palette skinning differs\n");
+		goto out;
+	}
+
+	for(i = 1; (name = md5_skin_isa_name(i)); i++) {
+		if ( !isa_diff(mdl, i, pal, scale, rv, rn, v, n, &vd, &nd) ) {
+			printf("  %s: not supported\n", name);
+			continue;
+		}
+		have |= 1U << i;
+		printf("  %s: max difference %g of model size, "
+			"%g in normals\n", name, vd, nd);
+		if ( !(vd < 1e-5f && nd < 1e-4f) ) {
+			printf("  %s skinning differs from scalar\n", name);
+			goto out;
+		}
+	}
+
+	for(i = 0; i < num_rounds; i++) {
+		start = now();
+		for(j = 0; j < mdl->num_meshes; j++)
+			ref_skin(&mdl->meshes[j], mdl->baseSkel, rv, rn);
+		ns = now() - start;
+		if ( 0 == i || ns < ref_ns )
+			ref_ns = ns;
+	}
+
+	/* Speedup over the quaternions, then over scalar */
+	printf("  %-12s %8.1f us %14s %8.1f Mverts/s\n", "quaternions",
+		ref_ns / 1e3, "", num_verts / (ref_ns / 1e3));
+	for(i = 0; (name = md5_skin_isa_name(i)); i++) {
+		if ( !(have & (1U << i)) )
+			continue;
+		ns = time_isa(mdl, i, pal, v, n);
+		if ( MD5_SKIN_SCALAR == i )
+			scalar_ns = ns;
+		printf("  %-12s %8.1f us %6.1fx %6.1fx %8.1f Mverts/s\n",
+			name, ns / 1e3, ref_ns / ns, scalar_ns / ns,
+			num_verts / (ns / 1e3));
+	}
+	printf("  md5_skin() uses %s\n", md5_skin_impl());
+	ret = 1;
+out:
+	free(pal);
+	free(rv);
+	free(rn);
+	free(v);
+	free(n);
+	return ret;
+}
+
+static int joints_same(const struct md5_joint_t *a,
+			const struct md5_joint_t *b, unsigned int num)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		if ( strcmp(a[i].name, b[i].name) ||
+				a[i].parent != b[i].parent ||
+				memcmp(a[i].pos, b[i].pos, sizeof(a[i].pos)) ||
+				memcmp(a[i].orient, b[i].orient,
+					sizeof(a[i].orient)) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Normals and tangents too, md5cook worked those out for us */
+static int mesh_same(const struct md5_mesh *a, const struct md5_mesh *b)
+{
+	const struct md5_mesh_part *pa, *pb;
+	const struct md5_weight_t *wa, *wb;
+	unsigned int i, j;
+
+	if ( a->num_joints != b->num_joints ||
+			a->num_meshes != b->num_meshes ||
+			a->max_verts != b->max_verts ||
+			a->max_tris != b->max_tris ) {
+		printf("  header differs\n");
+		return 0;
+	}
+
+	if ( !joints_same(a->baseSkel, b->baseSkel, a->num_joints) ) {
+		printf("  joints differ\n");
+		return 0;
+	}
+
+	for(i = 0; i < a->num_meshes; i++) {
+		pa = &a->meshes[i];
+		pb = &b->meshes[i];
+		if ( strcmp(pa->shader, pb->shader) ||
+				pa->num_verts != pb->num_verts ||
+				pa->num_tris != pb->num_tris ||
+				pa->num_weights != pb->num_weights ||
+				memcmp(pa->vertices, pb->vertices,
+					pa->num_verts * sizeof(*pa->vertices)) ||
+				memcmp(pa->triangles, pb->triangles,
+					pa->num_tris * sizeof(*pa->triangles)) ) {
+			printf("  mesh %u differs\n", i);
+			return 0;
+		}
+
+		for(j = 0; j < pa->num_weights; j++) {
+			wa = &pa->weights[j];
+			wb = &pb->weights[j];
+			if ( wa->joint != wb->joint ||
+					memcmp(&wa->bias, &wb->bias,
+						sizeof(wa->bias)) ||
+					memcmp(wa->normal, wb->normal,
+						sizeof(wa->normal)) ||
+					memcmp(wa->tangent, wb->tangent,
+						sizeof(wa->tangent)) ||
+					memcmp(wa->pos, wb->pos,
+						sizeof(wa->pos)) ) {
+				printf("  mesh %u weight %u differs\n", i, j);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static int map_file(const char *fn)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: %s: open: %s\n", _func, fn, get_err());
+		return 0;
+	}
+
+	if ( fstat(fd, &st) ) {
+		fprintf(stderr, "%s: %s: fstat: %s\n", _func, fn, get_err());
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+			fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "%s: %s: mmap: %s\n", _func, fn, get_err());
+		return 0;
+	}
+
+	mapped[num_mapped].f_ptr = map;
+	mapped[num_mapped].f_len = st.st_size;
+	mapped[num_mapped].f_name = fn;
+	num_mapped++;
+	return 1;
+}
+
+static void unmap_files(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_mapped; i++) {
+		munmap((void *)mapped[i].f_ptr, mapped[i].f_len);
+		memset(&mapped[i], 0, sizeof(mapped[i]));
+	}
+	num_mapped = 0;
+}
+
+/* Map the text file, and the cooked one if there is to be one */
+static int map_files(const char *fn, char *cfn, size_t sz)
+{
+	if ( !map_file(fn) )
+		return 0;
+
+	if ( cooked_dir ) {
+		snprintf(cfn, sz, "%s/%s", cooked_dir, fn);
+		if ( !map_file(cfn) ) {
+			unmap_files();
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int bench_anim(const char *fn)
+{
+	struct ref_anim *a;
+	struct md5_anim *b, *c = NULL, *q = NULL;
+	struct md5_joint_t *skel = NULL;
+	double ref_ns = 0, new_ns = 0, cooked_ns = 0, ns;
+	double interp_ns = 0, qinterp_ns = 0;
+	float pos_err, rot_err;
+	char cfn[strlen(fn) + (cooked_dir ? strlen(cooked_dir) : 0) + 2];
+	unsigned int i;
+	int ret = 0;
+
+	if ( !map_files(fn, cfn, sizeof(cfn)) )
+		return 0;
+
+	printf("%s: %lu KB\n", fn, (unsigned long)(mapped[0].f_len >> 10));
+
+	a = ref_load(fn);
+	b = new_load(fn);
+	if ( NULL == a || NULL == b ) {
+		fprintf(stderr, "%s: %s: %s failed to load\n", _func, fn,
+			(a) ? "ReadMD5Anim" : "reference");
+		goto out;
+	}
+
+	printf("  %u frames %u joints\n", b->num_frames, b->num_joints);
+	if ( !same(a, b) )
+		goto out;
+	printf("  skeletons and bounds identical\n");
+	printf("  skeletons %lu KB, were %lu KB\n",
+		(unsigned long)(skel_size(b) >> 10),
+		(unsigned long)(ref_skel_size(a) >> 10));
+
+	if ( cooked_dir ) {
+		c = new_load(cfn);
+		if ( NULL == c ) {
+			fprintf(stderr, "%s: %s: failed to load\n", _func, cfn);
+			goto out;
+		}
+		if ( c->qjoints ) {
+			printf("  cooked: %lu KB, quantised\n",
+				(unsigned long)(mapped[1].f_len >> 10));
+		}else if ( same(a, c) ) {
+			printf("  cooked: %lu KB, identical\n",
+				(unsigned long)(mapped[1].f_len >> 10));
+		}else{
+			goto out;
+		}
+	}
+
+	if ( quantise && b->num_frames && b->num_joints ) {
+		q = new_load(fn);
+		skel = calloc(b->num_joints, sizeof(*skel));
+		if ( NULL == q || NULL == skel ||
+				!md5_anim_quantise(q, MD5Q_POS_TOL,
+					MD5Q_ROT_TOL, &pos_err, &rot_err) ) {
+			fprintf(stderr, "%s: %s: quantise failed\n",
+				_func, fn);
+			goto out;
+		}
+		printf("  quantised: %lu KB, %u of %u keys\n",
+			(unsigned long)(qskel_size(q) >> 10), q->num_qkeys,
+			2 * q->num_frames * q->num_joints);
+		printf("  max error %g units, %g radians\n",
+			pos_err, rot_err);
+	}
+
+	/* Alternate and keep the best of each, so that anything else
+	 * going on in the machine hits both and is mostly ignored
+	 */
+	for(i = 0; i < num_rounds; i++) {
+		ns = time_ref(fn);
+		if ( ns < 0 )
+			goto out;
+		if ( 0 == i || ns < ref_ns )
+			ref_ns = ns;
+
+		ns = time_load(fn);
+		if ( ns < 0 )
+			goto out;
+		if ( 0 == i || ns < new_ns )
+			new_ns = ns;
+
+		if ( q ) {
+			ns = time_interp(b, skel);
+			if ( 0 == i || ns < interp_ns )
+				interp_ns = ns;
+			ns = time_interp(q, skel);
+			if ( 0 == i || ns < qinterp_ns )
+				qinterp_ns = ns;
+		}
+
+		if ( NULL == c )
+			continue;
+		ns = time_load(cfn);
+		if ( ns < 0 )
+			goto out;
+		if ( 0 == i || ns < cooked_ns )
+			cooked_ns = ns;
+	}
+
+	printf("  %-12s %8.2f ms\n", "reference", ref_ns / 1e6);
+	printf("  %-12s %8.2f ms %6.1fx\n", "ReadMD5Anim", new_ns / 1e6,
+		ref_ns / new_ns);
+	if ( c )
+		printf("  %-12s %8.3f ms %6.1fx\n", "cooked", cooked_ns / 1e6,
+			ref_ns / cooked_ns);
+	if ( q ) {
+		printf("  %-12s %8.1f ns/joint\n", "interpolate", interp_ns);
+		printf("  %-12s %8.1f ns/joint\n", "quantised", qinterp_ns);
+	}
+	ret = 1;
+out:
+	if ( a )
+		ref_free(a);
+	if ( b )
+		FreeAnim(b);
+	if ( c )
+		FreeAnim(c);
+	if ( q )
+		FreeAnim(q);
+	free(skel);
+	unmap_files();
+	return ret;
+}
+
+static int bench_mesh(const char *fn)
+{
+	struct md5_mesh *a, *b = NULL;
+	double text_ns = 0, cooked_ns = 0, ns;
+	char cfn[strlen(fn) + (cooked_dir ? strlen(cooked_dir) : 0) + 2];
+	unsigned int i;
+	int ret = 0;
+
+	if ( !map_files(fn, cfn, sizeof(cfn)) )
+		return 0;
+
+	printf("%s: %lu KB\n", fn, (unsigned long)(mapped[0].f_len >> 10));
+
+	a = mesh_load(fn);
+	if ( NULL == a ) {
+		fprintf(stderr, "%s: %s: failed to load\n", _func, fn);
+		goto out;
+	}
+
+	printf("  %u joints %u meshes\n", a->num_joints, a->num_meshes);
+	if ( !bench_skin(a) )
+		goto out;
+
+	if ( cooked_dir ) {
+		b = mesh_load(cfn);
+		if ( NULL == b ) {
+			fprintf(stderr, "%s: %s: failed to load\n", _func, cfn);
+			goto out;
+		}
+		if ( !mesh_same(a, b) )
+			goto out;
+		printf("  cooked: %lu KB, identical\n",
+			(unsigned long)(mapped[1].f_len >> 10));
+	}
+
+	for(i = 0; i < num_rounds; i++) {
+		ns = time_mesh(fn);
+		if ( ns < 0 )
+			goto out;
+		if ( 0 == i || ns < text_ns )
+			text_ns = ns;
+
+		if ( NULL == b )
+			continue;
+		ns = time_mesh(cfn);
+		if ( ns < 0 )
+			goto out;
+		if ( 0 == i || ns < cooked_ns )
+			cooked_ns = ns;
+	}
+
+	printf("  %-12s %8.2f ms\n", "text", text_ns / 1e6);
+	if ( b )
+		printf("  %-12s %8.3f ms %6.1fx\n", "cooked", cooked_ns / 1e6,
+			text_ns / cooked_ns);
+	ret = 1;
+out:
+	if ( a )
+		md5_mesh_put(a);
+	if ( b )
+		md5_mesh_put(b);
+	unmap_files();
+	return ret;
+}
+
+static int bench(const char *fn)
+{
+	size_t len = strlen(fn);
+
+	if ( len >= 8 && !strcmp(fn + len - 8, ".md5mesh") )
+		return bench_mesh(fn);
+	return bench_anim(fn);
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-n rounds] [-c cooked_dir] [-q] "
+		"file.md5anim|file.md5mesh ...\n", cmd);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+
+	while ( (c = getopt(argc, argv, "n:c:q")) != -1 ) {
+		switch ( c ) {
+		case 'n':
+			num_rounds = atoi(optarg);
+			break;
+		case 'c':
+			cooked_dir = optarg;
+			break;
+		case 'q':
+			quantise = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( optind >= argc || num_rounds < 1 ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for(i = optind; i < argc; i++) {
+		if ( !bench(argv[i]) )
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
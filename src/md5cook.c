@@ -0,0 +1,488 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Cook md5 text models and animations in to the binary form which the
+* loaders can use in place, eg:
+*
+*   md5cook models/marine.md5mesh cooked/models/marine.md5mesh
+*
+* The type comes from the name of the input. The output keeps the same
+* name when it goes in to the game file, the loaders tell cooked from
+* text by the magic. Cooked input is fine too and cooks to the same
+* thing again.
+*
+* With -q animations are quantised, and keys which interpolation can
+* stand in for are dropped if that moves joints no further than -p
+* model units or turns them no further than -r radians.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/vector.h>
+#include <blackbloc/tex.h>
+#include <blackbloc/img/tga.h>
+#include <blackbloc/model/md5.h>
+#include "md5.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+void con_printf(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+}
+
+/* Loads come straight from the filesystem, not a game file */
+int game_open(struct gfile *f, const char *name)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if ( fd < 0 )
+		return 0;
+
+	if ( fstat(fd, &st) ) {
+		close(fd);
+		return 0;
+	}
+
+	if ( st.st_size ) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if ( map == MAP_FAILED ) {
+			close(fd);
+			return 0;
+		}
+	}else{
+		map = NULL;
+	}
+
+	close(fd);
+	f->f_ptr = map;
+	f->f_len = st.st_size;
+	f->f_name = name;
+	return 1;
+}
+
+void game_close(struct gfile *f)
+{
+	if ( f->f_len )
+		munmap((void *)f->f_ptr, f->f_len);
+}
+
+/* The model loader links against these but only do_mesh_load() calls
+ * them and we never get that far.
+ */
+void game_prefetch(const char * const *names, unsigned int num)
+{
+}
+
+texture_t tga_get_by_name(const char *name)
+{
+	return NULL;
+}
+
+void tex_put(texture_t tex)
+{
+}
+
+static size_t cook_align(size_t ofs)
+{
+	return (ofs + (MD5C_ALIGN - 1)) & ~(size_t)(MD5C_ALIGN - 1);
+}
+
+/* Records are copied a field at a time in to zeroed memory so that the
+ * padding, and anything after the NUL in names, always comes out the
+ * same.
+ */
+static void put_joints(uint8_t *buf, const struct md5_joint_t *in,
+			unsigned int num)
+{
+	struct md5_joint_t *out = (struct md5_joint_t *)buf;
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		strncpy(out[i].name, in[i].name, sizeof(out[i].name) - 1);
+		out[i].parent = in[i].parent;
+		memcpy(out[i].pos, in[i].pos, sizeof(out[i].pos));
+		memcpy(out[i].orient, in[i].orient, sizeof(out[i].orient));
+	}
+}
+
+static void put_part(uint8_t *buf, const struct md5_mesh_part *in)
+{
+	struct md5_vertex_t *v = (struct md5_vertex_t *)buf;
+	struct md5_triangle_t *t;
+	struct md5_weight_t *w;
+	unsigned int i;
+
+	for(i = 0; i < in->num_verts; i++) {
+		memcpy(v[i].st, in->vertices[i].st, sizeof(v[i].st));
+		v[i].start = in->vertices[i].start;
+		v[i].count = in->vertices[i].count;
+	}
+
+	buf += cook_align(in->num_verts * sizeof(*v));
+	t = (struct md5_triangle_t *)buf;
+	for(i = 0; i < in->num_tris; i++)
+		memcpy(t[i].index, in->triangles[i].index,
+			sizeof(t[i].index));
+
+	buf += cook_align(in->num_tris * sizeof(*t));
+	w = (struct md5_weight_t *)buf;
+	for(i = 0; i < in->num_weights; i++) {
+		w[i].joint = in->weights[i].joint;
+		w[i].bias = in->weights[i].bias;
+		memcpy(w[i].normal, in->weights[i].normal,
+			sizeof(w[i].normal));
+		memcpy(w[i].tangent, in->weights[i].tangent,
+			sizeof(w[i].tangent));
+		memcpy(w[i].pos, in->weights[i].pos, sizeof(w[i].pos));
+	}
+}
+
+static size_t part_size(const struct md5_mesh_part *p)
+{
+	return cook_align(p->num_verts * sizeof(*p->vertices)) +
+		cook_align(p->num_tris * sizeof(*p->triangles)) +
+		cook_align(p->num_weights * sizeof(*p->weights));
+}
+
+/* Lay out a model, or with a NULL buffer just work out how big it is */
+static size_t mesh_image(const struct md5_mesh *mdl, uint8_t *buf)
+{
+	struct md5c_mesh *m = (struct md5c_mesh *)buf;
+	struct md5c_part *p;
+	unsigned int i;
+	size_t ofs;
+
+	ofs = cook_align(sizeof(*m));
+	if ( buf ) {
+		md5c_hdr_init(&m->m_hdr, MD5C_MESH);
+		m->m_num_joints = mdl->num_joints;
+		m->m_num_meshes = mdl->num_meshes;
+		m->m_parts = ofs;
+		p = (struct md5c_part *)(buf + ofs);
+	}else{
+		p = NULL;
+	}
+
+	ofs = cook_align(ofs + mdl->num_meshes * sizeof(*p));
+	if ( buf ) {
+		m->m_joints = ofs;
+		put_joints(buf + ofs, mdl->baseSkel, mdl->num_joints);
+	}
+
+	ofs = cook_align(ofs + mdl->num_joints * sizeof(*mdl->baseSkel));
+	for(i = 0; i < mdl->num_meshes; i++) {
+		const struct md5_mesh_part *in = &mdl->meshes[i];
+
+		if ( buf ) {
+			strncpy(p[i].p_shader, in->shader,
+				sizeof(p[i].p_shader) - 1);
+			p[i].p_num_verts = in->num_verts;
+			p[i].p_num_tris = in->num_tris;
+			p[i].p_num_weights = in->num_weights;
+			p[i].p_verts = ofs;
+			p[i].p_tris = ofs + cook_align(in->num_verts *
+						sizeof(*in->vertices));
+			p[i].p_weights = p[i].p_tris +
+					cook_align(in->num_tris *
+						sizeof(*in->triangles));
+			put_part(buf + ofs, in);
+		}
+		ofs += part_size(in);
+	}
+
+	return ofs;
+}
+
+static void put_bboxes(uint8_t *buf, const struct md5_anim *anim)
+{
+	struct md5_bbox_t *b = (struct md5_bbox_t *)buf;
+	unsigned int i;
+
+	for(i = 0; i < anim->num_frames; i++) {
+		memcpy(b[i].min, anim->bboxes[i].min, sizeof(b[i].min));
+		memcpy(b[i].max, anim->bboxes[i].max, sizeof(b[i].max));
+	}
+}
+
+static void put_hier(uint8_t *buf, const struct md5_hier_t *in,
+			unsigned int num)
+{
+	struct md5_hier_t *out = (struct md5_hier_t *)buf;
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		strncpy(out[i].name, in[i].name, sizeof(out[i].name) - 1);
+		out[i].parent = in[i].parent;
+	}
+}
+
+static size_t anim_image(const struct md5_anim *anim, uint8_t *buf)
+{
+	struct md5c_anim *a = (struct md5c_anim *)buf;
+	size_t ofs, num;
+
+	num = (size_t)anim->num_frames * anim->num_joints;
+
+	ofs = cook_align(sizeof(*a));
+	if ( buf ) {
+		md5c_hdr_init(&a->a_hdr, MD5C_ANIM);
+		a->a_num_frames = anim->num_frames;
+		a->a_num_joints = anim->num_joints;
+		a->a_frame_rate = anim->frameRate;
+		a->a_hier = ofs;
+		put_hier(buf + ofs, anim->hier, anim->num_joints);
+	}
+
+	ofs = cook_align(ofs + anim->num_joints * sizeof(*anim->hier));
+	if ( buf ) {
+		a->a_pos = ofs;
+		if ( num )
+			memcpy(buf + ofs, anim->pos,
+				num * sizeof(*anim->pos));
+	}
+
+	ofs = cook_align(ofs + num * sizeof(*anim->pos));
+	if ( buf ) {
+		a->a_orient = ofs;
+		if ( num )
+			memcpy(buf + ofs, anim->orient,
+				num * sizeof(*anim->orient));
+	}
+
+	ofs = cook_align(ofs + num * sizeof(*anim->orient));
+	if ( buf ) {
+		a->a_bboxes = ofs;
+		put_bboxes(buf + ofs, anim);
+	}
+
+	return ofs + anim->num_frames * sizeof(*anim->bboxes);
+}
+
+static void put_qjoints(uint8_t *buf, const struct md5_qjoint_t *in,
+			unsigned int num)
+{
+	struct md5_qjoint_t *out = (struct md5_qjoint_t *)buf;
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		memcpy(out[i].min, in[i].min, sizeof(out[i].min));
+		memcpy(out[i].scale, in[i].scale, sizeof(out[i].scale));
+		out[i].pos = in[i].pos;
+		out[i].rot = in[i].rot;
+		out[i].num_pos = in[i].num_pos;
+		out[i].num_rot = in[i].num_rot;
+	}
+}
+
+static size_t qanim_image(const struct md5_anim *anim, uint8_t *buf)
+{
+	struct md5c_qanim *q = (struct md5c_qanim *)buf;
+	size_t ofs;
+
+	ofs = cook_align(sizeof(*q));
+	if ( buf ) {
+		md5c_hdr_init(&q->q_hdr, MD5C_QANIM);
+		q->q_num_frames = anim->num_frames;
+		q->q_num_joints = anim->num_joints;
+		q->q_frame_rate = anim->frameRate;
+		q->q_num_keys = anim->num_qkeys;
+		q->q_hier = ofs;
+		put_hier(buf + ofs, anim->hier, anim->num_joints);
+	}
+
+	ofs = cook_align(ofs + anim->num_joints * sizeof(*anim->hier));
+	if ( buf ) {
+		q->q_joints = ofs;
+		put_qjoints(buf + ofs, anim->qjoints, anim->num_joints);
+	}
+
+	ofs = cook_align(ofs + anim->num_joints * sizeof(*anim->qjoints));
+	if ( buf ) {
+		q->q_keys = ofs;
+		if ( anim->num_qkeys )
+			memcpy(buf + ofs, anim->qkeys,
+				anim->num_qkeys * sizeof(*anim->qkeys));
+	}
+
+	ofs = cook_align(ofs + anim->num_qkeys * sizeof(*anim->qkeys));
+	if ( buf ) {
+		q->q_bboxes = ofs;
+		put_bboxes(buf + ofs, anim);
+	}
+
+	return ofs + anim->num_frames * sizeof(*anim->bboxes);
+}
+
+static int write_image(const char *fn, const uint8_t *buf, size_t sz)
+{
+	FILE *f;
+
+	f = fopen(fn, "wb");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s: fopen: %s\n", _func, fn, get_err());
+		return 0;
+	}
+
+	if ( fwrite(buf, sz, 1, f) != 1 || ferror(f) ) {
+		fprintf(stderr, "%s: %s: fwrite: %s\n", _func, fn, get_err());
+		fclose(f);
+		return 0;
+	}
+
+	if ( fclose(f) ) {
+		fprintf(stderr, "%s: %s: fclose: %s\n", _func, fn, get_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Offsets are 32 bits */
+static uint8_t *image_alloc(const char *fn, size_t sz)
+{
+	uint8_t *buf;
+
+	if ( sz > 0xffffffffUL ) {
+		fprintf(stderr, "%s: %s: too big to cook\n", _func, fn);
+		return NULL;
+	}
+
+	buf = calloc(1, sz);
+	if ( NULL == buf )
+		fprintf(stderr, "%s: %s: calloc: %s\n", _func, fn, get_err());
+	return buf;
+}
+
+static int cook_mesh(const char *in, const char *out)
+{
+	struct md5_mesh mdl;
+	uint8_t *buf;
+	size_t sz;
+	int ret;
+
+	memset(&mdl, 0, sizeof(mdl));
+	if ( !md5_mesh_read(in, &mdl) )
+		return 0;
+
+	sz = mesh_image(&mdl, NULL);
+	buf = image_alloc(out, sz);
+	if ( NULL == buf )
+		return 0;
+
+	mesh_image(&mdl, buf);
+	ret = write_image(out, buf, sz);
+	if ( ret )
+		printf("%s: %u joints, %u meshes, %lu bytes\n", out,
+			mdl.num_joints, mdl.num_meshes, (unsigned long)sz);
+	free(buf);
+	return ret;
+}
+
+/* Quantise with -q */
+static int quantise;
+static float pos_tol = MD5Q_POS_TOL;
+static float rot_tol = MD5Q_ROT_TOL;
+
+static int cook_anim(const char *in, const char *out)
+{
+	struct md5_anim anim;
+	size_t (*image)(const struct md5_anim *anim, uint8_t *buf);
+	float pos_err, rot_err;
+	uint8_t *buf;
+	size_t sz;
+	int ret;
+
+	memset(&anim, 0, sizeof(anim));
+	if ( !ReadMD5Anim(in, &anim) )
+		return 0;
+
+	if ( quantise && NULL == anim.qjoints ) {
+		if ( !md5_anim_quantise(&anim, pos_tol, rot_tol,
+					&pos_err, &rot_err) ) {
+			fprintf(stderr, "%s: %s: couldn't quantise\n",
+				_func, in);
+			return 0;
+		}
+		printf("%s: %u of %u keys, max error %g units, %g radians\n",
+			out, anim.num_qkeys,
+			2 * anim.num_frames * anim.num_joints,
+			pos_err, rot_err);
+	}
+
+	image = (anim.qjoints) ? qanim_image : anim_image;
+	sz = (*image)(&anim, NULL);
+	buf = image_alloc(out, sz);
+	if ( NULL == buf )
+		return 0;
+
+	(*image)(&anim, buf);
+	ret = write_image(out, buf, sz);
+	if ( ret )
+		printf("%s: %u frames, %u joints, %lu bytes\n", out,
+			anim.num_frames, anim.num_joints, (unsigned long)sz);
+	free(buf);
+	return ret;
+}
+
+static int has_suffix(const char *str, const char *sfx)
+{
+	size_t len = strlen(str), slen = strlen(sfx);
+	return len >= slen && !strcmp(str + len - slen, sfx);
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-q] [-p pos_tol] [-r rot_tol] "
+			"in.md5mesh|in.md5anim out\n", cmd);
+}
+
+int main(int argc, char **argv)
+{
+	int ret, c;
+
+	while ( (c = getopt(argc, argv, "qp:r:")) != -1 ) {
+		switch ( c ) {
+		case 'q':
+			quantise = 1;
+			break;
+		case 'p':
+			pos_tol = atof(optarg);
+			break;
+		case 'r':
+			rot_tol = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( argc - optind != 2 ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ( has_suffix(argv[optind], ".md5mesh") ) {
+		ret = cook_mesh(argv[optind], argv[optind + 1]);
+	}else if ( has_suffix(argv[optind], ".md5anim") ) {
+		ret = cook_anim(argv[optind], argv[optind + 1]);
+	}else{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -42,194 +42,377 @@
 #include "md5.h"
 #include <stdio.h>
 
+/* Joint lines are: name parent ( pos ) ( orient ) */
+static int read_joints(textreader_t txt, struct md5_mesh *mdl)
+{
+	struct md5_joint_t *joint;
+	struct txt_slice line, tok;
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < mdl->num_joints; ++i) {
+		joint = &mdl->baseSkel[i];
+		if ( !textreader_line(txt, &line) )
+			return 0;
+
+		/* Names keep their quotes, as they always have */
+		txt_word(&line, &tok);
+		len = tok.len;
+		if ( len >= sizeof(joint->name) )
+			len = sizeof(joint->name) - 1;
+		memcpy(joint->name, tok.ptr, len);
+		joint->name[len] = '\0';
+
+		if ( !txt_next_int(&line, &joint->parent) )
+			continue;
+		if ( joint->parent < -1 ||
+				joint->parent >= (int)mdl->num_joints )
+			return 0;
+
+		if ( txt_next_tuple(&line, joint->pos, 3) &&
+				txt_next_tuple(&line, joint->orient, 3) )
+			Quat_computeW(joint->orient);
+	}
+
+	return 1;
+}
+
+/* Indices in to arrays which were sized by the numfoo lines */
+static int next_index(struct txt_slice *line, unsigned int num,
+			unsigned int *idx)
+{
+	int val;
+
+	if ( !txt_next_int(line, &val) || val < 0 || (unsigned int)val >= num )
+		return 0;
+	*idx = val;
+	return 1;
+}
+
+static int mesh_count(struct txt_slice *line, unsigned int *num)
+{
+	int val;
+
+	if ( !txt_next_int(line, &val) || val < 0 )
+		return 0;
+	*num = val;
+	return 1;
+}
+
+/* Don't trust any of the indices we were given */
+static int mesh_valid(struct md5_mesh *mdl, struct md5_mesh_part *mesh)
+{
+	unsigned int i, j;
+
+	for(i = 0; i < mesh->num_verts; i++) {
+		if ( mesh->vertices[i].start < 0 ||
+				(unsigned int)mesh->vertices[i].start >
+					mesh->num_weights ||
+				mesh->vertices[i].count >
+				mesh->num_weights - mesh->vertices[i].start )
+			return 0;
+	}
+
+	for(i = 0; i < mesh->num_tris; i++) {
+		for(j = 0; j < 3; j++) {
+			if ( mesh->triangles[i].index[j] < 0 ||
+					(unsigned int)mesh->triangles[i].index[j]
+						>= mesh->num_verts )
+				return 0;
+		}
+	}
+
+	for(i = 0; i < mesh->num_weights; i++) {
+		if ( mesh->weights[i].joint < 0 ||
+				(unsigned int)mesh->weights[i].joint >=
+					mdl->num_joints )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Everything up to the closing brace of a mesh { block */
+static int read_mesh(textreader_t txt, struct md5_mesh *mdl,
+			struct md5_mesh_part *mesh)
+{
+	struct txt_slice line, kw, tok;
+	unsigned int n;
+	float fdata[4];
+	int idata[3];
+
+	while ( textreader_line(txt, &line) ) {
+		if ( txt_token(&line, &kw) != TXT_TOK_WORD )
+			continue;
+
+		if ( txt_slice_eq(&kw, "}") ) {
+			return mesh_valid(mdl, mesh);
+		} else if ( txt_slice_eq(&kw, "vert") ) {
+			if ( !next_index(&line, mesh->num_verts, &n) )
+				return 0;
+			if ( txt_next_tuple(&line, fdata, 2) &&
+					txt_next_int(&line, &idata[0]) &&
+					txt_next_int(&line, &idata[1]) ) {
+				/* Copy vertex data */
+				mesh->vertices[n].st[0] = fdata[0];
+				mesh->vertices[n].st[1] = fdata[1];
+				mesh->vertices[n].start = idata[0];
+				mesh->vertices[n].count = idata[1];
+			}
+		} else if ( txt_slice_eq(&kw, "tri") ) {
+			if ( !next_index(&line, mesh->num_tris, &n) )
+				return 0;
+			if ( txt_next_int(&line, &idata[0]) &&
+					txt_next_int(&line, &idata[1]) &&
+					txt_next_int(&line, &idata[2]) ) {
+				/* Copy triangle data */
+				mesh->triangles[n].index[0] = idata[1];
+				mesh->triangles[n].index[1] = idata[2];
+				mesh->triangles[n].index[2] = idata[0];
+			}
+		} else if ( txt_slice_eq(&kw, "weight") ) {
+			if ( !next_index(&line, mesh->num_weights, &n) )
+				return 0;
+			if ( txt_next_int(&line, &idata[0]) &&
+					txt_next_float(&line, &fdata[3]) &&
+					txt_next_tuple(&line, fdata, 3) ) {
+				/* Copy vertex data */
+				mesh->weights[n].joint = idata[0];
+				mesh->weights[n].bias = fdata[3];
+				v_zero(mesh->weights[n].normal);
+				v_zero(mesh->weights[n].tangent);
+				mesh->weights[n].pos[0] = fdata[0];
+				mesh->weights[n].pos[1] = fdata[1];
+				mesh->weights[n].pos[2] = fdata[2];
+			}
+		} else if ( txt_slice_eq(&kw, "shader") ) {
+			/* Copy the shader name without the quote marks */
+			if ( txt_token(&line, &tok) == TXT_TOK_STRING ) {
+				n = tok.len;
+				if ( n >= sizeof(mesh->shader) )
+					n = sizeof(mesh->shader) - 1;
+				memcpy(mesh->shader, tok.ptr, n);
+				mesh->shader[n] = '\0';
+			}
+		} else if ( txt_slice_eq(&kw, "numverts") ) {
+			if ( mesh->vertices ||
+					!mesh_count(&line, &mesh->num_verts) )
+				return 0;
+			if ( mesh->num_verts > 0 ) {
+				/* Zeroed so that missing lines can't leave
+				 * indices pointing anywhere
+				 */
+				mesh->vertices = mem_calloc(MEM_MD5MESH,
+						mesh->num_verts,
+						sizeof(*mesh->vertices));
+				if ( NULL == mesh->vertices )
+					return 0;
+				if ( mesh->num_verts > mdl->max_verts )
+					mdl->max_verts = mesh->num_verts;
+			}
+		} else if ( txt_slice_eq(&kw, "numtris") ) {
+			if ( mesh->triangles ||
+					!mesh_count(&line, &mesh->num_tris) )
+				return 0;
+			if ( mesh->num_tris > 0 ) {
+				mesh->triangles = mem_calloc(MEM_MD5MESH,
+						mesh->num_tris,
+						sizeof(*mesh->triangles));
+				if ( NULL == mesh->triangles )
+					return 0;
+				if ( mesh->num_tris > mdl->max_tris )
+					mdl->max_tris = mesh->num_tris;
+			}
+		} else if ( txt_slice_eq(&kw, "numweights") ) {
+			if ( mesh->weights ||
+					!mesh_count(&line, &mesh->num_weights) )
+				return 0;
+			if ( mesh->num_weights > 0 ) {
+				mesh->weights = mem_calloc(MEM_MD5MESH,
+						mesh->num_weights,
+						sizeof(*mesh->weights));
+				if ( NULL == mesh->weights )
+					return 0;
+			}
+		}
+	}
+
+	/* ran off the end */
+	return 0;
+}
+
 /**
- * Load an MD5 model from file.
+ * Parse an MD5 model from text.
+ *
+ * Every line starts with a keyword, dispatch on that and parse the
+ * rest of it in place.
  */
-static int mesh_read(const char *filename, struct md5_mesh *mdl)
+static int mesh_parse(const struct gfile *f, const char *filename,
+			struct md5_mesh *mdl)
 {
-	struct gfile f;
 	textreader_t txt;
-	unsigned int version, curr_mesh = 0;
-	unsigned int i, ret = 0;
-	char *line;
+	struct txt_slice line, kw;
+	unsigned int curr_mesh = 0;
+	int val, ret = 0;
 
-	if ( !game_open(&f, filename) ) {
-		con_printf("md5: error: couldn't open \"%s\"!\n", filename);
+	txt = textreader_new(f->f_ptr, f->f_len);
+	if ( NULL == txt )
 		return 0;
-	}
 
-	txt = textreader_new(f.f_ptr, f.f_len);
-	if ( NULL == txt )
-		goto out_close;
+	while ( textreader_line(txt, &line) ) {
+		if ( txt_token(&line, &kw) != TXT_TOK_WORD )
+			continue;
 
-	while ( (line = textreader_gets(txt)) ) {
-		if (sscanf(line, " MD5Version %d", &version) == 1) {
-			if (version != 10) {
+		if ( txt_slice_eq(&kw, "MD5Version") ) {
+			if ( !txt_next_int(&line, &val) )
+				continue;
+			if (val != 10) {
 				/* Bad version */
 				con_printf("Error: bad model version\n");
 				goto out;
 			}
-		} else if (sscanf(line, " numJoints %d", &mdl->num_joints) == 1) {
+		} else if ( txt_slice_eq(&kw, "numJoints") ) {
+			if ( !txt_next_int(&line, &val) || val < 0 ||
+					mdl->baseSkel )
+				goto bad;
+			mdl->num_joints = val;
+
 			if (mdl->num_joints > 0) {
 				/* Allocate memory for base skeleton joints */
-				mdl->baseSkel = (struct md5_joint_t *)
-				    calloc(mdl->num_joints,
-					   sizeof(struct md5_joint_t));
+				mdl->baseSkel = mem_calloc(MEM_MD5MESH,
+						mdl->num_joints,
+						sizeof(*mdl->baseSkel));
+				if ( NULL == mdl->baseSkel )
+					goto bad;
 			}
-		} else if (sscanf(line, " numMeshes %d", &mdl->num_meshes) == 1) {
-			if (mdl->num_meshes > 0) {
+		} else if ( txt_slice_eq(&kw, "numMeshes") ) {
+			if ( !txt_next_int(&line, &val) || val < 0 ||
+					mdl->meshes )
+				goto bad;
+
+			if (val > 0) {
 				/* Allocate memory for meshes */
-				mdl->meshes = (struct md5_mesh_part *)
-				    calloc(mdl->num_meshes,
-					   sizeof(struct md5_mesh_part));
+				mdl->meshes = mem_calloc(MEM_MD5MESH, val,
+						sizeof(*mdl->meshes));
+				if ( NULL == mdl->meshes )
+					goto bad;
 			}
-		} else if (strncmp(line, "joints {", 8) == 0) {
-			unsigned int i;
-
-			/* Read each joint */
-			for (i = 0; i < mdl->num_joints; ++i) {
-				struct md5_joint_t *joint = &mdl->baseSkel[i];
-
-				/* Read whole line */
-				line = textreader_gets(txt);
-
-				if (sscanf
-				    (line, "%s %d ( %f %f %f ) ( %f %f %f )",
-				     joint->name, &joint->parent,
-				     &joint->pos[0], &joint->pos[1],
-				     &joint->pos[2], &joint->orient[0],
-				     &joint->orient[1],
-				     &joint->orient[2]) == 8) {
-					/* Compute the w component */
-					Quat_computeW(joint->orient);
-				}
-			}
-		} else if (strncmp(line, "mesh {", 6) == 0) {
-			struct md5_mesh_part *mesh = &mdl->meshes[curr_mesh];
-			int v = 0;
-			int t = 0;
-			int w = 0;
-			float fdata[4];
-			int idata[3];
-
-			while ((line[0] != '}')) {
-				char *shptr;
-
-				/* Read whole line */
-				line = textreader_gets(txt);
-
-				if ( (shptr = strstr(line, "shader ")) ) {
-					int quote = 0, j = 0;
-
-					/* Copy the shader name whithout the quote marks */
-					shptr += strlen("shader ");
-					for (i = 0;
-					     *shptr != '\0' && (quote < 2);
-					     ++i, shptr++) {
-						if (*shptr == '\"')
-							quote++;
-
-						if ((quote == 1)
-						    && (*shptr != '\"')) {
-							mesh->shader[j] =
-								*shptr;
-							j++;
-						}
-					}
-				} else
-				    if (sscanf
-					(line, " numverts %d",
-					 &mesh->num_verts) == 1) {
-					if (mesh->num_verts > 0) {
-						/* Allocate memory for vertices */
-						mesh->vertices =
-						    (struct md5_vertex_t *)
-						    malloc(sizeof
-							   (struct md5_vertex_t)
-							   * mesh->num_verts);
-						if ( mesh->num_verts >
-							mdl->max_verts )
-							mdl->max_verts =
-								mesh->num_verts;
-					}
-				} else
-				    if (sscanf
-					(line, " numtris %d",
-					 &mesh->num_tris) == 1) {
-					if (mesh->num_tris > 0) {
-						/* Allocate memory for triangles */
-						mesh->triangles =
-						    (struct md5_triangle_t *)
-						    malloc(sizeof
-							   (struct
-							    md5_triangle_t) *
-							   mesh->num_tris);
-						if ( mesh->num_tris >
-							mdl->max_tris )
-							mdl->max_tris =
-								mesh->num_tris;
-					}
-				} else
-				    if (sscanf
-					(line, " numweights %d",
-					 &mesh->num_weights) == 1) {
-					if (mesh->num_weights > 0) {
-						/* Allocate memory for vertex weights */
-						mesh->weights =
-						    (struct md5_weight_t *)
-						    malloc(sizeof
-							   (struct md5_weight_t)
-							   * mesh->num_weights);
-					}
-				} else
-				    if (sscanf
-					(line, " vert %d ( %f %f ) %d %d",
-					 &v, &fdata[0], &fdata[1],
-					 &idata[0], &idata[1]) == 5) {
-					/* Copy vertex data */
-					mesh->vertices[v].st[0] = fdata[0];
-					mesh->vertices[v].st[1] = fdata[1];
-					mesh->vertices[v].start = idata[0];
-					mesh->vertices[v].count = idata[1];
-				} else
-				    if (sscanf
-					(line, " tri %d %d %d %d", &t,
-					 &idata[0], &idata[1],
-					 &idata[2]) == 4) {
-					/* Copy triangle data */
-					mesh->triangles[t].index[0] = idata[1];
-					mesh->triangles[t].index[1] = idata[2];
-					mesh->triangles[t].index[2] = idata[0];
-				} else
-				    if (sscanf
-					(line, " weight %d %d %f ( %f %f %f )",
-					 &w, &idata[0], &fdata[3],
-					 &fdata[0], &fdata[1],
-					 &fdata[2]) == 6) {
-					/* Copy vertex data */
-					mesh->weights[w].joint = idata[0];
-					mesh->weights[w].bias = fdata[3];
-					v_zero(mesh->weights[w].normal);
-					v_zero(mesh->weights[w].tangent);
-					mesh->weights[w].pos[0] = fdata[0];
-					mesh->weights[w].pos[1] = fdata[1];
-					mesh->weights[w].pos[2] = fdata[2];
-				}
-			}
-
+			mdl->num_meshes = val;
+		} else if ( txt_slice_eq(&kw, "joints") ) {
+			if ( !read_joints(txt, mdl) )
+				goto bad;
+		} else if ( txt_slice_eq(&kw, "mesh") ) {
+			if ( curr_mesh >= mdl->num_meshes ||
+					!read_mesh(txt, mdl,
+						&mdl->meshes[curr_mesh]) )
+				goto bad;
 			curr_mesh++;
 		}
 	}
 
 	ret = 1;
+	goto out;
 
+bad:
+	con_printf("md5: %s: bad or truncated mesh\n", filename);
 out:
 	textreader_free(txt);
-out_close:
-	game_close(&f);
 	return ret;
 }
 
+/**
+ * Use a cooked MD5 model in place.
+ *
+ * Everything but the part array, which also holds the textures, points
+ * straight in to the file. Normals and tangents were worked out by
+ * md5cook so there's nothing to compute.
+ */
+static int mesh_cooked(const char *filename, struct md5_mesh *mdl)
+{
+	const struct gfile *f = &mdl->cooked;
+	const struct md5c_mesh *m = f->f_ptr;
+	const struct md5c_part *p;
+	struct md5_mesh_part *mesh;
+	const void *joints, *parts, *verts, *tris, *weights;
+	unsigned int i;
+
+	if ( f->f_len < sizeof(*m) || !md5c_hdr_ok(f, MD5C_MESH) ) {
+		con_printf("md5: %s: cooked by an incompatible md5cook\n",
+				filename);
+		return 0;
+	}
+
+	if ( !md5c_array(f, m->m_joints, m->m_num_joints,
+				sizeof(*mdl->baseSkel), &joints) ||
+			!md5c_array(f, m->m_parts, m->m_num_meshes,
+				sizeof(*p), &parts) )
+		goto bad;
+
+	p = parts;
+	mdl->baseSkel = (struct md5_joint_t *)joints;
+	mdl->num_joints = m->m_num_joints;
+	if ( !md5c_joints_ok(mdl->baseSkel, mdl->num_joints) )
+		goto bad;
+
+	if ( m->m_num_meshes ) {
+		mdl->meshes = mem_calloc(MEM_MD5MESH, m->m_num_meshes,
+					sizeof(*mdl->meshes));
+		if ( NULL == mdl->meshes )
+			return 0;
+		mdl->num_meshes = m->m_num_meshes;
+	}
+
+	for(i = 0; i < mdl->num_meshes; i++) {
+		mesh = &mdl->meshes[i];
+
+		memcpy(mesh->shader, p[i].p_shader, sizeof(mesh->shader));
+		mesh->shader[sizeof(mesh->shader) - 1] = '\0';
+
+		if ( !md5c_array(f, p[i].p_verts, p[i].p_num_verts,
+					sizeof(*mesh->vertices), &verts) ||
+				!md5c_array(f, p[i].p_tris, p[i].p_num_tris,
+					sizeof(*mesh->triangles), &tris) ||
+				!md5c_array(f, p[i].p_weights,
+					p[i].p_num_weights,
+					sizeof(*mesh->weights), &weights) )
+			goto bad;
+
+		mesh->vertices = (struct md5_vertex_t *)verts;
+		mesh->triangles = (struct md5_triangle_t *)tris;
+		mesh->num_verts = p[i].p_num_verts;
+		mesh->num_tris = p[i].p_num_tris;
+		mesh->num_weights = p[i].p_num_weights;
+
+		/* Weights are vectors but the archive only lines files up
+		 * to 8 bytes, in which case they have to be copied out.
+		 */
+		if ( (uintptr_t)weights & (MD5C_ALIGN - 1) ) {
+			mesh->weights = mem_alloc(MEM_MD5MESH,
+					mesh->num_weights *
+					sizeof(*mesh->weights));
+			if ( NULL == mesh->weights )
+				return 0;
+			memcpy(mesh->weights, weights,
+				mesh->num_weights * sizeof(*mesh->weights));
+		}else{
+			mesh->weights = (struct md5_weight_t *)weights;
+		}
+
+		if ( !mesh_valid(mdl, mesh) )
+			goto bad;
+
+		if ( mesh->num_verts > mdl->max_verts )
+			mdl->max_verts = mesh->num_verts;
+		if ( mesh->num_tris > mdl->max_tris )
+			mdl->max_tris = mesh->num_tris;
+	}
+
+	return 1;
+bad:
+	con_printf("md5: %s: bad or truncated cooked mesh\n", filename);
+	return 0;
+}
+
 static void vertex_final_position(struct md5_mesh *mdl,
 					struct md5_mesh_part *mesh,
 					struct md5_vertex_t *vert,
@@ -295,9 +478,9 @@ static int mesh_normals_and_tangents(struct md5_mesh *mdl,
 	unsigned int v, t, w;
 	vec3_t *verts = NULL, *norms = NULL, *tangs = NULL;
 
-	verts = calloc(mesh->num_verts, sizeof(*verts));
-	norms = calloc(mesh->num_verts, sizeof(*verts));
-	tangs = calloc(mesh->num_verts, sizeof(*verts));
+	verts = mem_calloc(MEM_MD5MESH, mesh->num_verts, sizeof(*verts));
+	norms = mem_calloc(MEM_MD5MESH, mesh->num_verts, sizeof(*verts));
+	tangs = mem_calloc(MEM_MD5MESH, mesh->num_verts, sizeof(*verts));
 	if ( NULL == verts || NULL == norms || NULL == tangs )
 		goto err;
 
@@ -365,14 +548,14 @@ static int mesh_normals_and_tangents(struct md5_mesh *mdl,
 		v_normalize(weight->tangent);
 	}
 
-	free(verts);
-	free(norms);
-	free(tangs);
+	mem_free(MEM_MD5MESH, verts);
+	mem_free(MEM_MD5MESH, norms);
+	mem_free(MEM_MD5MESH, tangs);
 	return 1;
 err:
-	free(verts);
-	free(norms);
-	free(tangs);
+	mem_free(MEM_MD5MESH, verts);
+	mem_free(MEM_MD5MESH, norms);
+	mem_free(MEM_MD5MESH, tangs);
 	return 0;
 }
 
@@ -390,6 +573,38 @@ static int calc_normals_and_tangents(struct md5_mesh *mdl)
 	return 1;
 }
 
+/**
+ * Load an MD5 model, cooked or text.
+ */
+int md5_mesh_read(const char *filename, struct md5_mesh *mdl)
+{
+	struct gfile f;
+	int ret;
+
+	if ( !game_open(&f, filename) ) {
+		con_printf("md5: error: couldn't open \"%s\"!\n", filename);
+		return 0;
+	}
+
+	/* Freeing the model closes it */
+	if ( md5c_cooked(&f) ) {
+		mdl->cooked = f;
+		return mesh_cooked(filename, mdl);
+	}
+
+	ret = mesh_parse(&f, filename, mdl) &&
+		calc_normals_and_tangents(mdl);
+	game_close(&f);
+	return ret;
+}
+
+/* Anything that isn't part of a cooked file was allocated */
+static void mesh_array_free(struct md5_mesh *mdl, void *ptr)
+{
+	if ( !md5c_owns(&mdl->cooked, ptr) )
+		mem_free(MEM_MD5MESH, ptr);
+}
+
 /**
  * Free resources allocated for the model.
  */
@@ -397,49 +612,91 @@ static void mesh_free(struct md5_mesh *mdl)
 {
 	unsigned int i;
 
-	if (mdl->baseSkel) {
-		free(mdl->baseSkel);
-	}
+	mesh_array_free(mdl, mdl->baseSkel);
 
 	if (mdl->meshes) {
 		/* Free mesh data */
 		for (i = 0; i < mdl->num_meshes; ++i) {
-			free(mdl->meshes[i].vertices);
-			free(mdl->meshes[i].triangles);
-			free(mdl->meshes[i].weights);
+			mesh_array_free(mdl, mdl->meshes[i].vertices);
+			mesh_array_free(mdl, mdl->meshes[i].triangles);
+			mesh_array_free(mdl, mdl->meshes[i].weights);
+			md5_skin_free(&mdl->meshes[i]);
 			tex_put(mdl->meshes[i].skin);
 		}
-		free(mdl->meshes);
+		mem_free(MEM_MD5MESH, mdl->meshes);
 	}
 
-	free(mdl->name);
+	if ( mdl->cooked.f_ptr )
+		game_close(&mdl->cooked);
+
+	mem_free(MEM_MD5MESH, mdl->name);
 	list_del(&mdl->list);
-	free(mdl);
+	mem_free(MEM_MD5MESH, mdl);
 }
 
 static LIST_HEAD(md5_meshes);
 
+/* Declare the skins before loading them so the reads overlap */
+static void prefetch_skins(struct md5_mesh *mesh)
+{
+	static const char * const sfx[] = {".tga", "_local.tga"};
+	const unsigned int num_sfx = sizeof(sfx)/sizeof(*sfx);
+	const char **names;
+	char *buf, *ptr;
+	size_t sz = 0;
+	unsigned int i, j;
+
+	for(i = 0; i < mesh->num_meshes; i++)
+		for(j = 0; j < num_sfx; j++)
+			sz += strlen(mesh->meshes[i].shader) +
+				strlen(sfx[j]) + 1;
+
+	buf = mem_alloc(MEM_MD5MESH, sz);
+	names = mem_alloc(MEM_MD5MESH,
+			mesh->num_meshes * num_sfx * sizeof(*names));
+	if ( buf && names ) {
+		for(ptr = buf, i = 0; i < mesh->num_meshes; i++) {
+			for(j = 0; j < num_sfx; j++) {
+				names[i * num_sfx + j] = ptr;
+				ptr += sprintf(ptr, "%s%s",
+						mesh->meshes[i].shader,
+						sfx[j]) + 1;
+			}
+		}
+		game_prefetch(names, mesh->num_meshes * num_sfx);
+	}
+
+	mem_free(MEM_MD5MESH, names);
+	mem_free(MEM_MD5MESH, buf);
+}
+
 static struct md5_mesh *do_mesh_load(const char *filename)
 {
 	struct md5_mesh *mesh;
 	unsigned int i;
 
-	mesh = calloc(1, sizeof(*mesh));
+	mesh = mem_calloc(MEM_MD5MESH, 1, sizeof(*mesh));
 	if ( NULL == mesh )
 		return NULL;
+	INIT_LIST_HEAD(&mesh->list);
 
 	/* Load MD5 model file */
-	if (!mesh_read(filename, mesh))
+	if (!md5_mesh_read(filename, mesh))
 		goto err;
 
-	calc_normals_and_tangents(mesh);
-
-	mesh->name = strdup(filename);
+	mesh->name = mem_strdup(MEM_MD5MESH, filename);
 	if ( NULL == mesh->name )
 		goto err;
 
+	for(i = 0; i < mesh->num_meshes; i++) {
+		if ( !md5_skin_init(&mesh->meshes[i]) )
+			goto err;
+	}
+
 	con_printf("md5: mesh loaded: %s\n", mesh->name);
 
+	prefetch_skins(mesh);
+
 	for(i = 0; i < mesh->num_meshes; i++) {
 		char buf[strlen(mesh->meshes[i].shader) + 26];
 		snprintf(buf, sizeof(buf), "%s.tga",
@@ -463,8 +720,6 @@ static struct md5_mesh *do_mesh_load(const char *filename)
 	return mesh;
 err:
 	mesh_free(mesh);
-	free(mesh->name);
-	free(mesh);
 	return NULL;
 }
 
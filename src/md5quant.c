@@ -0,0 +1,525 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2010 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Quantised md5 animations. Each joint's positions and orientations are
+* kept as two separate tracks of keys, with anything in between the
+* keys interpolated. A position key is three 16 bit steps across the
+* range the joint moves through during the animation. An orientation
+* key is a quaternion with the largest component dropped, because it
+* can be worked out from the other three, and those three at 15 bits
+* each. That's 8 bytes for a key, frame number included, where the
+* floats take 28 bytes per joint for every frame.
+*
+* Keys that interpolation can stand in for, to within a tolerance, are
+* left out. Frames are the finished skeletons, so errors are in model
+* space and don't add up through the hierarchy.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/vector.h>
+#include <blackbloc/tex.h>
+#include <blackbloc/model/md5.h>
+
+#include <math.h>
+#include "md5.h"
+
+/* Components other than the largest are within +/- 1/sqrt(2) */
+#define QROT_RANGE	0.70710678f
+#define QROT_STEPS	32767.0f
+#define QPOS_STEPS	65535.0f
+
+static uint16_t quantise(float val, float steps)
+{
+	if ( !(val > 0.0f) )
+		return 0;
+	if ( val > steps )
+		return steps;
+	return lrintf(val);
+}
+
+static void qrot_pack(const quat4_t in, uint16_t v[3])
+{
+	unsigned int i, j, big;
+	quat4_t q;
+	float sign;
+
+	/* Not every exporter manages unit quaternions */
+	memcpy(q, in, sizeof(q));
+	Quat_normalize(q);
+
+	for(big = 0, i = 1; i < 4; i++) {
+		if ( fabsf(q[i]) > fabsf(q[big]) )
+			big = i;
+	}
+
+	/* q and -q are the same rotation, pick the one which makes the
+	 * missing component positive
+	 */
+	sign = (q[big] < 0.0f) ? -1.0f : 1.0f;
+	for(i = j = 0; i < 4; i++) {
+		if ( i == big )
+			continue;
+		v[j++] = quantise((q[i] * sign + QROT_RANGE) *
+				(QROT_STEPS / (2.0f * QROT_RANGE)), QROT_STEPS);
+	}
+
+	v[0] |= (big & 1) << 15;
+	v[1] |= (big >> 1) << 15;
+}
+
+static void qrot_unpack(const uint16_t v[3], quat4_t q)
+{
+	/* Where the three that were kept go, for each one that wasn't */
+	static const uint8_t kept[4][3] = {
+		{1, 2, 3},
+		{0, 2, 3},
+		{0, 1, 3},
+		{0, 1, 2},
+	};
+	const float step = 2.0f * QROT_RANGE / QROT_STEPS;
+	unsigned int big;
+	float x, y, z, sum;
+
+	x = (v[0] & 0x7fff) * step - QROT_RANGE;
+	y = (v[1] & 0x7fff) * step - QROT_RANGE;
+	z = (v[2] & 0x7fff) * step - QROT_RANGE;
+	sum = x * x + y * y + z * z;
+
+	big = (v[0] >> 15) | ((v[1] >> 15) << 1);
+	q[kept[big][0]] = x;
+	q[kept[big][1]] = y;
+	q[kept[big][2]] = z;
+	q[big] = (sum < 1.0f) ? sqrtf(1.0f - sum) : 0.0f;
+}
+
+static void qpos_unpack(const struct md5_qjoint_t *qj, const uint16_t v[3],
+			vec3_t pos)
+{
+	pos[0] = qj->min[0] + v[0] * qj->scale[0];
+	pos[1] = qj->min[1] + v[1] * qj->scale[1];
+	pos[2] = qj->min[2] + v[2] * qj->scale[2];
+}
+
+/* Normalised lerp, the long way round is never wanted */
+static void qrot_lerp(const quat4_t a, const quat4_t b, float t, quat4_t out)
+{
+	float tb, mag;
+
+	tb = (Quat_dotProduct(a, b) < 0.0f) ? -t : t;
+	out[0] = a[0] * (1.0f - t) + b[0] * tb;
+	out[1] = a[1] * (1.0f - t) + b[1] * tb;
+	out[2] = a[2] * (1.0f - t) + b[2] * tb;
+	out[3] = a[3] * (1.0f - t) + b[3] * tb;
+
+	/* With the sign fixed up it can't be shorter than 1/sqrt(2) */
+	mag = 1.0f / sqrtf(out[0] * out[0] + out[1] * out[1] +
+				out[2] * out[2] + out[3] * out[3]);
+	out[0] *= mag;
+	out[1] *= mag;
+	out[2] *= mag;
+	out[3] *= mag;
+}
+
+/* The last key at or before a frame */
+static unsigned int key_find(const struct md5_qkey_t *keys, unsigned int num,
+				unsigned int frame)
+{
+	unsigned int lo = 0, n, i;
+
+	/* Always halving, so there's nothing for branch prediction to miss */
+	for(n = num; n > 1; n -= i) {
+		i = n / 2;
+		lo = (keys[lo + i].frame <= frame) ? lo + i : lo;
+	}
+
+	return lo;
+}
+
+/* How far between key k and the next one a point frac of the way from
+ * frame to the one after is, if it's past key k and there is a next one
+ */
+static int key_lerp(const struct md5_qkey_t *keys, unsigned int num,
+			unsigned int frame, float frac,
+			unsigned int *k, float *t)
+{
+	*k = key_find(keys, num, frame);
+	if ( *k + 1 >= num )
+		return 0;
+	*t = ((float)frame - (float)keys[*k].frame + frac) /
+		(float)(keys[*k + 1].frame - keys[*k].frame);
+	return *t > 0.0f;
+}
+
+static void qpos_get(const struct md5_qjoint_t *qj,
+			const struct md5_qkey_t *keys, unsigned int num,
+			unsigned int frame, float frac, vec3_t pos)
+{
+	vec3_t a, b;
+	unsigned int k;
+	float t;
+
+	if ( !key_lerp(keys, num, frame, frac, &k, &t) ) {
+		qpos_unpack(qj, keys[k].v, pos);
+		return;
+	}
+
+	qpos_unpack(qj, keys[k].v, a);
+	qpos_unpack(qj, keys[k + 1].v, b);
+	pos[0] = a[0] + t * (b[0] - a[0]);
+	pos[1] = a[1] + t * (b[1] - a[1]);
+	pos[2] = a[2] + t * (b[2] - a[2]);
+}
+
+static void qrot_get(const struct md5_qkey_t *keys, unsigned int num,
+			unsigned int frame, float frac, quat4_t orient)
+{
+	quat4_t a, b;
+	unsigned int k;
+	float t;
+
+	if ( !key_lerp(keys, num, frame, frac, &k, &t) ) {
+		qrot_unpack(keys[k].v, orient);
+		return;
+	}
+
+	qrot_unpack(keys[k].v, a);
+	qrot_unpack(keys[k + 1].v, b);
+	qrot_lerp(a, b, t, orient);
+}
+
+static void qjoint_at(const struct md5_anim *anim, unsigned int frame,
+			float frac, unsigned int joint,
+			vec3_t pos, quat4_t orient)
+{
+	const struct md5_qjoint_t *qj = &anim->qjoints[joint];
+
+	qpos_get(qj, anim->qkeys + qj->pos, qj->num_pos, frame, frac, pos);
+	qrot_get(anim->qkeys + qj->rot, qj->num_rot, frame, frac, orient);
+}
+
+/**
+ * Position and orientation of a joint at a given frame of a quantised
+ * animation.
+ */
+void md5_anim_qjoint(const struct md5_anim *anim, unsigned int frame,
+			unsigned int joint, vec3_t pos, quat4_t orient)
+{
+	qjoint_at(anim, frame, 0.0f, joint, pos, orient);
+}
+
+static int track_ok(const struct md5_anim *anim, uint32_t ofs,
+			unsigned int num)
+{
+	const struct md5_qkey_t *keys;
+	unsigned int i;
+
+	/* Every frame needs a key at or before it */
+	if ( anim->num_frames && 0 == num )
+		return 0;
+	if ( ofs > anim->num_qkeys || num > anim->num_qkeys - ofs )
+		return 0;
+
+	keys = anim->qkeys + ofs;
+	for(i = 0; i < num; i++) {
+		if ( keys[i].frame >= anim->num_frames )
+			return 0;
+		if ( i && keys[i].frame <= keys[i - 1].frame )
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Check a quantised animation from a cooked file, so that decoding it
+ * can't go outside of the keys.
+ */
+int md5_anim_qvalid(const struct md5_anim *anim)
+{
+	const struct md5_qjoint_t *qj;
+	unsigned int i;
+
+	for(i = 0; i < anim->num_joints; i++) {
+		qj = &anim->qjoints[i];
+		if ( !track_ok(anim, qj->pos, qj->num_pos) ||
+				!track_ok(anim, qj->rot, qj->num_rot) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Quantisation, which is where the work is and which doesn't need to be
+ * anything like as fast
+ */
+struct qbuild {
+	const struct md5_anim *anim;
+	struct md5_qjoint_t *qj;
+	unsigned int joint;
+
+	/* Every frame of the joint quantised, and what that decodes to */
+	struct md5_qkey_t *pos;
+	struct md5_qkey_t *rot;
+	vec3_t *pos_deq;
+	quat4_t *rot_deq;
+};
+
+static float pos_dist(const vec3_t a, const vec3_t b)
+{
+	float x = a[0] - b[0], y = a[1] - b[1], z = a[2] - b[2];
+	return sqrtf(x * x + y * y + z * z);
+}
+
+/* Angle between two orientations. From the chord rather than acos of
+ * the dot product, which in floats can't tell anything under about a
+ * milliradian from nothing.
+ */
+static float rot_dist(const quat4_t a, const quat4_t b)
+{
+	float sign, x, y, z, w, d;
+
+	sign = (Quat_dotProduct(a, b) < 0.0f) ? -1.0f : 1.0f;
+	x = a[0] - b[0] * sign;
+	y = a[1] - b[1] * sign;
+	z = a[2] - b[2] * sign;
+	w = a[3] - b[3] * sign;
+	d = sqrtf(x * x + y * y + z * z + w * w) * 0.5f;
+	return 4.0f * asinf((d < 1.0f) ? d : 1.0f);
+}
+
+/* Whether keys at s and e can stand in for all the frames between */
+static int pos_span_ok(const struct qbuild *b, unsigned int s,
+			unsigned int e, float tol)
+{
+	struct md5_qkey_t keys[2] = {b->pos[s], b->pos[e]};
+	unsigned int f;
+	vec3_t p;
+
+	for(f = s + 1; f < e; f++) {
+		qpos_get(b->qj, keys, 2, f, 0.0f, p);
+		if ( pos_dist(p, b->pos_deq[f]) > tol )
+			return 0;
+	}
+
+	return 1;
+}
+
+static int rot_span_ok(const struct qbuild *b, unsigned int s,
+			unsigned int e, float tol)
+{
+	struct md5_qkey_t keys[2] = {b->rot[s], b->rot[e]};
+	unsigned int f;
+	quat4_t q;
+
+	for(f = s + 1; f < e; f++) {
+		qrot_get(keys, 2, f, 0.0f, q);
+		if ( rot_dist(q, b->rot_deq[f]) > tol )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Greedily stretch each span of frames between keys as far as it goes,
+ * keys are squashed down to the start of the track as they're chosen
+ */
+static unsigned int reduce(const struct qbuild *b, struct md5_qkey_t *track,
+			int (*ok)(const struct qbuild *b, unsigned int s,
+				unsigned int e, float tol),
+			float tol)
+{
+	unsigned int n = b->anim->num_frames, s, e, num = 1;
+
+	for(s = 0; s + 1 < n; s = e) {
+		for(e = s + 1; e + 1 < n && (*ok)(b, s, e + 1, tol); e++)
+			;
+		track[num++] = track[e];
+	}
+
+	return num;
+}
+
+static void quantise_joint(struct qbuild *b)
+{
+	const struct md5_anim *anim = b->anim;
+	struct md5_qjoint_t *qj = b->qj;
+	vec3_t max;
+	const float *p;
+	unsigned int f, i;
+
+	for(i = 0; i < 3; i++) {
+		qj->min[i] = max[i] = anim->pos[b->joint][i];
+		for(f = 1; f < anim->num_frames; f++) {
+			p = anim->pos[f * anim->num_joints + b->joint];
+			if ( p[i] < qj->min[i] )
+				qj->min[i] = p[i];
+			if ( p[i] > max[i] )
+				max[i] = p[i];
+		}
+		qj->scale[i] = (max[i] - qj->min[i]) / QPOS_STEPS;
+	}
+
+	for(f = 0; f < anim->num_frames; f++) {
+		p = anim->pos[f * anim->num_joints + b->joint];
+		b->pos[f].frame = b->rot[f].frame = f;
+		for(i = 0; i < 3; i++) {
+			b->pos[f].v[i] = (qj->scale[i] > 0.0f) ?
+				quantise((p[i] - qj->min[i]) / qj->scale[i],
+					QPOS_STEPS) : 0;
+		}
+		qpos_unpack(qj, b->pos[f].v, b->pos_deq[f]);
+
+		qrot_pack(anim->orient[f * anim->num_joints + b->joint],
+				b->rot[f].v);
+		qrot_unpack(b->rot[f].v, b->rot_deq[f]);
+	}
+}
+
+/**
+ * Replace an animation's positions and orientations with quantised
+ * ones.
+ * @param anim the animation, which mustn't be quantised already
+ * @param pos_tol how far keyframe reduction may move a joint, in model
+ *        units, on top of quantisation
+ * @param rot_tol how far it may turn one, in radians
+ * @param pos_err worst position error from the original, returned
+ * @param rot_err worst orientation error from the original, returned
+ * @return zero if there wasn't enough memory or there are too many
+ *         frames for 16 bit frame numbers, in which case the
+ *         animation is left as it was.
+ */
+int md5_anim_quantise(struct md5_anim *anim, float pos_tol, float rot_tol,
+			float *pos_err, float *rot_err)
+{
+	struct qbuild b;
+	struct md5_qkey_t *keys, *tmp;
+	unsigned int j, f, n, num_keys = 0;
+	vec3_t p;
+	quat4_t q, o;
+	int ret = 0;
+
+	/* Key frames are 16 bits and key indexes 32 */
+	if ( anim->num_frames > 0xffff || (uint64_t)2 * anim->num_frames *
+			anim->num_joints > 0xffffffffU )
+		return 0;
+
+	memset(&b, 0, sizeof(b));
+	b.anim = anim;
+
+	anim->qjoints = mem_calloc(MEM_MD5ANIM, anim->num_joints,
+					sizeof(*anim->qjoints));
+	keys = mem_alloc(MEM_MD5ANIM, (size_t)2 * anim->num_frames *
+				anim->num_joints * sizeof(*keys));
+	b.pos = mem_alloc(MEM_MD5ANIM, anim->num_frames * sizeof(*b.pos));
+	b.rot = mem_alloc(MEM_MD5ANIM, anim->num_frames * sizeof(*b.rot));
+	b.pos_deq = mem_alloc(MEM_MD5ANIM,
+				anim->num_frames * sizeof(*b.pos_deq));
+	b.rot_deq = mem_alloc(MEM_MD5ANIM,
+				anim->num_frames * sizeof(*b.rot_deq));
+	if ( anim->num_joints && anim->num_frames && (NULL == keys ||
+			NULL == anim->qjoints || NULL == b.pos ||
+			NULL == b.rot || NULL == b.pos_deq ||
+			NULL == b.rot_deq) ) {
+		mem_free(MEM_MD5ANIM, keys);
+		mem_free(MEM_MD5ANIM, anim->qjoints);
+		anim->qjoints = NULL;
+		goto out;
+	}
+
+	/* Without frames there's nothing to key, the joints stay zeroed */
+	for(j = 0; anim->num_frames && j < anim->num_joints; j++) {
+		b.qj = &anim->qjoints[j];
+		b.joint = j;
+		quantise_joint(&b);
+
+		n = reduce(&b, b.pos, pos_span_ok, pos_tol);
+		memcpy(keys + num_keys, b.pos, n * sizeof(*keys));
+		b.qj->pos = num_keys;
+		b.qj->num_pos = n;
+		num_keys += n;
+
+		n = reduce(&b, b.rot, rot_span_ok, rot_tol);
+		memcpy(keys + num_keys, b.rot, n * sizeof(*keys));
+		b.qj->rot = num_keys;
+		b.qj->num_rot = n;
+		num_keys += n;
+	}
+
+	/* Give back what reduction saved */
+	tmp = (num_keys) ? mem_alloc(MEM_MD5ANIM, num_keys * sizeof(*keys)) :
+			NULL;
+	if ( tmp )
+		memcpy(tmp, keys, num_keys * sizeof(*keys));
+	mem_free(MEM_MD5ANIM, keys);
+	if ( num_keys && NULL == tmp ) {
+		mem_free(MEM_MD5ANIM, anim->qjoints);
+		anim->qjoints = NULL;
+		goto out;
+	}
+	anim->qkeys = tmp;
+	anim->num_qkeys = num_keys;
+
+	*pos_err = *rot_err = 0.0f;
+	for(f = 0; f < anim->num_frames; f++) {
+		for(j = 0; j < anim->num_joints; j++) {
+			n = f * anim->num_joints + j;
+			md5_anim_qjoint(anim, f, j, p, q);
+			memcpy(o, anim->orient[n], sizeof(o));
+			Quat_normalize(o);
+			if ( pos_dist(p, anim->pos[n]) > *pos_err )
+				*pos_err = pos_dist(p, anim->pos[n]);
+			if ( rot_dist(q, o) > *rot_err )
+				*rot_err = rot_dist(q, o);
+		}
+	}
+
+	if ( !md5c_owns(&anim->cooked, anim->pos) )
+		mem_free(MEM_MD5ANIM, anim->pos);
+	if ( !md5c_owns(&anim->cooked, anim->orient) )
+		mem_free(MEM_MD5ANIM, anim->orient);
+	anim->pos = NULL;
+	anim->orient = NULL;
+	ret = 1;
+out:
+	mem_free(MEM_MD5ANIM, b.pos);
+	mem_free(MEM_MD5ANIM, b.rot);
+	mem_free(MEM_MD5ANIM, b.pos_deq);
+	mem_free(MEM_MD5ANIM, b.rot_deq);
+	return ret;
+}
+
+/**
+ * InterpolateSkeletons() for quantised animations. Between one frame and
+ * the next, which is almost always what's asked for, both are in the
+ * same span of keys so the keys can be interpolated directly. Anything
+ * else, like looping back to the start, is done frame by frame.
+ */
+void md5_anim_qinterp(const struct md5_anim *anim, unsigned int frameA,
+			unsigned int frameB, float interp,
+			struct md5_joint_t *out)
+{
+	vec3_t posA, posB;
+	quat4_t orientA, orientB;
+	unsigned int i;
+
+	if ( frameB == frameA + 1 ) {
+		for (i = 0; i < anim->num_joints; ++i) {
+			out[i].parent = anim->hier[i].parent;
+			qjoint_at(anim, frameA, interp, i,
+					out[i].pos, out[i].orient);
+		}
+		return;
+	}
+
+	for (i = 0; i < anim->num_joints; ++i) {
+		md5_anim_qjoint(anim, frameA, i, posA, orientA);
+		md5_anim_qjoint(anim, frameB, i, posB, orientB);
+
+		out[i].parent = anim->hier[i].parent;
+		out[i].pos[0] = posA[0] + interp * (posB[0] - posA[0]);
+		out[i].pos[1] = posA[1] + interp * (posB[1] - posA[1]);
+		out[i].pos[2] = posA[2] + interp * (posB[2] - posA[2]);
+		Quat_slerp(orientA, orientB, interp, out[i].orient);
+	}
+}
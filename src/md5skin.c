@@ -0,0 +1,689 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2010 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* md5 skinning. Each frame the skeleton is turned in to a palette of
+* 3x4 matrices, once per model, and then every weight is a couple of
+* matrix multiply-adds rather than two quaternion rotations.
+*
+* At load the vertices of each mesh are sorted by how many weights they
+* have, so they go in runs with the same count, and each run is cut up
+* in to groups of MD5_SKIN_LANES vertices. A group's weights are laid
+* out as one block per weight, a field at a time, so SIMD can skin a
+* vertex per lane. Weights are stored multiplied by their bias, with
+* the bias as the 4th component of the position to pick up the
+* translation. The last group of a run is padded out with zero weights.
+*
+* The kernel is picked on first use, the fastest one the CPU has going
+* by md5bench rather than the widest: AVX2 with FMA, then AVX-512, SSE2
+* or plain C. AVX-512 is no faster than AVX2 there, and on a lot of
+* CPUs it costs clock speed. The plain C one is the reference, SSE2
+* does the same arithmetic in the same order so it comes out the same,
+* the wider ones use FMA so they're only the same to within rounding.
+* Matrix rows are loaded per joint and transposed, rather than
+* gathered, gathers are slower than that on a lot of CPUs.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/vector.h>
+#include <blackbloc/tex.h>
+#include <blackbloc/model/md5.h>
+
+#include <pthread.h>
+#include <math.h>
+#include "md5.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MD5_SKIN_X86 1
+#endif
+
+struct vert_order {
+	unsigned int count;
+	unsigned int index;
+};
+
+static int order_cmp(const void *_A, const void *_B)
+{
+	const struct vert_order *a = _A, *b = _B;
+
+	if ( a->count != b->count )
+		return (a->count < b->count) ? -1 : 1;
+	if ( a->index != b->index )
+		return (a->index < b->index) ? -1 : 1;
+	return 0;
+}
+
+static void put_weight(struct md5_skin_block_t *b, unsigned int lane,
+			const struct md5_weight_t *w)
+{
+	b->joint[lane] = w->joint;
+	b->pos[0][lane] = w->pos[0] * w->bias;
+	b->pos[1][lane] = w->pos[1] * w->bias;
+	b->pos[2][lane] = w->pos[2] * w->bias;
+	b->pos[3][lane] = w->bias;
+	b->normal[0][lane] = w->normal[0] * w->bias;
+	b->normal[1][lane] = w->normal[1] * w->bias;
+	b->normal[2][lane] = w->normal[2] * w->bias;
+}
+
+static size_t num_groups(unsigned int num_verts)
+{
+	return num_verts / MD5_SKIN_LANES +
+		((num_verts % MD5_SKIN_LANES) ? 1 : 0);
+}
+
+/* Blocks for a run, with the last group padded out */
+static int run_blocks(size_t *num_blocks, unsigned int num_verts,
+			unsigned int count)
+{
+	const size_t max = ((size_t)-1) / sizeof(struct md5_skin_block_t);
+	size_t groups = num_groups(num_verts);
+
+	if ( count && groups > (max - *num_blocks) / count )
+		return 0;
+	*num_blocks += groups * count;
+	return 1;
+}
+
+/**
+ * Build the skinning layout for a mesh which has passed mesh_valid().
+ * @return zero if there wasn't enough memory.
+ */
+int md5_skin_init(struct md5_mesh_part *mesh)
+{
+	struct vert_order *order;
+	struct md5_skin_block_t *blk = NULL;
+	struct md5_skin_run_t *run = NULL;
+	unsigned int *remap = NULL;
+	size_t num_blocks = 0;
+	unsigned int i, j, k, num_runs = 0;
+
+	order = mem_alloc(MEM_MD5MESH, mesh->num_verts * sizeof(*order));
+	remap = mem_alloc(MEM_MD5MESH, mesh->num_verts * sizeof(*remap));
+	if ( mesh->num_verts && (NULL == order || NULL == remap) )
+		goto err;
+
+	for(i = 0; i < mesh->num_verts; i++) {
+		order[i].count = mesh->vertices[i].count;
+		order[i].index = i;
+	}
+
+	qsort(order, mesh->num_verts, sizeof(*order), order_cmp);
+	for(i = 0; i < mesh->num_verts; i = j) {
+		for(j = i; j < mesh->num_verts &&
+				order[j].count == order[i].count; j++)
+			remap[order[j].index] = j;
+		if ( !run_blocks(&num_blocks, j - i, order[i].count) )
+			goto err;
+		num_runs++;
+	}
+
+	/* Zeroed, so padding is joint 0 with no bias */
+	mesh->skin_blocks = mem_calloc(MEM_MD5MESH, num_blocks,
+					sizeof(*mesh->skin_blocks));
+	mesh->skin_runs = mem_alloc(MEM_MD5MESH,
+				num_runs * sizeof(*mesh->skin_runs));
+	mesh->skin_st = mem_alloc(MEM_MD5MESH,
+				mesh->num_verts * sizeof(*mesh->skin_st));
+	mesh->skin_indices = mem_alloc(MEM_MD5MESH, mesh->num_tris * 3 *
+				sizeof(*mesh->skin_indices));
+	if ( (num_blocks && NULL == mesh->skin_blocks) ||
+			(num_runs && NULL == mesh->skin_runs) ||
+			(mesh->num_verts && NULL == mesh->skin_st) ||
+			(mesh->num_tris && NULL == mesh->skin_indices) )
+		goto err;
+
+	for(blk = mesh->skin_blocks, i = 0; i < mesh->num_verts; i++) {
+		const struct md5_vertex_t *v = &mesh->vertices[order[i].index];
+
+		if ( 0 == i || v->count != order[i - 1].count ) {
+			if ( run )
+				blk += num_groups(run->num_verts) *
+						run->num_weights;
+			run = &mesh->skin_runs[mesh->num_skin_runs++];
+			run->num_verts = 0;
+			run->num_weights = v->count;
+		}
+
+		k = run->num_verts++;
+		for(j = 0; j < v->count; j++) {
+			put_weight(&blk[(k / MD5_SKIN_LANES) * v->count + j],
+					k % MD5_SKIN_LANES,
+					&mesh->weights[v->start + j]);
+		}
+
+		mesh->skin_st[i][0] = v->st[0];
+		mesh->skin_st[i][1] = 1.0f - v->st[1];
+	}
+
+	for(i = 0; i < mesh->num_tris; i++) {
+		for(j = 0; j < 3; j++) {
+			mesh->skin_indices[i * 3 + j] =
+				remap[mesh->triangles[i].index[j]];
+		}
+	}
+
+	mem_free(MEM_MD5MESH, order);
+	mem_free(MEM_MD5MESH, remap);
+	return 1;
+err:
+	mem_free(MEM_MD5MESH, order);
+	mem_free(MEM_MD5MESH, remap);
+	md5_skin_free(mesh);
+	return 0;
+}
+
+void md5_skin_free(struct md5_mesh_part *mesh)
+{
+	mem_free(MEM_MD5MESH, mesh->skin_blocks);
+	mem_free(MEM_MD5MESH, mesh->skin_runs);
+	mem_free(MEM_MD5MESH, mesh->skin_st);
+	mem_free(MEM_MD5MESH, mesh->skin_indices);
+	mesh->skin_blocks = NULL;
+	mesh->skin_runs = NULL;
+	mesh->skin_st = NULL;
+	mesh->skin_indices = NULL;
+	mesh->num_skin_runs = 0;
+}
+
+/**
+ * Turn a skeleton in to a matrix palette. The rotation is exactly what
+ * Quat_rotatePoint() does, which scales by the length of the quaternion
+ * if it isn't a unit one.
+ */
+void md5_palette(const struct md5_joint_t *skel, unsigned int num_joints,
+			struct md5_mat34_t *pal)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_joints; i++) {
+		const float *q = skel[i].orient;
+		float x = q[X], y = q[Y], z = q[Z], w = q[W];
+		float xx = x * x, yy = y * y, zz = z * z, ww = w * w;
+		float len, s;
+
+		len = sqrtf(xx + yy + zz + ww);
+		s = (len > 0.0f) ? 1.0f / len : 1.0f;
+
+		pal[i].row[0][0] = (ww + xx - yy - zz) * s;
+		pal[i].row[0][1] = 2.0f * (x * y - w * z) * s;
+		pal[i].row[0][2] = 2.0f * (x * z + w * y) * s;
+		pal[i].row[0][3] = skel[i].pos[0];
+
+		pal[i].row[1][0] = 2.0f * (x * y + w * z) * s;
+		pal[i].row[1][1] = (ww - xx + yy - zz) * s;
+		pal[i].row[1][2] = 2.0f * (y * z - w * x) * s;
+		pal[i].row[1][3] = skel[i].pos[1];
+
+		pal[i].row[2][0] = 2.0f * (x * z - w * y) * s;
+		pal[i].row[2][1] = 2.0f * (y * z + w * x) * s;
+		pal[i].row[2][2] = (ww - xx - yy + zz) * s;
+		pal[i].row[2][3] = skel[i].pos[2];
+	}
+}
+
+/* Skin up to MD5_SKIN_LANES vertices, given the blocks for their
+ * weights
+ */
+typedef void (*skin_fn_t)(const struct md5_skin_block_t *blk,
+				unsigned int count,
+				const struct md5_mat34_t *pal,
+				unsigned int num, vec3_t *verts, vec3_t *norms);
+
+static void skin_scalar(const struct md5_skin_block_t *blk,
+			unsigned int count, const struct md5_mat34_t *pal,
+			unsigned int num, vec3_t *verts, vec3_t *norms)
+{
+	unsigned int i, j;
+
+	for(i = 0; i < num; i++) {
+		float vx = 0.0f, vy = 0.0f, vz = 0.0f;
+		float nx = 0.0f, ny = 0.0f, nz = 0.0f;
+		float len;
+
+		for(j = 0; j < count; j++) {
+			const struct md5_skin_block_t *b = &blk[j];
+			const struct md5_mat34_t *m = &pal[b->joint[i]];
+
+			vx += m->row[0][0] * b->pos[0][i] +
+				m->row[0][1] * b->pos[1][i] +
+				m->row[0][2] * b->pos[2][i] +
+				m->row[0][3] * b->pos[3][i];
+			vy += m->row[1][0] * b->pos[0][i] +
+				m->row[1][1] * b->pos[1][i] +
+				m->row[1][2] * b->pos[2][i] +
+				m->row[1][3] * b->pos[3][i];
+			vz += m->row[2][0] * b->pos[0][i] +
+				m->row[2][1] * b->pos[1][i] +
+				m->row[2][2] * b->pos[2][i] +
+				m->row[2][3] * b->pos[3][i];
+
+			nx += m->row[0][0] * b->normal[0][i] +
+				m->row[0][1] * b->normal[1][i] +
+				m->row[0][2] * b->normal[2][i];
+			ny += m->row[1][0] * b->normal[0][i] +
+				m->row[1][1] * b->normal[1][i] +
+				m->row[1][2] * b->normal[2][i];
+			nz += m->row[2][0] * b->normal[0][i] +
+				m->row[2][1] * b->normal[1][i] +
+				m->row[2][2] * b->normal[2][i];
+		}
+
+		verts[i][0] = vx;
+		verts[i][1] = vy;
+		verts[i][2] = vz;
+
+		len = sqrtf(nx * nx + ny * ny + nz * nz);
+		if ( len != 0.0f ) {
+			len = 1.0f / len;
+			nx *= len;
+			ny *= len;
+			nz *= len;
+		}
+		norms[i][0] = nx;
+		norms[i][1] = ny;
+		norms[i][2] = nz;
+	}
+}
+
+#if MD5_SKIN_X86
+/* SIMD results come out a field at a time, vertices are interleaved.
+ * The helpers here have to be inlined, -Os doesn't bother and then the
+ * vectors all go through the stack.
+ */
+__attribute__((always_inline))
+static inline void put_verts(float out[6][MD5_SKIN_LANES], unsigned int num,
+				vec3_t *verts, vec3_t *norms)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		verts[i][0] = out[0][i];
+		verts[i][1] = out[1][i];
+		verts[i][2] = out[2][i];
+		norms[i][0] = out[3][i];
+		norms[i][1] = out[4][i];
+		norms[i][2] = out[5][i];
+	}
+}
+
+/* Row r of the matrices for 4 joints, transposed to a column per
+ * register, times a weight for each
+ */
+__attribute__((target("sse2"), always_inline))
+static inline void sse2_row(const struct md5_mat34_t *pal,
+				const int32_t *joint, unsigned int r,
+				const __m128 p[4], const __m128 nm[3],
+				__m128 *v, __m128 *n)
+{
+	__m128 c0, c1, c2, c3;
+
+	c0 = _mm_loadu_ps(pal[joint[0]].row[r]);
+	c1 = _mm_loadu_ps(pal[joint[1]].row[r]);
+	c2 = _mm_loadu_ps(pal[joint[2]].row[r]);
+	c3 = _mm_loadu_ps(pal[joint[3]].row[r]);
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+	*v = _mm_add_ps(*v, _mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(c0, p[0]), _mm_mul_ps(c1, p[1])),
+			_mm_mul_ps(c2, p[2])), _mm_mul_ps(c3, p[3])));
+	*n = _mm_add_ps(*n, _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(c0, nm[0]), _mm_mul_ps(c1, nm[1])),
+			_mm_mul_ps(c2, nm[2])));
+}
+
+__attribute__((target("sse2")))
+static void skin_sse2(const struct md5_skin_block_t *blk,
+			unsigned int count, const struct md5_mat34_t *pal,
+			unsigned int num, vec3_t *verts, vec3_t *norms)
+{
+	float out[6][MD5_SKIN_LANES];
+	unsigned int i, j;
+
+	for(i = 0; i < num; i += 4) {
+		__m128 v0, v1, v2, n0, n1, n2, len;
+
+		v0 = v1 = v2 = n0 = n1 = n2 = _mm_setzero_ps();
+
+		for(j = 0; j < count; j++) {
+			const struct md5_skin_block_t *b = &blk[j];
+			__m128 p[4], nm[3];
+
+			p[0] = _mm_loadu_ps(b->pos[0] + i);
+			p[1] = _mm_loadu_ps(b->pos[1] + i);
+			p[2] = _mm_loadu_ps(b->pos[2] + i);
+			p[3] = _mm_loadu_ps(b->pos[3] + i);
+			nm[0] = _mm_loadu_ps(b->normal[0] + i);
+			nm[1] = _mm_loadu_ps(b->normal[1] + i);
+			nm[2] = _mm_loadu_ps(b->normal[2] + i);
+
+			sse2_row(pal, b->joint + i, 0, p, nm, &v0, &n0);
+			sse2_row(pal, b->joint + i, 1, p, nm, &v1, &n1);
+			sse2_row(pal, b->joint + i, 2, p, nm, &v2, &n2);
+		}
+
+		len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(n0, n0), _mm_mul_ps(n1, n1)),
+				_mm_mul_ps(n2, n2)));
+		/* Zero length normals stay zero, NaNs stay NaN */
+		len = _mm_or_ps(_mm_and_ps(
+				_mm_cmpneq_ps(len, _mm_setzero_ps()),
+				_mm_div_ps(_mm_set1_ps(1.0f), len)),
+				_mm_cmpunord_ps(len, len));
+
+		_mm_storeu_ps(out[0] + i, v0);
+		_mm_storeu_ps(out[1] + i, v1);
+		_mm_storeu_ps(out[2] + i, v2);
+		_mm_storeu_ps(out[3] + i, _mm_mul_ps(n0, len));
+		_mm_storeu_ps(out[4] + i, _mm_mul_ps(n1, len));
+		_mm_storeu_ps(out[5] + i, _mm_mul_ps(n2, len));
+	}
+
+	put_verts(out, num, verts, norms);
+}
+
+/* As sse2_row() for 8 joints, joints 4-7 in the top half */
+__attribute__((target("avx2,fma"), always_inline))
+static inline void avx2_row(const struct md5_mat34_t *pal,
+				const int32_t *joint, unsigned int r,
+				const __m256 p[4], const __m256 nm[3],
+				__m256 *v, __m256 *n)
+{
+	__m256 c0, c1, c2, c3, t0, t1, t2, t3;
+
+	c0 = _mm256_insertf128_ps(_mm256_castps128_ps256(
+			_mm_loadu_ps(pal[joint[0]].row[r])),
+			_mm_loadu_ps(pal[joint[4]].row[r]), 1);
+	c1 = _mm256_insertf128_ps(_mm256_castps128_ps256(
+			_mm_loadu_ps(pal[joint[1]].row[r])),
+			_mm_loadu_ps(pal[joint[5]].row[r]), 1);
+	c2 = _mm256_insertf128_ps(_mm256_castps128_ps256(
+			_mm_loadu_ps(pal[joint[2]].row[r])),
+			_mm_loadu_ps(pal[joint[6]].row[r]), 1);
+	c3 = _mm256_insertf128_ps(_mm256_castps128_ps256(
+			_mm_loadu_ps(pal[joint[3]].row[r])),
+			_mm_loadu_ps(pal[joint[7]].row[r]), 1);
+
+	t0 = _mm256_unpacklo_ps(c0, c1);
+	t1 = _mm256_unpacklo_ps(c2, c3);
+	t2 = _mm256_unpackhi_ps(c0, c1);
+	t3 = _mm256_unpackhi_ps(c2, c3);
+	c0 = _mm256_shuffle_ps(t0, t1, 0x44);
+	c1 = _mm256_shuffle_ps(t0, t1, 0xee);
+	c2 = _mm256_shuffle_ps(t2, t3, 0x44);
+	c3 = _mm256_shuffle_ps(t2, t3, 0xee);
+
+	*v = _mm256_fmadd_ps(c0, p[0], *v);
+	*v = _mm256_fmadd_ps(c1, p[1], *v);
+	*v = _mm256_fmadd_ps(c2, p[2], *v);
+	*v = _mm256_fmadd_ps(c3, p[3], *v);
+	*n = _mm256_fmadd_ps(c0, nm[0], *n);
+	*n = _mm256_fmadd_ps(c1, nm[1], *n);
+	*n = _mm256_fmadd_ps(c2, nm[2], *n);
+}
+
+__attribute__((target("avx2,fma")))
+static void skin_avx2(const struct md5_skin_block_t *blk,
+			unsigned int count, const struct md5_mat34_t *pal,
+			unsigned int num, vec3_t *verts, vec3_t *norms)
+{
+	float out[6][MD5_SKIN_LANES];
+	unsigned int i, j;
+
+	for(i = 0; i < num; i += 8) {
+		__m256 v0, v1, v2, n0, n1, n2, len;
+
+		v0 = v1 = v2 = n0 = n1 = n2 = _mm256_setzero_ps();
+
+		for(j = 0; j < count; j++) {
+			const struct md5_skin_block_t *b = &blk[j];
+			__m256 p[4], nm[3];
+
+			p[0] = _mm256_loadu_ps(b->pos[0] + i);
+			p[1] = _mm256_loadu_ps(b->pos[1] + i);
+			p[2] = _mm256_loadu_ps(b->pos[2] + i);
+			p[3] = _mm256_loadu_ps(b->pos[3] + i);
+			nm[0] = _mm256_loadu_ps(b->normal[0] + i);
+			nm[1] = _mm256_loadu_ps(b->normal[1] + i);
+			nm[2] = _mm256_loadu_ps(b->normal[2] + i);
+
+			avx2_row(pal, b->joint + i, 0, p, nm, &v0, &n0);
+			avx2_row(pal, b->joint + i, 1, p, nm, &v1, &n1);
+			avx2_row(pal, b->joint + i, 2, p, nm, &v2, &n2);
+		}
+
+		len = _mm256_mul_ps(n0, n0);
+		len = _mm256_fmadd_ps(n1, n1, len);
+		len = _mm256_fmadd_ps(n2, n2, len);
+		len = _mm256_sqrt_ps(len);
+		len = _mm256_or_ps(_mm256_and_ps(
+				_mm256_cmp_ps(len, _mm256_setzero_ps(),
+					_CMP_NEQ_OQ),
+				_mm256_div_ps(_mm256_set1_ps(1.0f), len)),
+				_mm256_cmp_ps(len, len, _CMP_UNORD_Q));
+
+		_mm256_storeu_ps(out[0] + i, v0);
+		_mm256_storeu_ps(out[1] + i, v1);
+		_mm256_storeu_ps(out[2] + i, v2);
+		_mm256_storeu_ps(out[3] + i, _mm256_mul_ps(n0, len));
+		_mm256_storeu_ps(out[4] + i, _mm256_mul_ps(n1, len));
+		_mm256_storeu_ps(out[5] + i, _mm256_mul_ps(n2, len));
+	}
+
+	put_verts(out, num, verts, norms);
+}
+
+/* As sse2_row() for 16 joints, a 128 bit lane for every 4th joint */
+__attribute__((target("avx512f"), always_inline))
+static inline __m512 avx512_col(const struct md5_mat34_t *pal,
+				const int32_t *joint, unsigned int r)
+{
+	__m512 c;
+
+	c = _mm512_castps128_ps512(_mm_loadu_ps(pal[joint[0]].row[r]));
+	c = _mm512_insertf32x4(c, _mm_loadu_ps(pal[joint[4]].row[r]), 1);
+	c = _mm512_insertf32x4(c, _mm_loadu_ps(pal[joint[8]].row[r]), 2);
+	c = _mm512_insertf32x4(c, _mm_loadu_ps(pal[joint[12]].row[r]), 3);
+	return c;
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void avx512_row(const struct md5_mat34_t *pal,
+				const int32_t *joint, unsigned int r,
+				const __m512 p[4], const __m512 nm[3],
+				__m512 *v, __m512 *n)
+{
+	__m512 c0, c1, c2, c3, t0, t1, t2, t3;
+
+	c0 = avx512_col(pal, joint + 0, r);
+	c1 = avx512_col(pal, joint + 1, r);
+	c2 = avx512_col(pal, joint + 2, r);
+	c3 = avx512_col(pal, joint + 3, r);
+
+	t0 = _mm512_unpacklo_ps(c0, c1);
+	t1 = _mm512_unpacklo_ps(c2, c3);
+	t2 = _mm512_unpackhi_ps(c0, c1);
+	t3 = _mm512_unpackhi_ps(c2, c3);
+	c0 = _mm512_shuffle_ps(t0, t1, 0x44);
+	c1 = _mm512_shuffle_ps(t0, t1, 0xee);
+	c2 = _mm512_shuffle_ps(t2, t3, 0x44);
+	c3 = _mm512_shuffle_ps(t2, t3, 0xee);
+
+	*v = _mm512_fmadd_ps(c0, p[0], *v);
+	*v = _mm512_fmadd_ps(c1, p[1], *v);
+	*v = _mm512_fmadd_ps(c2, p[2], *v);
+	*v = _mm512_fmadd_ps(c3, p[3], *v);
+	*n = _mm512_fmadd_ps(c0, nm[0], *n);
+	*n = _mm512_fmadd_ps(c1, nm[1], *n);
+	*n = _mm512_fmadd_ps(c2, nm[2], *n);
+}
+
+__attribute__((target("avx512f")))
+static void skin_avx512(const struct md5_skin_block_t *blk,
+			unsigned int count, const struct md5_mat34_t *pal,
+			unsigned int num, vec3_t *verts, vec3_t *norms)
+{
+	float out[6][MD5_SKIN_LANES];
+	__m512 v0, v1, v2, n0, n1, n2, len;
+	__mmask16 ok;
+	unsigned int j;
+
+	v0 = v1 = v2 = n0 = n1 = n2 = _mm512_setzero_ps();
+
+	for(j = 0; j < count; j++) {
+		const struct md5_skin_block_t *b = &blk[j];
+		__m512 p[4], nm[3];
+
+		p[0] = _mm512_loadu_ps(b->pos[0]);
+		p[1] = _mm512_loadu_ps(b->pos[1]);
+		p[2] = _mm512_loadu_ps(b->pos[2]);
+		p[3] = _mm512_loadu_ps(b->pos[3]);
+		nm[0] = _mm512_loadu_ps(b->normal[0]);
+		nm[1] = _mm512_loadu_ps(b->normal[1]);
+		nm[2] = _mm512_loadu_ps(b->normal[2]);
+
+		avx512_row(pal, b->joint, 0, p, nm, &v0, &n0);
+		avx512_row(pal, b->joint, 1, p, nm, &v1, &n1);
+		avx512_row(pal, b->joint, 2, p, nm, &v2, &n2);
+	}
+
+	len = _mm512_mul_ps(n0, n0);
+	len = _mm512_fmadd_ps(n1, n1, len);
+	len = _mm512_fmadd_ps(n2, n2, len);
+	len = _mm512_sqrt_ps(len);
+	ok = _mm512_cmp_ps_mask(len, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+	len = _mm512_mask_div_ps(_mm512_set1_ps(1.0f), ok,
+				_mm512_set1_ps(1.0f), len);
+
+	_mm512_storeu_ps(out[0], v0);
+	_mm512_storeu_ps(out[1], v1);
+	_mm512_storeu_ps(out[2], v2);
+	_mm512_storeu_ps(out[3], _mm512_mul_ps(n0, len));
+	_mm512_storeu_ps(out[4], _mm512_mul_ps(n1, len));
+	_mm512_storeu_ps(out[5], _mm512_mul_ps(n2, len));
+
+	put_verts(out, num, verts, norms);
+}
+#endif
+
+static const struct {
+	const char *name;
+	skin_fn_t fn;
+} isa[MD5_SKIN_NR_ISA] = {
+	[MD5_SKIN_SCALAR] = {"scalar", skin_scalar},
+#if MD5_SKIN_X86
+	[MD5_SKIN_SSE2] = {"sse2", skin_sse2},
+	[MD5_SKIN_AVX2] = {"avx2", skin_avx2},
+	[MD5_SKIN_AVX512] = {"avx512", skin_avx512},
+#else
+	[MD5_SKIN_SSE2] = {"sse2", NULL},
+	[MD5_SKIN_AVX2] = {"avx2", NULL},
+	[MD5_SKIN_AVX512] = {"avx512", NULL},
+#endif
+};
+
+static unsigned int skin_isa;
+static pthread_once_t skin_once = PTHREAD_ONCE_INIT;
+
+/* __builtin_cpu_supports() only takes literals */
+static int isa_ok(unsigned int i)
+{
+	switch ( i ) {
+	case MD5_SKIN_SCALAR:
+		return 1;
+#if MD5_SKIN_X86
+	case MD5_SKIN_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case MD5_SKIN_AVX2:
+		return __builtin_cpu_supports("avx2") &&
+			__builtin_cpu_supports("fma");
+	case MD5_SKIN_AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* Fastest first, not widest */
+static const unsigned int skin_pref[MD5_SKIN_NR_ISA] = {
+	MD5_SKIN_AVX2,
+	MD5_SKIN_AVX512,
+	MD5_SKIN_SSE2,
+	MD5_SKIN_SCALAR,
+};
+
+static void skin_init(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < MD5_SKIN_NR_ISA; i++) {
+		if ( isa[skin_pref[i]].fn && isa_ok(skin_pref[i]) ) {
+			skin_isa = skin_pref[i];
+			break;
+		}
+	}
+}
+
+static void skin_runs(const struct md5_mesh_part *mesh,
+			const struct md5_mat34_t *pal,
+			vec3_t *verts, vec3_t *norms, skin_fn_t fn)
+{
+	const struct md5_skin_block_t *blk = mesh->skin_blocks;
+	unsigned int r, i, num;
+
+	for(r = 0; r < mesh->num_skin_runs; r++) {
+		const struct md5_skin_run_t *run = &mesh->skin_runs[r];
+
+		for(i = 0; i < run->num_verts; i += num) {
+			num = run->num_verts - i;
+			if ( num > MD5_SKIN_LANES )
+				num = MD5_SKIN_LANES;
+
+			(*fn)(blk, run->num_weights, pal, num, verts, norms);
+			blk += run->num_weights;
+			verts += num;
+			norms += num;
+		}
+	}
+}
+
+/**
+ * Skin a mesh with a palette from md5_palette(). Vertices come out in
+ * the sorted order which skin_indices and skin_st are in.
+ */
+void md5_skin(const struct md5_mesh_part *mesh,
+		const struct md5_mat34_t *pal,
+		vec3_t *verts, vec3_t *norms)
+{
+	pthread_once(&skin_once, skin_init);
+	skin_runs(mesh, pal, verts, norms, isa[skin_isa].fn);
+}
+
+/** Name of the kernel md5_skin() picked. */
+const char *md5_skin_impl(void)
+{
+	pthread_once(&skin_once, skin_init);
+	return isa[skin_isa].name;
+}
+
+/** Name of one of the MD5_SKIN_* kernels, or NULL past the last one. */
+const char *md5_skin_isa_name(unsigned int i)
+{
+	return (i < MD5_SKIN_NR_ISA) ? isa[i].name : NULL;
+}
+
+/**
+ * As md5_skin() with a particular kernel.
+ * @return zero if this build or CPU can't run it.
+ */
+int md5_skin_isa(unsigned int i, const struct md5_mesh_part *mesh,
+			const struct md5_mat34_t *pal,
+			vec3_t *verts, vec3_t *norms)
+{
+	if ( i >= MD5_SKIN_NR_ISA || NULL == isa[i].fn || !isa_ok(i) )
+		return 0;
+	skin_runs(mesh, pal, verts, norms, isa[i].fn);
+	return 1;
+}
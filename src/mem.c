@@ -0,0 +1,337 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Allocation accounting, see mem.h. With MEM_STATS we also sit in front
+* of glibc's malloc so that every heap allocation in the process is
+* counted, ours or not, and so that sections which mustn't allocate can
+* be enforced. glibc explicitly supports having malloc replaced like
+* this and we just pass everything through to the real one.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/mem.h>
+
+#include <unistd.h>
+
+#if MEM_STATS
+#include <malloc.h>
+#endif
+
+static const char * const tag_names[MEM_NR_TAGS] = {
+	[MEM_MISC] = "misc",
+	[MEM_BSP] = "bsp",
+	[MEM_MD5MESH] = "md5mesh",
+	[MEM_MD5ANIM] = "md5anim",
+	[MEM_MD2] = "md2",
+	[MEM_IMG] = "img",
+	[MEM_MPOOL] = "mpool",
+	[MEM_GANG] = "gang",
+};
+
+#if MEM_STATS
+struct mem_acct {
+	size_t a_live;
+	size_t a_peak;
+	unsigned long a_allocs;
+	unsigned long a_last;
+	unsigned long a_frame;
+};
+
+static struct mem_acct tags[MEM_NR_TAGS];
+static struct mem_acct heap;
+static __thread int nomalloc;
+
+static void acct_add(struct mem_acct *a, size_t sz)
+{
+	size_t live, peak;
+
+	live = __atomic_add_fetch(&a->a_live, sz, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&a->a_allocs, 1, __ATOMIC_RELAXED);
+
+	peak = __atomic_load_n(&a->a_peak, __ATOMIC_RELAXED);
+	while ( live > peak &&
+			!__atomic_compare_exchange_n(&a->a_peak, &peak, live, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+		;
+}
+
+static void acct_sub(struct mem_acct *a, size_t sz)
+{
+	__atomic_sub_fetch(&a->a_live, sz, __ATOMIC_RELAXED);
+}
+
+static void acct_get(struct mem_acct *a, struct mem_stat *st)
+{
+	st->s_live = __atomic_load_n(&a->a_live, __ATOMIC_RELAXED);
+	st->s_peak = __atomic_load_n(&a->a_peak, __ATOMIC_RELAXED);
+	st->s_allocs = __atomic_load_n(&a->a_allocs, __ATOMIC_RELAXED);
+	st->s_frame = a->a_frame;
+}
+
+static void acct_frame(struct mem_acct *a)
+{
+	unsigned long n;
+
+	n = __atomic_load_n(&a->a_allocs, __ATOMIC_RELAXED);
+	a->a_frame = n - a->a_last;
+	a->a_last = n;
+}
+
+/* Tagged sizes are what malloc really gave us so that they cancel out
+ * exactly, even if the caller forgets what it asked for.
+ */
+void *mem_alloc(unsigned int tag, size_t sz)
+{
+	void *ret;
+
+	ret = malloc(sz);
+	if ( ret )
+		acct_add(&tags[tag], malloc_usable_size(ret));
+	return ret;
+}
+
+void *mem_calloc(unsigned int tag, size_t num, size_t sz)
+{
+	void *ret;
+
+	ret = calloc(num, sz);
+	if ( ret )
+		acct_add(&tags[tag], malloc_usable_size(ret));
+	return ret;
+}
+
+char *mem_strdup(unsigned int tag, const char *str)
+{
+	char *ret;
+
+	ret = strdup(str);
+	if ( ret )
+		acct_add(&tags[tag], malloc_usable_size(ret));
+	return ret;
+}
+
+void mem_free(unsigned int tag, void *ptr)
+{
+	if ( NULL == ptr )
+		return;
+	acct_sub(&tags[tag], malloc_usable_size(ptr));
+	free(ptr);
+}
+
+/* For memory which doesn't come from mem_alloc(), eg. mmap'd slabs */
+void mem_add(unsigned int tag, size_t sz)
+{
+	acct_add(&tags[tag], sz);
+}
+
+void mem_sub(unsigned int tag, size_t sz)
+{
+	acct_sub(&tags[tag], sz);
+}
+
+extern void *__libc_malloc(size_t sz);
+extern void *__libc_calloc(size_t num, size_t sz);
+extern void *__libc_realloc(void *ptr, size_t sz);
+extern void *__libc_memalign(size_t align, size_t sz);
+extern void __libc_free(void *ptr);
+
+/* Don't use stdio here, it may allocate */
+static void heap_check(void)
+{
+	static const char msg[] = "mem: malloc in a no-malloc section\n";
+
+	if ( likely(!nomalloc) )
+		return;
+
+	nomalloc = 0;
+	if ( write(STDERR_FILENO, msg, sizeof(msg) - 1) )
+		;
+	abort();
+}
+
+void *malloc(size_t sz)
+{
+	void *ret;
+
+	heap_check();
+	ret = __libc_malloc(sz);
+	if ( ret )
+		acct_add(&heap, malloc_usable_size(ret));
+	return ret;
+}
+
+void *calloc(size_t num, size_t sz)
+{
+	void *ret;
+
+	heap_check();
+	ret = __libc_calloc(num, sz);
+	if ( ret )
+		acct_add(&heap, malloc_usable_size(ret));
+	return ret;
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+	size_t old;
+	void *ret;
+
+	heap_check();
+	old = (ptr) ? malloc_usable_size(ptr) : 0;
+	ret = __libc_realloc(ptr, sz);
+	if ( ret ) {
+		acct_sub(&heap, old);
+		acct_add(&heap, malloc_usable_size(ret));
+	}else if ( ptr && 0 == sz ) {
+		acct_sub(&heap, old);
+	}
+	return ret;
+}
+
+void *memalign(size_t align, size_t sz)
+{
+	void *ret;
+
+	heap_check();
+	ret = __libc_memalign(align, sz);
+	if ( ret )
+		acct_add(&heap, malloc_usable_size(ret));
+	return ret;
+}
+
+void *aligned_alloc(size_t align, size_t sz)
+{
+	return memalign(align, sz);
+}
+
+void *valloc(size_t sz)
+{
+	return memalign(sysconf(_SC_PAGESIZE), sz);
+}
+
+void *pvalloc(size_t sz)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if ( sz > SIZE_MAX - page ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return memalign(page, (sz + page - 1) & ~(page - 1));
+}
+
+int posix_memalign(void **ptr, size_t align, size_t sz)
+{
+	void *ret;
+
+	if ( align < sizeof(void *) || (align & (align - 1)) )
+		return EINVAL;
+
+	ret = memalign(align, sz);
+	if ( NULL == ret )
+		return ENOMEM;
+
+	*ptr = ret;
+	return 0;
+}
+
+void free(void *ptr)
+{
+	if ( NULL == ptr )
+		return;
+	acct_sub(&heap, malloc_usable_size(ptr));
+	__libc_free(ptr);
+}
+
+/** Is accounting compiled in */
+int mem_enabled(void)
+{
+	return 1;
+}
+
+/** Snapshot a tag's counters.
+ * @param tag a MEM_* tag
+ * @param st filled in with the counters
+ */
+void mem_get(unsigned int tag, struct mem_stat *st)
+{
+	acct_get(&tags[tag], st);
+}
+
+/** Snapshot counters for the whole heap, tagged or not */
+void mem_total(struct mem_stat *st)
+{
+	acct_get(&heap, st);
+}
+
+/** Mark the end of a frame, call once per main loop iteration */
+void mem_frame(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < MEM_NR_TAGS; i++)
+		acct_frame(&tags[i]);
+	acct_frame(&heap);
+}
+
+/** Abort on any malloc by the calling thread until turned off again */
+void mem_nomalloc(int on)
+{
+	nomalloc = on;
+}
+#else
+int mem_enabled(void)
+{
+	return 0;
+}
+
+void mem_get(unsigned int tag, struct mem_stat *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+void mem_total(struct mem_stat *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+void mem_frame(void)
+{
+}
+
+void mem_nomalloc(int on)
+{
+}
+#endif
+
+const char *mem_tag_name(unsigned int tag)
+{
+	return (tag < MEM_NR_TAGS) ? tag_names[tag] : NULL;
+}
+
+/** Write every counter out for scripts.
+ * @param f where to
+ *
+ * One line per tag and a final one named heap for the whole process,
+ * each being tag, live bytes, peak bytes, total allocations and
+ * allocations in the last frame separated by spaces.
+ */
+void mem_dump(FILE *f)
+{
+	struct mem_stat st;
+	unsigned int i;
+
+	fprintf(f, "# tag live peak allocs frame\n");
+	for(i = 0; i <= MEM_NR_TAGS; i++) {
+		if ( i < MEM_NR_TAGS )
+			mem_get(i, &st);
+		else
+			mem_total(&st);
+		fprintf(f, "%s %lu %lu %lu %lu\n",
+			(i < MEM_NR_TAGS) ? tag_names[i] : "heap",
+			(unsigned long)st.s_live, (unsigned long)st.s_peak,
+			st.s_allocs, st.s_frame);
+	}
+}
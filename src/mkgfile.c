@@ -8,13 +8,18 @@
 #include <blackbloc/mpool.h>
 #include <blackbloc/gfile.h>
 #include <blackbloc/gfile-internal.h>
+#include <blackbloc/fnv_hash.h>
+#include <blackbloc/lz.h>
+#include <blackbloc/crc32c.h>
 
 #include <stdio.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 struct manifest {
 	char *m_name;
@@ -26,16 +31,130 @@ struct file {
 	char *f_name;
 	uint32_t f_rsz;
 	uint32_t f_asz;
-	uint32_t f_ofs;
+	uint64_t f_ofs;
+	uint32_t f_order;
+	uint16_t f_mode;
+	uint8_t *f_zbuf;
+	/* stored record straight out of an existing archive */
+	const uint8_t *f_data;
+	/* content hash, and the name of the file we're a copy of */
+	uint64_t f_hash;
+	const char *f_link;
+	/* CRC32C of the record as stored */
+	uint32_t f_crc;
 };
 
+/* An existing archive being updated or compacted */
+struct archive {
+	int a_fd;
+	const uint8_t *a_map;
+	size_t a_len;
+	unsigned int a_version;
+	uint64_t a_blob_ofs;
+	unsigned int a_max_blk;
+	/* checksum block, if there is one */
+	uint64_t a_csum_ofs;
+	uint64_t a_csum_len;
+};
+
+struct bucket {
+	uint32_t b_idx;
+	uint32_t b_cnt;
+	uint32_t b_start;
+};
+
+struct phash {
+	uint32_t p_num_buckets;
+	uint32_t p_num_slots;
+	int32_t *p_disp;
+	uint32_t *p_slot;
+};
+
+/* Give up on a bucket after this many displacements */
+#define PHASH_MAX_DISP (1 << 24)
+#define PHASH_FREE 0xffffffffUL
+
 static struct mpool fmem;
 static struct gang nmem;
 static unsigned int num_files;
-static off_t tot_sz;
 static struct manifest *manifest;
+static int zmode;
+static const char *trace_fn;
+static unsigned int num_threads = 1;
+static int pmode;
+
+/* A parallel loop over num items, items are handed out in order */
+struct work {
+	int (*w_fn)(unsigned int idx, unsigned int tid, void *priv);
+	void *w_priv;
+	unsigned int w_num;
+	unsigned int w_next;
+	int w_err;
+};
+
+struct worker {
+	struct work *t_work;
+	unsigned int t_id;
+};
+
+static void *do_work(void *priv)
+{
+	struct worker *t = priv;
+	struct work *w = t->t_work;
+	unsigned int idx;
+
+	while ( !__sync_fetch_and_add(&w->w_err, 0) ) {
+		idx = __sync_fetch_and_add(&w->w_next, 1);
+		if ( idx >= w->w_num )
+			break;
+		if ( !(*w->w_fn)(idx, t->t_id, w->w_priv) )
+			__sync_fetch_and_or(&w->w_err, 1);
+	}
+
+	return NULL;
+}
+
+/* Run fn over num items on num_threads threads, the calling thread is
+ * worker zero so with one thread this is just a plain loop.
+ */
+static int run_parallel(int (*fn)(unsigned int, unsigned int, void *),
+			void *priv, unsigned int num)
+{
+	struct worker t[num_threads];
+	pthread_t tid[num_threads];
+	struct work w;
+	unsigned int i, nt;
+	int ret;
+
+	w.w_fn = fn;
+	w.w_priv = priv;
+	w.w_num = num;
+	w.w_next = 0;
+	w.w_err = 0;
+
+	for(i = 0; i < num_threads; i++) {
+		t[i].t_work = &w;
+		t[i].t_id = i;
+	}
+
+	for(nt = 1; nt < num_threads; nt++) {
+		ret = pthread_create(&tid[nt], NULL, do_work, &t[nt]);
+		if ( ret ) {
+			fprintf(stderr, "%s: pthread_create: %s\n",
+				_func, strerror(ret));
+			break;
+		}
+	}
+
+	do_work(&t[0]);
+
+	for(i = 1; i < nt; i++)
+		pthread_join(tid[i], NULL);
+
+	return !w.w_err;
+}
 
-static int dump_align(FILE *f, uint32_t *cur)
+static int dump_align(FILE *f, uint64_t *cur)
 {
 	static const uint8_t pad[GFILE_ALIGN_MASK];
 	size_t sz;
@@ -52,12 +171,29 @@ static int dump_align(FILE *f, uint32_t *cur)
 	return 1;
 }
 
-static int dump_file(FILE *f, uint32_t *cur, struct file *file)
+/* Records which are already in memory, compressed or from an archive */
+static const uint8_t *file_buf(const struct file *file)
+{
+	return (file->f_zbuf) ? file->f_zbuf : file->f_data;
+}
+
+static int dump_file(FILE *f, uint64_t *cur, struct file *file)
 {
 	const uint8_t *map, *ptr;
 	int fd, ret = 0;
 	size_t sz = ALIGN_GFILE(file->f_asz);
 
+	if ( file_buf(file) ) {
+		if ( fwrite(file_buf(file), file->f_asz, 1, f) != 1 ||
+				ferror(f) ) {
+			fprintf(stderr, "%s: %s: %s\n",
+				_func, file->f_name, get_err());
+			return 0;
+		}
+		*cur += file->f_asz;
+		return dump_align(f, cur);
+	}
+
 	fd = open(file->f_name, O_RDONLY);
 	if ( fd < 0 ) 
 		goto err;
@@ -82,11 +218,153 @@ err:
 	return ret;
 }
 
-static int dump_header(FILE *f, uint32_t *cur, uint32_t num_blk)
+static int pwrite_all(int fd, const void *buf, size_t len, off_t ofs)
 {
-	struct gfile_hdr h;
-	h.h_magic = be32toh(GFILE_MAGIC);
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+
+	while ( len ) {
+		ret = pwrite(fd, ptr, len, ofs);
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return 0;
+		}
+		ptr += ret;
+		len -= ret;
+		ofs += ret;
+	}
+
+	return 1;
+}
+
+#if HAVE_COPY_FILE_RANGE
+/* Let the kernel do the copy, returns how much got done. Anything short
+ * of len with errno clear means the file shrank under us, otherwise the
+ * caller can do the rest by hand.
+ */
+static size_t copy_range(int in, int out, off_t ofs, size_t len)
+{
+	loff_t in_ofs = 0, out_ofs = ofs;
+	ssize_t ret;
+	size_t done;
+
+	for(done = 0; done < len; done += ret) {
+		ret = copy_file_range(in, &in_ofs, out, &out_ofs,
+					len - done, 0);
+		if ( ret == 0 ) {
+			errno = 0;
+			break;
+		}
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				ret = 0;
+			else
+				break;
+		}
+	}
+
+	return done;
+}
+#endif
+
+/* Write a file at its final offset in the output, this is dump_file()
+ * for parallel mode where workers write disjoint ranges.
+ */
+static int pack_file(int out, off_t ofs, const struct file *file)
+{
+	static const uint8_t pad[GFILE_ALIGN_MASK];
+	const uint8_t *map;
+	size_t done = 0;
+	int fd, ret = 0;
+
+	if ( file_buf(file) ) {
+		ret = pwrite_all(out, file_buf(file), file->f_asz, ofs);
+		goto out;
+	}
+
+	fd = open(file->f_name, O_RDONLY);
+	if ( fd < 0 )
+		goto out;
+
+#if HAVE_COPY_FILE_RANGE
+	done = copy_range(fd, out, ofs, file->f_rsz);
+	if ( done < file->f_rsz && (errno == 0 ||
+			(errno != EXDEV && errno != ENOSYS &&
+			errno != EINVAL && errno != EOPNOTSUPP)) )
+		goto out_close;
+#endif
+
+	/* fall back to mmap + pwrite for whatever's left */
+	if ( done < file->f_rsz ) {
+		map = mmap(NULL, file->f_rsz, PROT_READ, MAP_SHARED, fd, 0);
+		if ( map == MAP_FAILED )
+			goto out_close;
+		ret = pwrite_all(out, map + done, file->f_rsz - done,
+				ofs + done);
+		munmap((void *)map, file->f_rsz);
+	}else{
+		ret = 1;
+	}
+
+out_close:
+	close(fd);
+out:
+	if ( ret && ALIGN_GFILE(file->f_asz) != file->f_asz )
+		ret = pwrite_all(out, pad,
+				ALIGN_GFILE(file->f_asz) - file->f_asz,
+				ofs + file->f_asz);
+	if ( !ret )
+		fprintf(stderr, "%s: %s: %s\n", _func, file->f_name,
+			load_err("file changed size"));
+	return ret;
+}
+
+struct pack {
+	const struct file *p_arr;
+	int p_fd;
+	uint64_t p_base;
+};
+
+/* f_ofs is relative to base */
+
+static int pack_one(unsigned int idx, unsigned int tid, void *priv)
+{
+	struct pack *p = priv;
+	return pack_file(p->p_fd, p->p_base + p->p_arr[idx].f_ofs,
+			&p->p_arr[idx]);
+}
+
+static int pack_files(int fd, const struct file *f_arr, unsigned int num,
+			uint64_t base)
+{
+	struct pack p;
+
+	p.p_arr = f_arr;
+	p.p_fd = fd;
+	p.p_base = base;
+	return run_parallel(pack_one, &p, num);
+}
+
+/* On-disk size of the header and directory */
+static size_t hdr_size(unsigned int version, unsigned int num_blk)
+{
+	if ( version == 1 )
+		return sizeof(struct gfile_hdr) +
+			num_blk * sizeof(struct gfile_blk);
+	return sizeof(struct gfile_hdr64) +
+		num_blk * sizeof(struct gfile_blk64);
+}
+
+/* New archives are always written as the current version */
+static int dump_header(FILE *f, uint64_t *cur, uint32_t num_blk)
+{
+	struct gfile_hdr64 h;
+	h.h_magic = be32toh(GFILE_MAGIC64);
+	h.h_version = be16toh(GFILE_VERSION);
+	h.h_flags = 0;
 	h.h_num_blk = be32toh(num_blk);
+	h.h_reserved = 0;
 	if ( fwrite(&h, sizeof(h), 1, f) != 1 || ferror(f) ) {
 		fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
 		return 0;
@@ -95,15 +373,15 @@ static int dump_header(FILE *f, uint32_t *cur, uint32_t num_blk)
 	return 1;
 }
 
-static int dump_block(FILE *f, uint32_t *cur, uint16_t type, uint16_t id,
-			uint32_t ofs, uint32_t len)
+static int dump_block(FILE *f, uint64_t *cur, uint16_t type, uint16_t id,
+			uint64_t ofs, uint64_t len)
 {
-	struct gfile_blk b;
+	struct gfile_blk64 b;
 	b.b_type = be16toh(type);
 	b.b_id = be16toh(id);
-	b.b_ofs = be32toh(ofs);
-	b.b_len = be32toh(len);
 	b.b_flags = 0;
+	b.b_ofs = be64toh(ofs);
+	b.b_len = be64toh(len);
 	if ( fwrite(&b, sizeof(b), 1, f) != 1 || ferror(f) ) {
 		fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
 		return 0;
@@ -112,7 +390,7 @@ static int dump_block(FILE *f, uint32_t *cur, uint16_t type, uint16_t id,
 	return 1;
 }
 
-static int dump_nidx(FILE *f, uint32_t *cur,
+static int dump_nidx(FILE *f, uint64_t *cur,
 			uint32_t num_names,
 			uint32_t strtab_sz)
 {
@@ -127,16 +405,38 @@ static int dump_nidx(FILE *f, uint32_t *cur,
 	return 1;
 }
 
-static int dump_name(FILE *f, uint32_t *cur,
+static int dump_name(FILE *f, uint64_t *cur,
+			uint64_t ofs, uint32_t len,
+			uint32_t name, uint16_t nlen,
+			uint16_t mode)
+{
+	struct gfile_name64 n;
+	n.n_ofs = be64toh(ofs);
+	n.n_len = be32toh(len);
+	n.n_name = be32toh(name);
+	n.n_nlen = be16toh(nlen);
+	n.n_mode = be16toh(mode);
+	n.n_reserved = 0;
+	if ( fwrite(&n, sizeof(n), 1, f) != 1 || ferror(f) ) {
+		fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
+		return 0;
+	}
+	*cur += sizeof(n);
+	return 1;
+}
+
+/* Only for updating version 1 archives in place */
+static int dump_name_v1(FILE *f, uint64_t *cur,
 			uint32_t ofs, uint32_t len,
-			uint32_t name, uint16_t nlen)
+			uint32_t name, uint16_t nlen,
+			uint16_t mode)
 {
 	struct gfile_name n;
 	n.n_ofs = be32toh(ofs);
 	n.n_len = be32toh(len);
 	n.n_name = be32toh(name);
 	n.n_nlen = be16toh(nlen);
-	n.n_mode = 0;
+	n.n_mode = be16toh(mode);
 	if ( fwrite(&n, sizeof(n), 1, f) != 1 || ferror(f) ) {
 		fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
 		return 0;
@@ -145,7 +445,36 @@ static int dump_name(FILE *f, uint32_t *cur,
 	return 1;
 }
 
-static int dump_str(FILE *f, uint32_t *cur, const char *str)
+static int dump_phash(FILE *f, uint64_t *cur, struct phash *ph)
+{
+	struct gfile_phash p;
+	unsigned int i;
+
+	p.p_num_buckets = be32toh(ph->p_num_buckets);
+	p.p_num_slots = be32toh(ph->p_num_slots);
+
+	/* Byte-swap in place, the tables are not used after this */
+	for(i = 0; i < ph->p_num_buckets; i++)
+		ph->p_disp[i] = be32toh(ph->p_disp[i]);
+	for(i = 0; i < ph->p_num_slots; i++)
+		ph->p_slot[i] = be32toh(ph->p_slot[i]);
+
+	if ( fwrite(&p, sizeof(p), 1, f) != 1 ||
+		fwrite(ph->p_disp, sizeof(*ph->p_disp),
+			ph->p_num_buckets, f) != ph->p_num_buckets ||
+		fwrite(ph->p_slot, sizeof(*ph->p_slot),
+			ph->p_num_slots, f) != ph->p_num_slots ||
+		ferror(f) ) {
+		fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
+		return 0;
+	}
+	*cur += sizeof(p);
+	*cur += ph->p_num_buckets * sizeof(*ph->p_disp);
+	*cur += ph->p_num_slots * sizeof(*ph->p_slot);
+	return 1;
+}
+
+static int dump_str(FILE *f, uint64_t *cur, const char *str)
 {
 	if ( fwrite(str, strlen(str) + 1, 1, f) != 1 || ferror(f) ) {
 		fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
@@ -155,6 +484,31 @@ static int dump_str(FILE *f, uint32_t *cur, const char *str)
 	return 1;
 }
 
+static int dump_csum(FILE *f, uint64_t *cur, const struct file *f_arr,
+			unsigned int num)
+{
+	struct gfile_csum c;
+	unsigned int i;
+	uint32_t crc;
+
+	c.c_num = be32toh(num);
+	if ( fwrite(&c, sizeof(c), 1, f) != 1 || ferror(f) )
+		goto err;
+	*cur += sizeof(c);
+
+	for(i = 0; i < num; i++) {
+		crc = be32toh(f_arr[i].f_crc);
+		if ( fwrite(&crc, sizeof(crc), 1, f) != 1 || ferror(f) )
+			goto err;
+		*cur += sizeof(crc);
+	}
+
+	return dump_align(f, cur);
+err:
+	fprintf(stderr, "%s: fwrite: %s\n", _func, get_err());
+	return 0;
+}
+
 static int fcmp_sz(const void *_A, const void *_B)
 {
 	const struct file *a = _A, *b = _B;
@@ -167,203 +521,1078 @@ static int fcmp_name(const void *_A, const void *_B)
 	return strcmp(a->f_name, b->f_name);
 }
 
-/* Create the gfile */
-static int dump_gfile(FILE *f)
+/* Traced files first in the order they were touched, then the rest by
+ * size. Without a trace this is the same as fcmp_sz. Duplicates take up
+ * no space so they go at the end.
+ */
+static int fcmp_layout(const void *_A, const void *_B)
 {
-	struct file *f_arr;
-	struct manifest *m;
-	unsigned int i;
-	uint64_t aligned_sz = 0;
-	uint32_t strtab_sz = 0;
-	uint32_t idx_sz = 0;
-	uint32_t ovh_sz = 0;
-	uint32_t gfl_sz = 0;
-	uint32_t strtab_base = 0;
-	uint32_t file_base = 0;
-	uint32_t cur;
-	int ret = 0;
+	const struct file *a = _A, *b = _B;
 
-	/* 1. Copy manifest in to file array */
-	f_arr = calloc(sizeof(*f_arr), num_files);
-	if ( f_arr == NULL ) {
-		fprintf(stderr, "%s: calloc: %s\n", _func, get_err());
-		goto err;
-	}
+	if ( !a->f_link != !b->f_link )
+		return (a->f_link) ? 1 : -1;
+	if ( a->f_order && b->f_order )
+		return (a->f_order < b->f_order) ? -1 : 1;
+	if ( a->f_order || b->f_order )
+		return (a->f_order) ? -1 : 1;
+	return fcmp_sz(a, b);
+}
 
-	for(m = manifest, i = 0; m; m = m->m_next, i++) {
-		f_arr[i].f_name = m->m_name;
-		if ( (uint64_t)m->m_size > 0xffffffffULL ) {
-			fprintf(stderr, "%s: %s: file too big\n",
-				_func, m->m_name);
-				goto err_free;
-		}
-		f_arr[i].f_rsz = m->m_size;
-		f_arr[i].f_asz = m->m_size;
-	}
+/* Records which need writing first, in the order they're laid out */
+static int fcmp_new(const void *_A, const void *_B)
+{
+	const struct file *a = _A, *b = _B;
 
-	assert(i == num_files);
+	if ( !a->f_data != !b->f_data )
+		return (a->f_data) ? 1 : -1;
+	return (a->f_ofs < b->f_ofs) ? -1 : (a->f_ofs > b->f_ofs);
+}
 
-	/* We're done with the manifest now */
-	mpool_fini(&fmem);
+static int fcmp_dup_sz(const struct file *a, const struct file *b)
+{
+	if ( a->f_asz != b->f_asz )
+		return (a->f_asz < b->f_asz) ? -1 : 1;
+	if ( a->f_mode != b->f_mode )
+		return (a->f_mode < b->f_mode) ? -1 : 1;
+	return 0;
+}
 
+/* Group files with identical contents, lowest name first */
+static int fcmp_dup(const void *_A, const void *_B)
+{
+	const struct file *a = _A, *b = _B;
+	int ret;
 
-	/* 2. Lay out the files and calculate on-disk sizes */
+	ret = fcmp_dup_sz(a, b);
+	if ( ret )
+		return ret;
+	if ( a->f_hash != b->f_hash )
+		return (a->f_hash < b->f_hash) ? -1 : 1;
+	return strcmp(a->f_name, b->f_name);
+}
 
-	/* Files layed out in size order and padded to record alignment.
-	 * We sort by name and then fcmp_size for interesting reasons,
-	 * it's needed to stabilise the sort because there may be
-	 * files of the same size.
-	 */
-	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_name);
-	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_sz);
-	for(i = 0; i < num_files; i++) {
-		f_arr[i].f_ofs = aligned_sz;
-		aligned_sz += ALIGN_GFILE(f_arr[i].f_asz);
-		strtab_sz += strlen(f_arr[i].f_name) + 1;
+static int fcmp_key(const void *key, const void *_B)
+{
+	const struct file *b = _B;
+	return strcmp(key, b->f_name);
+}
+
+static int bcmp_cnt(const void *_A, const void *_B)
+{
+	const struct bucket *a = _A, *b = _B;
+	if ( a->b_cnt != b->b_cnt )
+		return (a->b_cnt < b->b_cnt) ? 1 : -1;
+	return (a->b_idx < b->b_idx) ? -1 : (a->b_idx > b->b_idx);
+}
+
+/* Try to place every member of a multi-entry bucket with displacement d,
+ * backing out any partial placement on collision.
+ */
+static int place_bucket(struct phash *ph, const struct file *f_arr,
+			const uint32_t *memb, uint32_t cnt, int32_t d)
+{
+	uint32_t i, s;
+
+	for(i = 0; i < cnt; i++) {
+		s = fnv_mix(fnv_hash_seed(f_arr[memb[i]].f_name, d)) %
+			ph->p_num_slots;
+		if ( ph->p_slot[s] != PHASH_FREE )
+			break;
+		ph->p_slot[s] = memb[i];
 	}
 
-	/* maximum size of total gfile or any record is 4GB */
-	if ( aligned_sz > 0xffffffffULL ) {
-		fprintf(stderr, "%s: total file size exceeded\n",
-			_func);
-		goto err_free;
+	if ( i == cnt )
+		return 1;
+
+	while ( i-- ) {
+		s = fnv_mix(fnv_hash_seed(f_arr[memb[i]].f_name, d)) %
+			ph->p_num_slots;
+		ph->p_slot[s] = PHASH_FREE;
 	}
 
-	/* Calculate variables needed for layout  */
-	ovh_sz = sizeof(struct gfile_hdr) +
-			2 * sizeof(struct gfile_blk);
-	idx_sz = sizeof(struct gfile_nidx) + 
-			num_files * sizeof(struct gfile_name) +
-			ALIGN_GFILE(strtab_sz);
-	strtab_base = ovh_sz + sizeof(struct gfile_nidx) +
-			num_files * sizeof(struct gfile_name);
-	file_base = ovh_sz + idx_sz;
-	gfl_sz = sizeof(struct gfile_hdr) +
-			2 * sizeof(struct gfile_blk) +
-			idx_sz + (uint32_t)aligned_sz;
-
-	fprintf(stderr, " * %u KB of files aligned to %u KB\n",
-			(uint32_t)tot_sz >> 10,
-			(uint32_t)aligned_sz >> 10);
-	fprintf(stderr, " * name_idx = %u bytes (%u KB)\n",
-		idx_sz, idx_sz >> 10);
-	fprintf(stderr, "   * num_names = %u\n", num_files);
-	fprintf(stderr, "   * strtab_sz = %u bytes (%u KB)\n",
-		strtab_sz, strtab_sz >> 10);
-	fprintf(stderr, " * overhead = %lu (%lu KB)\n",
-		ovh_sz + (uint32_t)aligned_sz - tot_sz,
-		(ovh_sz + (uint32_t)aligned_sz - tot_sz) >> 10);
-	fprintf(stderr, " * total_sz = %u (%u KB)\n",
-		gfl_sz, gfl_sz >> 10);
+	return 0;
+}
 
-	assert((idx_sz & GFILE_ALIGN_MASK) == 0);
-	assert((strtab_base & GFILE_ALIGN_MASK) == 0);
-	assert((file_base & GFILE_ALIGN_MASK) == 0);
-	assert((gfl_sz & GFILE_ALIGN_MASK) == 0);
+/* Build a minimal perfect hash over the name-sorted file array. Big
+ * buckets are placed first while the table is still empty, singletons
+ * just take whatever slots are left over.
+ */
+static int build_phash(const struct file *f_arr, unsigned int num,
+			struct phash *ph)
+{
+	struct bucket *bkt = NULL;
+	uint32_t *memb = NULL;
+	uint32_t *hash = NULL;
+	uint32_t i, j, s;
+	int32_t d;
+	int ret = 0;
 
-	
-	/* 3. write out headers + blocks */
-	cur = 0;
-	if ( !dump_header(f, &cur, 2) )
-		goto err_free;
-	
-	/* Gotta dump blocks in type/id order */
-	if ( !dump_block(f, &cur, GFILE_TYPE_BLOB, GFILE_BLOB_FILES,
-				file_base, (uint32_t)aligned_sz) )
-		goto err_free;
-	if ( !dump_block(f, &cur, GFILE_TYPE_NIDX, GFILE_NIDX_FILENAMES,
-				ovh_sz, idx_sz) )
-		goto err_free;
+	memset(ph, 0, sizeof(*ph));
 
-	assert(cur == ovh_sz);
+	if ( num == 0 )
+		return 0;
 
-	if ( !dump_nidx(f, &cur, num_files, strtab_sz) )
-		goto err_free;
+	for(i = 1; i < num; i++) {
+		if ( !strcmp(f_arr[i - 1].f_name, f_arr[i].f_name) ) {
+			fprintf(stderr, "%s: duplicate name: %s\n",
+				_func, f_arr[i].f_name);
+			return 0;
+		}
+	}
 
-	/* sort index entries by filename for fast queries */
-	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_name);
-	for(strtab_sz = i = 0; i < num_files; i++) {
-		if ( !dump_name(f, &cur,
-				file_base + f_arr[i].f_ofs,
-				f_arr[i].f_asz,
-				strtab_base + strtab_sz,
-				strlen(f_arr[i].f_name)) )
-			goto err_free;
-		strtab_sz += strlen(f_arr[i].f_name) + 1;
+	ph->p_num_buckets = num;
+	ph->p_num_slots = num;
+	ph->p_disp = calloc(ph->p_num_buckets, sizeof(*ph->p_disp));
+	ph->p_slot = malloc(ph->p_num_slots * sizeof(*ph->p_slot));
+	bkt = calloc(ph->p_num_buckets, sizeof(*bkt));
+	memb = malloc(num * sizeof(*memb));
+	hash = malloc(num * sizeof(*hash));
+	if ( NULL == ph->p_disp || NULL == ph->p_slot ||
+			NULL == bkt || NULL == memb || NULL == hash ) {
+		fprintf(stderr, "%s: malloc: %s\n", _func, get_err());
+		goto out;
 	}
 
-	assert(cur == strtab_base);
-	for(i = 0; i < num_files; i++) {
-		if ( !dump_str(f, &cur, f_arr[i].f_name) )
-			goto err_free;
+	/* 1. Distribute names in to buckets */
+	for(i = 0; i < num; i++) {
+		hash[i] = fnv_mix(fnv_hash(f_arr[i].f_name)) %
+				ph->p_num_buckets;
+		bkt[hash[i]].b_cnt++;
 	}
 
-	if ( !dump_align(f, &cur) )
-		goto err_free;
+	for(s = i = 0; i < ph->p_num_buckets; i++) {
+		bkt[i].b_idx = i;
+		bkt[i].b_start = s;
+		s += bkt[i].b_cnt;
+		bkt[i].b_cnt = 0;
+	}
 
-	assert(cur == file_base);
-	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_sz);
-	for(i = 0; i < num_files; i++) {
-		//fprintf(stderr, "[0x%.6x @ 0x%.7x]: %s\n",
-		//	f_arr[i].f_rsz, cur, f_arr[i].f_name);
-		assert(file_base + f_arr[i].f_ofs == cur);
-		if ( !dump_file(f, &cur, &f_arr[i]) )
-			return 0;
+	for(i = 0; i < num; i++) {
+		struct bucket *b = &bkt[hash[i]];
+		memb[b->b_start + b->b_cnt++] = i;
 	}
 
-	/* Job done, let's make sure it's flushed to disk */
-	assert(cur == gfl_sz);
-	fprintf(stderr, "Synchronising file...\n");
-	if ( fsync(fileno(f)) &&
-		errno != EROFS &&
-		errno != EINVAL ) {
-		fprintf(stderr, "fsync: %s\n", get_err());
-		goto err_free;
+	/* 2. Place biggest buckets first */
+	qsort(bkt, ph->p_num_buckets, sizeof(*bkt), bcmp_cnt);
+
+	for(i = 0; i < ph->p_num_slots; i++)
+		ph->p_slot[i] = PHASH_FREE;
+
+	for(i = 0; i < ph->p_num_buckets && bkt[i].b_cnt > 1; i++) {
+		for(d = 1; d < PHASH_MAX_DISP; d++) {
+			if ( place_bucket(ph, f_arr, memb + bkt[i].b_start,
+						bkt[i].b_cnt, d) )
+				break;
+		}
+		if ( d == PHASH_MAX_DISP ) {
+			fprintf(stderr, "%s: unable to place bucket %u\n",
+				_func, bkt[i].b_idx);
+			goto out;
+		}
+		ph->p_disp[bkt[i].b_idx] = d;
 	}
 
-	ret = 1;
+	/* 3. Singletons go straight in to free slots */
+	for(s = 0; i < ph->p_num_buckets && bkt[i].b_cnt == 1; i++) {
+		while ( ph->p_slot[s] != PHASH_FREE )
+			s++;
+		j = memb[bkt[i].b_start];
+		ph->p_slot[s] = j;
+		ph->p_disp[bkt[i].b_idx] = -(int32_t)s - 1;
+	}
 
-err_free:
-	free(f_arr);
-err:
+	ret = 1;
+out:
+	if ( !ret ) {
+		free(ph->p_disp);
+		free(ph->p_slot);
+		memset(ph, 0, sizeof(*ph));
+	}
+	free(bkt);
+	free(memb);
+	free(hash);
 	return ret;
 }
 
-/* Scan file size and remember it all */
-static int file_to_manifest(const char *fn)
+static double now(void)
 {
-	struct stat st;
-	struct manifest *f;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	if ( strlen(fn) + 1 > 0xffff ) {
-		fprintf(stderr, "%s: name too long\n", fn);
-		return 0;
-	}
+/* Compress a file in to memory, keeping it only if it shrinks. The
+ * result is decoded again straight away both as a sanity check and
+ * so we can report decode throughput.
+ */
+static int compress_file(struct file *file, uint8_t *scratch,
+				double *dtime)
+{
+	const uint8_t *map;
+	struct gfile_lz *z;
+	uint8_t *buf;
+	size_t zlen;
+	double start;
+	int fd, ret = 0;
 
-	if ( stat(fn, &st) ) {
-		fprintf(stderr, "stat: %s: %s\n",
-			fn, get_err());
-		return 0;
-	}
+	if ( file->f_rsz <= sizeof(*z) + 1 )
+		return 1;
 
-	f = mpool_alloc(&fmem);
-	if ( f == NULL )
-		return 0;
+	fd = open(file->f_name, O_RDONLY);
+	if ( fd < 0 )
+		goto err;
 
-	f->m_name = gang_alloc(&nmem, strlen(fn) + 1);
-	if ( f->m_name == NULL )
-		return 0;
+	map = mmap(NULL, file->f_rsz, PROT_READ, MAP_SHARED, fd, 0);
+	if ( map == MAP_FAILED )
+		goto err_close;
 
-	strcpy(f->m_name, fn);
+	buf = malloc(file->f_rsz);
+	if ( NULL == buf )
+		goto err_unmap;
 
-	f->m_size = st.st_size;
-	f->m_next = manifest;
-	manifest = f;
+	zlen = lz_compress(map, file->f_rsz, buf + sizeof(*z),
+				file->f_rsz - sizeof(*z) - 1);
+	if ( zlen == 0 ) {
+		/* didn't shrink, store it raw */
+		free(buf);
+		ret = 1;
+		goto err_unmap;
+	}
+
+	start = now();
+	if ( !lz_decompress(buf + sizeof(*z), zlen, scratch, file->f_rsz) ||
+			memcmp(scratch, map, file->f_rsz) ) {
+		fprintf(stderr, "%s: %s: round trip failed\n",
+			_func, file->f_name);
+		free(buf);
+		errno = 0;
+		goto err_unmap;
+	}
+	*dtime += now() - start;
+
+	z = (struct gfile_lz *)buf;
+	z->z_len = be32toh(file->f_rsz);
+	file->f_zbuf = buf;
+	file->f_asz = zlen + sizeof(*z);
+	file->f_mode |= GFILE_MODE_LZ;
+	ret = 1;
+
+err_unmap:
+	munmap((void *)map, file->f_rsz);
+err_close:
+	close(fd);
+err:
+	if ( !ret && errno )
+		fprintf(stderr, "%s: %s: %s\n", _func, file->f_name, get_err());
+	return ret;
+}
+
+/* Each worker gets its own scratch buffer and decode timer */
+struct zwork {
+	struct file *z_arr;
+	uint8_t **z_scratch;
+	double *z_dtime;
+};
+
+static int compress_one(unsigned int idx, unsigned int tid, void *priv)
+{
+	struct zwork *z = priv;
+
+	/* already stored in an archive, or a copy of another file */
+	if ( z->z_arr[idx].f_data || z->z_arr[idx].f_link )
+		return 1;
+
+	return compress_file(&z->z_arr[idx], z->z_scratch[tid],
+				&z->z_dtime[tid]);
+}
+
+static int compress_files(struct file *f_arr, unsigned int num)
+{
+	uint64_t raw_sz = 0, z_sz = 0;
+	unsigned int i, num_z = 0;
+	uint32_t max = 0;
+	uint8_t *scratch[num_threads];
+	double dtime[num_threads];
+	struct zwork z;
+	int ret = 0;
+
+	for(i = 0; i < num; i++)
+		if ( !f_arr[i].f_data && f_arr[i].f_rsz > max )
+			max = f_arr[i].f_rsz;
+
+	memset(scratch, 0, sizeof(scratch));
+	for(i = 0; i < num_threads; i++) {
+		dtime[i] = 0;
+		scratch[i] = malloc(max ? max : 1);
+		if ( NULL == scratch[i] ) {
+			fprintf(stderr, "%s: malloc: %s\n",
+				_func, get_err());
+			goto out;
+		}
+	}
+
+	z.z_arr = f_arr;
+	z.z_scratch = scratch;
+	z.z_dtime = dtime;
+	if ( !run_parallel(compress_one, &z, num) )
+		goto out;
+
+	for(i = 0; i < num; i++) {
+		if ( f_arr[i].f_zbuf ) {
+			raw_sz += f_arr[i].f_rsz;
+			z_sz += f_arr[i].f_asz;
+			num_z++;
+		}
+	}
+
+	/* decode rate is per thread */
+	for(i = 1; i < num_threads; i++)
+		dtime[0] += dtime[i];
+	ret = 1;
+out:
+	for(i = 0; i < num_threads; i++)
+		free(scratch[i]);
+	if ( !ret )
+		return 0;
+
+	fprintf(stderr, " * compressed %u/%u files: %lu KB -> %lu KB "
+			"(%.1f%%)\n", num_z, num,
+			(unsigned long)(raw_sz >> 10),
+			(unsigned long)(z_sz >> 10),
+			(raw_sz) ? (100.0 * z_sz) / raw_sz : 100.0);
+	if ( dtime[0] > 0 ) {
+		fprintf(stderr, "   * decode = %.1f MB/s\n",
+			(raw_sz / dtime[0]) / (1 << 20));
+	}
+	return 1;
+}
+
+/* Stored bytes of a file, either in memory or mapped from disk */
+static const uint8_t *content_get(const struct file *file)
+{
+	const uint8_t *map;
+	int fd;
+
+	if ( file->f_data )
+		return file->f_data;
+
+	fd = open(file->f_name, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: %s: %s\n", _func, file->f_name, get_err());
+		return NULL;
+	}
+
+	map = mmap(NULL, file->f_asz, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "%s: %s: %s\n", _func, file->f_name, get_err());
+		return NULL;
+	}
+
+	return map;
+}
+
+static void content_put(const struct file *file, const uint8_t *ptr)
+{
+	if ( NULL == file->f_data )
+		munmap((void *)ptr, file->f_asz);
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
+#define HASH_CHUNK (1U << 16)
+
+/* 64 bit FNV-1a over words rather than bytes, it only has to pick out
+ * candidates since matches get compared byte for byte anyway.
+ */
+static uint64_t content_hash(uint64_t h, const uint8_t *ptr, size_t len)
+{
+	uint64_t w;
+
+	for(; len >= sizeof(w); ptr += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, ptr, sizeof(w));
+		h = (h ^ w) * HASH_PRIME;
+	}
+	for(; len; ptr++, len--)
+		h = (h ^ *ptr) * HASH_PRIME;
+
+	return h;
+}
+
+/* Hash through read(), mapping lots of tiny files costs more than the
+ * copy. Chunks are always full until the end so the hash only depends
+ * on the contents.
+ */
+static int hash_file(struct file *file)
+{
+	uint8_t buf[HASH_CHUNK];
+	uint64_t h = HASH_INIT;
+	size_t left, len;
+	ssize_t ret;
+	int fd;
+
+	fd = open(file->f_name, O_RDONLY);
+	if ( fd < 0 )
+		goto err;
+
+	for(left = file->f_asz; left; left -= len) {
+		len = (left < sizeof(buf)) ? left : sizeof(buf);
+		for(ret = 0; (size_t)ret < len; ) {
+			ssize_t r = read(fd, buf + ret, len - ret);
+			if ( r < 0 && errno == EINTR )
+				continue;
+			if ( r <= 0 ) {
+				if ( r == 0 )
+					errno = 0;
+				goto err_close;
+			}
+			ret += r;
+		}
+		h = content_hash(h, buf, len);
+	}
+
+	close(fd);
+	file->f_hash = h;
+	return 1;
+
+err_close:
+	close(fd);
+err:
+	fprintf(stderr, "%s: %s: %s\n", _func, file->f_name,
+		(errno) ? get_err() : load_err("file changed size"));
+	return 0;
+}
+
+/* Only files which share a size with a neighbour can have a twin */
+static int hash_one(unsigned int idx, unsigned int tid, void *priv)
+{
+	struct file *f_arr = priv, *file = &f_arr[idx];
+
+	if ( file->f_asz == 0 )
+		return 1;
+	if ( (idx == 0 || fcmp_dup_sz(file - 1, file)) &&
+			(idx + 1 == num_files || fcmp_dup_sz(file, file + 1)) )
+		return 1;
+
+	if ( file->f_data ) {
+		file->f_hash = content_hash(HASH_INIT, file->f_data,
+						file->f_asz);
+		return 1;
+	}
+
+	return hash_file(file);
+}
+
+/* Find files with identical contents, every copy gets f_link pointed at
+ * the name of the file which is actually stored. Copies keep their own
+ * entry in the name index but share the record of the original. Stored
+ * records, eg. when compacting, are compared as they're stored.
+ */
+static int dedup_files(struct file *f_arr, unsigned int num)
+{
+	unsigned int i, j, k, num_hashed = 0;
+	const uint8_t *a, *b;
+	struct file *orig;
+	double start;
+
+	start = now();
+
+	qsort(f_arr, num, sizeof(*f_arr), fcmp_dup);
+	if ( !run_parallel(hash_one, f_arr, num) )
+		return 0;
+	qsort(f_arr, num, sizeof(*f_arr), fcmp_dup);
+
+	for(i = 0; i < num; i = j) {
+		orig = &f_arr[i];
+		for(j = i + 1; j < num; j++) {
+			if ( fcmp_dup_sz(orig, &f_arr[j]) ||
+					orig->f_hash != f_arr[j].f_hash )
+				break;
+		}
+
+		if ( orig->f_hash )
+			num_hashed += j - i;
+
+		if ( j - i < 2 || orig->f_asz == 0 )
+			continue;
+
+		a = content_get(orig);
+		if ( NULL == a )
+			return 0;
+
+		/* a hash collision just means a missed copy */
+		for(k = i + 1; k < j; k++) {
+			b = content_get(&f_arr[k]);
+			if ( NULL == b ) {
+				content_put(orig, a);
+				return 0;
+			}
+			if ( a == b || !memcmp(a, b, orig->f_asz) )
+				f_arr[k].f_link = orig->f_name;
+			content_put(&f_arr[k], b);
+		}
+
+		content_put(orig, a);
+	}
+
+	fprintf(stderr, " * dedup: hashed %u files in %.3f s\n",
+		num_hashed, now() - start);
+	return 1;
+}
+
+/* Work for the checksum pass, stored records from an archive are only
+ * checksummed if c_stored is set, otherwise they keep the old CRC.
+ */
+struct cwork {
+	struct file *c_arr;
+	int c_stored;
+};
+
+static int checksum_one(unsigned int idx, unsigned int tid, void *priv)
+{
+	struct cwork *c = priv;
+	struct file *file = &c->c_arr[idx];
+	const uint8_t *ptr;
+
+	/* copies get the checksum of the original */
+	if ( file->f_link || (file->f_data && !c->c_stored) )
+		return 1;
+
+	if ( file_buf(file) ) {
+		file->f_crc = crc32c(0, file_buf(file), file->f_asz);
+		return 1;
+	}
+
+	if ( file->f_asz == 0 ) {
+		file->f_crc = crc32c(0, NULL, 0);
+		return 1;
+	}
+
+	ptr = content_get(file);
+	if ( NULL == ptr )
+		return 0;
+	file->f_crc = crc32c(0, ptr, file->f_asz);
+	content_put(file, ptr);
+	return 1;
+}
+
+/* Checksum records as they will be stored, ie. after compression */
+static int checksum_files(struct file *f_arr, unsigned int num, int stored)
+{
+	struct cwork c;
+	uint64_t sz = 0;
+	unsigned int i;
+	double start;
+
+	start = now();
+
+	c.c_arr = f_arr;
+	c.c_stored = stored;
+	if ( !run_parallel(checksum_one, &c, num) )
+		return 0;
+
+	for(i = 0; i < num; i++) {
+		if ( f_arr[i].f_link || (f_arr[i].f_data && !stored) )
+			continue;
+		sz += f_arr[i].f_asz;
+	}
+
+	start = now() - start;
+	fprintf(stderr, " * crc32c: %lu KB in %.3f s (%.1f MB/s, %s)\n",
+		(unsigned long)(sz >> 10), start,
+		(start > 0) ? (sz / start) / (1 << 20) : 0.0,
+		crc32c_impl());
+	return 1;
+}
+
+/* Read an access trace, one name per line as written by the client
+ * trace command, and number each file by when it was first touched.
+ * f_arr must be sorted by name.
+ */
+static int apply_trace(struct file *f_arr)
+{
+	char buf[8192];
+	unsigned int ln, num_traced = 0, num_missing = 0;
+	uint64_t traced_sz = 0;
+	struct file *file;
+	FILE *f;
+
+	f = fopen(trace_fn, "r");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s: %s\n", _func, trace_fn, get_err());
+		return 0;
+	}
+
+	for(ln = 1; fgets(buf, sizeof(buf), f); ln++) {
+		char *lf;
+
+		lf = strchr(buf, '\n');
+		if ( lf == NULL ) {
+			fprintf(stderr, "%s: line %u too long\n",
+				trace_fn, ln);
+			fclose(f);
+			return 0;
+		}
+		*lf = '\0';
+
+		if ( buf[0] == '\0' )
+			continue;
+
+		/* files dropped since the trace was taken are harmless */
+		file = bsearch(buf, f_arr, num_files, sizeof(*f_arr),
+				fcmp_key);
+		if ( NULL == file ) {
+			num_missing++;
+			continue;
+		}
+
+		if ( file->f_order )
+			continue;
+
+		file->f_order = ++num_traced;
+		traced_sz += file->f_asz;
+	}
+
+	fclose(f);
+
+	fprintf(stderr, " * trace: %u files (%lu KB) laid out first",
+			num_traced, (unsigned long)(traced_sz >> 10));
+	if ( num_missing )
+		fprintf(stderr, ", %u unknown names", num_missing);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+/* Copy the manifest in to a file array, num_files long */
+static struct file *manifest_files(void)
+{
+	struct file *f_arr;
+	struct manifest *m;
+	unsigned int i;
+
+	f_arr = calloc(sizeof(*f_arr), num_files);
+	if ( f_arr == NULL && num_files ) {
+		fprintf(stderr, "%s: calloc: %s\n", _func, get_err());
+		return NULL;
+	}
+
+	for(m = manifest, i = 0; m; m = m->m_next, i++) {
+		f_arr[i].f_name = m->m_name;
+		if ( (uint64_t)m->m_size > 0xffffffffULL ) {
+			fprintf(stderr, "%s: %s: file too big\n",
+				_func, m->m_name);
+			free(f_arr);
+			return NULL;
+		}
+		f_arr[i].f_rsz = m->m_size;
+		f_arr[i].f_asz = m->m_size;
+	}
+
+	assert(i == num_files);
+
+	/* We're done with the manifest now */
+	mpool_fini(&fmem);
+	return f_arr;
+}
+
+static size_t name_size(unsigned int version)
+{
+	return (version == 1) ? sizeof(struct gfile_name) :
+				sizeof(struct gfile_name64);
+}
+
+/* Build the perfect hash for a name sorted array and work out how big
+ * the index blocks are going to be. Returns the number of blocks.
+ */
+static unsigned int plan_index(const struct file *f_arr, unsigned int num,
+				unsigned int version,
+				struct phash *ph, uint32_t *strtab_sz,
+				uint32_t *idx_sz, uint32_t *phash_sz)
+{
+	unsigned int i, num_blk;
+
+	/* Hash is built over the name sorted index, if we can't find a
+	 * perfect hash then readers just fall back to the binary search
+	 */
+	if ( build_phash(f_arr, num, ph) ) {
+		num_blk = 3;
+		*phash_sz = ALIGN_GFILE(sizeof(struct gfile_phash) +
+				ph->p_num_buckets * sizeof(*ph->p_disp) +
+				ph->p_num_slots * sizeof(*ph->p_slot));
+	}else{
+		num_blk = 2;
+		*phash_sz = 0;
+	}
+
+	for(*strtab_sz = i = 0; i < num; i++)
+		*strtab_sz += strlen(f_arr[i].f_name) + 1;
+
+	*idx_sz = sizeof(struct gfile_nidx) + num * name_size(version) +
+			ALIGN_GFILE(*strtab_sz);
+	return num_blk;
+}
+
+static uint32_t csum_size(unsigned int num)
+{
+	return ALIGN_GFILE(sizeof(struct gfile_csum) +
+				num * sizeof(uint32_t));
+}
+
+/* Write name index, string table and perfect hash starting at *cur.
+ * f_arr must be name sorted and each f_ofs is relative to file_base.
+ * Version 1 names are file offsets, after that they're relative to the
+ * start of the index so they stay 32 bits wherever the index ends up.
+ */
+static int dump_index(FILE *f, uint64_t *cur, unsigned int version,
+			const struct file *f_arr,
+			unsigned int num, uint64_t file_base,
+			uint32_t strtab_sz, struct phash *ph)
+{
+	uint64_t strtab_base, name_base;
+	uint32_t ofs;
+	unsigned int i;
+	int ret;
+
+	name_base = (version == 1) ? 0 : *cur;
+	strtab_base = *cur + sizeof(struct gfile_nidx) +
+			num * name_size(version);
+
+	if ( !dump_nidx(f, cur, num, strtab_sz) )
+		return 0;
+
+	for(ofs = i = 0; i < num; i++) {
+		if ( version == 1 ) {
+			ret = dump_name_v1(f, cur,
+				file_base + f_arr[i].f_ofs,
+				f_arr[i].f_asz,
+				strtab_base - name_base + ofs,
+				strlen(f_arr[i].f_name),
+				f_arr[i].f_mode);
+		}else{
+			ret = dump_name(f, cur,
+				file_base + f_arr[i].f_ofs,
+				f_arr[i].f_asz,
+				strtab_base - name_base + ofs,
+				strlen(f_arr[i].f_name),
+				f_arr[i].f_mode);
+		}
+		if ( !ret )
+			return 0;
+		ofs += strlen(f_arr[i].f_name) + 1;
+	}
+
+	assert(*cur == strtab_base);
+	for(i = 0; i < num; i++) {
+		if ( !dump_str(f, cur, f_arr[i].f_name) )
+			return 0;
+	}
+
+	if ( !dump_align(f, cur) )
+		return 0;
+
+	if ( ph->p_disp ) {
+		if ( !dump_phash(f, cur, ph) )
+			return 0;
+		if ( !dump_align(f, cur) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Size of a file's contents, records from an archive may be compressed */
+static uint64_t orig_size(const struct file *file)
+{
+	const struct gfile_lz *z;
+
+	if ( file->f_data && (file->f_mode & GFILE_MODE_LZ) &&
+			file->f_asz >= sizeof(*z) ) {
+		z = (const struct gfile_lz *)file->f_data;
+		return be32toh(z->z_len);
+	}
+
+	return file->f_rsz;
+}
+
+/* Create the gfile from num_files entries of f_arr, which is freed */
+static int dump_gfile(FILE *f, struct file *f_arr)
+{
+	struct phash ph;
+	unsigned int i;
+	unsigned int num_blk;
+	uint64_t orig_sz = 0;
+	uint64_t aligned_sz = 0;
+	uint64_t stored_sz = 0;
+	uint32_t strtab_sz = 0;
+	uint32_t idx_sz = 0;
+	uint32_t phash_sz = 0;
+	uint32_t csum_sz = 0;
+	uint32_t ovh_sz = 0;
+	uint64_t gfl_sz = 0;
+	uint64_t file_base = 0;
+	uint64_t dup_sz = 0;
+	unsigned int num_dup = 0;
+	struct file *orig;
+	uint64_t cur;
+	double start;
+	int ret = 0;
+
+	memset(&ph, 0, sizeof(ph));
+
+	for(i = 0; i < num_files; i++)
+		orig_sz += orig_size(&f_arr[i]);
+
+	if ( !dedup_files(f_arr, num_files) )
+		goto err_free;
+
+	if ( zmode && !compress_files(f_arr, num_files) )
+		goto err_free;
+
+	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_name);
+	num_blk = plan_index(f_arr, num_files, GFILE_VERSION, &ph,
+				&strtab_sz, &idx_sz, &phash_sz);
+	csum_sz = csum_size(num_files);
+	num_blk++;
+
+	if ( trace_fn && !apply_trace(f_arr) )
+		goto err_free;
+
+	if ( !checksum_files(f_arr, num_files, 1) )
+		goto err_free;
+
+	/* A copy being loaded means the original is */
+	for(i = 0; i < num_files; i++) {
+		if ( NULL == f_arr[i].f_link || !f_arr[i].f_order )
+			continue;
+		orig = bsearch(f_arr[i].f_link, f_arr, num_files,
+				sizeof(*f_arr), fcmp_key);
+		if ( !orig->f_order || orig->f_order > f_arr[i].f_order )
+			orig->f_order = f_arr[i].f_order;
+	}
+
+	/* 2. Lay out the files and calculate on-disk sizes */
+
+	/* Files layed out in size order and padded to record alignment,
+	 * unless there's an access trace in which case those files go
+	 * first in the order they're loaded so a cold load reads the
+	 * archive sequentially. We sort by name and then fcmp_layout
+	 * for interesting reasons, it's needed to stabilise the sort
+	 * because there may be files of the same size.
+	 */
+	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_name);
+	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_layout);
+	for(i = 0; i < num_files; i++) {
+		if ( f_arr[i].f_link )
+			continue;
+		f_arr[i].f_ofs = aligned_sz;
+		aligned_sz += ALIGN_GFILE(f_arr[i].f_asz);
+		stored_sz += f_arr[i].f_asz;
+	}
+
+	/* Copies point at the original record, compressed or not */
+	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_name);
+	for(i = 0; i < num_files; i++) {
+		if ( NULL == f_arr[i].f_link )
+			continue;
+		orig = bsearch(f_arr[i].f_link, f_arr, num_files,
+				sizeof(*f_arr), fcmp_key);
+		f_arr[i].f_ofs = orig->f_ofs;
+		f_arr[i].f_asz = orig->f_asz;
+		f_arr[i].f_mode = orig->f_mode;
+		f_arr[i].f_crc = orig->f_crc;
+		dup_sz += ALIGN_GFILE(orig->f_asz);
+		num_dup++;
+	}
+
+	/* Calculate variables needed for layout, offsets are 64 bits so
+	 * only the records themselves are limited to 4GB
+	 */
+	ovh_sz = hdr_size(GFILE_VERSION, num_blk);
+	file_base = ovh_sz + idx_sz + phash_sz + csum_sz;
+	gfl_sz = file_base + aligned_sz;
+
+	fprintf(stderr, " * files = %lu KB before dedup and compression\n",
+			(unsigned long)(orig_sz >> 10));
+	fprintf(stderr, " * records = %lu KB stored, %lu KB aligned\n",
+			(unsigned long)(stored_sz >> 10),
+			(unsigned long)(aligned_sz >> 10));
+	fprintf(stderr, " * name_idx = %u bytes (%u KB)\n",
+		idx_sz, idx_sz >> 10);
+	fprintf(stderr, "   * num_names = %u\n", num_files);
+	fprintf(stderr, "   * strtab_sz = %u bytes (%u KB)\n",
+		strtab_sz, strtab_sz >> 10);
+	fprintf(stderr, " * name_hash = %u bytes (%u KB)\n",
+		phash_sz, phash_sz >> 10);
+	fprintf(stderr, " * checksums = %u bytes (%u KB)\n",
+		csum_sz, csum_sz >> 10);
+	fprintf(stderr, " * dedup: %u files are copies, %lu KB saved\n",
+		num_dup, (unsigned long)(dup_sz >> 10));
+	fprintf(stderr, " * overhead = %lu (%lu KB)\n",
+		(unsigned long)(ovh_sz + aligned_sz - stored_sz),
+		(unsigned long)(ovh_sz + aligned_sz - stored_sz) >> 10);
+	fprintf(stderr, " * total_sz = %lu (%lu KB)\n",
+		(unsigned long)gfl_sz, (unsigned long)(gfl_sz >> 10));
+
+	assert((idx_sz & GFILE_ALIGN_MASK) == 0);
+	assert((file_base & GFILE_ALIGN_MASK) == 0);
+	assert((gfl_sz & GFILE_ALIGN_MASK) == 0);
+
+	
+	/* 3. write out headers + blocks */
+	cur = 0;
+	if ( !dump_header(f, &cur, num_blk) )
+		goto err_free;
+	
+	/* Gotta dump blocks in type/id order */
+	if ( !dump_block(f, &cur, GFILE_TYPE_BLOB, GFILE_BLOB_FILES,
+				file_base, aligned_sz) )
+		goto err_free;
+	if ( !dump_block(f, &cur, GFILE_TYPE_NIDX, GFILE_NIDX_FILENAMES,
+				ovh_sz, idx_sz) )
+		goto err_free;
+	if ( phash_sz && !dump_block(f, &cur,
+				GFILE_TYPE_NIDX, GFILE_NIDX_PHASH2,
+				ovh_sz + idx_sz, phash_sz) )
+		goto err_free;
+	if ( !dump_block(f, &cur, GFILE_TYPE_CSUM, GFILE_CSUM_CRC32C,
+				ovh_sz + idx_sz + phash_sz, csum_sz) )
+		goto err_free;
+
+	assert(cur == ovh_sz);
+
+	/* sort index entries by filename for fast queries */
+	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_name);
+	if ( !dump_index(f, &cur, GFILE_VERSION, f_arr, num_files, file_base,
+				strtab_sz, &ph) )
+		goto err_free;
+	if ( !dump_csum(f, &cur, f_arr, num_files) )
+		goto err_free;
+
+	assert(cur == file_base);
+	/* copies are sorted to the end and have nothing to write */
+	qsort(f_arr, num_files, sizeof(*f_arr), fcmp_layout);
+	start = now();
+	if ( pmode ) {
+		/* Everything before the files went through stdio */
+		if ( fflush(f) || ferror(f) ) {
+			fprintf(stderr, "%s: fflush: %s\n",
+				_func, get_err());
+			goto err_free;
+		}
+		if ( !pack_files(fileno(f), f_arr, num_files - num_dup,
+					file_base) )
+			goto err_free;
+		cur += aligned_sz;
+	}else{
+		for(i = 0; i < num_files - num_dup; i++) {
+			//fprintf(stderr, "[0x%.6x @ 0x%.7x]: %s\n",
+			//	f_arr[i].f_rsz, cur, f_arr[i].f_name);
+			assert(file_base + f_arr[i].f_ofs == cur);
+			if ( !dump_file(f, &cur, &f_arr[i]) )
+				goto err_free;
+		}
+		if ( fflush(f) )
+			goto err_free;
+	}
+	start = now() - start;
+	fprintf(stderr, " * wrote %lu KB in %.3f s (%.1f MB/s, %s)\n",
+		(unsigned long)(aligned_sz >> 10), start,
+		(start > 0) ? (aligned_sz / start) / (1 << 20) : 0.0,
+		(pmode) ? "pwrite" : "stdio");
+
+	/* Job done, let's make sure it's flushed to disk */
+	assert(cur == gfl_sz);
+	fprintf(stderr, "Synchronising file...\n");
+	if ( fsync(fileno(f)) &&
+		errno != EROFS &&
+		errno != EINVAL ) {
+		fprintf(stderr, "fsync: %s\n", get_err());
+		goto err_free;
+	}
+
+	ret = 1;
+
+err_free:
+	free(ph.p_disp);
+	free(ph.p_slot);
+	for(i = 0; i < num_files; i++)
+		free(f_arr[i].f_zbuf);
+	free(f_arr);
+	return ret;
+}
+
+/* Remember a file name, sizes are filled in by stat_manifest() */
+static int file_to_manifest(const char *fn)
+{
+	struct manifest *f;
+
+	if ( strlen(fn) + 1 > 0xffff ) {
+		fprintf(stderr, "%s: name too long\n", fn);
+		return 0;
+	}
+
+	f = mpool_alloc(&fmem);
+	if ( f == NULL )
+		return 0;
+
+	f->m_name = gang_alloc(&nmem, strlen(fn) + 1);
+	if ( f->m_name == NULL )
+		return 0;
+
+	strcpy(f->m_name, fn);
+
+	f->m_size = 0;
+	f->m_next = manifest;
+	manifest = f;
 	num_files++;
-	tot_sz += st.st_size;
 	return 1;
 }
 
+static int stat_one(unsigned int idx, unsigned int tid, void *priv)
+{
+	struct manifest **m = priv;
+	struct stat st;
+
+	if ( stat(m[idx]->m_name, &st) ) {
+		fprintf(stderr, "stat: %s: %s\n",
+			m[idx]->m_name, get_err());
+		return 0;
+	}
+
+	m[idx]->m_size = st.st_size;
+	return 1;
+}
+
+/* Scan file sizes, for a big data set that's mostly waiting on inode
+ * reads so it's done across all the worker threads.
+ */
+static int stat_manifest(void)
+{
+	struct manifest **arr, *m;
+	unsigned int i;
+	double start;
+	int ret;
+
+	arr = malloc(num_files * sizeof(*arr));
+	if ( NULL == arr && num_files ) {
+		fprintf(stderr, "%s: malloc: %s\n", _func, get_err());
+		return 0;
+	}
+
+	for(m = manifest, i = 0; m; m = m->m_next, i++)
+		arr[i] = m;
+
+	start = now();
+	ret = run_parallel(stat_one, arr, num_files);
+	if ( ret ) {
+		fprintf(stderr, " * stat %u files in %.3f s\n",
+			num_files, now() - start);
+	}
+
+	free(arr);
+	return ret;
+}
+
 /* Scan files to be included from the "manifest" file */
 static int scan_manifest(FILE *f)
 {
@@ -405,15 +1634,671 @@ static int scan_manifest(FILE *f)
 	return 1;
 }
 
+/* Decode directory entry idx of either version, the directory must
+ * already be known to fit in the mapping.
+ */
+static void archive_blk(const struct archive *a, unsigned int idx,
+			uint16_t *type, uint16_t *id,
+			uint64_t *ofs, uint64_t *len)
+{
+	const struct gfile_hdr64 *h64;
+	const struct gfile_hdr *h;
+
+	if ( a->a_version == 1 ) {
+		h = (const struct gfile_hdr *)a->a_map;
+		*type = be16toh(h->h_blk[idx].b_type);
+		*id = be16toh(h->h_blk[idx].b_id);
+		*ofs = be32toh(h->h_blk[idx].b_ofs);
+		*len = be32toh(h->h_blk[idx].b_len);
+	}else{
+		h64 = (const struct gfile_hdr64 *)a->a_map;
+		*type = be16toh(h64->h_blk[idx].b_type);
+		*id = be16toh(h64->h_blk[idx].b_id);
+		*ofs = be64toh(h64->h_blk[idx].b_ofs);
+		*len = be64toh(h64->h_blk[idx].b_len);
+	}
+}
+
+static unsigned int archive_num_blk(const struct archive *a)
+{
+	const struct gfile_hdr *h = (const struct gfile_hdr *)a->a_map;
+	const struct gfile_hdr64 *h64 = (const struct gfile_hdr64 *)a->a_map;
+
+	if ( a->a_version == 1 )
+		return be32toh(h->h_num_blk);
+	return be32toh(h64->h_num_blk);
+}
+
+/* Map an existing archive and sanity check the bits we need */
+static int archive_open(struct archive *a, const char *fn, int wr)
+{
+	const struct gfile_hdr64 *h;
+	struct stat st;
+	uint64_t ofs, len, min_ofs;
+	uint16_t type, id;
+	uint32_t i, num_blk;
+	size_t hdr_sz;
+
+	memset(a, 0, sizeof(*a));
+
+	a->a_fd = open(fn, (wr) ? O_RDWR : O_RDONLY);
+	if ( a->a_fd < 0 )
+		goto err;
+
+	if ( fstat(a->a_fd, &st) )
+		goto err_close;
+
+	if ( (size_t)st.st_size < sizeof(*h) ||
+			(uint64_t)st.st_size > SIZE_MAX ) {
+		errno = 0;
+		goto err_close;
+	}
+
+	a->a_len = st.st_size;
+	a->a_map = mmap(NULL, a->a_len, PROT_READ, MAP_SHARED, a->a_fd, 0);
+	if ( a->a_map == MAP_FAILED )
+		goto err_close;
+
+	errno = 0;
+	h = (const struct gfile_hdr64 *)a->a_map;
+	if ( be32toh(h->h_magic) == GFILE_MAGIC ) {
+		a->a_version = 1;
+		if ( a->a_len > 0xffffffffULL )
+			goto err_unmap;
+	}else if ( be32toh(h->h_magic) == GFILE_MAGIC64 &&
+			be16toh(h->h_version) == GFILE_VERSION ) {
+		a->a_version = GFILE_VERSION;
+	}else{
+		goto err_unmap;
+	}
+
+	num_blk = archive_num_blk(a);
+	hdr_sz = hdr_size(a->a_version, 0);
+	if ( num_blk > (a->a_len - hdr_sz) /
+			(hdr_size(a->a_version, 1) - hdr_sz) )
+		goto err_unmap;
+
+	/* The header can grow in to the gap before the first block */
+	min_ofs = a->a_len;
+	for(i = 0; i < num_blk; i++) {
+		archive_blk(a, i, &type, &id, &ofs, &len);
+		if ( ofs > a->a_len || len > a->a_len - ofs )
+			goto err_unmap;
+		if ( ofs < min_ofs )
+			min_ofs = ofs;
+		if ( type == GFILE_TYPE_BLOB && id == GFILE_BLOB_FILES )
+			a->a_blob_ofs = ofs;
+		if ( type == GFILE_TYPE_CSUM && id == GFILE_CSUM_CRC32C ) {
+			a->a_csum_ofs = ofs;
+			a->a_csum_len = len;
+		}
+	}
+
+	if ( min_ofs < hdr_size(a->a_version, num_blk) )
+		goto err_unmap;
+	a->a_max_blk = (min_ofs - hdr_sz) /
+			(hdr_size(a->a_version, 1) - hdr_sz);
+	return 1;
+
+err_unmap:
+	munmap((void *)a->a_map, a->a_len);
+err_close:
+	close(a->a_fd);
+err:
+	fprintf(stderr, "%s: %s: %s\n", _func, fn,
+		load_err("not a valid gfile"));
+	return 0;
+}
+
+static void archive_close(struct archive *a)
+{
+	munmap((void *)a->a_map, a->a_len);
+	close(a->a_fd);
+}
+
+/* Turn the name index of an archive in to a file array, the names and
+ * data point in to the mapping. f_ofs is absolute.
+ */
+static struct file *archive_files(struct archive *a, unsigned int *num)
+{
+	const struct gfile_nidx *n = NULL;
+	const struct gfile_name *ptr;
+	const struct gfile_name64 *ptr64;
+	const struct gfile_csum *c = NULL;
+	struct file *f_arr;
+	uint64_t ofs, len, nofs, name_base = 0;
+	uint16_t type, id;
+	uint32_t i, num_blk, nlen;
+	size_t ent_sz;
+
+	num_blk = archive_num_blk(a);
+	for(i = 0; i < num_blk; i++) {
+		archive_blk(a, i, &type, &id, &ofs, &len);
+		if ( type == GFILE_TYPE_NIDX &&
+				id == GFILE_NIDX_FILENAMES &&
+				len >= sizeof(*n) ) {
+			n = (const struct gfile_nidx *)(a->a_map + ofs);
+			break;
+		}
+	}
+
+	ent_sz = name_size(a->a_version);
+	if ( NULL == n || be32toh(n->i_num_names) >
+			(a->a_len - ((const uint8_t *)n - a->a_map) -
+			 sizeof(*n)) / ent_sz ) {
+		fprintf(stderr, "%s: bad name index\n", _func);
+		return NULL;
+	}
+
+	*num = be32toh(n->i_num_names);
+
+	/* A checksum block that doesn't match the index is just ignored,
+	 * the archive gets new checksums anyway unless it's an update.
+	 */
+	if ( a->a_csum_len ) {
+		c = (const struct gfile_csum *)(a->a_map + a->a_csum_ofs);
+		if ( a->a_csum_len < sizeof(*c) ||
+				be32toh(c->c_num) != *num ||
+				(a->a_csum_len - sizeof(*c)) / sizeof(uint32_t)
+					< *num ) {
+			fprintf(stderr, "%s: bad checksum block\n", _func);
+			a->a_csum_len = 0;
+			c = NULL;
+		}
+	}
+
+	f_arr = calloc(sizeof(*f_arr), *num ? *num : 1);
+	if ( NULL == f_arr ) {
+		fprintf(stderr, "%s: calloc: %s\n", _func, get_err());
+		return NULL;
+	}
+
+	/* version 2 names are relative to the index */
+	if ( a->a_version != 1 )
+		name_base = (const uint8_t *)n - a->a_map;
+
+	for(i = 0; i < *num; i++) {
+		if ( a->a_version == 1 ) {
+			ptr = n->i_name + i;
+			nofs = be32toh(ptr->n_name);
+			nlen = be16toh(ptr->n_nlen);
+			ofs = be32toh(ptr->n_ofs);
+			len = be32toh(ptr->n_len);
+			f_arr[i].f_mode = be16toh(ptr->n_mode);
+		}else{
+			ptr64 = (const struct gfile_name64 *)n->i_name + i;
+			nofs = name_base + be32toh(ptr64->n_name);
+			nlen = be16toh(ptr64->n_nlen);
+			ofs = be64toh(ptr64->n_ofs);
+			len = be32toh(ptr64->n_len);
+			f_arr[i].f_mode = be16toh(ptr64->n_mode);
+		}
+
+		if ( nofs + nlen >= a->a_len ||
+				a->a_map[nofs + nlen] != '\0' ||
+				ofs > a->a_len || len > a->a_len - ofs ) {
+			fprintf(stderr, "%s: bad name entry %u\n", _func, i);
+			free(f_arr);
+			return NULL;
+		}
+
+		f_arr[i].f_name = (char *)a->a_map + nofs;
+		f_arr[i].f_ofs = ofs;
+		f_arr[i].f_rsz = len;
+		f_arr[i].f_asz = len;
+		f_arr[i].f_data = a->a_map + f_arr[i].f_ofs;
+		if ( c )
+			f_arr[i].f_crc = be32toh(c->c_crc[i]);
+	}
+
+	return f_arr;
+}
+
+/* Rewrite an archive with just the live records, in a fresh layout */
+static int compact_gfile(const char *fn)
+{
+	struct archive a;
+	struct file *f_arr;
+	int ret;
+
+	if ( !archive_open(&a, fn, 0) )
+		return 0;
+
+	f_arr = archive_files(&a, &num_files);
+	if ( NULL == f_arr ) {
+		archive_close(&a);
+		return 0;
+	}
+
+	ret = dump_gfile(stdout, f_arr);
+	archive_close(&a);
+	return ret;
+}
+
+/* Is this file already in the archive byte for byte? */
+static int same_content(const struct file *old, const char *fn, off_t sz)
+{
+	const struct gfile_lz *z;
+	const uint8_t *data = old->f_data, *map;
+	uint8_t *buf = NULL;
+	int fd, ret = 0;
+
+	if ( old->f_mode & GFILE_MODE_LZ ) {
+		z = (const struct gfile_lz *)data;
+		if ( old->f_asz < sizeof(*z) || be32toh(z->z_len) != sz )
+			return 0;
+		buf = malloc(sz ? sz : 1);
+		if ( NULL == buf )
+			return 0;
+		if ( !lz_decompress(data + sizeof(*z),
+					old->f_asz - sizeof(*z), buf, sz) )
+			goto out;
+		data = buf;
+	}else if ( old->f_asz != sz ) {
+		return 0;
+	}
+
+	if ( sz == 0 ) {
+		ret = 1;
+		goto out;
+	}
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 )
+		goto out;
+	map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+	if ( map != MAP_FAILED ) {
+		ret = !memcmp(map, data, sz);
+		munmap((void *)map, sz);
+	}
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+static void fill_blk(struct gfile_blk *b, uint16_t type, uint16_t id,
+			uint32_t ofs, uint32_t len)
+{
+	b->b_type = be16toh(type);
+	b->b_id = be16toh(id);
+	b->b_ofs = be32toh(ofs);
+	b->b_len = be32toh(len);
+	b->b_flags = 0;
+}
+
+static void fill_blk64(struct gfile_blk64 *b, uint16_t type, uint16_t id,
+			uint64_t ofs, uint64_t len)
+{
+	b->b_type = be16toh(type);
+	b->b_id = be16toh(id);
+	b->b_flags = 0;
+	b->b_ofs = be64toh(ofs);
+	b->b_len = be64toh(len);
+}
+
+/* The index, perfect hash and checksums are contiguous at idx_ofs, the
+ * last two are left out of the header if their size is zero. Archives
+ * keep whatever version they were created with.
+ */
+static int dump_update_hdr(int fd, unsigned int version,
+				uint64_t blob_ofs, uint64_t blob_len,
+				uint64_t idx_ofs, uint32_t idx_sz,
+				uint32_t phash_sz, uint32_t csum_sz)
+{
+	uint8_t buf[sizeof(struct gfile_hdr64) +
+			4 * sizeof(struct gfile_blk64)];
+	struct gfile_hdr64 h64;
+	struct gfile_blk64 b64[4];
+	struct gfile_hdr h;
+	struct gfile_blk b[4];
+	uint64_t ofs[4], len[4];
+	uint16_t type[4], id[4];
+	uint32_t i, num_blk = 0;
+	size_t sz;
+
+	type[num_blk] = GFILE_TYPE_BLOB;
+	id[num_blk] = GFILE_BLOB_FILES;
+	ofs[num_blk] = blob_ofs;
+	len[num_blk++] = blob_len;
+
+	type[num_blk] = GFILE_TYPE_NIDX;
+	id[num_blk] = GFILE_NIDX_FILENAMES;
+	ofs[num_blk] = idx_ofs;
+	len[num_blk++] = idx_sz;
+
+	if ( phash_sz ) {
+		type[num_blk] = GFILE_TYPE_NIDX;
+		id[num_blk] = GFILE_NIDX_PHASH2;
+		ofs[num_blk] = idx_ofs + idx_sz;
+		len[num_blk++] = phash_sz;
+	}
+
+	if ( csum_sz ) {
+		type[num_blk] = GFILE_TYPE_CSUM;
+		id[num_blk] = GFILE_CSUM_CRC32C;
+		ofs[num_blk] = idx_ofs + idx_sz + phash_sz;
+		len[num_blk++] = csum_sz;
+	}
+
+	if ( version == 1 ) {
+		for(i = 0; i < num_blk; i++)
+			fill_blk(&b[i], type[i], id[i], ofs[i], len[i]);
+		h.h_magic = be32toh(GFILE_MAGIC);
+		h.h_num_blk = be32toh(num_blk);
+		memcpy(buf, &h, sizeof(h));
+		memcpy(buf + sizeof(h), b, num_blk * sizeof(*b));
+	}else{
+		for(i = 0; i < num_blk; i++)
+			fill_blk64(&b64[i], type[i], id[i], ofs[i], len[i]);
+		h64.h_magic = be32toh(GFILE_MAGIC64);
+		h64.h_version = be16toh(version);
+		h64.h_flags = 0;
+		h64.h_num_blk = be32toh(num_blk);
+		h64.h_reserved = 0;
+		memcpy(buf, &h64, sizeof(h64));
+		memcpy(buf + sizeof(h64), b64, num_blk * sizeof(*b64));
+	}
+
+	/* A single sector sized write, so the switch is atomic */
+	sz = hdr_size(version, num_blk);
+	if ( !pwrite_all(fd, buf, sz, 0) ) {
+		fprintf(stderr, "%s: pwrite: %s\n", _func, get_err());
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Sort by name and drop repeats, a name listed twice in the changes
+ * must only be merged once
+ */
+static unsigned int uniq_files(struct file *f_arr, unsigned int num)
+{
+	unsigned int i, j;
+
+	qsort(f_arr, num, sizeof(*f_arr), fcmp_name);
+	for(i = j = 0; i < num; i++) {
+		if ( j && !strcmp(f_arr[j - 1].f_name, f_arr[i].f_name) )
+			continue;
+		f_arr[j++] = f_arr[i];
+	}
+
+	return j;
+}
+
+/* Append new and changed files to an existing archive followed by a new
+ * index, then point the header at it. Nothing which the old header
+ * references is touched so a crash at any point leaves a valid archive.
+ */
+static int update_gfile(const char *fn)
+{
+	struct archive a;
+	struct file *f_arr, *u_arr = NULL, *file;
+	struct phash ph;
+	unsigned int i, num_old, num_new, num = 0, num_blk;
+	unsigned int num_add = 0, num_rep = 0, num_same = 0;
+	uint32_t strtab_sz, idx_sz, phash_sz, csum_sz = 0;
+	uint64_t cur, end, idx_ofs;
+	uint64_t append_ofs, live_sz;
+	FILE *f = NULL;
+	double start;
+	int fd, ret = 0;
+
+	memset(&ph, 0, sizeof(ph));
+	start = now();
+
+	if ( !archive_open(&a, fn, 1) )
+		return 0;
+
+	f_arr = archive_files(&a, &num_old);
+	if ( NULL == f_arr )
+		goto out_close;
+	num = num_old;
+
+	/* Changed files come from the manifest */
+	u_arr = manifest_files();
+	if ( NULL == u_arr && num_files )
+		goto out_free;
+	num_new = uniq_files(u_arr, num_files);
+
+	file = realloc(f_arr, (num_old + num_new) * sizeof(*f_arr) + 1);
+	if ( NULL == file ) {
+		fprintf(stderr, "%s: realloc: %s\n", _func, get_err());
+		goto out_free;
+	}
+	f_arr = file;
+
+	/* Merge, replaced entries are overwritten in place */
+	qsort(f_arr, num_old, sizeof(*f_arr), fcmp_name);
+	for(num = num_old, i = 0; i < num_new; i++) {
+		file = bsearch(u_arr[i].f_name, f_arr, num_old,
+				sizeof(*f_arr), fcmp_key);
+		if ( NULL == file ) {
+			f_arr[num++] = u_arr[i];
+			num_add++;
+		}else if ( same_content(file, u_arr[i].f_name,
+						u_arr[i].f_rsz) ) {
+			num_same++;
+		}else{
+			*file = u_arr[i];
+			num_rep++;
+		}
+	}
+	num_files = num;
+
+	if ( zmode && !compress_files(f_arr, num) )
+		goto out_free;
+
+	/* Old records keep their checksums, but if there weren't any then
+	 * adding them means reading the whole archive, that's for -c.
+	 */
+	if ( a.a_csum_len ) {
+		if ( !checksum_files(f_arr, num, 0) )
+			goto out_free;
+		csum_sz = csum_size(num);
+	}
+
+	/* Lay out the new records after the end of the archive */
+	append_ofs = ALIGN_GFILE((uint64_t)a.a_len);
+	for(i = 0; i < num; i++) {
+		if ( NULL == f_arr[i].f_data ) {
+			f_arr[i].f_ofs = append_ofs;
+			append_ofs += ALIGN_GFILE(f_arr[i].f_asz);
+		}
+	}
+
+	qsort(f_arr, num, sizeof(*f_arr), fcmp_name);
+	num_blk = plan_index(f_arr, num, a.a_version, &ph,
+				&strtab_sz, &idx_sz, &phash_sz);
+	if ( csum_sz && ++num_blk > a.a_max_blk ) {
+		fprintf(stderr, " * no room for checksums in header\n");
+		num_blk--;
+		csum_sz = 0;
+	}
+	if ( num_blk > a.a_max_blk ) {
+		/* no room in the header, readers can live without it */
+		fprintf(stderr, " * no room for name_hash in header\n");
+		free(ph.p_disp);
+		free(ph.p_slot);
+		memset(&ph, 0, sizeof(ph));
+		num_blk = 2;
+		phash_sz = 0;
+	}
+
+	/* version 1 archives can't grow past 4GB, compact them first */
+	if ( a.a_version == 1 &&
+			append_ofs + idx_sz + phash_sz + csum_sz > 0xffffffffULL ) {
+		fprintf(stderr, "%s: total file size exceeded\n", _func);
+		goto out_free;
+	}
+	idx_ofs = append_ofs;
+	end = idx_ofs + idx_sz + phash_sz + csum_sz;
+
+	/* 1. records, in parallel if asked to */
+	qsort(f_arr, num, sizeof(*f_arr), fcmp_new);
+	for(live_sz = i = 0; i < num; i++) {
+		/* copies share a record */
+		if ( i && f_arr[i].f_ofs == f_arr[i - 1].f_ofs )
+			continue;
+		live_sz += ALIGN_GFILE(f_arr[i].f_asz);
+	}
+	if ( !pack_files(a.a_fd, f_arr, num_add + num_rep, 0) )
+		goto out_free;
+
+	/* 2. index, through stdio */
+	fd = dup(a.a_fd);
+	if ( fd < 0 || NULL == (f = fdopen(fd, "r+")) ||
+			fseeko(f, idx_ofs, SEEK_SET) ) {
+		fprintf(stderr, "%s: %s\n", _func, get_err());
+		if ( fd >= 0 && NULL == f )
+			close(fd);
+		goto out_free;
+	}
+
+	qsort(f_arr, num, sizeof(*f_arr), fcmp_name);
+	cur = idx_ofs;
+	if ( !dump_index(f, &cur, a.a_version, f_arr, num, 0,
+				strtab_sz, &ph) )
+		goto out_free;
+	if ( csum_sz && !dump_csum(f, &cur, f_arr, num) )
+		goto out_free;
+	assert(cur == end);
+	if ( fflush(f) || ferror(f) ) {
+		fprintf(stderr, "%s: fflush: %s\n", _func, get_err());
+		goto out_free;
+	}
+
+	/* 3. everything must be on disk before the header points at it */
+	if ( fsync(a.a_fd) ) {
+		fprintf(stderr, "fsync: %s\n", get_err());
+		goto out_free;
+	}
+
+	if ( !dump_update_hdr(a.a_fd, a.a_version, a.a_blob_ofs,
+				idx_ofs - a.a_blob_ofs, idx_ofs,
+				idx_sz, phash_sz, csum_sz) )
+		goto out_free;
+
+	if ( fsync(a.a_fd) ) {
+		fprintf(stderr, "fsync: %s\n", get_err());
+		goto out_free;
+	}
+
+	fprintf(stderr, " * update: %u added, %u replaced, %u unchanged\n",
+		num_add, num_rep, num_same);
+	fprintf(stderr, " * appended %lu KB in %.3f s\n",
+		(unsigned long)((end - a.a_len) >> 10), now() - start);
+	live_sz += hdr_size(a.a_version, num_blk) +
+			idx_sz + phash_sz + csum_sz;
+	fprintf(stderr, " * %lu KB of %lu KB is dead, "
+			"compact with -c to reclaim it\n",
+			(unsigned long)((end - live_sz) >> 10),
+			(unsigned long)(end >> 10));
+	ret = 1;
+
+out_free:
+	if ( f )
+		fclose(f);
+	free(ph.p_disp);
+	free(ph.p_slot);
+	for(i = 0; i < num; i++)
+		free(f_arr[i].f_zbuf);
+	free(f_arr);
+	free(u_arr);
+out_close:
+	archive_close(&a);
+	return ret;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-z] [-t trace] [-j threads] "
+			"< manifest > file.gfs\n", cmd);
+	fprintf(stderr, "       %s -u file.gfs [-z] [-j threads] "
+			"< changed\n", cmd);
+	fprintf(stderr, "       %s -c file.gfs [-t trace] [-j threads] "
+			"> new.gfs\n", cmd);
+	fprintf(stderr, "  -z  Compress files which shrink\n");
+	fprintf(stderr, "  -t  Lay out files in the order they appear in "
+			"an access trace\n");
+	fprintf(stderr, "  -j  Pack with this many threads, output must "
+			"be a regular file\n");
+	fprintf(stderr, "  -u  Update an archive in place with new or "
+			"changed files\n");
+	fprintf(stderr, "  -c  Compact an archive, dropping dead records\n");
+}
+
 int main(int argc, char **argv)
 { 
+	const char *update_fn = NULL, *compact_fn = NULL;
+	struct file *f_arr;
+	int c;
+
+	while ( (c = getopt(argc, argv, "zt:j:u:c:")) != -1 ) {
+		switch ( c ) {
+		case 'z':
+			zmode = 1;
+			break;
+		case 't':
+			trace_fn = optarg;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			if ( num_threads < 1 || num_threads > 1024 ) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			pmode = 1;
+			break;
+		case 'u':
+			update_fn = optarg;
+			break;
+		case 'c':
+			compact_fn = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( update_fn && compact_fn ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	mpool_init(&fmem, sizeof(struct manifest), 0);
 	gang_init(&nmem, 0);
 
+	/* Workers write straight to their offsets in the output */
+	if ( pmode && NULL == update_fn ) {
+		struct stat st;
+
+		if ( fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode) ) {
+			fprintf(stderr, "%s: -j needs output to be a "
+				"regular file\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( compact_fn )
+		return compact_gfile(compact_fn) ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	if ( !scan_manifest(stdin) )
 		return EXIT_FAILURE;
 
-	if ( !dump_gfile(stdout) )
+	if ( !stat_manifest() )
+		return EXIT_FAILURE;
+
+	if ( update_fn )
+		return update_gfile(update_fn) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	f_arr = manifest_files();
+	if ( NULL == f_arr && num_files )
+		return EXIT_FAILURE;
+
+	if ( !dump_gfile(stdout, f_arr) )
 		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
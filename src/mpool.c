@@ -7,6 +7,8 @@
 #include <blackbloc/blackbloc.h>
 #include <blackbloc/mpool.h>
 
+#include "slab.h"
+
 /** Initialise an mpool.
  * \ingroup g_mpool
  *
@@ -21,30 +23,63 @@
  * (may only return 0 if the obj_size is 0).
  */
 int _public mpool_init(struct mpool *m, size_t obj_size, unsigned slab_size)
+{
+	return mpool_init_aligned(m, obj_size, slab_size, 1, 0);
+}
+
+/** Initialise an mpool with aligned objects.
+ * \ingroup g_mpool
+ *
+ * @param m an mpool structure to use
+ * @param obj_size size of objects to allocate
+ * @param slab_size size of slabs in number of objects (set to zero for auto)
+ * @param align alignment of every object, a power of two
+ * @param flags MPOOL_HUGEPAGE to back slabs with transparent huge pages
+ *
+ * As mpool_init() but objects are aligned to align bytes, eg. 16 for
+ * anything holding a vector_t or 64 to keep objects on their own cache
+ * lines. Object size is rounded up to the alignment. With MPOOL_HUGEPAGE
+ * slabs are mmap'd in huge page multiples, which is only worth it for
+ * pools which will grow to many megabytes.
+ *
+ * @return zero on error, non-zero for success
+ */
+int _public mpool_init_aligned(struct mpool *m, size_t obj_size,
+				unsigned slab_size, size_t align,
+				unsigned int flags)
 {
 	/* quick sanity checks */
 	if ( obj_size == 0 )
 		return 0;
+	if ( align == 0 )
+		align = 1;
+	if ( align & (align - 1) )
+		return 0;
 
 	if ( obj_size < sizeof(void *) )
 		obj_size = sizeof(void *);
 
-	m->obj_size = obj_size;
+	m->obj_size = SLAB_ALIGN(obj_size, align);
+	m->align = align;
+	m->hdr_size = SLAB_ALIGN(sizeof(struct mpool_hdr), align);
+	m->flags = flags;
 
 	if ( slab_size ) {
-		m->slab_size = sizeof(struct mpool_hdr) + 
-				(slab_size * obj_size);
+		m->slab_size = m->hdr_size + (slab_size * m->obj_size);
 	}else{
 		/* XXX: totally arbitrary... */
 		if ( m->obj_size < 8192 ) {
-			m->slab_size = sizeof(struct mpool_hdr) +
+			m->slab_size = m->hdr_size +
 				(8192 - (8192 % m->obj_size));
 		}else{
-			m->slab_size = sizeof(struct mpool_hdr) +
+			m->slab_size = m->hdr_size +
 				(4 * m->obj_size);
 		}
 	}
 
+	if ( flags & MPOOL_HUGEPAGE )
+		m->slab_size = SLAB_ALIGN(m->slab_size, SLAB_HUGE_SIZE);
+
 	m->slabs = NULL;
 	m->free = NULL;
 
@@ -66,12 +101,13 @@ static void *mpool_alloc_slow(struct mpool *m)
 	struct mpool_hdr *h;
 	void *ptr, *ret;
 	
-	h = ptr = malloc(m->slab_size);
+	h = ptr = slab_alloc(MEM_MPOOL, m->slab_size, m->align,
+				m->flags & MPOOL_HUGEPAGE);
 	if ( h == NULL )
 		return NULL;
 
 	/* Set first object */
-	ret = ptr + sizeof(*h);
+	ret = ptr + m->hdr_size;
 	h->next_obj = ret + m->obj_size;
 
 	/* prepend to slab list */
@@ -123,12 +159,126 @@ void _public mpool_fini(struct mpool *m)
 {
 	struct mpool_hdr *h, *f;
 
-	for(h=m->slabs; (f=h) ; free(f))
+	for(h=m->slabs; (f=h) ; slab_free(MEM_MPOOL, f, m->slab_size,
+						m->flags & MPOOL_HUGEPAGE))
 		h=h->next;
 
 	memset(m, 0, sizeof(*m));
 }
 
+/* End of the objects handed out from a slab, a failed bump in
+ * mpool_alloc() leaves next_obj past the end.
+ */
+static void *slab_end(const struct mpool *m, const struct mpool_hdr *h)
+{
+	void *end = (void *)h + m->slab_size;
+
+	return (h->next_obj < end) ? h->next_obj : end;
+}
+
+static int slab_cmp(const void *_A, const void *_B)
+{
+	const struct mpool_hdr * const *a = _A, * const *b = _B;
+
+	if ( *a < *b )
+		return -1;
+	return *a > *b;
+}
+
+/* Which slab an object is in, tab is sorted by address */
+static unsigned int slab_find(const struct mpool *m,
+				struct mpool_hdr **tab, unsigned int num,
+				const void *obj)
+{
+	unsigned int lo = 0, hi = num, mid;
+
+	while ( lo < hi ) {
+		mid = lo + (hi - lo) / 2;
+		if ( obj < (void *)tab[mid] )
+			hi = mid;
+		else if ( obj >= (void *)tab[mid] + m->slab_size )
+			lo = mid + 1;
+		else
+			return mid;
+	}
+
+	return num;
+}
+
+/** Return empty slabs to the system.
+ * \ingroup g_mpool
+ * @param m a valid mpool structure returned from mpool_init()
+ *
+ * Slabs in which every object has been freed are taken off the free list
+ * and released. This walks the whole free list so call it at quiet times
+ * such as after unloading a level, not from the allocation path.
+ *
+ * @return number of bytes released
+ */
+size_t _public mpool_trim(struct mpool *m)
+{
+	struct mpool_hdr **tab, *h, **hp;
+	unsigned int num, i, *nfree;
+	void **pp, *obj;
+	size_t ret = 0;
+
+	for(num = 0, h = m->slabs; h; h = h->next)
+		num++;
+	if ( 0 == num || NULL == m->free )
+		return 0;
+
+	tab = malloc(num * sizeof(*tab));
+	nfree = calloc(num, sizeof(*nfree));
+	if ( NULL == tab || NULL == nfree )
+		goto out;
+
+	for(i = 0, h = m->slabs; h; h = h->next)
+		tab[i++] = h;
+	qsort(tab, num, sizeof(*tab), slab_cmp);
+
+	for(obj = m->free; obj; obj = *(void **)obj) {
+		i = slab_find(m, tab, num, obj);
+		if ( i < num )
+			nfree[i]++;
+	}
+
+	/* mark empty slabs by clearing their count */
+	for(i = 0; i < num; i++) {
+		h = tab[i];
+		if ( nfree[i] != (slab_end(m, h) - ((void *)h + m->hdr_size)) /
+				m->obj_size )
+			nfree[i] = 1;
+		else
+			nfree[i] = 0;
+	}
+
+	for(pp = &m->free; *pp; ) {
+		i = slab_find(m, tab, num, *pp);
+		if ( i < num && !nfree[i] )
+			*pp = **(void ***)pp;
+		else
+			pp = *pp;
+	}
+
+	for(hp = &m->slabs; *hp; ) {
+		h = *hp;
+		i = slab_find(m, tab, num, h);
+		if ( nfree[i] ) {
+			hp = &h->next;
+			continue;
+		}
+		*hp = h->next;
+		slab_free(MEM_MPOOL, h, m->slab_size,
+				m->flags & MPOOL_HUGEPAGE);
+		ret += m->slab_size;
+	}
+
+out:
+	free(nfree);
+	free(tab);
+	return ret;
+}
+
 /** Destroy an mpool calling a destructor function for each object.
  * \ingroup g_mpool
  * @param m a valid mpool structure returned from mpool_init()
@@ -142,8 +292,11 @@ void _public mpool_destroy(struct mpool *m, void(*dtor)(void *))
 	struct mpool_hdr *h, *f;
 	void *p;
 
-	for(h=m->slabs; (f=h); h=h->next, free(f)) {
-		for(p = f->data; p < f->next_obj; p += m->obj_size)
+	for(h=m->slabs; (f=h); h=h->next,
+			slab_free(MEM_MPOOL, f, m->slab_size,
+					m->flags & MPOOL_HUGEPAGE)) {
+		for(p = (void *)f + m->hdr_size; p < slab_end(m, f);
+				p += m->obj_size)
 			(*dtor)(p);
 	}
 
@@ -124,7 +124,8 @@ static void build_polygon(struct _q2bsp *map, struct bsp_msurface *fa)
 	lnumverts = fa->numedges;
 	vertpage = 0;
 
-	poly = malloc(sizeof(*poly) + (lnumverts) * VERTEXSIZE*sizeof(float));
+	poly = mem_alloc(MEM_BSP, sizeof(*poly) +
+			(lnumverts) * VERTEXSIZE*sizeof(float));
 	poly->next = fa->polys;
 	poly->flags = fa->flags;
 	fa->polys = poly;
@@ -247,7 +248,7 @@ static int q2bsp_submodels(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: model oom\n");
 		return 0;
 	}
@@ -285,7 +286,7 @@ static int q2bsp_nodes(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: node oom\n");
 		return 0;
 	}
@@ -344,7 +345,7 @@ static int q2bsp_leafs(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: leaf oom\n");
 		return 0;
 	}
@@ -383,12 +384,12 @@ static int q2bsp_visibility(struct _q2bsp *map, const void *data, uint32_t len)
 
 	map->map_visibility = data;
 
-	if ( !(out=malloc(num * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, num * sizeof(*out))) ) {
 		con_printf("q2bsp: vis oom\n");
 		return 0;
 	}
 
-	if ( !(map->vis=malloc(num>>3)) ) {
+	if ( !(map->vis=mem_alloc(MEM_BSP, num>>3)) ) {
 		con_printf("q2bsp: vis oom 2\n");
 		return 0;
 	}
@@ -424,7 +425,7 @@ static int q2bsp_marksurfaces(struct _q2bsp *map, const void *data, uint32_t len
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: leaf face oom\n");
 		return 0;
 	}
@@ -465,7 +466,7 @@ static int q2bsp_faces(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: face oom\n");
 		return 0;
 	}
@@ -539,7 +540,7 @@ static int q2bsp_planes(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: plane oom\n");
 		return 0;
 	}
@@ -599,7 +600,7 @@ static int q2bsp_surfedges(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: surfedge oom\n");
 		return 0;
 	}
@@ -632,7 +633,7 @@ static int q2bsp_edges(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: edge oom\n");
 		return 0;
 	}
@@ -667,7 +668,7 @@ static int q2bsp_vertexes(struct _q2bsp *map, const void *data, int len)
 		return 0;
 	}
 
-	out = malloc(count * sizeof(*out));
+	out = mem_alloc(MEM_BSP, count * sizeof(*out));
 	if ( out == NULL ) {
 		con_printf("q2bsp: vertex oom\n");
 		return 0;
@@ -698,6 +699,28 @@ static texture_t get_texture(const char *name)
 	return NULL; //return q2wal_get(name);
 }
 
+/* Declare all the textures up front so they load while we parse */
+static void prefetch_textures(const struct bsp_texinfo *in, int count)
+{
+	char (*fn)[9 + sizeof(in->texture) + 5];
+	const char **names;
+	int i;
+
+	fn = mem_alloc(MEM_BSP, count * sizeof(*fn));
+	names = mem_alloc(MEM_BSP, count * sizeof(*names));
+	if ( fn && names ) {
+		for(i = 0; i < count; i++) {
+			snprintf(fn[i], sizeof(fn[i]), "textures/%s.tga",
+				in[i].texture);
+			names[i] = fn[i];
+		}
+		game_prefetch(names, count);
+	}
+
+	mem_free(MEM_BSP, names);
+	mem_free(MEM_BSP, fn);
+}
+
 static int q2bsp_texinfo(struct _q2bsp *map, const void *data, uint32_t len)
 {
 	const struct bsp_texinfo *in;
@@ -717,13 +740,15 @@ static int q2bsp_texinfo(struct _q2bsp *map, const void *data, uint32_t len)
 		return 0;
 	}
 
-	if ( !(out=malloc(count * sizeof(*out))) ) {
+	if ( !(out=mem_alloc(MEM_BSP, count * sizeof(*out))) ) {
 		con_printf("q2bsp: texinfo oom\n");
 		return 0;
 	}
 
 	map->mtex = out;
 
+	prefetch_textures(in, count);
+
 	for(i=0; i < count; i++, in++, out++) {
 		for(j=0; j<2; j++) {
 			out->vecs[j][0] = le32toh(in->vecs[j][1]);
@@ -766,18 +791,18 @@ static void do_free(struct _q2bsp *map)
 	unsigned int i;
 	for(i = 0; i < map->num_mtex; i++)
 		tex_put(map->mtex[i].image);
-	free(map->mtex);
-	free(map->mvert);
-	free(map->medge);
-	free(map->mplane);
-	free(map->msurface);
-	free(map->marksurface);
-	free(map->mleaf);
-	free(map->mnode);
-	free(map->visofs);
-	free(map->msurfedge);
-	free(map->vis);
-	free(map);
+	mem_free(MEM_BSP, map->mtex);
+	mem_free(MEM_BSP, map->mvert);
+	mem_free(MEM_BSP, map->medge);
+	mem_free(MEM_BSP, map->mplane);
+	mem_free(MEM_BSP, map->msurface);
+	mem_free(MEM_BSP, map->marksurface);
+	mem_free(MEM_BSP, map->mleaf);
+	mem_free(MEM_BSP, map->mnode);
+	mem_free(MEM_BSP, map->visofs);
+	mem_free(MEM_BSP, map->msurfedge);
+	mem_free(MEM_BSP, map->vis);
+	mem_free(MEM_BSP, map);
 }
 
 void q2bsp_free(q2bsp_t map)
@@ -795,7 +820,7 @@ q2bsp_t q2bsp_load(const char *name)
 	unsigned int i;
 	int ret;
 
-	map = calloc(1, sizeof(*map));
+	map = mem_calloc(MEM_BSP, 1, sizeof(*map));
 	if ( NULL == map ) {
 		con_printf("bsp: %s: %s\n", name, get_err());
 		goto err;
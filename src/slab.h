@@ -0,0 +1,69 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Where mpool and gang get their memory from. Plain slabs come from
+* malloc, or posix_memalign if they need more alignment than that gives.
+* Huge slabs are mmap'd, aligned to a huge page and advised for
+* transparent huge pages so a big pool takes a TLB entry per 2MB.
+* Slabs are accounted by the size asked for under the owner's tag.
+*/
+#ifndef __SLAB_HEADER_INCLUDED__
+#define __SLAB_HEADER_INCLUDED__
+
+#include <sys/mman.h>
+
+#define SLAB_HUGE_SIZE	(2UL << 20)
+
+#define SLAB_ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+static inline void *slab_alloc(unsigned int tag, size_t size,
+				size_t align, int huge)
+{
+	uint8_t *ptr, *ret;
+	size_t len;
+	void *mem;
+
+	if ( !huge ) {
+		if ( align <= sizeof(void *) )
+			mem = malloc(size);
+		else if ( posix_memalign(&mem, align, size) )
+			mem = NULL;
+		if ( mem )
+			mem_add(tag, size);
+		return mem;
+	}
+
+	/* over-map and trim so we start on a huge page boundary */
+	len = size + SLAB_HUGE_SIZE;
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( ptr == MAP_FAILED )
+		return NULL;
+
+	ret = (uint8_t *)SLAB_ALIGN((uintptr_t)ptr, SLAB_HUGE_SIZE);
+	if ( ret > ptr )
+		munmap(ptr, ret - ptr);
+	if ( ptr + len > ret + size )
+		munmap(ret + size, (ptr + len) - (ret + size));
+
+#ifdef MADV_HUGEPAGE
+	/* only advice, a kernel without THP still gives us memory */
+	madvise(ret, size, MADV_HUGEPAGE);
+#endif
+	mem_add(tag, size);
+	return ret;
+}
+
+static inline void slab_free(unsigned int tag, void *ptr,
+				size_t size, int huge)
+{
+	mem_sub(tag, size);
+	if ( huge )
+		munmap(ptr, size);
+	else
+		free(ptr);
+}
+
+#endif /* __SLAB_HEADER_INCLUDED__ */
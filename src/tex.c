@@ -97,7 +97,7 @@ void tex_put(struct _texture *tex)
 
 void teximg_dtor_generic(texture_t tex)
 {
-	free(tex);
+	mem_free(MEM_IMG, tex);
 }
 
 static int notex;
@@ -137,7 +137,7 @@ void tex_unbind(struct _texture *tex)
 /* Just free it */
 void teximg_unprep_generic(struct _texture *tex, unsigned int mip)
 {
-	free(tex->t_mipmap[mip].m_pixels);
+	mem_free(MEM_IMG, tex->t_mipmap[mip].m_pixels);
 	tex->t_mipmap[mip].m_pixels = NULL;
 }
 
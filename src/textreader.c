@@ -2,10 +2,17 @@
 * This file is part of blackbloc
 * Copyright (c) 2008 Gianni Tedesco
 * Released under the terms of the GNU GPL version 2
+*
+* Line by line reading of text, usually a mapped gfile. Either lines
+* are copied out as strings for sscanf() and friends or, without any
+* copying, returned as slices of the original text which can be split
+* up in to tokens in place. The two can be mixed on the same reader.
 */
 #include <blackbloc/blackbloc.h>
 #include <blackbloc/textreader.h>
 #include <stdio.h>
+#include <float.h>
+#include <limits.h>
 
 struct _textreader {
 	const char *txt_ptr;
@@ -27,54 +34,480 @@ textreader_t textreader_new(const char *ptr, size_t len)
 	return txt;
 }
 
-static void to_buf(struct _textreader *txt, const char *tmp)
+/** Get the next line without copying it.
+ * @param txt the reader
+ * @param line filled in with the line, minus its line-break
+ *
+ * The line points in to the text passed to textreader_new() and is good
+ * for as long as that is.
+ *
+ * @return zero at the end of the text, non-zero otherwise
+ */
+int textreader_line(textreader_t txt, struct txt_slice *line)
 {
-	size_t len = tmp - txt->txt_ptr;
+	const char *tmp, *cr;
 
-	if ( len + 1 > txt->txt_buflen ) {
+	if ( txt->txt_ptr >= txt->txt_end )
+		return 0;
+
+	/* a line ends at \n, \r\n or a lone \r */
+	tmp = memchr(txt->txt_ptr, '\n', txt->txt_end - txt->txt_ptr);
+	if ( NULL == tmp )
+		tmp = txt->txt_end;
+	cr = memchr(txt->txt_ptr, '\r', tmp - txt->txt_ptr);
+	if ( cr )
+		tmp = cr;
+
+	line->ptr = txt->txt_ptr;
+	line->len = tmp - txt->txt_ptr;
+
+	/* past the end if there's no trailing line-break */
+	txt->txt_ptr = tmp + 1;
+	if ( tmp + 1 < txt->txt_end && tmp[0] == '\r' && tmp[1] == '\n' )
+		txt->txt_ptr++;
+	return 1;
+}
+
+static char *to_buf(struct _textreader *txt, const struct txt_slice *line)
+{
+	if ( line->len + 1 > txt->txt_buflen ) {
 		free(txt->txt_retbuf);
-		txt->txt_buflen = len + 1;
-		txt->txt_retbuf = malloc(len + 1);
+		txt->txt_buflen = 0;
+		txt->txt_retbuf = malloc(line->len + 1);
 		if ( NULL == txt->txt_retbuf ) {
 			txt->txt_ptr = txt->txt_end;
-			return;
+			return NULL;
 		}
+		txt->txt_buflen = line->len + 1;
 	}
 
-	snprintf(txt->txt_retbuf, txt->txt_buflen,
-		 "%.*s", (int)len, txt->txt_ptr);
+	memcpy(txt->txt_retbuf, line->ptr, line->len);
+	txt->txt_retbuf[line->len] = '\0';
+	return txt->txt_retbuf;
 }
 
+/** Get a copy of the next line as a string.
+ * @param txt the reader
+ *
+ * The string is overwritten by the next call.
+ *
+ * @return the line, or NULL at the end of the text
+ */
 char *textreader_gets(textreader_t txt)
 {
-	const char *tmp;
+	struct txt_slice line;
 
-	if ( txt->txt_ptr >= txt->txt_end ) {
+	if ( !textreader_line(txt, &line) ) {
 		free(txt->txt_retbuf);
 		txt->txt_retbuf = NULL;
+		txt->txt_buflen = 0;
 		return NULL;
 	}
 
-	for(tmp = txt->txt_ptr; tmp < txt->txt_end; tmp++) {
-		if ( *tmp == '\r' || *tmp == '\n' ) {
-			to_buf(txt, tmp);
+	return to_buf(txt, &line);
+}
+
+void textreader_free(textreader_t txt)
+{
+	free(txt->txt_retbuf);
+	free(txt);
+}
+
+#define C_SPACE	(1 << 0)
+#define C_PUNCT	(1 << 1)
+#define C_QUOTE	(1 << 2)
+
+/* Anything non-zero ends a word */
+static const uint8_t cclass[256] = {
+	[' '] = C_SPACE, ['\t'] = C_SPACE, ['\r'] = C_SPACE,
+	['\n'] = C_SPACE, ['\v'] = C_SPACE, ['\f'] = C_SPACE,
+	['('] = C_PUNCT, [')'] = C_PUNCT, ['{'] = C_PUNCT, ['}'] = C_PUNCT,
+	['"'] = C_QUOTE,
+};
+
+static int is_space(char c)
+{
+	return cclass[(uint8_t)c] & C_SPACE;
+}
+
+static int is_punct(char c)
+{
+	return cclass[(uint8_t)c] & C_PUNCT;
+}
+
+static int is_delim(char c)
+{
+	return cclass[(uint8_t)c] != 0;
+}
+
+/** Split the next token off the front of a line.
+ * @param line line to split, advanced past the token
+ * @param tok filled in with the token
+ *
+ * Tokens are separated by whitespace, brackets and braces are tokens in
+ * their own right and a // comment ends the line. A quoted string is
+ * one token, returned without its quotes.
+ *
+ * @return TXT_TOK_NONE at the end of the line, TXT_TOK_STRING for a
+ * quoted string or TXT_TOK_WORD for anything else
+ */
+int txt_token(struct txt_slice *line, struct txt_slice *tok)
+{
+	const char *ptr = line->ptr, *end = line->ptr + line->len;
+	const char *tmp;
+	int ret = TXT_TOK_WORD;
+
+	while ( ptr < end && is_space(*ptr) )
+		ptr++;
+
+	if ( ptr >= end ||
+			(ptr + 1 < end && ptr[0] == '/' && ptr[1] == '/') ) {
+		line->ptr = end;
+		line->len = 0;
+		return TXT_TOK_NONE;
+	}
+
+	if ( *ptr == '"' ) {
+		for(tmp = ++ptr; tmp < end && *tmp != '"'; tmp++)
+			/* nothing */;
+		tok->ptr = ptr;
+		tok->len = tmp - ptr;
+		if ( tmp < end )
+			tmp++;
+		ret = TXT_TOK_STRING;
+	}else if ( is_punct(*ptr) ) {
+		tmp = ptr + 1;
+		tok->ptr = ptr;
+		tok->len = 1;
+	}else{
+		for(tmp = ptr; tmp < end && !is_delim(*tmp); tmp++)
+			/* nothing */;
+		tok->ptr = ptr;
+		tok->len = tmp - ptr;
+	}
+
+	line->ptr = tmp;
+	line->len = end - tmp;
+	return ret;
+}
+
+/** Compare a slice with a string */
+int txt_slice_eq(const struct txt_slice *s, const char *str)
+{
+	return strlen(str) == s->len && !memcmp(s->ptr, str, s->len);
+}
+
+/** Convert a whole slice to an integer.
+ * @return zero if it's not entirely a decimal integer
+ */
+int txt_slice_int(const struct txt_slice *s, int *val)
+{
+	const char *ptr = s->ptr, *end = s->ptr + s->len;
+	unsigned int max = INT_MAX, ret = 0;
+	int neg = 0;
+
+	if ( ptr < end && (*ptr == '-' || *ptr == '+') )
+		neg = (*ptr++ == '-');
+	if ( ptr >= end )
+		return 0;
+
+	/* INT_MIN has one more digit's worth than INT_MAX */
+	if ( neg )
+		max = (unsigned int)INT_MAX + 1;
+
+	for(; ptr < end; ptr++) {
+		if ( *ptr < '0' || *ptr > '9' )
+			return 0;
+		if ( ret > (max - (*ptr - '0')) / 10 )
+			return 0;
+		ret = ret * 10 + (*ptr - '0');
+	}
+
+	if ( neg )
+		*val = (ret == max) ? INT_MIN : -(int)ret;
+	else
+		*val = ret;
+	return 1;
+}
+
+/* Powers of ten which are exact as doubles */
+static const double pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* Exporters print floats with %f, which gives six decimal places. Do
+ * those as one 64 bit word, a digit per byte, rather than a digit at a
+ * time. The word starts on the digit before the point, so it doesn't go
+ * past the end when the number is the last thing on the line.
+ *
+ * Returns the six digits as a number, or -1 if they're not there.
+ */
+static int six_decimals(const char *ptr, const char *end)
+{
+	uint64_t x;
+
+	if ( end - ptr < 7 || *ptr != '.' )
+		return -1;
+	if ( end - ptr > 7 && (unsigned)(ptr[7] - '0') < 10 )
+		return -1;
+
+	memcpy(&x, ptr - 1, sizeof(x));
+	x = le64toh(x) & 0xffffffffffff0000ULL;
+	if ( (x & 0xf0f0f0f0f0f00000ULL) != 0x3030303030300000ULL ||
+			((x + 0x0606060606060000ULL) &
+			 0xf0f0f0f0f0f00000ULL) != 0x3030303030300000ULL )
+		return -1;
+
+	/* Pairs of digits, then fours, then all six */
+	x -= 0x3030303030300000ULL;
+	x = (x * 10 + (x >> 8)) & 0x00ff00ff00ff00ffULL;
+	x = (x * 100 + (x >> 16)) & 0x0000ffff0000ffffULL;
+	x = x * 10000 + (x >> 32);
+	return (uint32_t)x;
+}
 
-			txt->txt_ptr = tmp + 1;
-			if ( tmp + 1 < txt->txt_end &&
-					tmp[0] == '\r' && tmp[1] == '\n' )
-				txt->txt_ptr++;
-			return txt->txt_retbuf;
+/* Decimal to float without strtof() for numbers with at most 19
+ * digits and a power of ten no bigger than 1e22, which is anything a
+ * modelling tool writes. The digits and the power of ten are then both
+ * exact doubles so the one multiply or divide rounds exactly once, to
+ * the nearest double. Going on to float can only round that differently
+ * from strtof() if the double is exactly halfway between two floats, so
+ * we bail in that case. That needs double arithmetic done as double,
+ * hence FLT_EVAL_METHOD.
+ *
+ * Converts as much of the text as looks like a number and returns where
+ * it stopped, or NULL if the caller should ask strtof().
+ */
+static const char *fast_float(const char *ptr, const char *end, float *val)
+{
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+	uint64_t mant = 0, bits;
+	const char *dig;
+	int neg = 0, exp10 = 0, esign = 1, e = 0;
+	int digits, frac;
+	uint32_t fbits;
+	double d;
+	float f;
+
+	if ( ptr < end ) {
+		neg = (*ptr == '-');
+		ptr += (neg || *ptr == '+');
+	}
+
+	for(dig = ptr; ptr < end && (unsigned)(*ptr - '0') < 10; ptr++)
+		mant = mant * 10 + (*ptr - '0');
+	digits = ptr - dig;
+
+	frac = (digits) ? six_decimals(ptr, end) : -1;
+	if ( frac >= 0 ) {
+		mant = mant * 1000000 + frac;
+		exp10 = -6;
+		digits += 6;
+		ptr += 7;
+	}else if ( ptr < end && *ptr == '.' ) {
+		for(dig = ++ptr; ptr < end && (unsigned)(*ptr - '0') < 10;
+				ptr++)
+			mant = mant * 10 + (*ptr - '0');
+		exp10 = -(ptr - dig);
+		digits += ptr - dig;
+	}
+
+	/* leading zeros count too, so this is conservative */
+	if ( 0 == digits || digits > 19 )
+		return NULL;
+
+	if ( ptr < end && (*ptr == 'e' || *ptr == 'E') ) {
+		ptr++;
+		if ( ptr < end && (*ptr == '-' || *ptr == '+') )
+			esign = (*ptr++ == '-') ? -1 : 1;
+		if ( ptr >= end || (unsigned)(*ptr - '0') >= 10 )
+			return NULL;
+		for(; ptr < end && (unsigned)(*ptr - '0') < 10; ptr++) {
+			e = e * 10 + (*ptr - '0');
+			if ( e > 1000 )
+				return NULL;
 		}
+		exp10 += esign * e;
 	}
 
-	/* lack of trailing line-break */
-	to_buf(txt, tmp);
-	txt->txt_ptr = tmp + 1;
-	return txt->txt_retbuf;
+	if ( mant > (1ULL << 53) )
+		return NULL;
+
+	if ( 0 == mant ) {
+		d = 0.0;
+	}else if ( exp10 < 0 ) {
+		if ( exp10 < -22 )
+			return NULL;
+		d = (double)mant / pow10[-exp10];
+	}else{
+		if ( exp10 > 22 )
+			return NULL;
+		d = (double)mant * pow10[exp10];
+	}
+
+	memcpy(&bits, &d, sizeof(bits));
+	if ( (bits & 0x1fffffffULL) == 0x10000000ULL )
+		return NULL;
+
+	/* Signs are all over the place in animation data and a branch on
+	 * them mispredicts, so the sign bit goes on afterwards
+	 */
+	f = d;
+	memcpy(&fbits, &f, sizeof(fbits));
+	fbits ^= (uint32_t)neg << 31;
+	memcpy(val, &fbits, sizeof(*val));
+	return ptr;
+#else
+	return NULL;
+#endif
 }
 
-void textreader_free(textreader_t txt)
+/* For whatever fast_float() can't do. strtof() wants a string, the slice
+ * may run up to the end of a mapping so it can't be given that directly.
+ */
+static int slow_float(const struct txt_slice *s, float *val)
 {
-	free(txt->txt_retbuf);
-	free(txt);
+	char buf[64], *end;
+	float ret;
+
+	if ( 0 == s->len || s->len >= sizeof(buf) )
+		return 0;
+	memcpy(buf, s->ptr, s->len);
+	buf[s->len] = '\0';
+
+	ret = strtof(buf, &end);
+	if ( end != buf + s->len )
+		return 0;
+	*val = ret;
+	return 1;
+}
+
+/** Split the next whitespace separated word off a line, as is.
+ * @param line line to split, advanced past the word
+ * @param tok filled in with the word
+ *
+ * Like sscanf()'s %s, quotes and all. For when txt_token() is too clever.
+ *
+ * @return zero at the end of the line
+ */
+int txt_word(struct txt_slice *line, struct txt_slice *tok)
+{
+	const char *ptr = line->ptr, *end = line->ptr + line->len;
+	const char *tmp;
+
+	while ( ptr < end && is_space(*ptr) )
+		ptr++;
+	for(tmp = ptr; tmp < end && !is_space(*tmp); tmp++)
+		/* nothing */;
+
+	tok->ptr = ptr;
+	tok->len = tmp - ptr;
+	line->ptr = tmp;
+	line->len = end - tmp;
+	return tok->len != 0;
+}
+
+/** Take a token off a line and convert it to an integer.
+ * @return zero if there's no token or it's not an integer, in which case
+ * the token is left on the line
+ */
+int txt_next_int(struct txt_slice *line, int *val)
+{
+	struct txt_slice rest = *line, tok;
+
+	if ( txt_token(&rest, &tok) != TXT_TOK_WORD ||
+			!txt_slice_int(&tok, val) )
+		return 0;
+
+	*line = rest;
+	return 1;
+}
+
+/** Take as many numbers as there are, up to n, off a line.
+ * @param line line to split, advanced past the numbers
+ * @param v where to put the numbers
+ * @param n the most to take
+ *
+ * Stops at the end of the line or at the first token which isn't a
+ * number, leaving that on the line. Converting the usual sort of number
+ * is done in one pass over the text.
+ *
+ * @return how many numbers were taken
+ */
+unsigned int txt_next_floats(struct txt_slice *line, float *v, unsigned int n)
+{
+	const char *ptr = line->ptr, *end = line->ptr + line->len;
+	const char *tmp;
+	struct txt_slice rest, tok;
+	unsigned int i;
+	float val;
+
+	for(i = 0; i < n; i++) {
+		while ( ptr < end && is_space(*ptr) )
+			ptr++;
+
+		tmp = fast_float(ptr, end, &val);
+		if ( likely(tmp && (tmp == end || is_delim(*tmp))) ) {
+			v[i] = val;
+			ptr = tmp;
+			continue;
+		}
+
+		rest.ptr = ptr;
+		rest.len = end - ptr;
+		if ( txt_token(&rest, &tok) != TXT_TOK_WORD ||
+				!slow_float(&tok, &v[i]) )
+			break;
+		ptr = rest.ptr;
+	}
+
+	line->ptr = ptr;
+	line->len = end - ptr;
+	return i;
+}
+
+/** Convert a whole slice to a float.
+ * @return zero if it's not entirely a number
+ *
+ * Gives exactly what strtof() would.
+ */
+int txt_slice_float(const struct txt_slice *s, float *val)
+{
+	struct txt_slice rest = *s;
+	float ret;
+
+	if ( !txt_next_floats(&rest, &ret, 1) || rest.len )
+		return 0;
+	*val = ret;
+	return 1;
+}
+
+/** Take a token off a line and convert it to a float.
+ * @return zero if there's no token or it's not a number, in which case
+ * the token is left on the line
+ */
+int txt_next_float(struct txt_slice *line, float *val)
+{
+	return txt_next_floats(line, val, 1);
+}
+
+/** Take a bracketed list of numbers, eg. ( 1 2 3 ), off a line.
+ * @param line line to split, advanced past the list
+ * @param v where to put the numbers
+ * @param n how many numbers there must be
+ *
+ * @return zero if the list isn't there or isn't n numbers long
+ */
+int txt_next_tuple(struct txt_slice *line, float *v, unsigned int n)
+{
+	struct txt_slice tok;
+
+	if ( txt_token(line, &tok) != TXT_TOK_WORD || !txt_slice_eq(&tok, "(") )
+		return 0;
+
+	if ( txt_next_floats(line, v, n) != n )
+		return 0;
+
+	return txt_token(line, &tok) == TXT_TOK_WORD && txt_slice_eq(&tok, ")");
 }
@@ -0,0 +1,259 @@
+/*
+* This file is part of blackbloc
+* Copyright (c) 2008 Gianni Tedesco
+* Released under the terms of the GNU GPL version 2
+*
+* Text parsing throughput, eg:
+*
+*   txtbench [-n rounds] file.md5anim ...
+*
+* Each file is read in to memory and then split in to lines and then in
+* to tokens, with each token that's a number converted to a float. Done
+* both the old way, copying lines out with textreader_gets() and going
+* at them with sscanf(), and in place with textreader_line() and
+* txt_token(). Token counts and the sum of the numbers are printed so
+* that it's clear both did the same work.
+*/
+#include <blackbloc/blackbloc.h>
+#include <blackbloc/textreader.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct result {
+	unsigned long lines;
+	unsigned long toks;
+	unsigned long nums;
+	double sum;
+};
+
+struct method {
+	const char *name;
+	int (*parse)(const char *ptr, size_t len, struct result *r);
+};
+
+static unsigned int num_rounds = 20;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int gets_only(const char *ptr, size_t len, struct result *r)
+{
+	textreader_t txt;
+	char *line;
+
+	txt = textreader_new(ptr, len);
+	if ( NULL == txt )
+		return 0;
+
+	while ( (line = textreader_gets(txt)) )
+		r->lines++;
+
+	textreader_free(txt);
+	return 1;
+}
+
+static int line_only(const char *ptr, size_t len, struct result *r)
+{
+	struct txt_slice line;
+	textreader_t txt;
+
+	txt = textreader_new(ptr, len);
+	if ( NULL == txt )
+		return 0;
+
+	while ( textreader_line(txt, &line) )
+		r->lines++;
+
+	textreader_free(txt);
+	return 1;
+}
+
+static int gets_sscanf(const char *ptr, size_t len, struct result *r)
+{
+	char *line, word[64];
+	textreader_t txt;
+	float f;
+	int n;
+
+	txt = textreader_new(ptr, len);
+	if ( NULL == txt )
+		return 0;
+
+	while ( (line = textreader_gets(txt)) ) {
+		r->lines++;
+		while ( sscanf(line, " %63s%n", word, &n) == 1 ) {
+			if ( !strncmp(word, "//", 2) )
+				break;
+			line += n;
+			r->toks++;
+			if ( sscanf(word, "%f", &f) == 1 ) {
+				r->nums++;
+				r->sum += f;
+			}
+		}
+	}
+
+	textreader_free(txt);
+	return 1;
+}
+
+static int line_token(const char *ptr, size_t len, struct result *r)
+{
+	struct txt_slice line, tok;
+	textreader_t txt;
+	float f;
+
+	txt = textreader_new(ptr, len);
+	if ( NULL == txt )
+		return 0;
+
+	while ( textreader_line(txt, &line) ) {
+		r->lines++;
+		while ( txt_token(&line, &tok) ) {
+			r->toks++;
+			if ( txt_slice_float(&tok, &f) ) {
+				r->nums++;
+				r->sum += f;
+			}
+		}
+	}
+
+	textreader_free(txt);
+	return 1;
+}
+
+static const struct method methods[] = {
+	{"gets", gets_only},
+	{"line", line_only},
+	{"gets+sscanf", gets_sscanf},
+	{"line+token", line_token},
+};
+
+static char *load(const char *fn, size_t *len)
+{
+	struct stat st;
+	char *buf;
+	ssize_t ret;
+	size_t got;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: %s: open: %s\n", _func, fn, get_err());
+		return NULL;
+	}
+
+	if ( fstat(fd, &st) ) {
+		fprintf(stderr, "%s: %s: fstat: %s\n", _func, fn, get_err());
+		goto err_close;
+	}
+
+	buf = malloc(st.st_size);
+	if ( NULL == buf && st.st_size ) {
+		fprintf(stderr, "%s: %s: malloc: %s\n", _func, fn, get_err());
+		goto err_close;
+	}
+
+	for(got = 0; got < (size_t)st.st_size; got += ret) {
+		ret = read(fd, buf + got, st.st_size - got);
+		if ( ret <= 0 ) {
+			fprintf(stderr, "%s: %s: read: %s\n", _func, fn,
+				load_err("short read"));
+			goto err_free;
+		}
+	}
+
+	close(fd);
+	*len = st.st_size;
+	return buf;
+
+err_free:
+	free(buf);
+err_close:
+	close(fd);
+	return NULL;
+}
+
+static int bench(const char *fn)
+{
+	struct result r;
+	unsigned int i, n;
+	double start, ns;
+	size_t len;
+	char *buf;
+
+	buf = load(fn, &len);
+	if ( NULL == buf )
+		return 0;
+
+	printf("%s: %lu KB\n", fn, (unsigned long)(len >> 10));
+
+	for(i = 0; i < sizeof(methods) / sizeof(*methods); i++) {
+		memset(&r, 0, sizeof(r));
+		if ( !(*methods[i].parse)(buf, len, &r) )
+			goto err;
+
+		start = now();
+		for(n = 0; n < num_rounds; n++) {
+			memset(&r, 0, sizeof(r));
+			if ( !(*methods[i].parse)(buf, len, &r) )
+				goto err;
+		}
+		ns = (now() - start) / num_rounds;
+
+		printf("  %-12s %8.1f MB/s %8.2f Mlines/s  "
+			"%lu lines %lu toks %lu nums sum %.3f\n",
+			methods[i].name,
+			(len / (1024.0 * 1024.0)) / (ns / 1e9),
+			(r.lines / 1e6) / (ns / 1e9),
+			r.lines, r.toks, r.nums, r.sum);
+	}
+
+	free(buf);
+	return 1;
+err:
+	fprintf(stderr, "%s: %s: out of memory\n", _func, fn);
+	free(buf);
+	return 0;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-n rounds] file ...\n", cmd);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+
+	while ( (c = getopt(argc, argv, "n:")) != -1 ) {
+		switch ( c ) {
+		case 'n':
+			num_rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( optind >= argc || num_rounds < 1 ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for(i = optind; i < argc; i++) {
+		if ( !bench(argv[i]) )
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}